@@ -8,6 +8,7 @@
  * functions that make communicating with CHDK simple.
  */
  
+#include <cstdio>
 #include <cstring>
 #include <fstream>
 // Needed for usleep() in script wait
@@ -16,8 +17,10 @@
  
 #include "libptp++.hpp"
 #include "CHDKCamera.hpp"
+#include "CameraExecutor.hpp"
 #include "PTPContainer.hpp"
 #include "LVData.hpp"
+#include "UploadManifest.hpp"
 
 namespace PTP {
 
@@ -38,6 +41,24 @@ CHDKCamera::CHDKCamera(libusb_device * dev) : CameraBase(dev) {
     ;
 }
 
+/**
+ * @brief Set up the scratch command container for the CHDK operation \a operation
+ *
+ * @param[in] operation   A member of \c CHDK_OPERATIONS
+ * @param[in] param       The operation's parameter, if it has one
+ * @param[in] param_count 1 for just the operation, 2 to add \a param after it
+ * @return The scratch command, ready for \c CameraBase::try_ptp_transaction
+ */
+PTPContainer& CHDKCamera::_chdk_command(const uint32_t operation, const uint32_t param, const int param_count) {
+    uint32_t params[2] = { operation, param };
+    
+    this->scratch_cmd.type = PTPContainer::CONTAINER_TYPE_COMMAND;
+    this->scratch_cmd.code = 0x9999;
+    this->scratch_cmd.set_payload(params, param_count * sizeof(uint32_t));     // Reuses the last command's memory
+    
+    return this->scratch_cmd;
+}
+
 /**
  * Retrieve the version of CHDK that this \c CHDKCamera is connected to.
  * 
@@ -45,26 +66,32 @@ CHDKCamera::CHDKCamera(libusb_device * dev) : CameraBase(dev) {
  * @return The CHDK version number.
  */
 float CHDKCamera::get_chdk_version(void) {
-    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
-    cmd.add_param(PTP::PTP_CHDK_Version);
+    return this->try_get_chdk_version().value();
+}
+
+/**
+ * @brief Retrieve the version of CHDK, without throwing
+ *
+ * @return The CHDK version number, or the error \c CHDKCamera::get_chdk_version would have thrown.
+ * @see CHDKCamera::get_chdk_version
+ */
+Result<float> CHDKCamera::try_get_chdk_version(void) {
+    PTPContainer& cmd = this->_chdk_command(PTP::PTP_CHDK_Version, 0, 1);
+    
+    Result<void> sent = this->try_ptp_transaction(cmd, this->no_data, false, this->scratch_resp, this->scratch_out);
+    if(!sent) {
+        return Result<float>::failure(sent.get_error(), sent.get_usb_error());
+    }
     
-    PTPContainer out_resp, data, out_data;
-    this->ptp_transaction(cmd, data, false, out_resp, out_data);
     // param 1 is four bytes of major version
     // param 2 is four bytes of minor version
-    float out;
-    unsigned char * payload;
-    int payload_size;
     uint32_t major = 0, minor = 0;
-    payload = out_resp.get_payload(&payload_size);
-    if(payload_size >= 8) { // Need at least 8 bytes in the payload
-        std::memcpy(&major, payload, 4);            // Copy first four bytes into major
-        std::memcpy(&minor, payload + 4, 4);        // Copy next four bytes into minor
+    if(this->scratch_resp.try_get_param_n(1)) {     // Need at least 8 bytes in the payload
+        major = this->scratch_resp.try_get_param_n(0).value();
+        minor = this->scratch_resp.try_get_param_n(1).value();
     }
-    delete[] payload;
     
-    out = major + minor/10.0;   // This assumes that the minor version is one digit long
-    return out;
+    return (float)(major + minor/10.0);     // This assumes that the minor version is one digit long
 }
 
 /**
@@ -73,13 +100,26 @@ float CHDKCamera::get_chdk_version(void) {
  * @return The current script status, a member of CHDK_SCRIPT_STATUS
  */
 uint32_t CHDKCamera::check_script_status(void) {
-    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
-    cmd.add_param(PTP::PTP_CHDK_ScriptStatus);
+    return this->try_check_script_status().value();
+}
+
+/**
+ * @brief Check the status of the currently running script, without throwing
+ *
+ * Meant for polling: once it has run, it neither allocates nor throws.
+ *
+ * @return The current script status, a member of CHDK_SCRIPT_STATUS, or what went wrong.
+ * @see CHDKCamera::check_script_status
+ */
+Result<uint32_t> CHDKCamera::try_check_script_status(void) {
+    PTPContainer& cmd = this->_chdk_command(PTP::PTP_CHDK_ScriptStatus, 0, 1);
     
-    PTPContainer out_resp, data, out_data;
-    this->ptp_transaction(cmd, data, true, out_resp, out_data);
+    Result<void> sent = this->try_ptp_transaction(cmd, this->no_data, true, this->scratch_resp, this->scratch_out);
+    if(!sent) {
+        return Result<uint32_t>::failure(sent.get_error(), sent.get_usb_error());
+    }
     
-    return out_resp.get_param_n(0);
+    return this->scratch_resp.try_get_param_n(0);
 }
 
 /**
@@ -92,33 +132,46 @@ uint32_t CHDKCamera::check_script_status(void) {
  * @todo Finish blocking code, allow timeout input
  */
 uint32_t CHDKCamera::execute_lua(const std::string script, uint32_t * script_error, const bool block) {
-    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
-    cmd.add_param(PTP::PTP_CHDK_ExecuteScript);
-    cmd.add_param(PTP_CHDK_SL_LUA);
-    
-    PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
-    data.set_payload(script.c_str(), script.length() + 1);
-    
-    PTPContainer out_resp, out_data;
-    this->ptp_transaction(cmd, data, false, out_resp, out_data);
-    
-    uint32_t out = -1;
-    unsigned char * payload;
-    int payload_size;
-    payload = out_resp.get_payload(&payload_size);
+    uint32_t out = this->try_execute_lua(script, block ? NULL : script_error).value();
     
     if(block) {
         //printf("TODO: Blocking code");
         this->_wait_for_script_return(5);
-    } else {
-        if(payload_size >= 8) { // Need at least 8 bytes in the payload
-            std::memcpy(&out, payload, 4);
-            if(script_error != NULL) {
-                std::memcpy(script_error, payload + 4, 4);
-            }
+        return -1;
+    }
+    
+    return out;
+}
+
+/**
+ * @brief Ask CHDK to start the lua script \a script, without throwing
+ *
+ * Doesn't wait for the script; see \c CHDKCamera::execute_lua for that.
+ *
+ * @param[in]  script       The LUA script to execute.
+ * @param[out] script_error (optional) The error code CHDK gave for starting the script.
+ * @return The first parameter in the PTP response, or -1 if there wasn't one, or what went wrong.
+ * @see CHDKCamera::execute_lua
+ */
+Result<uint32_t> CHDKCamera::try_execute_lua(const std::string& script, uint32_t * script_error) {
+    PTPContainer& cmd = this->_chdk_command(PTP::PTP_CHDK_ExecuteScript, PTP_CHDK_SL_LUA, 2);
+    
+    this->scratch_data.type = PTPContainer::CONTAINER_TYPE_DATA;
+    this->scratch_data.code = 0x9999;
+    this->scratch_data.set_payload(script.c_str(), script.length() + 1);
+    
+    Result<void> sent = this->try_ptp_transaction(cmd, this->scratch_data, false, this->scratch_resp, this->scratch_out);
+    if(!sent) {
+        return Result<uint32_t>::failure(sent.get_error(), sent.get_usb_error());
+    }
+    
+    uint32_t out = -1;
+    if(this->scratch_resp.try_get_param_n(1)) {     // Need at least 8 bytes in the payload
+        out = this->scratch_resp.try_get_param_n(0).value();
+        if(script_error != NULL) {
+            *script_error = this->scratch_resp.try_get_param_n(1).value();
         }
     }
-    delete[] payload;
     
     return out;
 }
@@ -134,12 +187,23 @@ uint32_t CHDKCamera::execute_lua(const std::string script, uint32_t * script_err
  * @todo Convert to a string and return actual message?
  */
 void CHDKCamera::read_script_message(PTPContainer& out_resp, PTPContainer& out_data) {
-    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
-    cmd.add_param(PTP::PTP_CHDK_ReadScriptMsg);
-    cmd.add_param(PTP_CHDK_SL_LUA);
+    this->try_read_script_message(out_resp, out_data).value();
+}
+
+/**
+ * @brief Read the current script message from CHDK, without throwing
+ *
+ * Passing the same containers each time saves allocating for every message.
+ *
+ * @param[out] out_resp \c PTPContainer containing the response from the PTP transaction.
+ * @param[out] out_data \c PTPContainer containing the data from the PTP transaction.
+ * @return Nothing, or what went wrong.
+ * @see CHDKCamera::read_script_message
+ */
+Result<void> CHDKCamera::try_read_script_message(PTPContainer& out_resp, PTPContainer& out_data) {
+    PTPContainer& cmd = this->_chdk_command(PTP::PTP_CHDK_ReadScriptMsg, PTP_CHDK_SL_LUA, 2);
     
-    PTPContainer data;
-    this->ptp_transaction(cmd, data, true, out_resp, out_data);
+    return this->try_ptp_transaction(cmd, this->no_data, true, out_resp, out_data);
     // We'll just let the caller deal with the data
 }
 
@@ -151,27 +215,30 @@ void CHDKCamera::read_script_message(PTPContainer& out_resp, PTPContainer& out_d
  * @return The first parameter from the PTP response.
  */
 uint32_t CHDKCamera::write_script_message(const std::string message, const uint32_t script_id) {
-    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
-    cmd.add_param(PTP::PTP_CHDK_WriteScriptMsg);
-    cmd.add_param(script_id);
-    
-    PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
-    data.set_payload(message.c_str(), message.length());
-    
-    PTPContainer out_resp, out_data;
-    this->ptp_transaction(cmd, data, false, out_resp, out_data);
+    return this->try_write_script_message(message, script_id).value();
+}
+
+/**
+ * @brief Write a message to the script running on CHDK, without throwing
+ *
+ * @param[in] message The message to send to the script.
+ * @param[in] script_id (optional) The ID of the script to send the message to.
+ * @return The first parameter from the PTP response, or -1 if there wasn't one, or what went wrong.
+ * @see CHDKCamera::write_script_message
+ */
+Result<uint32_t> CHDKCamera::try_write_script_message(const std::string& message, const uint32_t script_id) {
+    PTPContainer& cmd = this->_chdk_command(PTP::PTP_CHDK_WriteScriptMsg, script_id, 2);
     
-    uint32_t out = -1;
-    unsigned char * payload;
-    int payload_size;
-    payload = out_resp.get_payload(&payload_size);
+    this->scratch_data.type = PTPContainer::CONTAINER_TYPE_DATA;
+    this->scratch_data.code = 0x9999;
+    this->scratch_data.set_payload(message.c_str(), message.length());
     
-    if(payload_size >= 4) { // Need four bytes of uint32_t response
-        std::memcpy(&out, payload, 4);
+    Result<void> sent = this->try_ptp_transaction(cmd, this->scratch_data, false, this->scratch_resp, this->scratch_out);
+    if(!sent) {
+        return Result<uint32_t>::failure(sent.get_error(), sent.get_usb_error());
     }
-    delete[] payload;
     
-    return out;
+    return this->scratch_resp.try_get_param_n(0).value_or(-1);     // Need four bytes of uint32_t response
 }
 
 /**
@@ -181,6 +248,14 @@ uint32_t CHDKCamera::write_script_message(const std::string message, const uint3
  * is returned, but overlay and palette can optionally be returned, also.  The \c LVData object can
  * then be used to retrieve and manipulate the live view data.
  *
+ * The frame is received directly into memory owned by \a data_out, which is
+ * reused from call to call, so calling this repeatedly with the same \c LVData
+ * neither copies nor allocates once the frame size settles.
+ *
+ * The palette rarely changes, and \a data_out keeps the last one it was sent,
+ * so after the first frame, the overlay can be drawn (see
+ * \c LVData::composite_overlay) without asking for the palette every time.
+ *
  * @param[out] data_out The address of an LVData object which will be populated with the requested data
  * @param[in]  liveview True to return the live view frame buffer
  * @param[in]  overlay  True to return the overlay frame buffer
@@ -188,24 +263,45 @@ uint32_t CHDKCamera::write_script_message(const std::string message, const uint3
  * @see LVData, http://chdk.wikia.com/wiki/Frame_buffers
  */
 void CHDKCamera::get_live_view_data(LVData& data_out, const bool liveview, const bool overlay, const bool palette) {
+    this->try_get_live_view_data(data_out, liveview, overlay, palette).value();
+}
+
+/**
+ * @brief Retrieve live view data from CHDK, without throwing
+ *
+ * The same as \c CHDKCamera::get_live_view_data, for loops that would rather
+ * skip a frame lost to a USB timeout than unwind.  A frame too short for what
+ * it describes fails with \c PTP::ERR_LVDATA_NOT_ENOUGH_DATA, which is only
+ * caught here, after the fact, since \c LVData throws it.
+ *
+ * @param[out] data_out The address of an LVData object which will be populated with the requested data
+ * @param[in]  liveview True to return the live view frame buffer
+ * @param[in]  overlay  True to return the overlay frame buffer
+ * @param[in]  palette  True to return the palette for the overlay
+ * @return Nothing, or what went wrong.
+ * @see CHDKCamera::get_live_view_data
+ */
+Result<void> CHDKCamera::try_get_live_view_data(LVData& data_out, const bool liveview, const bool overlay, const bool palette) {
     uint32_t flags = 0;
     if(liveview) flags |= LV_TFR_VIEWPORT;
     if(overlay)  flags |= LV_TFR_BITMAP;
     if(palette)  flags |= LV_TFR_PALETTE;
     
-    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
-    cmd.add_param(PTP::PTP_CHDK_GetDisplayData);
-    cmd.add_param(flags);
-    
-    PTPContainer data, out_resp, out_data;
-    this->ptp_transaction(cmd, data, true, out_resp, out_data);
+    PTPContainer& cmd = this->_chdk_command(PTP::PTP_CHDK_GetDisplayData, flags, 2);
     
-    int payload_size;
-    unsigned char * payload = out_data.get_payload(&payload_size);
+    data_out.recycle(this->scratch_out);     // Receive this frame into the memory of the last one
+    Result<void> sent = this->try_ptp_transaction(cmd, this->no_data, true, this->scratch_resp, this->scratch_out);
+    if(!sent) {
+        return sent;
+    }
     
-    data_out.read(payload, payload_size);    // The LVData class will completely handle the LV data
+    try {
+        data_out.adopt(this->scratch_out);    // The LVData class will completely handle the LV data
+    } catch(LIBPTP_PP_ERRORS e) {
+        return Result<void>::failure(e);
+    }
     
-    delete[] payload;
+    return sent;
 }
 
 /**
@@ -213,16 +309,16 @@ void CHDKCamera::get_live_view_data(LVData& data_out, const bool liveview, const
  *
  * This function will poll the camera every 50 ms for script messages.  If a
  * script is currently still running, it will continue to poll until all scripts
- * are done running.  All read messages are returned when all scripts are done
- * running.
+ * are done running.  Every message read along the way is collected, in order,
+ * and all of them are returned when all scripts are done running.  A script's
+ * return value is the last message returned.
  *
- * @todo Determine a method for returning the messages
- *
- * @param[in] timeout The maximum amount of time to let this function run for
+ * @param[in] timeout The maximum number of seconds to let this function run for, or 0 for no limit
  * @return All read script messages.
+ * @exception PTP::ERR_TIMEOUT if a script is still running after \a timeout seconds.
+ * @exception PTP::ERR_INVALID_RESPONSE if CHDK returns an unknown script status.
  */
 std::vector<std::string> CHDKCamera::_wait_for_script_return(const int timeout) {
-    int msg_count = 1;
     std::vector<std::string> msgs;
     struct timeval time;
     long t_start;
@@ -235,16 +331,25 @@ std::vector<std::string> CHDKCamera::_wait_for_script_return(const int timeout)
     while(1) {
         status = this->check_script_status();
         
-        if(status & PTP_CHDK_SCRIPT_STATUS_RUN) { // If a script is running
+        if(status & PTP_CHDK_SCRIPT_STATUS_MSG) { // Drain messages first, so a full queue can't stall the script
+            PTPContainer out_resp, out_data;
+            this->read_script_message(out_resp, out_data);
+            
+            int payload_size;
+            unsigned char * payload = out_data.get_payload(&payload_size);
+            uint32_t msg_length = out_resp.get_param_n(3);   // param 4 is the length of the message data
+            if(msg_length > (uint32_t)payload_size) msg_length = payload_size;
+            
+            msgs.push_back(std::string((char *)payload, msg_length));
+            delete[] payload;
+        } else if(status & PTP_CHDK_SCRIPT_STATUS_RUN) { // If a script is running
             // Sleep for 50 ms
             usleep(50 * 1000);
             gettimeofday(&time, NULL);
             t_end = (time.tv_sec * 1000) + (time.tv_usec / 1000);
-            if(timeout > 0 && timeout > (t_end - t_start)) {
+            if(timeout > 0 && (t_end - t_start) > timeout * 1000) {
                 throw ERR_TIMEOUT;
             }
-        } else if(status & PTP_CHDK_SCRIPT_STATUS_MSG) {
-            // TODO: Read script message, determine how to return
         } else if(status == 0) {
             break;
         } else {
@@ -269,18 +374,21 @@ std::vector<std::string> CHDKCamera::_wait_for_script_return(const int timeout)
  * @param[out] out_size The size of the resulting data structure
  * @param[in] local_filename The path and name of the local file to be read
  * @param[in] remote_filename The path and name of the location on the camera to place the file
- * @return A pointer to the first byte of the resulting data
+ * @return A pointer to the first byte of the resulting data, or NULL if \a local_filename can't be read
  * @see CHDKCamera::upload_file
  */
 uint8_t * CHDKCamera::_pack_file_for_upload(uint32_t * out_size, const std::string local_filename, const std::string remote_filename) {
     uint32_t file_size;
     uint8_t * out;
-    int name_length;
+    uint32_t name_length;
     
     name_length = remote_filename.length();
     
 	std::ifstream stream_local(local_filename.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
     // Open file for reading, binary type of file, place pointer at end of file
+    if(!stream_local.is_open()) {
+        return NULL;
+    }
     
     file_size = stream_local.tellg(); // Retrives the position of the input stream
     // Since we asked to open the file at the end, this is the length of the file
@@ -288,7 +396,7 @@ uint8_t * CHDKCamera::_pack_file_for_upload(uint32_t * out_size, const std::stri
     
 	out = new uint8_t[4 + name_length + file_size];   // Allocate memory for the packed file
     
-    std::memcpy(out, &file_size, 4);        // Copy four bytes of file size to output
+    std::memcpy(out, &name_length, 4);      // Copy four bytes of file name length to output
 	const char * r_filename = remote_filename.data();
     std::memcpy(out + 4, r_filename, name_length);      // Copy the file name in
     stream_local.read((char *)(out+4+name_length), file_size);    // Copy the file contents in
@@ -300,6 +408,27 @@ uint8_t * CHDKCamera::_pack_file_for_upload(uint32_t * out_size, const std::stri
     return out; // Return the packed file. Caller is responsible for free()ing this
 }
 
+/**
+ * @brief Send a file packed by \c CHDKCamera::_pack_file_for_upload to the camera
+ *
+ * @param[in] packed The packed file
+ * @param[in] packed_size The number of bytes in \a packed
+ * @param[in] timeout The timeout for each PTP call
+ * @return True on success
+ */
+bool CHDKCamera::_upload_packed_file(const uint8_t * packed, const uint32_t packed_size, const int timeout) {
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+    PTPContainer resp, out_data;
+    
+    cmd.add_param(PTP::PTP_CHDK_UploadFile);
+    data.set_payload(packed, packed_size);
+    
+    this->ptp_transaction(cmd, data, false, resp, out_data, timeout);
+    
+    return (resp.code == PTP::CHDK_PTP_RC_OK);
+}
+
 /**
  * @brief Public method to upload a local file to the camera.
  * 
@@ -311,20 +440,383 @@ uint8_t * CHDKCamera::_pack_file_for_upload(uint32_t * out_size, const std::stri
 bool CHDKCamera::upload_file(const std::string local_filename, const std::string remote_filename, const int timeout) {
     uint8_t * packed;
     uint32_t packed_size;
+    
+    packed = CHDKCamera::_pack_file_for_upload(&packed_size, local_filename, remote_filename);
+    if(packed == NULL) {
+        return false;
+    }
+    
+    bool ok = this->_upload_packed_file(packed, packed_size, timeout);
+    
+    delete[] packed;
+    
+    return ok;
+}
+
+/**
+ * @brief Upload a local file to the camera, unless it is already current there
+ *
+ * The contents of \a local_filename are hashed and compared against the entry
+ * for \a remote_filename in \a manifest.  If the hash and size match, the
+ * camera is asked (through a tiny Lua script) for the size and modification
+ * time of the remote file.  If those also match what was recorded when the
+ * file was last uploaded, the transfer is skipped.  Otherwise, the file is
+ * uploaded and \a manifest is updated.
+ *
+ * Only one small script round trip is spent on a file that is already current,
+ * so the cost of pushing a bundle scales with what changed in it.
+ *
+ * @note \a manifest is only updated in memory; call \c UploadManifest::save once
+ *       the whole bundle has been pushed.
+ *
+ * @param[in] local_filename The local path and filename to send
+ * @param[in] remote_filename The path and filename to store the file on the camera
+ * @param[in,out] manifest The manifest of files already uploaded to this camera
+ * @param[out] skipped (optional) Set to true if the upload was skipped because the file was current
+ * @param[in] timeout (optional) The timeout for each PTP call
+ * @return True if the file is current on the camera, whether or not it was uploaded
+ * @see UploadManifest, CHDKCamera::stat_remote_file
+ */
+bool CHDKCamera::upload_file_cached(const std::string local_filename, const std::string remote_filename, UploadManifest& manifest, bool * skipped, const int timeout) {
+    uint8_t * packed;
+    uint32_t packed_size;
+    uint32_t remote_size, remote_mtime;
+    
+    if(skipped != NULL) *skipped = false;
+    
+    packed = CHDKCamera::_pack_file_for_upload(&packed_size, local_filename, remote_filename);
+    if(packed == NULL) {
+        return false;
+    }
+    
+    uint32_t header_size = 4 + remote_filename.length();
+    uint32_t file_size = packed_size - header_size;
+    uint64_t hash = UploadManifest::hash(packed + header_size, file_size);
+    
+    const UploadManifest::Entry * entry = manifest.find(remote_filename);
+    if(entry != NULL && entry->hash == hash && entry->size == file_size) {
+        // We've sent these exact contents before; check nobody changed them on the card since
+        if(this->stat_remote_file(remote_filename, &remote_size, &remote_mtime) &&
+            remote_size == entry->size && remote_mtime == entry->mtime) {
+            delete[] packed;
+            if(skipped != NULL) *skipped = true;
+            return true;
+        }
+    }
+    
+    bool ok = this->_upload_packed_file(packed, packed_size, timeout);
+    delete[] packed;
+    
+    if(!ok) {
+        manifest.remove(remote_filename);
+        return false;
+    }
+    
+    // Record what the camera says about the file now, so we can recognize it next time
+    if(this->stat_remote_file(remote_filename, &remote_size, &remote_mtime) && remote_size == file_size) {
+        manifest.update(remote_filename, hash, file_size, remote_mtime);
+    } else {
+        manifest.remove(remote_filename);
+    }
+    
+    return true;
+}
+
+/**
+ * @brief Ask the camera for the size and modification time of a file
+ *
+ * Runs a one-line Lua script calling \c os.stat on the camera, and waits for
+ * its return value.
+ *
+ * @param[in] remote_filename The path and filename of the file on the camera
+ * @param[out] size The size of the file, in bytes
+ * @param[out] mtime The modification time of the file, as reported by CHDK
+ * @return True if the file exists, false if it doesn't or it couldn't be checked
+ */
+bool CHDKCamera::stat_remote_file(const std::string remote_filename, uint32_t * size, uint32_t * mtime) {
+    std::string quoted;
+    std::string::size_type i;
+    
+    // Escape the filename so it can be placed in a Lua string literal
+    for(i = 0; i < remote_filename.length(); i++) {
+        if(remote_filename[i] == '\\' || remote_filename[i] == '"') quoted += '\\';
+        quoted += remote_filename[i];
+    }
+    
+    std::string script = "local s=os.stat(\"" + quoted + "\") "
+                         "if s and not s.is_dir then return s.size..' '..s.mtime end return ''";
+    
+    uint32_t script_error = PTP_CHDK_S_ERRTYPE_NONE;
+    this->execute_lua(script, &script_error);
+    if(script_error != PTP_CHDK_S_ERRTYPE_NONE) {
+        return false;
+    }
+    
+    std::vector<std::string> msgs = this->_wait_for_script_return(5);
+    if(msgs.empty()) {
+        return false;
+    }
+    
+    unsigned long stat_size, stat_mtime;
+    if(std::sscanf(msgs.back().c_str(), "%lu %lu", &stat_size, &stat_mtime) != 2) {
+        return false;
+    }
+    
+    *size = stat_size;
+    *mtime = stat_mtime;
+    
+    return true;
+}
+
+/**
+ * @brief Retrieve the version of CHDK, as a coroutine
+ *
+ * @param[in] executor The executor running the task
+ * @param[in] cancel   (optional) A \c Cancellation that can stop the call
+ * @return The CHDK version number.
+ * @see CHDKCamera::get_chdk_version, CameraExecutor
+ */
+Task<float> CHDKCamera::async_get_chdk_version(CameraExecutor& executor, Cancellation * cancel) {
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP::PTP_CHDK_Version);
+    
+    PTPContainer out_resp, data, out_data;
+    co_await this->async_ptp_transaction(executor, cmd, data, false, out_resp, out_data, 0, cancel);
+    
+    uint32_t major = 0, minor = 0;
+    if(out_resp.try_get_param_n(1)) {
+        major = out_resp.get_param_n(0);
+        minor = out_resp.get_param_n(1);
+    }
+    
+    co_return (float)(major + minor/10.0);
+}
+
+/**
+ * @brief Check the status of the currently running script, as a coroutine
+ *
+ * @param[in] executor The executor running the task
+ * @param[in] cancel   (optional) A \c Cancellation that can stop the call
+ * @return The current script status, a member of CHDK_SCRIPT_STATUS
+ * @see CHDKCamera::check_script_status, CameraExecutor
+ */
+Task<uint32_t> CHDKCamera::async_check_script_status(CameraExecutor& executor, Cancellation * cancel) {
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP::PTP_CHDK_ScriptStatus);
+    
+    PTPContainer out_resp, data, out_data;
+    co_await this->async_ptp_transaction(executor, cmd, data, true, out_resp, out_data, 0, cancel);
+    
+    co_return out_resp.get_param_n(0);
+}
+
+/**
+ * @brief Ask CHDK to execute the lua script \a script, as a coroutine
+ *
+ * Blocking here only holds up the coroutine: while the script runs, the
+ * executor goes on with the others.
+ *
+ * @param[in]  executor     The executor running the task
+ * @param[in]  script       The LUA script to execute.
+ * @param[out] script_error The error code CHDK gave for starting the script, if not blocking.
+ * @param[in]  block        Whether or not to wait until the script has returned.
+ * @param[in]  cancel       (optional) A \c Cancellation that can stop the call, or the wait
+ * @return The first parameter in the PTP response, or -1 if blocking
+ * @exception PTP::ERR_TIMEOUT if blocking, and the script is still running after 5 seconds.
+ * @see CHDKCamera::execute_lua, CameraExecutor
+ */
+Task<uint32_t> CHDKCamera::async_execute_lua(CameraExecutor& executor, const std::string script, uint32_t * script_error, const bool block, Cancellation * cancel) {
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP::PTP_CHDK_ExecuteScript);
+    cmd.add_param(PTP_CHDK_SL_LUA);
+    
+    PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+    data.set_payload(script.c_str(), script.length() + 1);
+    
+    PTPContainer out_resp, out_data;
+    co_await this->async_ptp_transaction(executor, cmd, data, false, out_resp, out_data, 0, cancel);
+    
+    if(block) {
+        co_await this->async_wait_for_script_return(executor, 5, cancel);
+        co_return -1;
+    }
+    
+    uint32_t out = -1;
+    if(out_resp.try_get_param_n(1)) {   // Need at least 8 bytes in the payload
+        out = out_resp.get_param_n(0);
+        if(script_error != NULL) {
+            *script_error = out_resp.get_param_n(1);
+        }
+    }
+    
+    co_return out;
+}
+
+/**
+ * @brief Read the current script message from CHDK, as a coroutine
+ *
+ * @param[in]  executor The executor running the task
+ * @param[out] out_resp \c PTPContainer containing the response from the PTP transaction.
+ * @param[out] out_data \c PTPContainer containing the data from the PTP transaction.
+ * @param[in]  cancel   (optional) A \c Cancellation that can stop the call
+ * @see CHDKCamera::read_script_message, CameraExecutor
+ */
+Task<void> CHDKCamera::async_read_script_message(CameraExecutor& executor, PTPContainer& out_resp, PTPContainer& out_data, Cancellation * cancel) {
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP::PTP_CHDK_ReadScriptMsg);
+    cmd.add_param(PTP_CHDK_SL_LUA);
+    
+    PTPContainer data;
+    co_await this->async_ptp_transaction(executor, cmd, data, true, out_resp, out_data, 0, cancel);
+}
+
+/**
+ * @brief Write a message to the script running on CHDK, as a coroutine
+ *
+ * @param[in] executor  The executor running the task
+ * @param[in] message   The message to send to the script.
+ * @param[in] script_id (optional) The ID of the script to send the message to.
+ * @param[in] cancel    (optional) A \c Cancellation that can stop the call
+ * @return The first parameter from the PTP response.
+ * @see CHDKCamera::write_script_message, CameraExecutor
+ */
+Task<uint32_t> CHDKCamera::async_write_script_message(CameraExecutor& executor, const std::string message, const uint32_t script_id, Cancellation * cancel) {
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP::PTP_CHDK_WriteScriptMsg);
+    cmd.add_param(script_id);
+    
+    PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+    data.set_payload(message.c_str(), message.length());
+    
+    PTPContainer out_resp, out_data;
+    co_await this->async_ptp_transaction(executor, cmd, data, false, out_resp, out_data, 0, cancel);
+    
+    co_return out_resp.try_get_param_n(0).value_or(-1);
+}
+
+/**
+ * @brief Upload a local file to the camera, as a coroutine
+ *
+ * The file is read from disk before the coroutine first suspends, so it
+ * should be a small one, as scripts are.
+ *
+ * @param[in] executor        The executor running the task
+ * @param[in] local_filename  The local path and filename to send
+ * @param[in] remote_filename The path and filename to store the file on the camera
+ * @param[in] timeout         (optional) The timeout for each transfer
+ * @param[in] cancel          (optional) A \c Cancellation that can stop the upload
+ * @return True on success
+ * @see CHDKCamera::upload_file, CameraExecutor
+ */
+Task<bool> CHDKCamera::async_upload_file(CameraExecutor& executor, const std::string local_filename, const std::string remote_filename, const int timeout, Cancellation * cancel) {
+    uint32_t packed_size;
+    uint8_t * packed = CHDKCamera::_pack_file_for_upload(&packed_size, local_filename, remote_filename);
+    if(packed == NULL) {
+        co_return false;
+    }
+    
     PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
     PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
     PTPContainer resp, out_data;
     
-    packed = CHDKCamera::_pack_file_for_upload(&packed_size, local_filename, remote_filename);
-    
     cmd.add_param(PTP::PTP_CHDK_UploadFile);
     data.set_payload(packed, packed_size);
+    delete[] packed;
     
-    this->ptp_transaction(cmd, data, false, resp, out_data);
+    co_await this->async_ptp_transaction(executor, cmd, data, false, resp, out_data, timeout, cancel);
     
-    delete[] packed;
+    co_return (resp.code == PTP::CHDK_PTP_RC_OK);
+}
+
+/**
+ * @brief Retrieve live view data from CHDK, as a coroutine
+ *
+ * As with \c CHDKCamera::get_live_view_data, the frame is received into
+ * memory owned by \a data_out, which must stay alive until the task finishes.
+ *
+ * @param[in]  executor The executor running the task
+ * @param[out] data_out The LVData object which will be populated with the requested data
+ * @param[in]  liveview True to return the live view frame buffer
+ * @param[in]  overlay  True to return the overlay frame buffer
+ * @param[in]  palette  True to return the palette for the overlay
+ * @param[in]  cancel   (optional) A \c Cancellation that can stop the call
+ * @see CHDKCamera::get_live_view_data, CameraExecutor
+ */
+Task<void> CHDKCamera::async_get_live_view_data(CameraExecutor& executor, LVData& data_out, const bool liveview, const bool overlay, const bool palette, Cancellation * cancel) {
+    uint32_t flags = 0;
+    if(liveview) flags |= LV_TFR_VIEWPORT;
+    if(overlay)  flags |= LV_TFR_BITMAP;
+    if(palette)  flags |= LV_TFR_PALETTE;
+    
+    PTPContainer cmd(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+    cmd.add_param(PTP::PTP_CHDK_GetDisplayData);
+    cmd.add_param(flags);
+    
+    PTPContainer data, out_resp, out_data;
+    data_out.recycle(out_data);
+    try {
+        co_await this->async_ptp_transaction(executor, cmd, data, true, out_resp, out_data, 0, cancel);
+    } catch(...) {
+        data_out.reclaim(out_data);     // Keep the memory for the next frame
+        throw;
+    }
+    
+    data_out.adopt(out_data);
+}
+
+/**
+ * @brief Wait until the currently running script returns, as a coroutine
+ *
+ * Polls every 50 ms, like \c CHDKCamera::_wait_for_script_return, but sleeps
+ * on \a executor between polls, so other cameras carry on meanwhile.
+ *
+ * @param[in] executor The executor running the task
+ * @param[in] timeout  The maximum number of seconds to wait, or 0 for no limit
+ * @param[in] cancel   (optional) A \c Cancellation that can stop the wait
+ * @return All read script messages.
+ * @exception PTP::ERR_TIMEOUT if a script is still running after \a timeout seconds.
+ * @exception PTP::ERR_INVALID_RESPONSE if CHDK returns an unknown script status.
+ * @see CHDKCamera::_wait_for_script_return, CameraExecutor
+ */
+Task<std::vector<std::string> > CHDKCamera::async_wait_for_script_return(CameraExecutor& executor, const int timeout, Cancellation * cancel) {
+    std::vector<std::string> msgs;
+    struct timeval time;
+    long t_start;
+    long t_end;
+    uint32_t status;
+    
+    gettimeofday(&time, NULL);
+    t_start = (time.tv_sec * 1000) + (time.tv_usec / 1000);
+    
+    while(1) {
+        status = co_await this->async_check_script_status(executor, cancel);
+        
+        if(status & PTP_CHDK_SCRIPT_STATUS_MSG) {
+            PTPContainer out_resp, out_data;
+            co_await this->async_read_script_message(executor, out_resp, out_data, cancel);
+            
+            int payload_size;
+            unsigned char * payload = out_data.get_payload(&payload_size);
+            uint32_t msg_length = out_resp.get_param_n(3);
+            if(msg_length > (uint32_t)payload_size) msg_length = payload_size;
+            
+            msgs.push_back(std::string((char *)payload, msg_length));
+            delete[] payload;
+        } else if(status & PTP_CHDK_SCRIPT_STATUS_RUN) {
+            co_await executor.sleep(50, cancel);
+            gettimeofday(&time, NULL);
+            t_end = (time.tv_sec * 1000) + (time.tv_usec / 1000);
+            if(timeout > 0 && (t_end - t_start) > timeout * 1000) {
+                throw ERR_TIMEOUT;
+            }
+        } else if(status == 0) {
+            break;
+        } else {
+            throw ERR_INVALID_RESPONSE;
+        }
+    }
     
-    return (resp.get_param_n(0) == PTP::CHDK_PTP_RC_OK);
+    co_return msgs;
 }
 
 } /* namespace PTP */
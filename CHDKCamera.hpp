@@ -4,14 +4,25 @@
 #include <string>
 #include <vector>
 #include "CameraBase.hpp"
+#include "PTPContainer.hpp"
+#include "Result.hpp"
 
 namespace PTP {
     
-    class PTPContainer;
     class LVData;
+    class UploadManifest;
 
     class CHDKCamera : public CameraBase {
         static uint8_t * _pack_file_for_upload(uint32_t * out_size, const std::string local_filename, const std::string remote_filename);
+        bool _upload_packed_file(const uint8_t * packed, const uint32_t packed_size, const int timeout);
+        
+        // Reused by the try_ calls, so they don't allocate once they've warmed up
+        PTPContainer scratch_cmd;
+        PTPContainer scratch_data;
+        PTPContainer scratch_resp;
+        PTPContainer scratch_out;
+        PTPContainer no_data;
+        PTPContainer& _chdk_command(const uint32_t operation, const uint32_t param, const int param_count);
         public:
             CHDKCamera();
             CHDKCamera(libusb_device *dev);
@@ -21,9 +32,25 @@ namespace PTP {
             void read_script_message(PTPContainer& out_data, PTPContainer& out_resp);
             uint32_t write_script_message(const std::string message, const uint32_t script_id=0);
             bool upload_file(const std::string local_filename, const std::string remote_filename, int timeout=0);
+            bool upload_file_cached(const std::string local_filename, const std::string remote_filename, UploadManifest& manifest, bool * skipped=NULL, const int timeout=0);
+            bool stat_remote_file(const std::string remote_filename, uint32_t * size, uint32_t * mtime);
             char * download_file(const std::string filename, const int timeout);
             void get_live_view_data(LVData& data_out, const bool liveview=true, const bool overlay=false, const bool palette=false);
             std::vector<std::string> _wait_for_script_return(const int timeout);
+            Result<float> try_get_chdk_version(void);
+            Result<uint32_t> try_check_script_status(void);
+            Result<uint32_t> try_execute_lua(const std::string& script, uint32_t * script_error);
+            Result<void> try_read_script_message(PTPContainer& out_resp, PTPContainer& out_data);
+            Result<uint32_t> try_write_script_message(const std::string& message, const uint32_t script_id=0);
+            Result<void> try_get_live_view_data(LVData& data_out, const bool liveview=true, const bool overlay=false, const bool palette=false);
+            Task<float> async_get_chdk_version(CameraExecutor& executor, Cancellation * cancel=NULL);
+            Task<uint32_t> async_check_script_status(CameraExecutor& executor, Cancellation * cancel=NULL);
+            Task<uint32_t> async_execute_lua(CameraExecutor& executor, const std::string script, uint32_t * script_error, const bool block=false, Cancellation * cancel=NULL);
+            Task<void> async_read_script_message(CameraExecutor& executor, PTPContainer& out_resp, PTPContainer& out_data, Cancellation * cancel=NULL);
+            Task<uint32_t> async_write_script_message(CameraExecutor& executor, const std::string message, const uint32_t script_id=0, Cancellation * cancel=NULL);
+            Task<bool> async_upload_file(CameraExecutor& executor, const std::string local_filename, const std::string remote_filename, const int timeout=0, Cancellation * cancel=NULL);
+            Task<void> async_get_live_view_data(CameraExecutor& executor, LVData& data_out, const bool liveview=true, const bool overlay=false, const bool palette=false, Cancellation * cancel=NULL);
+            Task<std::vector<std::string> > async_wait_for_script_return(CameraExecutor& executor, const int timeout, Cancellation * cancel=NULL);
     };
     
 }
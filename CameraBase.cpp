@@ -9,14 +9,22 @@
  * can just talk to the camera using the correct protocol.
  */
  
+#include <algorithm>
 #include <cstring>
+#include <exception>
 #include <stdint.h>
 
 #include "libptp++.hpp"
 #include "CameraBase.hpp"
+#include "CameraExecutor.hpp"
+#include "CameraMetrics.hpp"
 #include "PTPContainer.hpp"
+#include "Tracer.hpp"
+#include "USBCapture.hpp"
+#include "Util.hpp"
 
 namespace PTP {
+
  
 /**
  * Creates a new, empty \c CameraBase object.  Can then call
@@ -67,6 +75,16 @@ void CameraBase::init() {
     this->ep_in = 0;
     this->ep_out = 0;
     this->_transaction_id = 0;
+    this->transfer_error = 0;
+    this->metrics = NULL;
+    this->metrics_camera = -1;
+#ifdef LIBPTP_PP_TRACE
+    this->trace_track = Tracer::add_track("");
+#else
+    this->trace_track = 0;
+#endif
+    this->capture = NULL;
+    this->async_mutex.reset(new AsyncMutex);
 }
 
 /**
@@ -92,6 +110,8 @@ bool CameraBase::close() {
  * @param[in] timeout The maximum number of seconds to attempt to send for.
  * @return 0 on success, libusb error code otherwise.
  * @exception PTP::ERR_NOT_OPEN if not connected to a camera.
+ * @note All traffic to the camera goes through here and \c CameraBase::_bulk_read,
+ *       so a subclass can override the pair to stand in for one; see \c FakeCamera.
  * @see CameraBase::_bulk_read
  */
 int CameraBase::_bulk_write(unsigned char * bytestr, const int length, const int timeout) {
@@ -137,9 +157,27 @@ int CameraBase::_bulk_read(unsigned char * data_out, const int size, int * trans
  * @see CameraBase::_bulk_write, CameraBase::recv_ptp_message
  */
 int CameraBase::send_ptp_message(const PTPContainer& cmd, const int timeout) {
-    unsigned char * packed = cmd.pack();
-    int ret = this->_bulk_write(packed, cmd.get_length(), timeout);
-    delete[] packed;
+    // Commands are a few dozen bytes; only a big data phase needs the heap
+    unsigned char buffer[512];
+    unsigned char * packed = (cmd.get_length() <= sizeof(buffer)) ? buffer : new unsigned char[cmd.get_length()];
+    cmd.pack(packed);
+    uint64_t begin = (this->capture != NULL) ? monotonic_ns() : 0;
+    int ret;
+    {
+        LIBPTP_PP_TRACE_SCOPE("usb_write", "usb", this->trace_track, "bytes", cmd.get_length());
+        ret = this->_bulk_write(packed, cmd.get_length(), timeout);
+    }
+    if(this->capture != NULL) {
+        this->capture->append(USBCaptureFormat::DIRECTION_OUT, ret, begin, monotonic_ns(), packed, cmd.get_length(), NULL, 0);
+    }
+    if(packed != buffer) {
+        delete[] packed;
+    }
+    
+    if(ret != 0) {
+        this->usb_error = ret;
+        if(this->transfer_error == 0) this->transfer_error = ret;
+    }
     
     return ret;
 }
@@ -150,43 +188,112 @@ int CameraBase::send_ptp_message(const PTPContainer& cmd, const int timeout) {
  * This function works by first reading in a buffer of 512 bytes from the camera
  * to determine the length of the PTP message it will receive.  If necessary, it
  * then makes another \c CameraBase::_bulk_read call to read in the rest of the
- * data.  Finally, \c PTPContainer::unpack is called to place the data in \a out.
+ * data.  The rest of the data is read straight into the payload of \a out, reusing
+ * the payload memory \a out already has if it is big enough, so a large data
+ * phase is never copied after it comes off the wire.
  *
  * @warning \a timeout is passed to each call to \c CameraBase::_bulk_read.  Therefore,
  *          this function could take up to 2 * \a timeout seconds to return.
  *
  * @param[out] out A pointer to a PTPContainer that will store the read PTP message.
  * @param[in]  timeout The maximum number of seconds to wait to read each time.
- * @see CameraBase::_bulk_read, CameraBase::send_ptp_message
+ * @exception PTP::ERR_CANNOT_RECV if we can't read a complete PTP message.
+ * @see CameraBase::_bulk_read, CameraBase::send_ptp_message, CameraBase::try_recv_ptp_message
  */
 void CameraBase::recv_ptp_message(PTPContainer& out, const int timeout) {
+    this->try_recv_ptp_message(out, timeout).value();
+}
+
+/**
+ * @brief Recives a \c PTPContainer from the camera, without throwing
+ *
+ * Works just like \c CameraBase::recv_ptp_message, but a failure is returned,
+ * along with the libusb error behind it, instead of thrown.  Code that polls,
+ * and expects to time out now and then, doesn't have to unwind each time.
+ *
+ * @param[out] out A pointer to a PTPContainer that will store the read PTP message.
+ * @param[in]  timeout The maximum number of seconds to wait to read each time.
+ * @return Nothing, or \c PTP::ERR_CANNOT_RECV if we can't read a complete PTP message,
+ *         or \c PTP::ERR_NOT_OPEN if there's no camera open.
+ * @see CameraBase::recv_ptp_message
+ */
+Result<void> CameraBase::try_recv_ptp_message(PTPContainer& out, const int timeout) {
+    try {
+        return this->_try_recv_ptp_message(out, timeout);
+    } catch(LIBPTP_PP_ERRORS e) {
+        return Result<void>::failure(e);    // Only _bulk_read throws, and only if the camera isn't open
+    }
+}
+
+/**
+ * @brief The receive itself, for \c CameraBase::try_recv_ptp_message and
+ *        \c CameraBase::try_ptp_transaction to call
+ */
+Result<void> CameraBase::_try_recv_ptp_message(PTPContainer& out, const int timeout) {
     // Determine size we need to read
-	unsigned char * buffer = new unsigned char[512];
+    unsigned char buffer[512];
+    uint64_t begin = (this->capture != NULL) ? monotonic_ns() : 0;
     int read = 0;
-    this->_bulk_read(buffer, 512, &read, timeout); // TODO: Error checking on response
+    int ret;
+    {
+        LIBPTP_PP_TRACE_SCOPE("usb_read", "usb", this->trace_track, "bytes", 512);
+        ret = this->_bulk_read(buffer, 512, &read, timeout);
+    }
     uint32_t size = 0;
-    if(read < 4) {
-        // If we actually read less than four bytes, we can't copy four bytes out of the buffer.
+    int result = ret;
+    if(ret != 0) {
+        this->usb_error = ret;
+        if(this->transfer_error == 0) this->transfer_error = ret;
+    }
+    if(read < 12) {
+        // If we actually read less than a header, we can't tell what we're receiving.
         // Also, something went very, very wrong
-        throw PTP::ERR_CANNOT_RECV;
-        return;
+        if(this->capture != NULL) {
+            this->capture->append(USBCaptureFormat::DIRECTION_IN, result, begin, monotonic_ns(), buffer, read, NULL, 0);
+        }
+        return Result<void>::failure(PTP::ERR_CANNOT_RECV, result);
     }
     std::memcpy(&size, buffer, 4);      // The first four bytes of the buffer are the size
+    if(size < 12) {
+        if(this->capture != NULL) {
+            this->capture->append(USBCaptureFormat::DIRECTION_IN, result, begin, monotonic_ns(), buffer, read, NULL, 0);
+        }
+        return Result<void>::failure(PTP::ERR_CANNOT_RECV, result);
+    }
+    
+    std::memcpy(&out.type, buffer + 4, 2);
+    std::memcpy(&out.code, buffer + 6, 2);
+    std::memcpy(&out.transaction_id, buffer + 8, 4);
     
-    // Copy our first part into the output buffer -- so we can reuse buffer
-    unsigned char * out_buf = new unsigned char[size];
-    if(size < 512) {
-        std::memcpy(out_buf, buffer, size);
-    } else {
-        std::memcpy(out_buf, buffer, 512);
-        // We've already read 512 bytes... read the rest!
-        this->_bulk_read(&out_buf[512], size-512, &read, timeout);
+    // Copy what we've already read into the payload, and read the rest right after it
+    unsigned char * payload;
+    uint32_t have;
+    {
+        LIBPTP_PP_TRACE_SCOPE("ptp_unpack", "ptp", this->trace_track, "bytes", size);
+        payload = out.reserve_payload(size - 12);
+        have = ((uint32_t)read < size) ? read : size;
+        std::memcpy(payload, buffer + 12, have - 12);
+    }
+    if(have < size) {
+        LIBPTP_PP_TRACE_SCOPE("usb_read", "usb", this->trace_track, "bytes", size - have);
+        ret = this->_bulk_read(payload + (have - 12), size - have, &read, timeout);
+        if(ret != 0) {
+            this->usb_error = ret;
+            if(this->transfer_error == 0) this->transfer_error = ret;
+            if(result == 0) result = ret;
+        }
+        have += read;
     }
     
-    out.unpack(out_buf);
+    if(this->capture != NULL) {
+        this->capture->append(USBCaptureFormat::DIRECTION_IN, result, begin, monotonic_ns(), buffer, 12, payload, have - 12);
+    }
+    if(ret != 0 || have < size) {
+        // The rest of the payload never came, so it isn't a message at all
+        return Result<void>::failure(PTP::ERR_CANNOT_RECV, ret);
+    }
     
-    delete[] out_buf;
-    delete[] buffer;
+    return Result<void>();
 }
 
 /**
@@ -204,6 +311,11 @@ void CameraBase::recv_ptp_message(PTPContainer& out, const int timeout) {
  * If provided, \a out_resp will be populated with the command response, even if
  * \a receiving is false.
  *
+ * If the camera has metrics (\c CameraBase::set_metrics), the transaction is timed
+ * and counted there, whether it succeeds or throws.  In a build with trace points
+ * (see \c Tracer), it is also a span on the camera's track, with its transfers
+ * as spans inside it.
+ *
  * @warning \c CameraBase::_bulk_read and \c CameraBase::_bulk_write are called multiple
  *          times during the execution of this function, and \a timeout is passed to each
  *          of them individually.  Therefore, this function could take much more than
@@ -216,42 +328,354 @@ void CameraBase::recv_ptp_message(PTPContainer& out, const int timeout) {
  * @param[out] out_data  (optional) A \c PTPContainer where the camera's data response will be placed.
  * @param[in]  timeout   The maximum number of seconds each \c CameraBase::_bulk_read or \c CameraBase::_bulk_write
  *                       should attempt to communicate for.
- * @see CameraBase::send_ptp_message, CameraBase::recv_ptp_message
+ * @exception PTP::ERR_CANNOT_SEND if the command or its data can't be sent.
+ * @exception PTP::ERR_CANNOT_RECV if the data or the response can't be read.
+ * @see CameraBase::send_ptp_message, CameraBase::recv_ptp_message, CameraBase::try_ptp_transaction
  */
 void CameraBase::ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout) {
+    this->try_ptp_transaction(cmd, data, receiving, out_resp, out_data, timeout).value();
+}
+
+/**
+ * @brief Perform a complete PTP transaction, without throwing
+ *
+ * Works just like \c CameraBase::ptp_transaction, but a failure is returned
+ * instead of thrown.  The result carries the first libusb error of the
+ * transaction, so a timeout (\c LIBUSB_ERROR_TIMEOUT) can be told from a
+ * camera that's gone (\c LIBUSB_ERROR_NO_DEVICE).  Once \a out_resp and
+ * \a out_data are big enough for what they receive, nothing is allocated either.
+ *
+ * @param[in]  cmd       A \c PTPContainer containing the command to send to the camera.
+ * @param[in]  data      (optional) A \c PTPContainer containing the data to be sent with the command.
+ * @param[in]  receiving Whether or not to receive data in addition to a response from the camera.
+ * @param[out] out_resp  (optional) A \c PTPContainer where the camera's response will be placed.
+ * @param[out] out_data  (optional) A \c PTPContainer where the camera's data response will be placed.
+ * @param[in]  timeout   The maximum number of seconds each \c CameraBase::_bulk_read or \c CameraBase::_bulk_write
+ *                       should attempt to communicate for.
+ * @return Nothing, or the error \c CameraBase::ptp_transaction would have thrown.
+ * @see CameraBase::ptp_transaction
+ */
+Result<void> CameraBase::try_ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout) {
+    LIBPTP_PP_TRACE_SCOPE("ptp_transaction", "ptp", this->trace_track, "opcode", cmd.code);
+    
+    uint64_t start = (this->metrics != NULL) ? monotonic_ns() : 0;
+    Result<void> result;
+    this->transfer_error = 0;
+    try {
+        result = this->_try_ptp_transaction(cmd, data, receiving, out_resp, out_data, timeout);
+    } catch(LIBPTP_PP_ERRORS e) {
+        result = Result<void>::failure(e);      // Only the bulk transfers throw, and only if the camera isn't open
+    }
+    
+    if(this->metrics != NULL) {
+        if(!result) {
+            this->metrics->record(this->metrics_camera, cmd, monotonic_ns() - start, 0, 0, 0, this->transfer_error, true);
+        } else {
+            uint64_t sent = cmd.get_length() + (data.is_empty() ? 0 : data.get_length());
+            uint64_t received = out_resp.get_length() + ((receiving && !out_data.is_empty()) ? out_data.get_length() : 0);
+            this->metrics->record(this->metrics_camera, cmd, monotonic_ns() - start, sent, received, out_resp.code, this->transfer_error, false);
+        }
+    }
+    
+    return result;
+}
+
+/**
+ * @brief The transaction itself, for \c CameraBase::try_ptp_transaction to time
+ */
+Result<void> CameraBase::_try_ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout) {
     bool received_data = false;
     bool received_resp = false;
+    Result<void> result;
 
     cmd.transaction_id = this->get_and_increment_transaction_id();
-    this->send_ptp_message(cmd, timeout);
+    int ret = this->send_ptp_message(cmd, timeout);
+    if(ret != 0) {
+        return Result<void>::failure(PTP::ERR_CANNOT_SEND, ret);
+    }
     
     if(!data.is_empty()) {
         // Only send data if it doesn't have an empty payload
         data.transaction_id = cmd.transaction_id;
-        this->send_ptp_message(data, timeout);
+        ret = this->send_ptp_message(data, timeout);
+        if(ret != 0) {
+            return Result<void>::failure(PTP::ERR_CANNOT_SEND, ret);
+        }
     }
     
     if(receiving) {
         PTPContainer out;
-        this->recv_ptp_message(out, timeout);
+        out.swap(out_data);     // Receive into out_data's memory, in case it's already big enough
+        result = this->_try_recv_ptp_message(out, timeout);
+        if(!result) {
+            out_data.swap(out);     // Keep the memory for next time
+            return Result<void>::failure(result.get_error(), this->transfer_error);
+        }
         if(out.type == PTPContainer::CONTAINER_TYPE_DATA) {
             received_data = true;
-            // TODO: It occurs to me that pack() and unpack() might be inefficient. Let's try to find a better way to do this.
-            unsigned char * packed = out.pack();
-            out_data.unpack(packed);
-            delete[] packed;
+            out_data.swap(out);
         } else if(out.type == PTPContainer::CONTAINER_TYPE_RESPONSE) {
             received_resp = true;
-            unsigned char * packed = out.pack();
-            out_resp.unpack(packed);
-            delete[] packed;
+            out_resp.swap(out);
+            // Keep out_resp's old memory in out_data, so the next transaction receives into it
+            std::swap(out_data.payload, out.payload);
+            std::swap(out_data.payload_capacity, out.payload_capacity);
         }
     }
     
     if(!received_resp) {
         // Read it anyway!
         // TODO: We should return response AND data...
-        this->recv_ptp_message(out_resp, timeout);
+        result = this->_try_recv_ptp_message(out_resp, timeout);
+        if(!result) {
+            return Result<void>::failure(result.get_error(), this->transfer_error);
+        }
+    }
+    
+    return result;
+}
+
+/**
+ * @brief Write to the camera without blocking the thread, for \c CameraBase::async_send_ptp_message
+ *
+ * A camera without a device handle, such as \c FakeCamera, writes with
+ * \c CameraBase::_bulk_write instead, and finishes before returning.
+ *
+ * @return 0 on success, libusb error code otherwise.
+ * @exception PTP::ERR_NOT_OPEN if not connected to a camera.
+ * @exception PTP::ERR_CANCELLED, PTP::ERR_TIMEOUT if \a cancel stopped the write.
+ */
+Task<int> CameraBase::_async_bulk_write(CameraExecutor& executor, unsigned char * bytestr, const int length, const int timeout, Cancellation * cancel) {
+    if(cancel != NULL) cancel->throw_if_cancelled();
+    
+    if(this->handle == NULL) {
+        co_return this->_bulk_write(bytestr, length, timeout);
+    }
+    
+    BulkTransfer transfer(executor, this->handle, this->ep_out, bytestr, length, timeout, cancel);
+    co_return co_await transfer;
+}
+
+/**
+ * @brief Read from the camera without blocking the thread, for \c CameraBase::async_recv_ptp_message
+ *
+ * A camera without a device handle, such as \c FakeCamera, reads with
+ * \c CameraBase::_bulk_read instead, and finishes before returning.
+ *
+ * @return 0 on success, libusb error code otherwise.
+ * @exception PTP::ERR_NOT_OPEN if not connected to a camera.
+ * @exception PTP::ERR_CANCELLED, PTP::ERR_TIMEOUT if \a cancel stopped the read.
+ */
+Task<int> CameraBase::_async_bulk_read(CameraExecutor& executor, unsigned char * data_out, const int size, int * transferred, const int timeout, Cancellation * cancel) {
+    if(cancel != NULL) cancel->throw_if_cancelled();
+    
+    if(this->handle == NULL) {
+        co_return this->_bulk_read(data_out, size, transferred, timeout);
+    }
+    
+    BulkTransfer transfer(executor, this->handle, this->ep_in, data_out, size, timeout, cancel);
+    int ret = co_await transfer;
+    *transferred = transfer.get_transferred();
+    co_return ret;
+}
+
+/**
+ * @brief Send the data contained in \a cmd to the connected camera, as a coroutine
+ *
+ * The same as \c CameraBase::send_ptp_message, but the thread goes on with
+ * other coroutines on \a executor while the transfer is in flight.  \a cmd
+ * must stay alive until the task finishes.
+ *
+ * @param[in] executor The executor running the task
+ * @param[in] cmd The \c PTPContainer containing the command/data to send.
+ * @param[in] timeout The maximum number of milliseconds to attempt to send for.
+ * @param[in] cancel (optional) A \c Cancellation that can stop the send.
+ * @return 0 on success, libusb error code otherwise.
+ * @exception PTP::ERR_CANCELLED, PTP::ERR_TIMEOUT if \a cancel stopped the send.
+ * @see CameraBase::send_ptp_message, CameraExecutor
+ */
+Task<int> CameraBase::async_send_ptp_message(CameraExecutor& executor, const PTPContainer& cmd, const int timeout, Cancellation * cancel) {
+    unsigned char buffer[512];
+    unsigned char * packed = (cmd.get_length() <= sizeof(buffer)) ? buffer : new unsigned char[cmd.get_length()];
+    cmd.pack(packed);
+    uint64_t begin = (this->capture != NULL) ? monotonic_ns() : 0;
+    int ret;
+    try {
+        ret = co_await this->_async_bulk_write(executor, packed, cmd.get_length(), timeout, cancel);
+    } catch(LIBPTP_PP_ERRORS e) {
+        if(packed != buffer) {
+            delete[] packed;
+        }
+        throw;
+    }
+    if(this->capture != NULL) {
+        this->capture->append(USBCaptureFormat::DIRECTION_OUT, ret, begin, monotonic_ns(), packed, cmd.get_length(), NULL, 0);
+    }
+    if(packed != buffer) {
+        delete[] packed;
+    }
+    
+    if(ret != 0) {
+        this->usb_error = ret;
+        if(this->transfer_error == 0) this->transfer_error = ret;
+    }
+    
+    co_return ret;
+}
+
+/**
+ * @brief Recives a \c PTPContainer from the camera, as a coroutine
+ *
+ * The same as \c CameraBase::recv_ptp_message, but the thread goes on with
+ * other coroutines on \a executor while the transfers are in flight.  \a out
+ * must stay alive until the task finishes.
+ *
+ * @param[in]  executor The executor running the task
+ * @param[out] out A PTPContainer that will store the read PTP message.
+ * @param[in]  timeout The maximum number of milliseconds to wait to read each time.
+ * @param[in]  cancel (optional) A \c Cancellation that can stop the receive.
+ * @exception PTP::ERR_CANNOT_RECV if we can't read a complete PTP message.
+ * @exception PTP::ERR_CANCELLED, PTP::ERR_TIMEOUT if \a cancel stopped the receive.
+ * @see CameraBase::recv_ptp_message, CameraExecutor
+ */
+Task<void> CameraBase::async_recv_ptp_message(CameraExecutor& executor, PTPContainer& out, const int timeout, Cancellation * cancel) {
+    unsigned char buffer[512];
+    uint64_t begin = (this->capture != NULL) ? monotonic_ns() : 0;
+    int read = 0;
+    int ret = co_await this->_async_bulk_read(executor, buffer, 512, &read, timeout, cancel);
+    uint32_t size = 0;
+    int result = ret;
+    if(ret != 0) {
+        this->usb_error = ret;
+        if(this->transfer_error == 0) this->transfer_error = ret;
+    }
+    if(read >= 12) {
+        std::memcpy(&size, buffer, 4);      // The first four bytes of the buffer are the size
+    }
+    if(read < 12 || size < 12) {
+        if(this->capture != NULL) {
+            this->capture->append(USBCaptureFormat::DIRECTION_IN, result, begin, monotonic_ns(), buffer, read, NULL, 0);
+        }
+        throw PTP::ERR_CANNOT_RECV;
+    }
+    
+    std::memcpy(&out.type, buffer + 4, 2);
+    std::memcpy(&out.code, buffer + 6, 2);
+    std::memcpy(&out.transaction_id, buffer + 8, 4);
+    
+    // Copy what we've already read into the payload, and read the rest right after it
+    unsigned char * payload = out.reserve_payload(size - 12);
+    uint32_t have = ((uint32_t)read < size) ? read : size;
+    std::memcpy(payload, buffer + 12, have - 12);
+    if(have < size) {
+        ret = co_await this->_async_bulk_read(executor, payload + (have - 12), size - have, &read, timeout, cancel);
+        if(ret != 0) {
+            this->usb_error = ret;
+            if(this->transfer_error == 0) this->transfer_error = ret;
+            if(result == 0) result = ret;
+        }
+        have += read;
+    }
+    
+    if(this->capture != NULL) {
+        this->capture->append(USBCaptureFormat::DIRECTION_IN, result, begin, monotonic_ns(), buffer, 12, payload, have - 12);
+    }
+    if(ret != 0 || have < size) {
+        throw PTP::ERR_CANNOT_RECV;
+    }
+}
+
+/**
+ * @brief Perform a complete PTP transaction, as a coroutine
+ *
+ * The same as \c CameraBase::ptp_transaction, but the thread goes on with
+ * other coroutines on \a executor while the transfers are in flight.  Async
+ * transactions on the same camera wait their turn, so several coroutines
+ * can share one.  The containers must stay alive until the task finishes.
+ *
+ * If the camera has metrics (\c CameraBase::set_metrics), the transaction is
+ * counted there, as a blocking one would be, but it isn't traced.
+ *
+ * @param[in]  executor  The executor running the task
+ * @param[in]  cmd       A \c PTPContainer containing the command to send to the camera.
+ * @param[in]  data      (optional) A \c PTPContainer containing the data to be sent with the command.
+ * @param[in]  receiving Whether or not to receive data in addition to a response from the camera.
+ * @param[out] out_resp  (optional) A \c PTPContainer where the camera's response will be placed.
+ * @param[out] out_data  (optional) A \c PTPContainer where the camera's data response will be placed.
+ * @param[in]  timeout   The maximum number of milliseconds each transfer should attempt to communicate for.
+ * @param[in]  cancel    (optional) A \c Cancellation that can stop the transaction.
+ * @exception PTP::ERR_CANNOT_SEND if the command or its data can't be sent.
+ * @exception PTP::ERR_CANCELLED, PTP::ERR_TIMEOUT if \a cancel stopped the transaction.
+ * @see CameraBase::ptp_transaction, CameraExecutor
+ */
+Task<void> CameraBase::async_ptp_transaction(CameraExecutor& executor, PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout, Cancellation * cancel) {
+    co_await this->async_mutex->lock(executor);
+    
+    uint64_t start = monotonic_ns();
+    std::exception_ptr error;
+    this->transfer_error = 0;
+    try {
+        co_await this->_async_ptp_transaction(executor, cmd, data, receiving, out_resp, out_data, timeout, cancel);
+    } catch(...) {
+        error = std::current_exception();   // Anything at all, so the lock is always given back
+    }
+    
+    if(this->metrics != NULL) {
+        if(error) {
+            this->metrics->record(this->metrics_camera, cmd, monotonic_ns() - start, 0, 0, 0, this->transfer_error, true);
+        } else {
+            uint64_t sent = cmd.get_length() + (data.is_empty() ? 0 : data.get_length());
+            uint64_t received = out_resp.get_length() + ((receiving && !out_data.is_empty()) ? out_data.get_length() : 0);
+            this->metrics->record(this->metrics_camera, cmd, monotonic_ns() - start, sent, received, out_resp.code, this->transfer_error, false);
+        }
+    }
+    
+    this->async_mutex->unlock();
+    if(error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/**
+ * @brief The transaction itself, for \c CameraBase::async_ptp_transaction to time
+ */
+Task<void> CameraBase::_async_ptp_transaction(CameraExecutor& executor, PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout, Cancellation * cancel) {
+    bool received_resp = false;
+    
+    cmd.transaction_id = this->get_and_increment_transaction_id();
+    if(co_await this->async_send_ptp_message(executor, cmd, timeout, cancel) != 0) {
+        throw PTP::ERR_CANNOT_SEND;
+    }
+    
+    if(!data.is_empty()) {
+        // Only send data if it doesn't have an empty payload
+        data.transaction_id = cmd.transaction_id;
+        if(co_await this->async_send_ptp_message(executor, data, timeout, cancel) != 0) {
+            throw PTP::ERR_CANNOT_SEND;
+        }
+    }
+    
+    if(receiving) {
+        PTPContainer out;
+        out.swap(out_data);     // Receive into out_data's memory, in case it's already big enough
+        try {
+            co_await this->async_recv_ptp_message(executor, out, timeout, cancel);
+        } catch(LIBPTP_PP_ERRORS e) {
+            out_data.swap(out);     // Keep the memory for next time
+            throw;
+        }
+        if(out.type == PTPContainer::CONTAINER_TYPE_DATA) {
+            out_data.swap(out);
+        } else if(out.type == PTPContainer::CONTAINER_TYPE_RESPONSE) {
+            received_resp = true;
+            out_resp.swap(out);
+            std::swap(out_data.payload, out.payload);
+            std::swap(out_data.payload_capacity, out.payload_capacity);
+        }
+    }
+    
+    if(!received_resp) {
+        co_await this->async_recv_ptp_message(executor, out_resp, timeout, cancel);
     }
 }
 
@@ -383,6 +807,53 @@ int CameraBase::get_usb_error() {
     return this->usb_error;
 }
 
+/**
+ * @brief Count this camera's transactions in \a metrics
+ *
+ * Every \c CameraBase::ptp_transaction from then on is timed and counted
+ * under \a name and its operation; see \c CameraMetrics.  Cameras without
+ * metrics skip all of it.
+ *
+ * @param[in] metrics Where to count, or NULL to stop counting
+ * @param[in] name    What to call this camera in the metrics, such as its serial number
+ * @exception ERR_METRICS_TOO_MANY_CAMERAS If \a metrics already has \c CameraMetrics::MAX_CAMERAS cameras.
+ */
+void CameraBase::set_metrics(CameraMetrics * metrics, const std::string name) {
+    int camera = -1;
+    if(metrics != NULL) {
+        camera = metrics->add_camera(name);
+    }
+    this->metrics = metrics;
+    this->metrics_camera = camera;
+}
+
+/**
+ * @brief Record every container this camera sends and receives in \a capture
+ *
+ * Each one is written with when it went and how long its transfer took, so
+ * \c ReplayCamera can play the session back later; see \c USBRecorder.
+ *
+ * @param[in] capture Where to record, or NULL to stop recording.  Must outlive
+ *                    its use by this camera, and be used by no other.
+ */
+void CameraBase::set_capture(USBRecorder * capture) {
+    this->capture = capture;
+}
+
+/**
+ * @brief Name this camera's track in traces
+ *
+ * Without a name, the track is called "camera" and a number.  Does nothing
+ * in a build without trace points; see \c Tracer.
+ *
+ * @param[in] name What to call this camera in a trace, such as its serial number
+ */
+void CameraBase::set_trace_name(const std::string name) {
+    if(this->trace_track != 0) {
+        Tracer::set_track_name(this->trace_track, name);
+    }
+}
+
 /**
  * @brief Retrieves our current transaction ID and increments it
  *
@@ -1,11 +1,23 @@
 #ifndef LIBPTP_PP_CAMERABASE_H_
 #define LIBPTP_PP_CAMERABASE_H_
 
+#include <memory>
+#include <string>
 #include <libusb-1.0/libusb.h>
+#include "Result.hpp"
 
 namespace PTP {
     
     class PTPContainer;
+    class CameraMetrics;
+    class USBRecorder;
+
+    // The coroutine API is declared in CameraExecutor.hpp, which needs C++20;
+    //  only code that calls the async_ functions has to include it
+    class CameraExecutor;
+    class Cancellation;
+    class AsyncMutex;
+    template <typename T> class Task;
 
     class CameraBase {
         private:
@@ -15,25 +27,44 @@ namespace PTP {
             uint8_t ep_in;
             uint8_t ep_out;
             uint32_t _transaction_id;
+            int transfer_error;         // First USB error of the current transaction
+            CameraMetrics * metrics;    // NULL unless set_metrics was called
+            int metrics_camera;
+            int trace_track;            // Where this camera's spans go in a trace; 0 if built without trace points
+            USBRecorder * capture;      // NULL unless set_capture was called
+            std::unique_ptr<AsyncMutex> async_mutex;    // One async transaction on the wire at a time
             void init();
+            Result<void> _try_recv_ptp_message(PTPContainer& out, const int timeout);
+            Result<void> _try_ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout);
+            Task<void> _async_ptp_transaction(CameraExecutor& executor, PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout, Cancellation * cancel);
             
         protected:
-            int _bulk_write(unsigned char * bytestr, const int length, const int timeout=0);
-            int _bulk_read(unsigned char * data_out, const int size, int * transferred, const int timeout=0);
+            virtual int _bulk_write(unsigned char * bytestr, const int length, const int timeout=0);
+            virtual int _bulk_read(unsigned char * data_out, const int size, int * transferred, const int timeout=0);
+            virtual Task<int> _async_bulk_write(CameraExecutor& executor, unsigned char * bytestr, const int length, const int timeout, Cancellation * cancel);
+            virtual Task<int> _async_bulk_read(CameraExecutor& executor, unsigned char * data_out, const int size, int * transferred, const int timeout, Cancellation * cancel);
             int get_and_increment_transaction_id(); // What a beautiful name for a function
             
         public:
             CameraBase();
             CameraBase(libusb_device *dev);
-            ~CameraBase();
+            virtual ~CameraBase();
             bool open(libusb_device *dev);
             bool close();
             bool reopen();
             int send_ptp_message(const PTPContainer& cmd, const int timeout=0);
             void recv_ptp_message(PTPContainer& out, const int timeout=0);
             void ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout=0);
+            Result<void> try_recv_ptp_message(PTPContainer& out, const int timeout=0);
+            Result<void> try_ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout=0);
+            Task<int> async_send_ptp_message(CameraExecutor& executor, const PTPContainer& cmd, const int timeout=0, Cancellation * cancel=NULL);
+            Task<void> async_recv_ptp_message(CameraExecutor& executor, PTPContainer& out, const int timeout=0, Cancellation * cancel=NULL);
+            Task<void> async_ptp_transaction(CameraExecutor& executor, PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data, const int timeout=0, Cancellation * cancel=NULL);
             static libusb_device * find_first_camera();
             int get_usb_error();
+            void set_metrics(CameraMetrics * metrics, const std::string name);
+            void set_trace_name(const std::string name);
+            void set_capture(USBRecorder * capture);
     };
 }
 
@@ -0,0 +1,704 @@
+/**
+ * @file CameraBroker.cpp
+ *
+ * @brief Shares one camera between many clients over a Unix socket
+ *
+ * Only one process can hold a camera's USB interface, and only one
+ * transaction can be on the wire at a time.  A \c CameraBroker holds the
+ * camera and answers requests from any number of \c CameraBrokerClient s,
+ * in this process or others, one transaction after another.
+ *
+ * Clients tend to ask the same things: several of them polling
+ * \c check_script_status, or all wanting the current live view frame.  A
+ * request that's identical to one already waiting for the camera doesn't
+ * get a transaction of its own; it waits for the first one and gets the same
+ * answer.  Answers to requests that only read can also be kept for a short
+ * while (\c CameraBroker::set_cache_ttl), so a burst of polls costs one
+ * round trip.  Requests that change the camera's state, such as running a
+ * script, are never shared, and throw away everything cached except the
+ * CHDK version.  Reads that were already under way when such a request came
+ * in aren't cached or shared either, since they may have seen the camera
+ * from before it.
+ *
+ * How long each client waits, from a request arriving to its answer going
+ * out, is measured and reported in \c CameraBroker::Stats.
+ */
+
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "libptp++.hpp"
+#include "CameraBroker.hpp"
+#include "CHDKCamera.hpp"
+#include "LVData.hpp"
+#include "PTPContainer.hpp"
+#include "Util.hpp"
+
+namespace PTP {
+
+using namespace CameraBrokerProtocol;
+
+/**
+ * @brief Read exactly \a size bytes from \a fd
+ *
+ * @return False if the connection closed or failed first
+ */
+static bool read_all(const int fd, void * buffer, const size_t size) {
+    uint8_t * p = (uint8_t *)buffer;
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = recv(fd, p + done, size - done, 0);
+        if(n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * @brief Write exactly \a size bytes to \a fd
+ *
+ * @return False if the connection closed or failed first
+ */
+static bool write_all(const int fd, const void * buffer, const size_t size) {
+    const uint8_t * p = (const uint8_t *)buffer;
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = send(fd, p + done, size - done, MSG_NOSIGNAL);
+        if(n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * @brief Append \a container to \a out as it would go over USB
+ */
+static void append_container(std::vector<uint8_t>& out, const PTPContainer& container) {
+    const size_t offset = out.size();
+    out.resize(offset + container.get_length());
+    if(container.is_empty()) {
+        // No payload to pack, and maybe no buffer; the header is all there is
+        const uint32_t length = container.get_length();
+        std::memcpy(&out[offset], &length, 4);
+        std::memcpy(&out[offset + 4], &container.type, 2);
+        std::memcpy(&out[offset + 6], &container.code, 2);
+        std::memcpy(&out[offset + 8], &container.transaction_id, 4);
+        return;
+    }
+    unsigned char * packed = container.pack();
+    std::memcpy(&out[offset], packed, container.get_length());
+    delete[] packed;
+}
+
+/**
+ * @brief Check that a whole packed container starts at \a offset of \a size bytes
+ *
+ * @param[out] length The container's length, if it's there
+ * @return True if it's all there
+ */
+static bool find_container(const uint8_t * data, const size_t size, const size_t offset, uint32_t * length) {
+    if(offset + 12 > size) return false;
+    std::memcpy(length, data + offset, 4);
+    return (*length >= 12 && *length <= size - offset);
+}
+
+/**
+ * @brief Split an answer made of a packed response and packed data
+ *
+ * @exception ERR_INVALID_RESPONSE If \a body isn't that.
+ */
+static void unpack_pair(const std::vector<uint8_t>& body, PTPContainer& out_resp, PTPContainer& out_data) {
+    uint32_t resp_length, data_length;
+    if(!find_container(body.data(), body.size(), 0, &resp_length) ||
+        !find_container(body.data(), body.size(), resp_length, &data_length)) {
+        throw ERR_INVALID_RESPONSE;
+    }
+    out_resp.unpack(body.data());
+    out_data.unpack(body.data() + resp_length);
+}
+
+/**
+ * @brief Get ready to share \a camera
+ *
+ * Until changed, the CHDK version is cached for a minute and script status
+ * for 20 ms; live view frames aren't cached, but simultaneous requests for
+ * them share a frame.
+ *
+ * @param[in] camera An open camera, which the broker uses from its own threads
+ */
+CameraBroker::CameraBroker(CHDKCamera& camera) : camera(camera) {
+    std::memset(this->ttl_ms, 0, sizeof(this->ttl_ms));
+    this->ttl_ms[OP_CHDK_VERSION] = 60 * 1000;
+    this->ttl_ms[OP_SCRIPT_STATUS] = 20;
+    this->generation = 0;
+
+    this->stats.clients = 0;
+    this->stats.requests = 0;
+    this->stats.transactions = 0;
+    this->stats.coalesced = 0;
+    this->stats.cache_hits = 0;
+    this->stats.errors = 0;
+}
+
+CameraBroker::~CameraBroker() {
+    this->stop();
+}
+
+/**
+ * @brief Accept clients on the Unix socket at \a path
+ *
+ * A background thread accepts connections, and each client gets a thread of
+ * its own.  Anything already at \a path is replaced.
+ *
+ * @param[in] path Where to create the socket
+ * @exception ERR_BROKER_CANNOT_CONNECT If the socket can't be created.
+ */
+void CameraBroker::listen(const std::string path) {
+    this->stop();
+
+    if(!this->server.listen(path, 16, [this](int connection) { this->accept_client(connection); },
+                            [this]() { this->reap_clients(false); })) {
+        throw ERR_BROKER_CANNOT_CONNECT;
+    }
+}
+
+/**
+ * @brief Stop accepting clients, hang up on the ones connected, and remove the socket
+ *
+ * Requests already waiting for the camera are finished first.  Does nothing
+ * if not listening.
+ */
+void CameraBroker::stop() {
+    this->server.stop();
+    this->reap_clients(true);
+}
+
+/**
+ * @brief Keep answers to \a op for \a ttl_ms
+ *
+ * Only requests that read can be cached: \c OP_CHDK_VERSION,
+ * \c OP_SCRIPT_STATUS and \c OP_LIVE_VIEW.  With a TTL of 0, identical
+ * requests still share an answer while they're in flight.
+ *
+ * @param[in] op     The request to cache answers to
+ * @param[in] ttl_ms How long an answer stays good, in milliseconds; 0 not to cache
+ */
+void CameraBroker::set_cache_ttl(const OP op, const int ttl_ms) {
+    if(op != OP_CHDK_VERSION && op != OP_SCRIPT_STATUS && op != OP_LIVE_VIEW) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->ttl_ms[op] = (ttl_ms > 0) ? ttl_ms : 0;
+    this->cache.clear();
+}
+
+/**
+ * @brief Retrieve counts so far, and latency of the clients connected now
+ */
+CameraBroker::Stats CameraBroker::get_stats() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    Stats out = this->stats;
+    std::list<Client *>::const_iterator it;
+    for(it = this->clients.begin(); it != this->clients.end(); it++) {
+        out.connected.push_back((*it)->stats);
+    }
+    return out;
+}
+
+/**
+ * @brief Start a thread for the new client on \a connection
+ */
+void CameraBroker::accept_client(const int connection) {
+    Client * client = new Client;
+    client->fd = connection;
+    client->latency_ms_total = 0;
+    client->done = false;
+    std::memset(&client->stats, 0, sizeof(ClientStats));
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    client->stats.id = ++this->stats.clients;
+    this->clients.push_back(client);
+    client->thread = std::thread(&CameraBroker::serve, this, client);
+}
+
+/**
+ * @brief Clean up after clients that have hung up
+ *
+ * @param[in] all Hang up on the ones that haven't, too
+ */
+void CameraBroker::reap_clients(const bool all) {
+    std::list<Client *> finished;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        std::list<Client *>::iterator it = this->clients.begin();
+        while(it != this->clients.end()) {
+            if(all || (*it)->done) {
+                shutdown((*it)->fd, SHUT_RDWR);     // Wakes its thread if it's waiting for a request
+                finished.push_back(*it);
+                it = this->clients.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    std::list<Client *>::iterator it;
+    for(it = finished.begin(); it != finished.end(); it++) {
+        (*it)->thread.join();
+        close((*it)->fd);
+        delete *it;
+    }
+}
+
+/**
+ * @brief A client's thread: answer its requests until it hangs up
+ *
+ * A client that sends something that can't be a request is hung up on.
+ */
+void CameraBroker::serve(Client * client) {
+    std::vector<uint8_t> body;
+
+    while(true) {
+        RequestHeader header;
+        if(!read_all(client->fd, &header, sizeof(RequestHeader)) || header.length > MAX_BODY) {
+            break;
+        }
+        body.resize(header.length);
+        if(header.length > 0 && !read_all(client->fd, body.data(), header.length)) {
+            break;
+        }
+
+        const uint64_t start = monotonic_us();
+        PendingReply result;
+        if(header.op == 0 || header.op >= OP_COUNT) {
+            result.error = ERR_BROKER_INVALID_REQUEST;
+        } else {
+            try {
+                result = this->handle(header.op, header.flags, body);
+            } catch(...) {
+                break;      // Out of memory, most likely; the client will see the connection drop
+            }
+        }
+
+        ResponseHeader answer;
+        answer.length = result.body.size();
+        answer.id = header.id;
+        answer.error = result.error;
+        answer.reserved = 0;
+        if(!write_all(client->fd, &answer, sizeof(ResponseHeader)) ||
+            !write_all(client->fd, result.body.data(), result.body.size())) {
+            break;
+        }
+
+        const double latency_ms = (monotonic_us() - start) / 1000.0;
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stats.requests++;
+        if(result.error != ERR_NONE) {
+            this->stats.errors++;
+        }
+        client->stats.requests++;
+        client->latency_ms_total += latency_ms;
+        client->stats.latency_ms_last = latency_ms;
+        client->stats.latency_ms_mean = client->latency_ms_total / client->stats.requests;
+        if(latency_ms > client->stats.latency_ms_max) {
+            client->stats.latency_ms_max = latency_ms;
+        }
+    }
+
+    client->done = true;
+}
+
+/**
+ * @brief Answer a request: from the cache, by waiting for an identical one, or from the camera
+ */
+CameraBroker::PendingReply CameraBroker::handle(const uint32_t op, const uint32_t flags, const std::vector<uint8_t>& body) {
+    if(op != OP_CHDK_VERSION && op != OP_SCRIPT_STATUS && op != OP_LIVE_VIEW) {
+        PendingReply result = this->execute(op, flags, body);
+
+        // The camera may not be in the state the cache remembers any more, nor in the state
+        //  reads that started before this one saw
+        const uint32_t keep = OP_CHDK_VERSION;
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->generation++;
+        std::map<std::string, Cached>::iterator it = this->cache.begin();
+        while(it != this->cache.end()) {
+            if(it->first.compare(0, sizeof(uint32_t), (const char *)&keep, sizeof(uint32_t)) == 0) {
+                it++;
+            } else {
+                it = this->cache.erase(it);
+            }
+        }
+        return result;
+    }
+
+    // Identical requests have identical keys
+    std::string key((const char *)&op, sizeof(uint32_t));
+    key.append((const char *)&flags, sizeof(uint32_t));
+    key.append((const char *)body.data(), body.size());
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    std::map<std::string, Cached>::iterator cached = this->cache.find(key);
+    if(cached != this->cache.end()) {
+        if(monotonic_us() < cached->second.expires_us) {
+            this->stats.cache_hits++;
+            return cached->second.result;
+        }
+        this->cache.erase(cached);
+    }
+
+    // Only wait for an identical request if nothing has changed the camera since it started
+    std::map<std::string, InFlight>::iterator pending = this->in_flight.find(key);
+    if(pending != this->in_flight.end() && pending->second.generation == this->generation) {
+        std::shared_future<PendingReply> answer = pending->second.answer;
+        this->stats.coalesced++;
+        lock.unlock();
+        return answer.get();
+    }
+
+    std::promise<PendingReply> promise;
+    const uint64_t generation = this->generation;
+    InFlight& flight = this->in_flight[key];    // Replaces any from before the last change
+    flight.answer = promise.get_future().share();
+    flight.generation = generation;
+    lock.unlock();
+
+    PendingReply result;
+    try {
+        result = this->execute(op, flags, body);
+    } catch(...) {
+        // Not a camera error, but those waiting for it mustn't wait forever
+        lock.lock();
+        pending = this->in_flight.find(key);
+        if(pending != this->in_flight.end() && pending->second.generation == generation) {
+            this->in_flight.erase(pending);
+        }
+        lock.unlock();
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+
+    lock.lock();
+    pending = this->in_flight.find(key);
+    if(pending != this->in_flight.end() && pending->second.generation == generation) {
+        this->in_flight.erase(pending);
+    }
+    if(this->ttl_ms[op] > 0 && result.error == ERR_NONE && generation == this->generation) {
+        Cached& entry = this->cache[key];
+        entry.expires_us = monotonic_us() + (uint64_t)this->ttl_ms[op] * 1000;
+        entry.result = result;
+    }
+    lock.unlock();
+
+    promise.set_value(result);
+    return result;
+}
+
+/**
+ * @brief Carry out a request on the camera
+ *
+ * @return The answer, or the error the camera or the request caused
+ */
+CameraBroker::PendingReply CameraBroker::execute(const uint32_t op, const uint32_t flags, const std::vector<uint8_t>& body) {
+    PendingReply result;
+    result.error = ERR_NONE;
+
+    std::lock_guard<std::mutex> camera_lock(this->camera_mutex);
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stats.transactions++;
+    }
+
+    try {
+        PTPContainer cmd, data, out_resp, out_data;
+        const std::string text((const char *)body.data(), body.size());
+        uint32_t cmd_length, data_length, values[2];
+        float version;
+
+        switch(op) {
+            case OP_TRANSACTION:
+                if(!find_container(body.data(), body.size(), 0, &cmd_length)) {
+                    throw ERR_BROKER_INVALID_REQUEST;
+                }
+                cmd.unpack(body.data());
+                if(cmd_length < body.size()) {
+                    if(!find_container(body.data(), body.size(), cmd_length, &data_length)) {
+                        throw ERR_BROKER_INVALID_REQUEST;
+                    }
+                    data.unpack(body.data() + cmd_length);
+                }
+                this->camera.ptp_transaction(cmd, data, (flags & 1) != 0, out_resp, out_data);
+                append_container(result.body, out_resp);
+                append_container(result.body, out_data);
+                break;
+            case OP_CHDK_VERSION:
+                version = this->camera.get_chdk_version();
+                result.body.resize(sizeof(float));
+                std::memcpy(result.body.data(), &version, sizeof(float));
+                break;
+            case OP_SCRIPT_STATUS:
+                values[0] = this->camera.check_script_status();
+                result.body.assign((uint8_t *)values, (uint8_t *)(values + 1));
+                break;
+            case OP_EXECUTE_LUA:
+                values[1] = 0;
+                values[0] = this->camera.execute_lua(text, &values[1], false);
+                result.body.assign((uint8_t *)values, (uint8_t *)(values + 2));
+                break;
+            case OP_READ_SCRIPT_MESSAGE:
+                this->camera.read_script_message(out_resp, out_data);
+                append_container(result.body, out_resp);
+                append_container(result.body, out_data);
+                break;
+            case OP_WRITE_SCRIPT_MESSAGE:
+                values[0] = this->camera.write_script_message(text, flags);
+                result.body.assign((uint8_t *)values, (uint8_t *)(values + 1));
+                break;
+            case OP_LIVE_VIEW:
+                cmd.type = PTPContainer::CONTAINER_TYPE_COMMAND;
+                cmd.code = 0x9999;
+                cmd.add_param(PTP_CHDK_GetDisplayData);
+                cmd.add_param(flags);
+                this->camera.ptp_transaction(cmd, data, true, out_resp, out_data);
+                append_container(result.body, out_data);
+                break;
+        }
+    } catch(LIBPTP_PP_ERRORS e) {
+        result.error = e;
+        result.body.clear();
+    }
+
+    return result;
+}
+
+/**
+ * @brief Connect to the \c CameraBroker listening at \a path
+ *
+ * @param[in] path The broker's socket
+ * @exception ERR_BROKER_CANNOT_CONNECT If there's no broker there.
+ */
+CameraBrokerClient::CameraBrokerClient(const std::string path) {
+    this->next_id = 1;
+    this->last_latency_ms = 0;
+
+    struct sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path)) {
+        throw ERR_BROKER_CANNOT_CONNECT;
+    }
+    std::strcpy(address.sun_path, path.c_str());
+
+    this->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(this->fd < 0) {
+        throw ERR_BROKER_CANNOT_CONNECT;
+    }
+    if(connect(this->fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(this->fd);
+        throw ERR_BROKER_CANNOT_CONNECT;
+    }
+}
+
+CameraBrokerClient::~CameraBrokerClient() {
+    close(this->fd);
+}
+
+/**
+ * @brief Run a raw PTP transaction on the broker's camera
+ *
+ * Same as \c CameraBase::ptp_transaction, except that the broker chooses the
+ * transaction ID.  Never shared with other clients' requests.
+ *
+ * @exception ERR_BROKER_DISCONNECTED If the broker has gone away.
+ * @see CameraBase::ptp_transaction
+ */
+void CameraBrokerClient::ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    std::vector<uint8_t> containers;
+    append_container(containers, cmd);
+    if(!data.is_empty()) {
+        append_container(containers, data);
+    }
+
+    this->request(OP_TRANSACTION, receiving ? 1 : 0, containers.data(), containers.size());
+    unpack_pair(this->body, out_resp, out_data);
+}
+
+/**
+ * @brief Retrieve the version of CHDK on the broker's camera
+ *
+ * @see CHDKCamera::get_chdk_version
+ */
+float CameraBrokerClient::get_chdk_version() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->request(OP_CHDK_VERSION, 0, NULL, 0);
+    if(this->body.size() != sizeof(float)) {
+        throw ERR_INVALID_RESPONSE;
+    }
+
+    float out;
+    std::memcpy(&out, this->body.data(), sizeof(float));
+    return out;
+}
+
+/**
+ * @brief Check the status of the script running on the broker's camera
+ *
+ * The answer may be shared with other clients, and may be a few
+ * milliseconds old; see \c CameraBroker::set_cache_ttl.
+ *
+ * @see CHDKCamera::check_script_status
+ */
+uint32_t CameraBrokerClient::check_script_status() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->request(OP_SCRIPT_STATUS, 0, NULL, 0);
+    if(this->body.size() != sizeof(uint32_t)) {
+        throw ERR_INVALID_RESPONSE;
+    }
+
+    uint32_t out;
+    std::memcpy(&out, this->body.data(), sizeof(uint32_t));
+    return out;
+}
+
+/**
+ * @brief Run a Lua script on the broker's camera
+ *
+ * Unlike \c CHDKCamera::execute_lua, blocking only waits for the script to
+ * stop running, and leaves its messages for whoever reads them.
+ *
+ * @param[in]  script       The Lua script to run.
+ * @param[out] script_error CHDK's \c PTP_CHDK_S_ERRTYPE for starting the script.
+ * @param[in]  block        Whether to wait for the script to finish.
+ * @return The script's ID.
+ * @see CHDKCamera::execute_lua
+ */
+uint32_t CameraBrokerClient::execute_lua(const std::string script, uint32_t * script_error, const bool block) {
+    uint32_t values[2];
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->request(OP_EXECUTE_LUA, 0, script.c_str(), script.length());
+        if(this->body.size() != sizeof(values)) {
+            throw ERR_INVALID_RESPONSE;
+        }
+        std::memcpy(values, this->body.data(), sizeof(values));
+    }
+
+    if(script_error != NULL) {
+        *script_error = values[1];
+    }
+    if(block && values[1] == PTP_CHDK_S_ERRTYPE_NONE) {
+        while(this->check_script_status() & PTP_CHDK_SCRIPT_STATUS_RUN) {
+            usleep(50 * 1000);
+        }
+    }
+
+    return values[0];
+}
+
+/**
+ * @brief Read the next message from scripts on the broker's camera
+ *
+ * @see CHDKCamera::read_script_message
+ */
+void CameraBrokerClient::read_script_message(PTPContainer& out_resp, PTPContainer& out_data) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->request(OP_READ_SCRIPT_MESSAGE, 0, NULL, 0);
+    unpack_pair(this->body, out_resp, out_data);
+}
+
+/**
+ * @brief Send a message to the script running on the broker's camera
+ *
+ * @see CHDKCamera::write_script_message
+ */
+uint32_t CameraBrokerClient::write_script_message(const std::string message, const uint32_t script_id) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->request(OP_WRITE_SCRIPT_MESSAGE, script_id, message.c_str(), message.length());
+    if(this->body.size() != sizeof(uint32_t)) {
+        throw ERR_INVALID_RESPONSE;
+    }
+
+    uint32_t out;
+    std::memcpy(&out, this->body.data(), sizeof(uint32_t));
+    return out;
+}
+
+/**
+ * @brief Retrieve live view data from the broker's camera
+ *
+ * Clients asking for the same buffers at the same time get the same frame.
+ *
+ * @see CHDKCamera::get_live_view_data
+ */
+void CameraBrokerClient::get_live_view_data(LVData& data_out, const bool liveview, const bool overlay, const bool palette) {
+    uint32_t flags = 0;
+    if(liveview) flags |= LV_TFR_VIEWPORT;
+    if(overlay)  flags |= LV_TFR_BITMAP;
+    if(palette)  flags |= LV_TFR_PALETTE;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->request(OP_LIVE_VIEW, flags, NULL, 0);
+
+    uint32_t length;
+    if(!find_container(this->body.data(), this->body.size(), 0, &length)) {
+        throw ERR_INVALID_RESPONSE;
+    }
+    PTPContainer frame;
+    data_out.recycle(frame);        // Unpack this frame into the memory of the last one
+    frame.unpack(this->body.data());
+    data_out.adopt(frame);
+}
+
+/**
+ * @brief Retrieve how long the last request took, as seen from this end
+ *
+ * @return Round trip time in milliseconds
+ */
+double CameraBrokerClient::get_last_latency_ms() const {
+    return this->last_latency_ms;
+}
+
+/**
+ * @brief Send a request, and wait for its answer in \c body
+ *
+ * @exception ERR_BROKER_DISCONNECTED If the broker hangs up.
+ * @exception ERR_INVALID_RESPONSE If the answer is for some other request.
+ * Any error the broker answers with is thrown, too.
+ */
+void CameraBrokerClient::request(const uint32_t op, const uint32_t flags, const void * data, const uint32_t size) {
+    const uint64_t start = monotonic_us();
+
+    RequestHeader header;
+    header.length = size;
+    header.id = this->next_id++;
+    header.op = op;
+    header.flags = flags;
+    if(!write_all(this->fd, &header, sizeof(RequestHeader)) || !write_all(this->fd, data, size)) {
+        throw ERR_BROKER_DISCONNECTED;
+    }
+
+    ResponseHeader answer;
+    if(!read_all(this->fd, &answer, sizeof(ResponseHeader)) || answer.length > MAX_BODY) {
+        throw ERR_BROKER_DISCONNECTED;
+    }
+    this->body.resize(answer.length);
+    if(!read_all(this->fd, this->body.data(), answer.length)) {
+        throw ERR_BROKER_DISCONNECTED;
+    }
+    this->last_latency_ms = (monotonic_us() - start) / 1000.0;
+
+    if(answer.id != header.id) {
+        throw ERR_INVALID_RESPONSE;
+    }
+    if(answer.error != ERR_NONE) {
+        throw (LIBPTP_PP_ERRORS)answer.error;
+    }
+}
+
+} /* namespace PTP */
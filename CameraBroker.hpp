@@ -0,0 +1,156 @@
+#ifndef LIBPTP_PP_CAMERABROKER_H_
+#define LIBPTP_PP_CAMERABROKER_H_
+
+#include <atomic>
+#include <future>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include "Util.hpp"
+
+namespace PTP {
+
+    class CHDKCamera;
+    class LVData;
+    class PTPContainer;
+
+    // What goes over the broker's socket.  Every request is a RequestHeader
+    // and length bytes of body, and gets a ResponseHeader with the same id and
+    // length bytes of body back.  All little endian, as the camera is.
+    namespace CameraBrokerProtocol {
+        enum OP {
+            OP_TRANSACTION = 1,         // Body: packed command, then packed data if any; flags: 1 if receiving.
+                                        //  Answer: packed response, then packed data
+            OP_CHDK_VERSION,            // Answer: a float
+            OP_SCRIPT_STATUS,           // Answer: a uint32_t
+            OP_EXECUTE_LUA,             // Body: the script.  Answer: uint32_t script id, uint32_t script error
+            OP_READ_SCRIPT_MESSAGE,     // Answer: packed response, then packed data
+            OP_WRITE_SCRIPT_MESSAGE,    // Body: the message; flags: the script id.  Answer: a uint32_t
+            OP_LIVE_VIEW,               // Flags: LV_TFR_* bits.  Answer: packed data
+            OP_COUNT
+        };
+
+        struct RequestHeader {
+            uint32_t length;            // Of the body
+            uint32_t id;                // Chosen by the client, echoed in the answer
+            uint32_t op;
+            uint32_t flags;
+        };
+
+        struct ResponseHeader {
+            uint32_t length;            // Of the body
+            uint32_t id;
+            int32_t error;              // A LIBPTP_PP_ERRORS; the body is empty unless it's ERR_NONE
+            uint32_t reserved;
+        };
+
+        static const uint32_t MAX_BODY = 64 * 1024 * 1024;
+    }
+
+    class CameraBroker {
+        public:
+            struct ClientStats {
+                int id;                     // In order of connection, from 1
+                uint64_t requests;
+                double latency_ms_last;     // From a request arriving to its answer going out
+                double latency_ms_mean;
+                double latency_ms_max;
+            };
+
+            struct Stats {
+                uint64_t clients;           // Connections accepted
+                uint64_t requests;          // Requests answered
+                uint64_t transactions;      // Requests that went to the camera
+                uint64_t coalesced;         // Requests that waited for an identical one already in flight
+                uint64_t cache_hits;        // Requests answered from the cache
+                uint64_t errors;            // Requests answered with an error
+                std::vector<ClientStats> connected;
+            };
+
+            CameraBroker(CHDKCamera& camera);
+            ~CameraBroker();
+            void listen(const std::string path);
+            void stop();
+            void set_cache_ttl(const CameraBrokerProtocol::OP op, const int ttl_ms);
+            Stats get_stats() const;
+
+        private:
+            struct PendingReply {
+                int32_t error;
+                std::vector<uint8_t> body;
+            };
+
+            struct Cached {
+                uint64_t expires_us;
+                PendingReply result;
+            };
+
+            struct InFlight {
+                std::shared_future<PendingReply> answer;
+                uint64_t generation;        // Of the camera's state when it started
+            };
+
+            struct Client {
+                int fd;
+                ClientStats stats;
+                double latency_ms_total;
+                std::thread thread;
+                std::atomic<bool> done;
+            };
+
+            CHDKCamera& camera;
+            std::mutex camera_mutex;        // One transaction on the wire at a time
+
+            mutable std::mutex mutex;       // Guards everything below
+            int ttl_ms[CameraBrokerProtocol::OP_COUNT];
+            std::map<std::string, InFlight> in_flight;
+            uint64_t generation;            // Bumped by every request that may change the camera
+            std::map<std::string, Cached> cache;
+            std::list<Client *> clients;
+            Stats stats;
+
+            UnixServer server;
+
+            CameraBroker(const CameraBroker&);      // Owns threads, so it can't be copied
+            CameraBroker& operator=(const CameraBroker&);
+
+            void accept_client(const int connection);
+            void reap_clients(const bool all);
+            void serve(Client * client);
+            PendingReply handle(const uint32_t op, const uint32_t flags, const std::vector<uint8_t>& body);
+            PendingReply execute(const uint32_t op, const uint32_t flags, const std::vector<uint8_t>& body);
+    };
+
+    class CameraBrokerClient {
+        public:
+            CameraBrokerClient(const std::string path);
+            ~CameraBrokerClient();
+            void ptp_transaction(PTPContainer& cmd, PTPContainer& data, const bool receiving, PTPContainer& out_resp, PTPContainer& out_data);
+            float get_chdk_version();
+            uint32_t check_script_status();
+            uint32_t execute_lua(const std::string script, uint32_t * script_error, const bool block=false);
+            void read_script_message(PTPContainer& out_resp, PTPContainer& out_data);
+            uint32_t write_script_message(const std::string message, const uint32_t script_id=0);
+            void get_live_view_data(LVData& data_out, const bool liveview=true, const bool overlay=false, const bool palette=false);
+            double get_last_latency_ms() const;
+
+        private:
+            int fd;
+            uint32_t next_id;
+            double last_latency_ms;         // Of the last request, measured here
+            std::mutex mutex;               // One request on the socket at a time
+            std::vector<uint8_t> body;      // Answer to the last request
+
+            CameraBrokerClient(const CameraBrokerClient&);  // Owns a connection, so it can't be copied
+            CameraBrokerClient& operator=(const CameraBrokerClient&);
+
+            void request(const uint32_t op, const uint32_t flags, const void * data, const uint32_t size);
+    };
+
+}
+
+#endif /* LIBPTP_PP_CAMERABROKER_H_ */
@@ -0,0 +1,559 @@
+/**
+ * @file CameraExecutor.cpp
+ *
+ * @brief Runs camera operations as C++20 coroutines, many cameras to a thread
+ *
+ * Every call in \c CameraBase and \c CHDKCamera blocks its thread until the
+ * camera answers, which can be seconds for a script or an upload.  Driving
+ * dozens of cameras that way takes dozens of threads.  The \c async_ calls
+ * do the same work as coroutines instead: each transfer is submitted with
+ * libusb's asynchronous API, and the coroutine is suspended until it
+ * completes, so one thread running a \c CameraExecutor can keep every
+ * camera busy at once.
+ *
+ * A coroutine returns a \c Task, which runs when it's awaited, or when it's
+ * handed to \c CameraExecutor::run or \c CameraExecutor::spawn.  Errors are
+ * thrown, as they are by the blocking calls, and come out of the
+ * \c co_await.  \c CameraExecutor::sleep waits without holding up the
+ * thread, for polling loops such as waiting on a script.
+ *
+ * Any operation can be given a \c Cancellation.  Cancelling it, from any
+ * thread, or letting its deadline pass, stops the transfer in flight and
+ * makes the operation throw \c ERR_CANCELLED or \c ERR_TIMEOUT.  A camera
+ * stopped in the middle of a transaction may still have an answer queued
+ * for it, so it is best reopened before it's used again.
+ *
+ * Several executors, each on its own thread, can share one libusb context,
+ * and so can the cameras they drive.  libusb then hands a finished transfer
+ * to whichever of those threads is handling events at the time.  That thread
+ * only takes the owning executor's lock to hand the coroutine back; the
+ * coroutine itself is always resumed on its own executor's thread.
+ *
+ * Cameras without a device handle, such as \c FakeCamera and
+ * \c ReplayCamera, still work: their transfers complete at once, by way of
+ * their blocking \c CameraBase::_bulk_read and \c CameraBase::_bulk_write.
+ *
+ * Trace spans (see \c Tracer) aren't recorded for async transactions; a span
+ * belongs to a thread, and here one thread has many transactions in flight.
+ */
+
+#include <chrono>
+#include <stdint.h>
+
+#include "libptp++.hpp"
+#include "CameraExecutor.hpp"
+#include "Util.hpp"
+
+namespace PTP {
+
+/**
+ * @brief Translate how an async transfer finished into what \c libusb_bulk_transfer would have returned
+ */
+static int result_for(const libusb_transfer_status status) {
+    switch(status) {
+        case LIBUSB_TRANSFER_COMPLETED: return 0;
+        case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_STALL:     return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+        case LIBUSB_TRANSFER_OVERFLOW:  return LIBUSB_ERROR_OVERFLOW;
+        case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+        default:                        return LIBUSB_ERROR_IO;
+    }
+}
+
+/**
+ * @brief A coroutine nobody awaits, which frees itself when it's done
+ */
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return Detached(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() { }
+        void unhandled_exception() { }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Detached(std::coroutine_handle<promise_type> handle) : handle(handle) { }
+};
+
+/**
+ * @brief Await \a task, for \c CameraExecutor::spawn, then count it finished
+ */
+static Detached detach(Task<void> task, int * spawned) {
+    try {
+        co_await task;
+    } catch(...) {
+        // Nobody is waiting to hear about it
+    }
+    (*spawned)--;
+}
+
+/**
+ * @brief Creates a \c Cancellation that hasn't been cancelled, with no deadline
+ */
+Cancellation::Cancellation() : cancelled(false), deadline_ns(0) {
+}
+
+/**
+ * @brief Cancel every operation given this \c Cancellation
+ *
+ * Safe to call from any thread.  The operations throw \c ERR_CANCELLED once
+ * their executor notices, which is within \c CameraExecutor::MAX_WAIT_US.
+ */
+void Cancellation::cancel() {
+    this->cancelled.store(true);
+}
+
+/**
+ * @brief Give the operations using this \c Cancellation \a milliseconds, from now, to finish
+ *
+ * Ones still running after that throw \c ERR_TIMEOUT.  A later call moves the deadline.
+ *
+ * @param[in] milliseconds How long they have
+ */
+void Cancellation::cancel_after(const int milliseconds) {
+    this->deadline_ns.store(monotonic_ns() + (uint64_t)milliseconds * 1000000);
+}
+
+/**
+ * @brief Determine whether operations using this \c Cancellation should stop
+ */
+bool Cancellation::is_cancelled() const {
+    return this->get_error() != ERR_NONE;
+}
+
+/**
+ * @brief Retrieve the error operations using this \c Cancellation should stop with
+ *
+ * @return \c ERR_CANCELLED if \c Cancellation::cancel was called, \c ERR_TIMEOUT
+ *         if the deadline has passed, or \c ERR_NONE
+ */
+LIBPTP_PP_ERRORS Cancellation::get_error() const {
+    if(this->cancelled.load()) {
+        return ERR_CANCELLED;
+    }
+    uint64_t deadline = this->deadline_ns.load();
+    if(deadline != 0 && monotonic_ns() >= deadline) {
+        return ERR_TIMEOUT;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Throw the error from \c Cancellation::get_error, if there is one
+ */
+void Cancellation::throw_if_cancelled() const {
+    LIBPTP_PP_ERRORS error = this->get_error();
+    if(error != ERR_NONE) {
+        throw error;
+    }
+}
+
+/**
+ * @brief Set up a wait of \a milliseconds on \a executor; nothing happens until it's awaited
+ */
+Sleep::Sleep(CameraExecutor& executor, const int milliseconds, Cancellation * cancel) : executor(executor) {
+    this->deadline_ns = monotonic_ns() + (uint64_t)(milliseconds > 0 ? milliseconds : 0) * 1000000;
+    this->cancel = cancel;
+    this->waiting = false;
+}
+
+/**
+ * @brief Forgets the wait, if its coroutine was destroyed in the middle of it
+ */
+Sleep::~Sleep() {
+    if(this->waiting) {
+        this->executor.remove_sleeper(this);
+    }
+}
+
+bool Sleep::await_ready() const {
+    return monotonic_ns() >= this->deadline_ns || (this->cancel != NULL && this->cancel->is_cancelled());
+}
+
+void Sleep::await_suspend(std::coroutine_handle<> awaiting) {
+    this->awaiting = awaiting;
+    this->waiting = true;
+    this->executor.add_sleeper(this);
+}
+
+/**
+ * @exception ERR_CANCELLED, ERR_TIMEOUT If the sleep's \c Cancellation stopped it
+ */
+void Sleep::await_resume() const {
+    if(this->cancel != NULL) {
+        this->cancel->throw_if_cancelled();
+    }
+}
+
+/**
+ * @brief Set up a bulk transfer; nothing is sent or received until it's awaited
+ *
+ * @param[in] executor The executor whose thread will handle the transfer's events
+ * @param[in] handle   The device to talk to
+ * @param[in] endpoint The endpoint to write to or read from; its direction decides which
+ * @param[in] buffer   What to write, or where to put what's read.  It must outlast the transfer.
+ * @param[in] length   How many bytes to write, or the most to read
+ * @param[in] timeout  How many milliseconds libusb gives the transfer, or 0 for no limit
+ * @param[in] cancel   (optional) A \c Cancellation that can stop the transfer
+ */
+BulkTransfer::BulkTransfer(CameraExecutor& executor, libusb_device_handle * handle, const unsigned char endpoint,
+                           unsigned char * buffer, const int length, const int timeout, Cancellation * cancel) : executor(executor) {
+    this->transfer = libusb_alloc_transfer(0);
+    this->cancel = cancel;
+    this->result = 0;
+    this->in_flight = false;
+    this->cancel_requested = false;
+    this->abandoned = false;
+    if(this->transfer != NULL) {
+        libusb_fill_bulk_transfer(this->transfer, handle, endpoint, buffer, length, BulkTransfer::on_complete, this, timeout);
+        this->transfer->actual_length = 0;
+    }
+}
+
+/**
+ * @brief Frees the transfer
+ *
+ * If its coroutine was destroyed while it was in flight, it's cancelled
+ * first, and events are handled until libusb has finished with it: the
+ * buffer is going away with the coroutine, and libusb could still be writing
+ * into it until then.
+ */
+BulkTransfer::~BulkTransfer() {
+    if(this->transfer == NULL) return;
+
+    bool in_flight;
+    {
+        std::lock_guard<std::mutex> lock(this->executor.mutex);
+        this->abandoned = true;
+        in_flight = this->in_flight;
+    }
+
+    if(in_flight) {
+        libusb_cancel_transfer(this->transfer);
+        while(in_flight) {
+            struct timeval tv;
+            tv.tv_sec = 0;
+            tv.tv_usec = CameraExecutor::MAX_WAIT_US;
+            libusb_handle_events_timeout_completed(this->executor.context, &tv, NULL);
+
+            std::lock_guard<std::mutex> lock(this->executor.mutex);
+            in_flight = this->in_flight;
+        }
+    }
+
+    libusb_free_transfer(this->transfer);
+}
+
+/**
+ * @brief Skip submitting the transfer if it couldn't be allocated, or was cancelled already
+ */
+bool BulkTransfer::await_ready() {
+    if(this->transfer == NULL) {
+        this->result = LIBUSB_ERROR_NO_MEM;
+        return true;
+    }
+    if(this->cancel != NULL && this->cancel->is_cancelled()) {
+        this->result = LIBUSB_ERROR_INTERRUPTED;
+        return true;
+    }
+    return false;
+}
+
+bool BulkTransfer::await_suspend(std::coroutine_handle<> awaiting) {
+    this->awaiting = awaiting;
+
+    // Added before it's submitted, as it can finish on another thread straight away
+    {
+        std::lock_guard<std::mutex> lock(this->executor.mutex);
+        this->in_flight = true;
+        this->executor.add_transfer(this);
+    }
+
+    int ret = libusb_submit_transfer(this->transfer);
+    if(ret != 0) {
+        std::lock_guard<std::mutex> lock(this->executor.mutex);
+        this->in_flight = false;
+        this->executor.remove_transfer(this);
+        this->result = ret;
+        return false;       // Carry straight on; it failed
+    }
+
+    return true;
+}
+
+/**
+ * @return 0 on success, libusb error code otherwise, like \c libusb_bulk_transfer
+ * @exception ERR_CANCELLED, ERR_TIMEOUT If the transfer's \c Cancellation stopped it before it finished
+ */
+int BulkTransfer::await_resume() {
+    if(this->result == LIBUSB_ERROR_INTERRUPTED && this->cancel != NULL) {
+        this->cancel->throw_if_cancelled();
+    }
+    return this->result;
+}
+
+/**
+ * @brief Retrieve how many bytes were actually written or read
+ */
+int BulkTransfer::get_transferred() const {
+    return (this->transfer != NULL) ? this->transfer->actual_length : 0;
+}
+
+/**
+ * @brief Called by libusb when a transfer finishes
+ *
+ * This can be on any thread handling events for the context, not just the
+ * executor's.  Once the lock is let go, \a transfer's \c BulkTransfer may be
+ * gone, so nothing touches it after that.
+ */
+void BulkTransfer::on_complete(libusb_transfer * transfer) {
+    BulkTransfer * self = (BulkTransfer *)transfer->user_data;
+    CameraExecutor& executor = self->executor;
+    {
+        std::lock_guard<std::mutex> lock(executor.mutex);
+        self->in_flight = false;
+        self->result = result_for(transfer->status);
+        executor.remove_transfer(self);
+        if(self->abandoned) return;     // Its destructor is waiting for this, and nothing else is
+        executor.ready.push_back(self->awaiting);
+    }
+    executor.wake.notify_one();
+}
+
+/**
+ * @brief Creates an unlocked \c AsyncMutex
+ */
+AsyncMutex::AsyncMutex() {
+    this->locked = false;
+}
+
+/**
+ * @brief Get an awaitable that returns once this coroutine holds the mutex
+ *
+ * @param[in] executor The executor to resume the coroutine on, if it has to wait
+ */
+AsyncMutex::Lock AsyncMutex::lock(CameraExecutor& executor) {
+    return Lock(*this, executor);
+}
+
+/**
+ * @brief Let the next waiting coroutine through, or unlock if none is waiting
+ */
+void AsyncMutex::unlock() {
+    std::pair<std::coroutine_handle<>, CameraExecutor *> next;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if(this->waiters.empty()) {
+            this->locked = false;
+            return;
+        }
+        next = this->waiters.front();      // Handed straight over; it stays locked
+        this->waiters.pop_front();
+    }
+    next.second->post(next.first);
+}
+
+bool AsyncMutex::Lock::await_ready() {
+    std::lock_guard<std::mutex> lock(this->mutex.mutex);
+    if(!this->mutex.locked) {
+        this->mutex.locked = true;
+        return true;
+    }
+    return false;
+}
+
+bool AsyncMutex::Lock::await_suspend(std::coroutine_handle<> awaiting) {
+    std::lock_guard<std::mutex> lock(this->mutex.mutex);
+    if(!this->mutex.locked) {
+        this->mutex.locked = true;      // Unlocked since await_ready
+        return false;
+    }
+    this->mutex.waiters.push_back(std::make_pair(awaiting, &this->executor));
+    return true;
+}
+
+/**
+ * @brief Creates an executor for the cameras of \a context
+ *
+ * @param[in] context The libusb context the cameras were opened in; NULL for the default one, which \c CameraBase uses
+ */
+CameraExecutor::CameraExecutor(libusb_context * context) {
+    this->context = context;
+    this->spawned = 0;
+}
+
+/**
+ * @brief Start \a task, without waiting for it
+ *
+ * It runs during \c CameraExecutor::run, along with everything else.  Nobody
+ * can await it, so anything it throws is dropped; catch errors inside it.
+ * Call only from the executor's thread, or before it's running.
+ *
+ * @param[in] task The task to run
+ */
+void CameraExecutor::spawn(Task<void> task) {
+    this->spawned++;
+    Detached detached = detach(std::move(task), &this->spawned);
+    this->post(detached.handle);
+}
+
+/**
+ * @brief Run coroutines until every spawned task has finished
+ */
+void CameraExecutor::run() {
+    while(this->spawned > 0) {
+        this->step();
+    }
+}
+
+/**
+ * @brief Retrieve the number of spawned tasks that haven't finished
+ */
+int CameraExecutor::get_spawned_count() const {
+    return this->spawned;
+}
+
+/**
+ * @brief Queue \a handle to be resumed on the executor's thread
+ *
+ * Safe to call from any thread; a coroutine waiting on something outside
+ * the executor can be woken this way.
+ *
+ * @param[in] handle The coroutine to resume
+ */
+void CameraExecutor::post(std::coroutine_handle<> handle) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->ready.push_back(handle);
+    }
+    this->wake.notify_one();
+}
+
+/**
+ * @brief Get an awaitable that waits \a milliseconds, letting other coroutines run meanwhile
+ *
+ * @param[in] milliseconds How long to wait
+ * @param[in] cancel       (optional) A \c Cancellation that can cut the wait short, by throwing
+ */
+Sleep CameraExecutor::sleep(const int milliseconds, Cancellation * cancel) {
+    return Sleep(*this, milliseconds, cancel);
+}
+
+/**
+ * @brief Start a task, for \c CameraExecutor::run
+ */
+void CameraExecutor::start(std::coroutine_handle<> handle) {
+    this->post(handle);
+}
+
+/**
+ * @brief Do one round of work
+ *
+ * Wakes sleepers that are due or cancelled, cancels transfers whose
+ * operations were cancelled, waits for something to be ready if nothing is,
+ * and resumes everything that's ready.
+ */
+void CameraExecutor::step() {
+    uint64_t now = monotonic_ns();
+
+    std::multimap<uint64_t, Sleep *>::iterator it = this->sleepers.begin();
+    while(it != this->sleepers.end()) {
+        Sleep * sleeper = it->second;
+        if(it->first <= now || (sleeper->cancel != NULL && sleeper->cancel->is_cancelled())) {
+            sleeper->waiting = false;
+            this->post(sleeper->awaiting);
+            it = this->sleepers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // Only this thread resumes, and so frees, the transfers' coroutines, so they outlive the lock
+    std::vector<BulkTransfer *> cancelling;
+    bool transferring;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        for(size_t i = 0; i < this->transfers.size(); i++) {
+            BulkTransfer * transfer = this->transfers[i];
+            if(!transfer->cancel_requested && transfer->cancel != NULL && transfer->cancel->is_cancelled()) {
+                transfer->cancel_requested = true;
+                cancelling.push_back(transfer);
+            }
+        }
+        transferring = !this->transfers.empty();
+    }
+    for(size_t i = 0; i < cancelling.size(); i++) {
+        libusb_cancel_transfer(cancelling[i]->transfer);     // It finishes, as cancelled, in a later event
+    }
+
+    int wait_us = MAX_WAIT_US;
+    if(!this->sleepers.empty()) {
+        uint64_t next = this->sleepers.begin()->first;
+        uint64_t until_next_us = (next > now) ? (next - now) / 1000 : 0;
+        if(until_next_us < (uint64_t)wait_us) wait_us = until_next_us;
+    }
+
+    bool idle;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        idle = this->ready.empty();
+    }
+    if(idle && transferring) {
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = wait_us;
+        libusb_handle_events_timeout_completed(this->context, &tv, NULL);  // Completions post their coroutines
+    } else if(idle) {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->wake.wait_for(lock, std::chrono::microseconds(wait_us), [this] { return !this->ready.empty(); });
+    }
+
+    // Anything these make ready waits for the next round, so a busy coroutine can't starve the rest
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->resuming.swap(this->ready);
+    }
+    for(size_t i = 0; i < this->resuming.size(); i++) {
+        this->resuming[i].resume();
+    }
+    this->resuming.clear();
+}
+
+void CameraExecutor::add_sleeper(Sleep * sleeper) {
+    this->sleepers.insert(std::make_pair(sleeper->deadline_ns, sleeper));
+}
+
+void CameraExecutor::remove_sleeper(Sleep * sleeper) {
+    std::multimap<uint64_t, Sleep *>::iterator it;
+    for(it = this->sleepers.begin(); it != this->sleepers.end(); ++it) {
+        if(it->second == sleeper) {
+            this->sleepers.erase(it);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Keep track of \a transfer while it's in flight; call with the mutex held
+ */
+void CameraExecutor::add_transfer(BulkTransfer * transfer) {
+    this->transfers.push_back(transfer);
+}
+
+/**
+ * @brief Stop keeping track of \a transfer, if it was; call with the mutex held
+ */
+void CameraExecutor::remove_transfer(BulkTransfer * transfer) {
+    for(size_t i = 0; i < this->transfers.size(); i++) {
+        if(this->transfers[i] == transfer) {
+            this->transfers[i] = this->transfers.back();
+            this->transfers.pop_back();
+            return;
+        }
+    }
+}
+
+} /* namespace PTP */
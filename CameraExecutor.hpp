@@ -0,0 +1,262 @@
+#ifndef LIBPTP_PP_CAMERAEXECUTOR_H_
+#define LIBPTP_PP_CAMERAEXECUTOR_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include <libusb-1.0/libusb.h>
+#include "Result.hpp"
+
+namespace PTP {
+
+    class CameraExecutor;
+
+    // Stops the async operations it's given to, on request or at a deadline
+    class Cancellation {
+        public:
+            Cancellation();
+            void cancel();
+            void cancel_after(const int milliseconds);
+            bool is_cancelled() const;
+            LIBPTP_PP_ERRORS get_error() const;     // ERR_CANCELLED, ERR_TIMEOUT past the deadline, or ERR_NONE
+            void throw_if_cancelled() const;
+
+        private:
+            std::atomic<bool> cancelled;
+            std::atomic<uint64_t> deadline_ns;      // 0 if there isn't one
+
+            Cancellation(const Cancellation&);      // Operations keep a pointer to it, so it can't be copied
+            Cancellation& operator=(const Cancellation&);
+    };
+
+    // What the promise of every Task has, whatever it returns
+    class TaskPromiseBase {
+        public:
+            // Goes straight on with whoever was awaiting the task, if anyone was
+            struct FinalAwaiter {
+                bool await_ready() noexcept { return false; }
+                template <typename P>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<P> finished) noexcept {
+                    std::coroutine_handle<> next = finished.promise().continuation;
+                    return next ? next : std::noop_coroutine();
+                }
+                void await_resume() noexcept { }
+            };
+
+            std::coroutine_handle<> continuation;
+            std::exception_ptr error;
+
+            std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+            FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+            void unhandled_exception() { this->error = std::current_exception(); }
+    };
+
+    /*
+     * A coroutine that produces a T.  It doesn't start until it's awaited, or
+     * handed to a CameraExecutor, and awaiting it throws whatever it threw.
+     */
+    template <typename T>
+    class Task {
+        public:
+            class promise_type : public TaskPromiseBase {
+                public:
+                    T value;
+                    Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+                    void return_value(T value) { this->value = std::move(value); }
+            };
+
+            Task(Task&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+            ~Task() { if(this->handle) this->handle.destroy(); }
+
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                this->handle.promise().continuation = awaiting;
+                return this->handle;
+            }
+            T await_resume() {
+                if(this->handle.promise().error) std::rethrow_exception(this->handle.promise().error);
+                return std::move(this->handle.promise().value);
+            }
+            bool is_done() const { return this->handle.done(); }
+
+        private:
+            std::coroutine_handle<promise_type> handle;
+
+            explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) { }
+            Task(const Task&);                  // Owns its coroutine, so it can't be copied
+            Task& operator=(const Task&);
+
+            friend class CameraExecutor;
+    };
+
+    template <>
+    class Task<void> {
+        public:
+            class promise_type : public TaskPromiseBase {
+                public:
+                    Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+                    void return_void() { }
+            };
+
+            Task(Task&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+            ~Task() { if(this->handle) this->handle.destroy(); }
+
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                this->handle.promise().continuation = awaiting;
+                return this->handle;
+            }
+            void await_resume() {
+                if(this->handle.promise().error) std::rethrow_exception(this->handle.promise().error);
+            }
+            bool is_done() const { return this->handle.done(); }
+
+        private:
+            std::coroutine_handle<promise_type> handle;
+
+            explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) { }
+            Task(const Task&);
+            Task& operator=(const Task&);
+
+            friend class CameraExecutor;
+    };
+
+    // Awaited to let other coroutines run for a while; see CameraExecutor::sleep
+    class Sleep {
+        public:
+            Sleep(CameraExecutor& executor, const int milliseconds, Cancellation * cancel);
+            ~Sleep();
+            bool await_ready() const;
+            void await_suspend(std::coroutine_handle<> awaiting);
+            void await_resume() const;
+
+        private:
+            CameraExecutor& executor;
+            uint64_t deadline_ns;
+            Cancellation * cancel;
+            std::coroutine_handle<> awaiting;
+            bool waiting;
+
+            Sleep(const Sleep&);                // The executor keeps a pointer to it, so it can't be copied
+            Sleep& operator=(const Sleep&);
+
+            friend class CameraExecutor;
+    };
+
+    // One libusb bulk transfer, awaited for its libusb_error
+    class BulkTransfer {
+        public:
+            BulkTransfer(CameraExecutor& executor, libusb_device_handle * handle, const unsigned char endpoint,
+                         unsigned char * buffer, const int length, const int timeout, Cancellation * cancel);
+            ~BulkTransfer();
+            bool await_ready();
+            bool await_suspend(std::coroutine_handle<> awaiting);
+            int await_resume();
+            int get_transferred() const;
+
+        private:
+            CameraExecutor& executor;
+            libusb_transfer * transfer;
+            Cancellation * cancel;
+            std::coroutine_handle<> awaiting;
+            int result;
+            bool in_flight;                     // Guarded by the executor's mutex, as completions can come on any thread
+            bool cancel_requested;
+            bool abandoned;                     // Its coroutine is being destroyed, so it mustn't be resumed
+
+            BulkTransfer(const BulkTransfer&);  // libusb keeps a pointer to it, so it can't be copied
+            BulkTransfer& operator=(const BulkTransfer&);
+
+            static void on_complete(libusb_transfer * transfer);
+
+            friend class CameraExecutor;
+    };
+
+    // Lets one coroutine at a time through, without blocking the thread
+    class AsyncMutex {
+        public:
+            class Lock {
+                public:
+                    Lock(AsyncMutex& mutex, CameraExecutor& executor) : mutex(mutex), executor(executor) { }
+                    bool await_ready();
+                    bool await_suspend(std::coroutine_handle<> awaiting);
+                    void await_resume() { }
+
+                private:
+                    AsyncMutex& mutex;
+                    CameraExecutor& executor;
+            };
+
+            AsyncMutex();
+            Lock lock(CameraExecutor& executor);
+            void unlock();
+
+        private:
+            std::mutex mutex;                   // Guards everything below
+            bool locked;
+            std::deque<std::pair<std::coroutine_handle<>, CameraExecutor *> > waiters;
+
+            AsyncMutex(const AsyncMutex&);      // Coroutines wait in it, so it can't be copied
+            AsyncMutex& operator=(const AsyncMutex&);
+    };
+
+    class CameraExecutor {
+        public:
+            static const int MAX_WAIT_US = 10000;   // The longest a cancel or post from another thread waits to be seen
+
+            CameraExecutor(libusb_context * context=NULL);
+            void spawn(Task<void> task);
+            template <typename T> T run(Task<T> task);
+            void run();
+            void post(std::coroutine_handle<> handle);
+            Sleep sleep(const int milliseconds, Cancellation * cancel=NULL);
+            int get_spawned_count() const;
+
+        private:
+            libusb_context * context;
+            std::mutex mutex;                       // Guards ready and transfers, which other threads can change
+            std::condition_variable wake;
+            std::vector<std::coroutine_handle<> > ready;
+            std::vector<std::coroutine_handle<> > resuming;
+            std::multimap<uint64_t, Sleep *> sleepers;  // By deadline
+            std::vector<BulkTransfer *> transfers;      // In flight
+            int spawned;                                // Spawned tasks that haven't finished
+
+            CameraExecutor(const CameraExecutor&);  // Coroutines wait in it, so it can't be copied
+            CameraExecutor& operator=(const CameraExecutor&);
+
+            void step();
+            void start(std::coroutine_handle<> handle);
+            void add_sleeper(Sleep * sleeper);
+            void remove_sleeper(Sleep * sleeper);
+            void add_transfer(BulkTransfer * transfer);
+            void remove_transfer(BulkTransfer * transfer);
+
+            friend class Sleep;
+            friend class BulkTransfer;
+    };
+
+    /*
+     * Runs every coroutine ready to run until task finishes, then returns what
+     * it returned, or throws what it threw.  Spawned tasks run meanwhile, and
+     * any left are carried on with by the next call to run.
+     */
+    template <typename T>
+    T CameraExecutor::run(Task<T> task) {
+        this->start(task.handle);
+        while(!task.handle.done()) {
+            this->step();
+        }
+        return task.await_resume();
+    }
+
+}
+
+#endif /* LIBPTP_PP_CAMERAEXECUTOR_H_ */
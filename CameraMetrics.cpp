@@ -0,0 +1,519 @@
+/**
+ * @file CameraMetrics.cpp
+ *
+ * @brief Counts and times every transaction, per camera and per operation
+ *
+ * A camera given a \c CameraMetrics with \c CameraBase::set_metrics reports
+ * each \c CameraBase::ptp_transaction here: how long it took, the bytes each
+ * way, whether the response was OK, whether it threw, and which USB error,
+ * if any, its transfers hit.  Counts are kept per camera and per operation;
+ * CHDK's operations, which all share PTP operation 0x9999, are told apart by
+ * their first parameter.
+ *
+ * Recording a transaction costs about a hundred nanoseconds, most of it the
+ * two clock reads, against a USB round trip of a hundred microseconds or
+ * more.  To keep threads that use different cameras, or the
+ * same one, from fighting over cache lines, each thread adds to a shard of
+ * its own, and the shards are summed only when someone asks.
+ *
+ * Latencies go into a histogram with 8 buckets per power of two of
+ * microseconds, like an HDR histogram with 3 significant bits, so percentiles
+ * are good to 12.5% from a microsecond to over an hour, in fixed memory.
+ *
+ * \c CameraMetrics::snapshot returns all of it as plain structures, and
+ * \c CameraMetrics::format_prometheus as Prometheus text, which can be
+ * written to a file for the node exporter's textfile collector, or served
+ * on a Unix socket.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "libptp++.hpp"
+#include "CameraMetrics.hpp"
+#include "PTPContainer.hpp"
+
+namespace PTP {
+
+// Names of CHDK's operations, by their first parameter
+static const char * chdk_op_names[] = {
+    "version", "get_memory", "set_memory", "call_function", "temp_data", "upload_file",
+    "download_file", "execute_script", "script_status", "script_support", "read_script_msg",
+    "write_script_msg", "get_display_data"
+};
+
+// The latency bounds exported to Prometheus, in microseconds: every power of two
+// up to about a minute.  They fall on bucket edges, so they're exact.
+static const int EXPORTED_OCTAVES = 27;
+
+static std::mutex shard_mutex;              // Guards free_shards and next_shard
+static std::vector<int> * free_shards = new std::vector<int>;  // Never freed, so threads exiting after main are safe
+static std::atomic<int> free_shard_count(0);    // Size of free_shards, to check without the lock
+static int next_shard = 0;                  // The lowest shard no thread has had yet
+
+/**
+ * @brief Gives the calling thread's shard back when the thread exits
+ */
+struct ShardHolder {
+    int shard;      // Written only by this thread, or -1 if it shares the last one
+    bool asked;     // Whether the thread has tried to take a shard yet
+
+    ShardHolder() {
+        this->shard = -1;
+        this->asked = false;
+    }
+    ~ShardHolder() {
+        if(this->shard < 0) return;
+        std::lock_guard<std::mutex> lock(shard_mutex);
+        free_shards->push_back(this->shard);
+        free_shard_count++;
+    }
+};
+
+static thread_local ShardHolder shard_holder;
+
+/**
+ * @brief Pick the shard the calling thread adds to
+ *
+ * Threads that record something get a shard each, which only they write, so
+ * they can add without a locked instruction.  A shard is given back when its
+ * thread exits, for the next thread to use.  While every shard but the last
+ * is taken, other threads share the last one, and take a shard of their own
+ * as soon as one is given back.
+ *
+ * @param[out] exclusive Set if the calling thread is the only one writing the shard
+ */
+static int get_shard(const int shards, bool * exclusive) {
+    ShardHolder& holder = shard_holder;
+    if(holder.shard < 0 && (!holder.asked || free_shard_count.load(std::memory_order_relaxed) > 0)) {
+        std::lock_guard<std::mutex> lock(shard_mutex);
+        holder.asked = true;
+        if(!free_shards->empty()) {
+            holder.shard = free_shards->back();
+            free_shards->pop_back();
+            free_shard_count--;
+        } else if(next_shard < shards - 1) {
+            holder.shard = next_shard++;
+        }
+    }
+
+    *exclusive = (holder.shard >= 0);
+    return *exclusive ? holder.shard : shards - 1;
+}
+
+/**
+ * @brief Add \a value to \a counter, which only this thread writes if \a exclusive
+ */
+static inline void add(std::atomic<uint64_t>& counter, const uint64_t value, const bool exclusive) {
+    if(exclusive) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    } else {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+}
+
+CameraMetrics::CameraMetrics() {
+    int i;
+    for(i = 0; i < MAX_CAMERAS; i++) {
+        this->cameras[i] = NULL;
+    }
+    this->camera_count = 0;
+}
+
+CameraMetrics::~CameraMetrics() {
+    this->stop_listening();
+
+    int i, key;
+    for(i = 0; i < this->camera_count; i++) {
+        for(key = 0; key < OP_KEYS; key++) {
+            delete this->cameras[i]->ops[key].load();
+        }
+        delete this->cameras[i];
+    }
+}
+
+/**
+ * @brief Find the latency bucket \a latency_us falls in
+ *
+ * Below 8 us, each microsecond has a bucket.  From there on, each power of
+ * two is split into 8 equal buckets.
+ */
+int CameraMetrics::get_bucket(const uint64_t latency_us) {
+    if(latency_us < 8) {
+        return (int)latency_us;
+    }
+
+    int octave = 63 - __builtin_clzll(latency_us);     // 3 or more
+    int bucket = 8 + (octave - 3) * 8 + (int)((latency_us >> (octave - 3)) & 7);
+    return (bucket < BUCKETS) ? bucket : BUCKETS - 1;
+}
+
+/**
+ * @brief Find the first latency past \a bucket
+ *
+ * @return The exclusive upper bound of \a bucket, in microseconds
+ */
+uint64_t CameraMetrics::get_bucket_bound_us(const int bucket) {
+    if(bucket < 8) {
+        return bucket + 1;
+    }
+
+    int octave = (bucket - 8) / 8 + 3;
+    return (uint64_t)(8 + (bucket - 8) % 8 + 1) << (octave - 3);
+}
+
+/**
+ * @brief Retrieve the mean latency
+ *
+ * @return Milliseconds, or 0 if there were no transactions
+ */
+double CameraMetrics::OpSnapshot::get_mean_ms() const {
+    if(this->transactions == 0) {
+        return 0;
+    }
+    return this->latency_ns_total / 1e6 / this->transactions;
+}
+
+/**
+ * @brief Estimate a latency percentile from the histogram
+ *
+ * @param[in] percentile From 0 to 100
+ * @return The upper bound of the bucket the percentile falls in, in milliseconds; 0 if there were no transactions
+ */
+double CameraMetrics::OpSnapshot::get_percentile_ms(const double percentile) const {
+    uint64_t total = 0, seen = 0;
+    unsigned int i;
+    for(i = 0; i < this->buckets.size(); i++) {
+        total += this->buckets[i];
+    }
+    if(total == 0) {
+        return 0;
+    }
+
+    double rank = percentile / 100.0 * total;
+    for(i = 0; i < this->buckets.size(); i++) {
+        seen += this->buckets[i];
+        if(seen >= rank && seen > 0) {
+            return CameraMetrics::get_bucket_bound_us(i) / 1000.0;
+        }
+    }
+    return CameraMetrics::get_bucket_bound_us(this->buckets.size() - 1) / 1000.0;
+}
+
+/**
+ * @brief Sum every shard of every camera and operation seen so far
+ *
+ * Operations a camera hasn't used are left out.  Counts keep climbing while
+ * this runs, so the result is a moment in the recent past rather than an
+ * exact one.
+ */
+CameraMetrics::Snapshot CameraMetrics::snapshot() const {
+    Snapshot out;
+    int i, key, shard, bucket;
+    const int cameras = this->camera_count.load(std::memory_order_acquire);
+
+    for(i = 0; i < cameras; i++) {
+        const Camera * camera = this->cameras[i];
+        for(key = 0; key < OP_KEYS; key++) {
+            const Op * op = camera->ops[key].load(std::memory_order_acquire);
+            if(op == NULL) continue;
+
+            OpSnapshot s;
+            s.camera = camera->name;
+            s.op = CameraMetrics::get_op_name(key);
+            s.transactions = s.failures = s.error_responses = s.timeouts = 0;
+            s.bytes_sent = s.bytes_received = s.latency_ns_total = 0;
+            s.buckets.assign(BUCKETS, 0);
+            for(shard = 0; shard < SHARDS; shard++) {
+                const Shard& sh = op->shards[shard];
+                s.transactions += sh.transactions.load(std::memory_order_relaxed);
+                s.failures += sh.failures.load(std::memory_order_relaxed);
+                s.error_responses += sh.error_responses.load(std::memory_order_relaxed);
+                s.timeouts += sh.timeouts.load(std::memory_order_relaxed);
+                s.bytes_sent += sh.bytes_sent.load(std::memory_order_relaxed);
+                s.bytes_received += sh.bytes_received.load(std::memory_order_relaxed);
+                s.latency_ns_total += sh.latency_ns_total.load(std::memory_order_relaxed);
+                for(bucket = 0; bucket < BUCKETS; bucket++) {
+                    s.buckets[bucket] += sh.buckets[bucket].load(std::memory_order_relaxed);
+                }
+            }
+            out.ops.push_back(s);
+        }
+
+        for(key = 0; key < USB_ERRORS; key++) {
+            uint64_t count = camera->usb_errors[key].load(std::memory_order_relaxed);
+            if(count == 0) continue;
+
+            UsbErrorSnapshot e;
+            e.camera = camera->name;
+            e.error = (key < 12) ? -(key + 1) : ((key == 12) ? LIBUSB_ERROR_OTHER : UNKNOWN_USB_ERROR);
+            e.count = count;
+            out.usb_errors.push_back(e);
+        }
+    }
+
+    return out;
+}
+
+/**
+ * @brief Quote \a value for a Prometheus label
+ */
+static std::string quote_label(const std::string& value) {
+    std::string out = "\"";
+    std::string::size_type i;
+    for(i = 0; i < value.size(); i++) {
+        if(value[i] == '\\' || value[i] == '"') out += '\\';
+        if(value[i] == '\n') {
+            out += "\\n";
+            continue;
+        }
+        out += value[i];
+    }
+    return out + "\"";
+}
+
+/**
+ * @brief Write everything in the Prometheus text exposition format
+ *
+ * Counters are \c libptp_transactions_total, \c libptp_transaction_failures_total,
+ * \c libptp_error_responses_total, \c libptp_timeouts_total,
+ * \c libptp_bytes_sent_total and \c libptp_bytes_received_total, labelled by
+ * camera and op; \c libptp_usb_errors_total is labelled by camera and libusb
+ * error name, or \c other for codes libusb doesn't define.  Latency is the histogram \c libptp_transaction_duration_seconds,
+ * with a bucket at every power of two microseconds.
+ */
+std::string CameraMetrics::format_prometheus() const {
+    static const struct {
+        const char * name;
+        const char * help;
+        uint64_t OpSnapshot::* value;
+    } counters[] = {
+        { "libptp_transactions_total", "PTP transactions", &OpSnapshot::transactions },
+        { "libptp_transaction_failures_total", "Transactions that failed without a response", &OpSnapshot::failures },
+        { "libptp_error_responses_total", "Transactions answered with a response code other than OK", &OpSnapshot::error_responses },
+        { "libptp_timeouts_total", "Transactions with a USB transfer that timed out", &OpSnapshot::timeouts },
+        { "libptp_bytes_sent_total", "Bytes of commands and data sent", &OpSnapshot::bytes_sent },
+        { "libptp_bytes_received_total", "Bytes of responses and data received", &OpSnapshot::bytes_received }
+    };
+    const Snapshot s = this->snapshot();
+    std::ostringstream out;
+    unsigned int c, i;
+    int octave, bucket;
+
+    for(c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+        out << "# HELP " << counters[c].name << " " << counters[c].help << "\n";
+        out << "# TYPE " << counters[c].name << " counter\n";
+        for(i = 0; i < s.ops.size(); i++) {
+            out << counters[c].name << "{camera=" << quote_label(s.ops[i].camera) << ",op=" << quote_label(s.ops[i].op)
+                << "} " << s.ops[i].*counters[c].value << "\n";
+        }
+    }
+
+    out << "# HELP libptp_usb_errors_total USB transfers that failed, by libusb error\n";
+    out << "# TYPE libptp_usb_errors_total counter\n";
+    for(i = 0; i < s.usb_errors.size(); i++) {
+        const int error = s.usb_errors[i].error;
+        out << "libptp_usb_errors_total{camera=" << quote_label(s.usb_errors[i].camera)
+            << ",error=" << quote_label((error == UNKNOWN_USB_ERROR) ? "other" : libusb_error_name(error)) << "} " << s.usb_errors[i].count << "\n";
+    }
+
+    out << "# HELP libptp_transaction_duration_seconds Time from sending a command to receiving its response\n";
+    out << "# TYPE libptp_transaction_duration_seconds histogram\n";
+    for(i = 0; i < s.ops.size(); i++) {
+        const OpSnapshot& op = s.ops[i];
+        const std::string labels = "camera=" + quote_label(op.camera) + ",op=" + quote_label(op.op);
+        uint64_t cumulative = 0;
+        bucket = 0;
+        for(octave = 0; octave < EXPORTED_OCTAVES; octave++) {
+            const uint64_t bound = (uint64_t)1 << octave;
+            while(bucket < BUCKETS && CameraMetrics::get_bucket_bound_us(bucket) <= bound) {
+                cumulative += op.buckets[bucket++];
+            }
+            char le[32];
+            snprintf(le, sizeof(le), "%g", bound / 1e6);
+            out << "libptp_transaction_duration_seconds_bucket{" << labels << ",le=\"" << le << "\"} " << cumulative << "\n";
+        }
+        out << "libptp_transaction_duration_seconds_bucket{" << labels << ",le=\"+Inf\"} " << op.transactions << "\n";
+        out << "libptp_transaction_duration_seconds_sum{" << labels << "} " << op.latency_ns_total / 1e9 << "\n";
+        out << "libptp_transaction_duration_seconds_count{" << labels << "} " << op.transactions << "\n";
+    }
+
+    return out.str();
+}
+
+/**
+ * @brief Write \c CameraMetrics::format_prometheus to \a path
+ *
+ * The text goes to a temporary file that's renamed over \a path, so a
+ * collector never reads half of it.
+ *
+ * @param[in] path Where to write, such as a \c .prom file in the node exporter's textfile directory
+ * @return False if the file couldn't be written
+ */
+bool CameraMetrics::write_prometheus(const std::string path) const {
+    return write_file_atomically(path, this->format_prometheus());
+}
+
+/**
+ * @brief Serve \c CameraMetrics::format_prometheus on the Unix socket at \a path
+ *
+ * A background thread accepts connections, writes the current metrics to
+ * each, and hangs up.  Anything already at \a path is replaced.
+ *
+ * @param[in] path Where to create the socket
+ * @exception ERR_METRICS_CANNOT_LISTEN If the socket can't be created.
+ */
+void CameraMetrics::listen(const std::string path) {
+    if(!this->server.listen(path, 8, [this](int connection) { this->serve(connection); })) {
+        throw ERR_METRICS_CANNOT_LISTEN;
+    }
+}
+
+/**
+ * @brief Stop serving metrics, and remove the socket
+ *
+ * Does nothing if not listening.
+ */
+void CameraMetrics::stop_listening() {
+    this->server.stop();
+}
+
+/**
+ * @brief Write the metrics to \a connection, and hang up
+ */
+void CameraMetrics::serve(const int connection) {
+    const std::string text = this->format_prometheus();
+    size_t done = 0;
+    while(done < text.size()) {
+        ssize_t n = send(connection, text.data() + done, text.size() - done, MSG_NOSIGNAL);
+        if(n <= 0) break;
+        done += n;
+    }
+    close(connection);
+}
+
+/**
+ * @brief Start counting for a camera called \a name
+ *
+ * @return The camera's index, for \c CameraMetrics::record
+ * @exception ERR_METRICS_TOO_MANY_CAMERAS If there are already \c MAX_CAMERAS cameras.
+ */
+int CameraMetrics::add_camera(const std::string name) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    const int index = this->camera_count.load(std::memory_order_relaxed);
+    if(index >= MAX_CAMERAS) {
+        throw ERR_METRICS_TOO_MANY_CAMERAS;
+    }
+
+    Camera * camera = new Camera;
+    camera->name = name;
+    int i;
+    for(i = 0; i < OP_KEYS; i++) {
+        camera->ops[i] = NULL;
+    }
+    for(i = 0; i < USB_ERRORS; i++) {
+        camera->usb_errors[i] = 0;
+    }
+
+    this->cameras[index] = camera;
+    this->camera_count.store(index + 1, std::memory_order_release);     // Publish it to snapshot()
+    return index;
+}
+
+/**
+ * @brief Count one transaction
+ *
+ * @param[in] camera         From \c CameraMetrics::add_camera
+ * @param[in] cmd            The command, which says what operation it was
+ * @param[in] latency_ns     From sending the command to receiving the response, or failing
+ * @param[in] bytes_sent     Of the command and any data sent
+ * @param[in] bytes_received Of the response and any data received
+ * @param[in] response       The response code, or 0 if there wasn't one
+ * @param[in] usb_error      The first libusb error of the transaction's transfers, or 0
+ * @param[in] failed         Whether the transaction threw
+ */
+void CameraMetrics::record(const int camera, const PTPContainer& cmd, const uint64_t latency_ns, const uint64_t bytes_sent,
+                           const uint64_t bytes_received, const uint16_t response, const int usb_error, const bool failed) {
+    Camera * c = this->cameras[camera];
+    const int key = CameraMetrics::get_op_key(cmd);
+
+    Op * op = c->ops[key].load(std::memory_order_acquire);
+    if(op == NULL) {
+        // First time this operation is seen; whoever loses the race throws theirs away
+        Op * fresh = new Op;
+        int shard, bucket;
+        for(shard = 0; shard < SHARDS; shard++) {
+            Shard& sh = fresh->shards[shard];
+            sh.transactions = sh.failures = sh.error_responses = sh.timeouts = 0;
+            sh.bytes_sent = sh.bytes_received = sh.latency_ns_total = 0;
+            for(bucket = 0; bucket < BUCKETS; bucket++) {
+                sh.buckets[bucket] = 0;
+            }
+        }
+        if(c->ops[key].compare_exchange_strong(op, fresh, std::memory_order_acq_rel)) {
+            op = fresh;
+        } else {
+            delete fresh;
+        }
+    }
+
+    bool exclusive;
+    Shard& sh = op->shards[get_shard(SHARDS, &exclusive)];
+    add(sh.transactions, 1, exclusive);
+    add(sh.latency_ns_total, latency_ns, exclusive);
+    add(sh.buckets[CameraMetrics::get_bucket(latency_ns / 1000)], 1, exclusive);
+    if(bytes_sent != 0) add(sh.bytes_sent, bytes_sent, exclusive);
+    if(bytes_received != 0) add(sh.bytes_received, bytes_received, exclusive);
+    if(failed) add(sh.failures, 1, exclusive);
+    if(!failed && response != CHDK_PTP_RC_OK) add(sh.error_responses, 1, exclusive);
+
+    if(usb_error != 0) {
+        if(usb_error == LIBUSB_ERROR_TIMEOUT) add(sh.timeouts, 1, exclusive);
+        int index = (usb_error <= -1 && usb_error >= -12) ? -usb_error - 1 : ((usb_error == LIBUSB_ERROR_OTHER) ? 12 : 13);
+        c->usb_errors[index].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Find where \a cmd's operation is counted
+ */
+int CameraMetrics::get_op_key(const PTPContainer& cmd) {
+    if(cmd.code >= 0x1000 && cmd.code < 0x1000 + PTP_OPS) {
+        return cmd.code - 0x1000;
+    }
+    if(cmd.code == 0x9999 && !cmd.is_empty()) {
+        uint32_t op = cmd.get_param_n(0);
+        if(op < (uint32_t)CHDK_OPS) {
+            return PTP_OPS + op;
+        }
+    }
+    return OP_KEYS - 1;
+}
+
+/**
+ * @brief Name the operation counted under \a key, for labels
+ */
+std::string CameraMetrics::get_op_name(const int key) {
+    char name[32];
+    if(key < PTP_OPS) {
+        snprintf(name, sizeof(name), "0x%04x", 0x1000 + key);
+    } else if(key < PTP_OPS + CHDK_OPS) {
+        const unsigned int op = key - PTP_OPS;
+        if(op < sizeof(chdk_op_names) / sizeof(chdk_op_names[0])) {
+            snprintf(name, sizeof(name), "chdk_%s", chdk_op_names[op]);
+        } else {
+            snprintf(name, sizeof(name), "chdk_%u", op);
+        }
+    } else {
+        return "other";
+    }
+    return name;
+}
+
+} /* namespace PTP */
@@ -0,0 +1,110 @@
+#ifndef LIBPTP_PP_CAMERAMETRICS_H_
+#define LIBPTP_PP_CAMERAMETRICS_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "Util.hpp"
+
+namespace PTP {
+
+    class CameraBase;
+    class PTPContainer;
+
+    class CameraMetrics {
+        public:
+            static const int MAX_CAMERAS = 64;
+            static const int BUCKETS = 240;     // Latency buckets: 8 per power of two of microseconds
+
+            struct OpSnapshot {
+                std::string camera;
+                std::string op;                 // "0x1001" for PTP operations, "chdk_<name>" for CHDK ones
+                uint64_t transactions;
+                uint64_t failures;              // Transactions that threw
+                uint64_t error_responses;       // Responses other than OK
+                uint64_t timeouts;              // Transactions with a USB transfer that timed out
+                uint64_t bytes_sent;
+                uint64_t bytes_received;
+                uint64_t latency_ns_total;
+                std::vector<uint64_t> buckets;  // Transactions per latency bucket; see get_bucket_bound_us
+
+                double get_mean_ms() const;
+                double get_percentile_ms(const double percentile) const;
+            };
+
+            static const int UNKNOWN_USB_ERROR = 1;     // Not a libusb_error: any code libusb doesn't define
+
+            struct UsbErrorSnapshot {
+                std::string camera;
+                int error;                      // A libusb_error, or UNKNOWN_USB_ERROR
+                uint64_t count;
+            };
+
+            struct Snapshot {
+                std::vector<OpSnapshot> ops;
+                std::vector<UsbErrorSnapshot> usb_errors;
+            };
+
+            CameraMetrics();
+            ~CameraMetrics();
+            Snapshot snapshot() const;
+            std::string format_prometheus() const;
+            bool write_prometheus(const std::string path) const;
+            void listen(const std::string path);
+            void stop_listening();
+            static int get_bucket(const uint64_t latency_us);
+            static uint64_t get_bucket_bound_us(const int bucket);
+
+        private:
+            static const int SHARDS = 8;        // One per thread, for up to 7 threads at a time; the rest share the last
+            static const int PTP_OPS = 256;     // 0x1000 - 0x10ff
+            static const int CHDK_OPS = 32;
+            static const int OP_KEYS = PTP_OPS + CHDK_OPS + 1;     // The last one is for everything else
+            static const int USB_ERRORS = 14;   // LIBUSB_ERROR_IO (-1) to LIBUSB_ERROR_NOT_SUPPORTED (-12), then LIBUSB_ERROR_OTHER, then anything else
+
+            struct alignas(64) Shard {
+                std::atomic<uint64_t> transactions;
+                std::atomic<uint64_t> failures;
+                std::atomic<uint64_t> error_responses;
+                std::atomic<uint64_t> timeouts;
+                std::atomic<uint64_t> bytes_sent;
+                std::atomic<uint64_t> bytes_received;
+                std::atomic<uint64_t> latency_ns_total;
+                std::atomic<uint64_t> buckets[BUCKETS];
+            };
+
+            struct Op {
+                Shard shards[SHARDS];
+            };
+
+            struct Camera {
+                std::string name;
+                std::atomic<Op *> ops[OP_KEYS];     // Made the first time each operation is seen
+                std::atomic<uint64_t> usb_errors[USB_ERRORS];
+            };
+
+            mutable std::mutex mutex;           // Guards adding cameras
+            Camera * cameras[MAX_CAMERAS];
+            std::atomic<int> camera_count;
+
+            UnixServer server;
+
+            CameraMetrics(const CameraMetrics&);    // Owns its counters, so it can't be copied
+            CameraMetrics& operator=(const CameraMetrics&);
+
+            // CameraBase::ptp_transaction reports each transaction here
+            friend class CameraBase;
+            int add_camera(const std::string name);
+            void record(const int camera, const PTPContainer& cmd, const uint64_t latency_ns, const uint64_t bytes_sent,
+                        const uint64_t bytes_received, const uint16_t response, const int usb_error, const bool failed);
+
+            static int get_op_key(const PTPContainer& cmd);
+            static std::string get_op_name(const int key);
+            void serve(const int connection);
+    };
+
+}
+
+#endif /* LIBPTP_PP_CAMERAMETRICS_H_ */
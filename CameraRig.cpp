@@ -0,0 +1,511 @@
+/**
+ * @file CameraRig.cpp
+ *
+ * @brief Fires a rig of CHDK cameras together, and reports how close together
+ *
+ * Calling \c execute_lua("shoot()") on each camera in turn spreads the shot
+ * over every script that has to be sent, compiled and started first, which
+ * with dozens of cameras is hundreds of milliseconds.  A \c CameraRig does all
+ * of that beforehand: \c CameraRig::arm starts a resident script on every
+ * camera, which focuses and then waits on \c read_usb_msg, so that a shot is
+ * a single short message to each.
+ *
+ * Messages take a while to reach a script, and a different while on each
+ * camera, so the rig measures it.  \c CameraRig::calibrate pings each script
+ * a number of times, NTP fashion: the script answers with its own clock
+ * (\c get_tick_count), and the round trip with the least queueing in it gives
+ * both the time a message takes to get there and the offset between the
+ * camera's clock and ours.  This assumes the way there takes as long as the
+ * way back; where it doesn't, the difference is much the same on cameras of
+ * the same kind, so it moves the whole rig rather than spreading it.
+ *
+ * \c CameraRig::shoot then picks a deadline a little way off, and from one
+ * thread per camera, sends each its release early by the time it takes to
+ * arrive.  Each script notes the time it got the release, by its own clock,
+ * and says so once it's shot; with the offsets, that puts every camera on the
+ * host's clock, so the skew reported is what was achieved, not what was
+ * aimed for.
+ *
+ * The camera's tick count is in milliseconds, and a script only runs on the
+ * camera's 10 ms keyboard tick, so the skew can't be got much below that, and
+ * can't be measured to better than a millisecond.  Clocks drift, so a rig
+ * left armed for long should be calibrated again before shooting.
+ */
+
+#include <cstdlib>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "libptp++.hpp"
+#include "CameraRig.hpp"
+#include "CHDKCamera.hpp"
+#include "PTPContainer.hpp"
+#include "ThreadPool.hpp"
+#include "Util.hpp"
+
+namespace PTP {
+
+/**
+ * @brief Set up an empty rig
+ *
+ * The action defaults to pressing the shutter the rest of the way for a
+ * tenth of a second.
+ */
+CameraRig::CameraRig() {
+    this->action = "press(\"shoot_full_only\") sleep(100) release(\"shoot_full_only\")";
+    this->pool = NULL;
+    this->shots = 0;
+}
+
+/**
+ * @brief Stops the scripts on any cameras still armed, and the threads
+ */
+CameraRig::~CameraRig() {
+    this->disarm();
+    delete this->pool;
+}
+
+/**
+ * @brief Add \a camera to the rig
+ *
+ * The camera must be open, with CHDK on it, and must outlive the rig.  While
+ * the rig is armed, nothing else should talk to it.
+ *
+ * @param[in] camera The camera
+ * @param[in] name   What to call it in a \c CameraRig::ShotReport
+ * @return The number of the camera in the rig, from 0
+ */
+int CameraRig::add_camera(CHDKCamera& camera, const std::string name) {
+    Member member;
+    member.camera = &camera;
+    member.name = name;
+    member.script_id = 0;
+    member.calibration.armed = false;
+    member.calibration.error = ERR_RIG_NOT_ARMED;
+    member.calibration.samples = 0;
+    member.calibration.rtt_us = 0;
+    member.calibration.latency_us = 0;
+    member.calibration.offset_us = 0;
+    this->members.push_back(member);
+
+    return this->members.size() - 1;
+}
+
+/**
+ * @brief Retrieve the number of cameras in the rig
+ */
+int CameraRig::get_camera_count() const {
+    return this->members.size();
+}
+
+/**
+ * @brief Set the Lua each camera runs when it gets the release
+ *
+ * It runs with the shutter half pressed, and must leave it that way.  Takes
+ * effect at the next \c CameraRig::arm.
+ *
+ * @param[in] action A Lua snippet, which presses \c shoot_full_only by default
+ */
+void CameraRig::set_action(const std::string action) {
+    this->action = action;
+}
+
+/**
+ * @brief Start the rig's script on every camera, wait for them to focus, and calibrate them
+ *
+ * Cameras are armed all at once, each from its own thread.  A camera that
+ * won't start the script, or doesn't focus in time, is left out, and its
+ * \c CameraRig::Calibration says why.  A rig that's already armed is disarmed
+ * first.
+ *
+ * @param[in] timeout_ms How long to give each camera to start the script and focus
+ * @param[in] rounds     Pings per camera; see \c CameraRig::calibrate
+ * @return The number of cameras armed and calibrated
+ * @see CameraRig::calibrate
+ */
+int CameraRig::arm(const int timeout_ms, const int rounds) {
+    const int n = this->members.size();
+    if(n == 0) return 0;
+
+    this->disarm();
+    if(this->pool == NULL || this->pool->get_thread_count() != n) {
+        delete this->pool;
+        this->pool = new ThreadPool(n);     // One each, so every camera is released at once
+    }
+
+    const std::string script = this->build_script();
+    this->pool->run(n, [this, &script, timeout_ms](const int i) {
+        Member& member = this->members[i];
+        Calibration& calibration = member.calibration;
+        calibration.samples = 0;
+
+        uint32_t script_error = PTP_CHDK_S_ERRTYPE_NONE;
+        Result<uint32_t> started = member.camera->try_execute_lua(script, &script_error);
+        if(!started) {
+            calibration.error = started.get_error();
+            return;
+        }
+        if(script_error != PTP_CHDK_S_ERRTYPE_NONE) {   // It didn't compile, or another script is running
+            calibration.error = ERR_RIG_SCRIPT_STOPPED;
+            return;
+        }
+        member.script_id = started.value();
+
+        calibration.error = this->wait_for_message(member, "armed", NULL, CameraRig::now_us() + (uint64_t)timeout_ms * 1000);
+        calibration.armed = (calibration.error == ERR_NONE);
+        if(calibration.error == ERR_TIMEOUT) {
+            member.camera->try_write_script_message("quit", member.script_id);  // Don't leave it holding focus
+        }
+    });
+
+    return this->calibrate(rounds);
+}
+
+/**
+ * @brief Measure how long messages take to reach each camera's script, and how far its clock is from ours
+ *
+ * Each armed camera is pinged \a rounds times, all cameras at once.  The ping
+ * that came back quickest is the one with the least time spent waiting
+ * around, so it alone is used.  A camera that stops answering keeps what it
+ * was calibrated with before, if anything.
+ *
+ * @param[in] rounds     Pings per camera; more find a quicker one, on a busy bus
+ * @param[in] timeout_ms How long to wait for each answer
+ * @return The number of cameras armed and calibrated
+ */
+int CameraRig::calibrate(const int rounds, const int timeout_ms) {
+    const int n = this->members.size();
+    if(this->pool == NULL) return 0;
+
+    this->pool->run(n, [this, rounds, timeout_ms](const int i) {
+        if(this->members[i].calibration.armed) {
+            this->ping(this->members[i], rounds, timeout_ms);
+        }
+    });
+
+    int calibrated = 0;
+    int i;
+    for(i = 0; i < n; i++) {
+        if(this->members[i].calibration.armed && this->members[i].calibration.samples > 0) calibrated++;
+    }
+
+    return calibrated;
+}
+
+/**
+ * @brief Fire every armed, calibrated camera at the same moment
+ *
+ * The moment is \a lead_ms from now, which has to be long enough to wake a
+ * thread for each camera and get the release to it.  Returns once every
+ * camera has shot and said when, or \a timeout_ms after it was sent the
+ * release.  Cameras that weren't armed or calibrated, or didn't answer, are
+ * in the report with what went wrong, and left out of the skew.
+ *
+ * @param[in] lead_ms    How far ahead to set the deadline
+ * @param[in] timeout_ms How long to wait for each camera to say it has shot
+ * @return When each camera got the release, and how far apart they were
+ * @exception ERR_RIG_NOT_ARMED If no camera is armed and calibrated.
+ */
+CameraRig::ShotReport CameraRig::shoot(const int lead_ms, const int timeout_ms) {
+    const int n = this->members.size();
+    int ready = 0;
+    int i;
+    for(i = 0; i < n; i++) {
+        if(this->members[i].calibration.armed && this->members[i].calibration.samples > 0) ready++;
+    }
+    if(ready == 0) {
+        throw ERR_RIG_NOT_ARMED;
+    }
+
+    ShotReport report;
+    report.shot = ++this->shots;
+    report.cameras.resize(n);
+    const uint64_t deadline = CameraRig::now_us() + (uint64_t)lead_ms * 1000;
+    report.deadline_us = deadline;
+
+    this->pool->run(n, [this, &report, deadline, timeout_ms](const int i) {
+        Member& member = this->members[i];
+        Calibration& calibration = member.calibration;
+        CameraShot& shot = report.cameras[i];
+        shot.name = member.name;
+        shot.send_error_us = 0;
+        shot.release_error_us = 0;
+        shot.uncertainty_us = 0;
+        if(!calibration.armed) {
+            shot.error = ERR_RIG_NOT_ARMED;
+            return;
+        }
+        if(calibration.samples == 0) {     // Without a ping answered there's no latency to send ahead by
+            shot.error = (calibration.error != ERR_NONE) ? calibration.error : ERR_RIG_NOT_ARMED;
+            return;
+        }
+
+        const uint64_t send_at = deadline - calibration.latency_us;
+        CameraRig::wait_until(send_at);
+        const uint64_t sent = CameraRig::now_us();
+        shot.send_error_us = (int64_t)(sent - send_at);
+
+        Result<uint32_t> written = member.camera->try_write_script_message("shoot", member.script_id);
+        if(!written) {
+            shot.error = written.get_error();
+            return;
+        }
+        if(written.value() != PTP_CHDK_S_MSGSTATUS_OK) {
+            calibration.armed = false;
+            shot.error = ERR_RIG_SCRIPT_STOPPED;
+            return;
+        }
+
+        int64_t tick_ms = 0;
+        shot.error = this->wait_for_message(member, "shot ", &tick_ms, sent + (uint64_t)timeout_ms * 1000);
+        if(shot.error == ERR_RIG_SCRIPT_STOPPED) {
+            calibration.armed = false;
+        }
+        if(shot.error != ERR_NONE) {
+            return;
+        }
+
+        // The tick counts whole milliseconds, so take the middle of the one it read
+        shot.release_error_us = tick_ms * 1000 + 500 - calibration.offset_us - (int64_t)deadline;
+        shot.uncertainty_us = calibration.rtt_us / 2 + 500;
+    });
+
+    report.fired = 0;
+    report.skew_us = 0;
+    report.send_spread_us = 0;
+    int64_t earliest = 0, latest = 0;
+    int64_t earliest_send = 0, latest_send = 0;
+    for(i = 0; i < n; i++) {
+        const CameraShot& shot = report.cameras[i];
+        if(shot.error != ERR_NONE) continue;
+
+        if(report.fired == 0 || shot.release_error_us < earliest) earliest = shot.release_error_us;
+        if(report.fired == 0 || shot.release_error_us > latest) latest = shot.release_error_us;
+        if(report.fired == 0 || shot.send_error_us < earliest_send) earliest_send = shot.send_error_us;
+        if(report.fired == 0 || shot.send_error_us > latest_send) latest_send = shot.send_error_us;
+        report.fired++;
+    }
+    report.skew_us = latest - earliest;
+    report.send_spread_us = latest_send - earliest_send;
+
+    return report;
+}
+
+/**
+ * @brief Tell every armed camera's script to let go of the shutter and finish
+ *
+ * Doesn't wait for the scripts to finish, and doesn't throw: a camera that
+ * can't be told has most likely gone already.
+ */
+void CameraRig::disarm() {
+    unsigned int i;
+    for(i = 0; i < this->members.size(); i++) {
+        Member& member = this->members[i];
+        if(member.calibration.armed) {
+            member.camera->try_write_script_message("quit", member.script_id);
+            member.calibration.armed = false;
+            member.calibration.error = ERR_RIG_NOT_ARMED;
+        }
+    }
+}
+
+/**
+ * @brief Determine whether any camera in the rig is armed
+ */
+bool CameraRig::is_armed() const {
+    unsigned int i;
+    for(i = 0; i < this->members.size(); i++) {
+        if(this->members[i].calibration.armed) return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Retrieve what the last calibration found for camera number \a camera
+ *
+ * @param[in] camera The number \c CameraRig::add_camera gave it
+ * @exception ERR_RIG_OUT_OF_RANGE If there's no such camera.
+ */
+CameraRig::Calibration CameraRig::get_calibration(const int camera) const {
+    if(camera < 0 || camera >= (int)this->members.size()) {
+        throw ERR_RIG_OUT_OF_RANGE;
+    }
+
+    return this->members[camera].calibration;
+}
+
+/**
+ * @brief Read the clock deadlines are set by
+ *
+ * @return The current time, in microseconds, from an arbitrary starting point
+ */
+uint64_t CameraRig::now_us() {
+    return monotonic_us();
+}
+
+/**
+ * @brief Put together the script each camera runs while armed
+ *
+ * It half presses the shutter, says "armed" once focused, then answers:
+ *  - "ping" with "pong <tick>"
+ *  - "shoot" by running the action, focusing again, and saying "shot <tick>",
+ *    with the tick from when the release arrived
+ *  - "quit" by letting go of the shutter and finishing, as it also does
+ *    after \c CameraRig::IDLE_MS with nothing to do
+ */
+std::string CameraRig::build_script() const {
+    std::ostringstream script;
+    script << "press(\"shoot_half\")\n"
+              "repeat sleep(10) until get_shooting()\n"
+              "write_usb_msg(\"armed\")\n"
+              "local idle = 0\n"
+              "while idle < " << CameraRig::IDLE_MS << " do\n"
+              "    local msg = read_usb_msg(100)\n"
+              "    if msg == nil then\n"
+              "        idle = idle + 100\n"
+              "    else\n"
+              "        idle = 0\n"
+              "    end\n"
+              "    if msg == \"ping\" then\n"
+              "        write_usb_msg(\"pong \" .. get_tick_count())\n"
+              "    elseif msg == \"shoot\" then\n"
+              "        local tick = get_tick_count()\n"
+              "        " << this->action << "\n"
+              "        repeat sleep(10) until get_shooting()\n"
+              "        write_usb_msg(\"shot \" .. tick)\n"
+              "    elseif msg == \"quit\" then\n"
+              "        break\n"
+              "    end\n"
+              "end\n"
+              "release(\"shoot_half\")\n";
+
+    return script.str();
+}
+
+/**
+ * @brief Read \a member's script messages until one starts with \a prefix
+ *
+ * Other messages from the script, such as answers to pings that were given
+ * up on, are passed over.
+ *
+ * @param[in]  member      The camera to read from
+ * @param[in]  prefix      What the message must start with
+ * @param[out] value       (optional) The number after \a prefix
+ * @param[in]  deadline_us When to give up, from \c CameraRig::now_us
+ * @return \c ERR_NONE, \c ERR_TIMEOUT, \c ERR_RIG_SCRIPT_STOPPED if the script
+ *         finished, or what went wrong reading
+ */
+LIBPTP_PP_ERRORS CameraRig::wait_for_message(Member& member, const std::string prefix, int64_t * value, const uint64_t deadline_us) {
+    PTPContainer resp, data;
+
+    while(1) {
+        Result<void> read = member.camera->try_read_script_message(resp, data);
+        if(!read) {
+            return read.get_error();
+        }
+
+        const uint32_t type = resp.try_get_param_n(0).value_or(PTP_CHDK_S_MSGTYPE_NONE);
+        if(type == PTP_CHDK_S_MSGTYPE_USER) {
+            int payload_size;
+            unsigned char * payload = data.get_payload(&payload_size);
+            uint32_t msg_length = resp.try_get_param_n(3).value_or(0);    // param 4 is the length of the message data
+            if(msg_length > (uint32_t)payload_size) msg_length = payload_size;
+            const std::string msg((char *)payload, msg_length);
+            delete[] payload;
+
+            if(msg.compare(0, prefix.length(), prefix) == 0) {
+                if(value != NULL) {
+                    *value = std::strtoll(msg.c_str() + prefix.length(), NULL, 10);
+                }
+                return ERR_NONE;
+            }
+            continue;
+        } else if(type == PTP_CHDK_S_MSGTYPE_RET || type == PTP_CHDK_S_MSGTYPE_ERR) {
+            if(resp.try_get_param_n(1).value_or(0) == member.script_id) {   // Not an earlier script's
+                return ERR_RIG_SCRIPT_STOPPED;
+            }
+            continue;
+        }
+
+        if(CameraRig::now_us() >= deadline_us) {
+            return ERR_TIMEOUT;
+        }
+        usleep(CameraRig::POLL_US);
+    }
+}
+
+/**
+ * @brief Ping \a member's script \a rounds times, and keep the quickest answer
+ *
+ * @param[in] member     The camera to calibrate
+ * @param[in] rounds     How many times to ping it
+ * @param[in] timeout_ms How long to wait for each answer
+ */
+void CameraRig::ping(Member& member, const int rounds, const int timeout_ms) {
+    Calibration& calibration = member.calibration;
+    LIBPTP_PP_ERRORS error = ERR_NONE;
+    int samples = 0;
+    int64_t best_rtt = 0, best_offset = 0;
+
+    int i;
+    for(i = 0; i < rounds; i++) {
+        const uint64_t sent = CameraRig::now_us();
+        Result<uint32_t> written = member.camera->try_write_script_message("ping", member.script_id);
+        if(!written) {
+            error = written.get_error();
+            break;
+        }
+        if(written.value() != PTP_CHDK_S_MSGSTATUS_OK) {
+            error = ERR_RIG_SCRIPT_STOPPED;
+            break;
+        }
+
+        int64_t tick_ms = 0;
+        error = this->wait_for_message(member, "pong ", &tick_ms, sent + (uint64_t)timeout_ms * 1000);
+        const uint64_t answered = CameraRig::now_us();
+        if(error != ERR_NONE) {
+            break;
+        }
+
+        const int64_t rtt = answered - sent;
+        if(samples == 0 || rtt < best_rtt) {
+            best_rtt = rtt;
+            // The script read its clock halfway through the round trip, and in the middle of that millisecond
+            best_offset = tick_ms * 1000 + 500 - (int64_t)((sent + answered) / 2);
+        }
+        samples++;
+    }
+
+    calibration.error = error;
+    if(error == ERR_RIG_SCRIPT_STOPPED) {
+        calibration.armed = false;
+    }
+    if(samples > 0) {
+        calibration.samples = samples;
+        calibration.rtt_us = best_rtt;
+        calibration.latency_us = best_rtt / 2;
+        calibration.offset_us = best_offset;
+    }
+}
+
+/**
+ * @brief Wait until \c CameraRig::now_us reaches \a at_us
+ *
+ * Sleeps most of the way, then spins, since a sleeping thread can wake a
+ * millisecond or so late.  The spin yields, so a rig with more cameras than
+ * the host has CPUs doesn't hold back the threads that are due.
+ */
+void CameraRig::wait_until(const uint64_t at_us) {
+    const uint64_t now = CameraRig::now_us();
+    if(at_us > now + 2000) {
+        usleep(at_us - now - 2000);
+    }
+    while(CameraRig::now_us() < at_us) {
+        std::this_thread::yield();
+    }
+}
+
+} /* namespace PTP */
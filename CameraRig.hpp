@@ -0,0 +1,84 @@
+#ifndef LIBPTP_PP_CAMERARIG_H_
+#define LIBPTP_PP_CAMERARIG_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "Result.hpp"
+
+namespace PTP {
+
+    class CHDKCamera;
+    class ThreadPool;
+
+    class CameraRig {
+        public:
+            static const int POLL_US = 500;             // Between reads of a camera's script messages, while waiting for one
+            static const int IDLE_MS = 600000;          // The script lets go of the shutter after this long with no message
+
+            // What calibration found for one camera
+            struct Calibration {
+                bool armed;                 // Running the rig's script, and focused
+                LIBPTP_PP_ERRORS error;     // What went wrong the last time it didn't answer
+                int samples;                // Pings answered in the last calibration
+                int64_t rtt_us;             // Shortest round trip, from sending a message to reading the answer
+                int64_t latency_us;         // From starting to send a message to the script getting it
+                int64_t offset_us;          // Camera clock minus host clock
+            };
+
+            // How one camera did in a shot
+            struct CameraShot {
+                std::string name;
+                LIBPTP_PP_ERRORS error;     // ERR_NONE if it fired and said when
+                int64_t send_error_us;      // When the release was sent, minus when it was meant to be
+                int64_t release_error_us;   // When the camera got the release, in host time, minus the deadline
+                int64_t uncertainty_us;     // How far release_error_us could be off, either way
+            };
+
+            struct ShotReport {
+                uint64_t shot;              // Counts from 1
+                uint64_t deadline_us;       // From CameraRig::now_us
+                int fired;                  // Cameras that fired and said when
+                int64_t skew_us;            // Latest release minus earliest, among those that fired
+                int64_t send_spread_us;     // Latest send error minus earliest
+                std::vector<CameraShot> cameras;    // In the order they were added
+            };
+
+            CameraRig();
+            ~CameraRig();
+            int add_camera(CHDKCamera& camera, const std::string name="");
+            int get_camera_count() const;
+            void set_action(const std::string action);
+            int arm(const int timeout_ms=10000, const int rounds=16);
+            int calibrate(const int rounds=16, const int timeout_ms=1000);
+            ShotReport shoot(const int lead_ms=100, const int timeout_ms=5000);
+            void disarm();
+            bool is_armed() const;
+            Calibration get_calibration(const int camera) const;
+            static uint64_t now_us();
+
+        private:
+            struct Member {
+                CHDKCamera * camera;
+                std::string name;
+                uint32_t script_id;
+                Calibration calibration;
+            };
+
+            std::vector<Member> members;
+            std::string action;
+            ThreadPool * pool;              // One thread per camera, started by arm()
+            uint64_t shots;
+
+            CameraRig(const CameraRig&);    // Owns threads, so it can't be copied
+            CameraRig& operator=(const CameraRig&);
+
+            std::string build_script() const;
+            LIBPTP_PP_ERRORS wait_for_message(Member& member, const std::string prefix, int64_t * value, const uint64_t deadline_us);
+            void ping(Member& member, const int rounds, const int timeout_ms);
+            static void wait_until(const uint64_t at_us);
+    };
+
+}
+
+#endif /* LIBPTP_PP_CAMERARIG_H_ */
@@ -0,0 +1,457 @@
+/**
+ * @file FakeCamera.cpp
+ *
+ * @brief A CHDK camera that lives entirely in memory
+ *
+ * Code that talks to a camera through \c CHDKCamera, like \c CameraBroker,
+ * is hard to exercise without one on the desk.  A \c FakeCamera stands in at
+ * the bottom: it overrides \c CameraBase::_bulk_write and
+ * \c CameraBase::_bulk_read, so everything above them, packing, transaction
+ * IDs and reading data phases, runs just as it would against a camera.
+ *
+ * It answers the CHDK operations the library uses the way a camera would:
+ * it reports a version, pretends to run scripts for a while and queues their
+ * return values as messages, passes messages to them, keeps uploaded files
+ * and hands them back for download, and makes up live view frames with a
+ * moving gradient.  Nothing else is emulated; other operations get
+ * \c CHDK_PTP_RC_ParameterNotSupported.
+ *
+ * Each transaction can be made to take a while, to stand in for the USB
+ * round trip, and they are counted, so tests can see how many actually
+ * reached the "camera".
+ */
+
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "libptp++.hpp"
+#include "FakeCamera.hpp"
+#include "PTPContainer.hpp"
+#include "Util.hpp"
+
+namespace PTP {
+
+/**
+ * @brief Whether the CHDK operation \a op is followed by a data phase from the host
+ */
+static bool takes_data(const uint32_t op) {
+    return (op == PTP_CHDK_ExecuteScript || op == PTP_CHDK_WriteScriptMsg ||
+            op == PTP_CHDK_UploadFile || op == PTP_CHDK_TempData);
+}
+
+/**
+ * @brief Whether the CHDK operation \a op answers with a data phase
+ */
+static bool gives_data(const uint32_t op) {
+    return (op == PTP_CHDK_ReadScriptMsg || op == PTP_CHDK_GetDisplayData || op == PTP_CHDK_DownloadFile);
+}
+
+/**
+ * @brief Create a fake camera with a \a width x \a height live view
+ *
+ * Transactions take no time, and scripts run for 100 ms, until changed.
+ *
+ * @param[in] width  Live view width in pixels; a multiple of 4
+ * @param[in] height Live view height in pixels
+ */
+FakeCamera::FakeCamera(const int width, const int height) : CHDKCamera() {
+    this->width = width & ~3;
+    this->height = height;
+    this->latency_us = 0;
+    this->script_duration_ms = 100;
+    this->script_id = 0;
+    this->script_end_us = 0;
+    this->frame_number = 0;
+    this->transactions = 0;
+    this->awaiting_data = false;
+}
+
+/**
+ * @brief Make every transaction take \a transaction_us
+ *
+ * @param[in] transaction_us Time each command takes to arrive, in microseconds
+ */
+void FakeCamera::set_latency(const int transaction_us) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->latency_us = transaction_us;
+}
+
+/**
+ * @brief Make scripts started from now on run for \a duration_ms
+ *
+ * @param[in] duration_ms How long \c check_script_status reports a script as running
+ */
+void FakeCamera::set_script_duration(const int duration_ms) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->script_duration_ms = duration_ms;
+}
+
+/**
+ * @brief Put a file on the fake card, as if it had been uploaded
+ *
+ * @param[in] remote_filename The name it's downloaded by
+ * @param[in] contents        What's in it
+ */
+void FakeCamera::put_file(const std::string remote_filename, const std::string contents) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->files[remote_filename] = contents;
+}
+
+/**
+ * @brief Look at a file on the fake card
+ *
+ * @param[in]  remote_filename The name it was uploaded as
+ * @param[out] contents        Gets what's in it
+ * @return False if there's no such file
+ */
+bool FakeCamera::get_file(const std::string remote_filename, std::string * contents) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    std::map<std::string, std::string>::const_iterator it = this->files.find(remote_filename);
+    if(it == this->files.end()) {
+        return false;
+    }
+    *contents = it->second;
+    return true;
+}
+
+/**
+ * @brief Get the number of transactions this camera has answered
+ */
+uint64_t FakeCamera::get_transaction_count() const {
+    return this->transactions;
+}
+
+/**
+ * @brief Take a container from the host
+ *
+ * A command is answered as soon as it arrives, unless its operation has a
+ * data phase, in which case it's answered when the data arrives.
+ *
+ * @return 0, or \c LIBUSB_ERROR_IO if \a bytestr isn't a PTP container
+ */
+int FakeCamera::_bulk_write(unsigned char * bytestr, const int length, const int timeout) {
+    (void)timeout;
+    uint32_t size;
+    if(length < 12) {
+        return LIBUSB_ERROR_IO;
+    }
+    std::memcpy(&size, bytestr, 4);
+    if(size != (uint32_t)length) {
+        return LIBUSB_ERROR_IO;
+    }
+
+    PTPContainer container(bytestr);
+    int latency;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        latency = this->latency_us;
+    }
+    if(container.type == PTPContainer::CONTAINER_TYPE_COMMAND && latency > 0) {
+        usleep(latency);
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if(this->awaiting_data) {
+        this->awaiting_data = false;
+        if(container.type == PTPContainer::CONTAINER_TYPE_DATA) {
+            this->answer(this->command, container);
+            return 0;
+        }
+        this->answer(this->command, PTPContainer());    // The host had no data for it after all
+    }
+
+    if(container.type == PTPContainer::CONTAINER_TYPE_COMMAND) {
+        if(container.code == 0x9999 && !container.is_empty() && takes_data(container.get_param_n(0))) {
+            this->command.swap(container);
+            this->awaiting_data = true;
+        } else {
+            this->answer(container, PTPContainer());
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Hand the host the next container it's owed, or as much of it as fits
+ *
+ * @return 0, or \c LIBUSB_ERROR_TIMEOUT if there's nothing to read
+ */
+int FakeCamera::_bulk_read(unsigned char * data_out, const int size, int * transferred, const int timeout) {
+    (void)timeout;
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if(this->awaiting_data) {
+        // Reading means the host is done writing, so this command has no data phase
+        this->awaiting_data = false;
+        this->answer(this->command, PTPContainer());
+    }
+
+    *transferred = 0;
+    if(this->outgoing.empty()) {
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    std::vector<uint8_t>& next = this->outgoing.front();
+    const int n = ((size_t)size < next.size()) ? size : (int)next.size();
+    std::memcpy(data_out, next.data(), n);
+    *transferred = n;
+    next.erase(next.begin(), next.begin() + n);
+    if(next.empty()) {
+        this->outgoing.pop_front();
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Carry out \a cmd, and queue the data and response for the host to read
+ *
+ * Scripts "run" for the script duration; one that starts with \c return
+ * queues the rest of its text as a string return value when it finishes, and
+ * any other queues nil.
+ *
+ * @param[in] cmd  The command; only CHDK operations (0x9999) are understood.
+ * @param[in] data Data sent with the command, such as a script; may be empty.
+ */
+void FakeCamera::answer(const PTPContainer& cmd, const PTPContainer& data) {
+    this->transactions++;
+    const uint64_t now = monotonic_us();
+
+    PTPContainer resp(PTPContainer::CONTAINER_TYPE_RESPONSE, CHDK_PTP_RC_OK);
+    resp.transaction_id = cmd.transaction_id;
+    PTPContainer reply(PTPContainer::CONTAINER_TYPE_DATA, cmd.code);
+    reply.transaction_id = cmd.transaction_id;
+
+    if(cmd.code != 0x9999 || cmd.is_empty()) {
+        resp.code = CHDK_PTP_RC_ParameterNotSupported;
+        this->queue(resp);
+        return;
+    }
+
+    // A script that has run its course leaves its return value behind
+    if(this->script_end_us != 0 && now >= this->script_end_us) {
+        this->script_end_us = 0;
+        this->inbox.clear();
+        this->messages.push_back(this->script_return);
+    }
+
+    std::string text;
+    if(!data.is_empty()) {
+        int payload_size;
+        unsigned char * payload = data.get_payload(&payload_size);
+        text.assign((char *)payload, payload_size);
+        delete[] payload;
+    }
+    const uint32_t op = cmd.get_param_n(0);
+    uint32_t name_length;
+
+    switch(op) {
+        case PTP_CHDK_Version:
+            resp.add_param(PTP_CHDK_VERSION_MAJOR);
+            resp.add_param(PTP_CHDK_VERSION_MINOR);
+            break;
+        case PTP_CHDK_ScriptStatus:
+            resp.add_param((this->script_end_us != 0 ? PTP_CHDK_SCRIPT_STATUS_RUN : 0) |
+                           (!this->messages.empty() ? PTP_CHDK_SCRIPT_STATUS_MSG : 0));
+            break;
+        case PTP_CHDK_ExecuteScript:
+            if(!text.empty() && text[text.size() - 1] == '\0') {
+                text.erase(text.size() - 1);    // Scripts are sent with their terminator
+            }
+            if(this->script_end_us != 0) {
+                // CHDK refuses to start a script while another is running
+                resp.add_param(this->script_id);
+                resp.add_param(PTP_CHDK_S_ERRTYPE_COMPILE);
+                break;
+            }
+            this->script_id++;
+            this->script_end_us = now + (uint64_t)this->script_duration_ms * 1000;
+            this->script_return.type = PTP_CHDK_S_MSGTYPE_RET;
+            this->script_return.script_id = this->script_id;
+            if(text.compare(0, 7, "return ") == 0) {
+                this->script_return.subtype = PTP_CHDK_TYPE_STRING;
+                this->script_return.data = text.substr(7);
+            } else {
+                this->script_return.subtype = PTP_CHDK_TYPE_NIL;
+                this->script_return.data.clear();
+            }
+            resp.add_param(this->script_id);
+            resp.add_param(PTP_CHDK_S_ERRTYPE_NONE);
+            break;
+        case PTP_CHDK_ReadScriptMsg:
+            if(this->messages.empty()) {
+                resp.add_param(PTP_CHDK_S_MSGTYPE_NONE);
+                resp.add_param(0);
+                resp.add_param(0);
+                resp.add_param(0);
+            } else {
+                const Message& message = this->messages.front();
+                resp.add_param(message.type);
+                resp.add_param(message.script_id);
+                resp.add_param(message.subtype);
+                resp.add_param(message.data.size());
+                reply.set_payload(message.data.data(), message.data.size());
+                this->messages.pop_front();
+            }
+            break;
+        case PTP_CHDK_WriteScriptMsg:
+            if(this->script_end_us == 0) {
+                resp.add_param(PTP_CHDK_S_MSGSTATUS_NOTRUN);
+            } else if(cmd.get_param_n(1) != 0 && cmd.get_param_n(1) != this->script_id) {
+                resp.add_param(PTP_CHDK_S_MSGSTATUS_BADID);
+            } else {
+                this->inbox.push_back(text);
+                resp.add_param(PTP_CHDK_S_MSGSTATUS_OK);
+            }
+            break;
+        case PTP_CHDK_UploadFile:
+            // Four bytes of name length, the name, then the contents
+            if(text.size() < 4) {
+                resp.code = CHDK_PTP_RC_GeneralError;
+                break;
+            }
+            std::memcpy(&name_length, text.data(), 4);
+            if(name_length > text.size() - 4) {
+                resp.code = CHDK_PTP_RC_GeneralError;
+                break;
+            }
+            this->files[text.substr(4, name_length)] = text.substr(4 + name_length);
+            break;
+        case PTP_CHDK_TempData:
+            this->temp_data = text;
+            break;
+        case PTP_CHDK_DownloadFile:
+            if(this->files.count(this->temp_data) == 0) {
+                resp.code = CHDK_PTP_RC_GeneralError;
+                break;
+            }
+            reply.set_payload(this->files[this->temp_data].data(), this->files[this->temp_data].size());
+            break;
+        case PTP_CHDK_GetDisplayData:
+            this->display_data(cmd.get_param_n(1), reply);
+            break;
+        default:
+            resp.code = CHDK_PTP_RC_ParameterNotSupported;
+            break;
+    }
+
+    if(gives_data(op) && resp.code == CHDK_PTP_RC_OK) {
+        this->queue(reply);
+    }
+    this->queue(resp);
+}
+
+/**
+ * @brief Queue \a container for the host to read, as it would come over USB
+ */
+void FakeCamera::queue(const PTPContainer& container) {
+    std::vector<uint8_t> bytes(container.get_length());
+    if(container.is_empty()) {
+        // No payload to pack, and maybe no buffer; the header is all there is
+        const uint32_t length = container.get_length();
+        std::memcpy(&bytes[0], &length, 4);
+        std::memcpy(&bytes[4], &container.type, 2);
+        std::memcpy(&bytes[6], &container.code, 2);
+        std::memcpy(&bytes[8], &container.transaction_id, 4);
+    } else {
+        unsigned char * packed = container.pack();
+        std::memcpy(bytes.data(), packed, container.get_length());
+        delete[] packed;
+    }
+    this->outgoing.push_back(bytes);
+}
+
+/**
+ * @brief Make up a GetDisplayData payload for \a flags
+ *
+ * The viewport is a gradient that moves a few pixels every frame, over
+ * neutral chroma.  The overlay is half as wide, with a frame around the
+ * edge in palette entry 1 of a 16 entry palette.
+ *
+ * @param[in]  flags    \c LV_TFR_VIEWPORT, \c LV_TFR_BITMAP and \c LV_TFR_PALETTE, as in \c CHDKCamera::get_live_view_data
+ * @param[out] out_data Gets the payload
+ */
+void FakeCamera::display_data(const uint32_t flags, PTPContainer& out_data) {
+    lv_data_header header;
+    lv_framebuffer_desc vp, bm;
+    std::memset(&header, 0, sizeof(lv_data_header));
+    std::memset(&vp, 0, sizeof(lv_framebuffer_desc));
+    std::memset(&bm, 0, sizeof(lv_framebuffer_desc));
+
+    const int vp_size = this->width * this->height * 3 / 2;    // 6 bytes per 4 pixels
+    const int bm_width = this->width / 2;
+    const int bm_size = bm_width * this->height;
+    const int palette_size = 16 * 4;
+
+    header.version_major = LIVE_VIEW_VERSION_MAJOR;
+    header.version_minor = LIVE_VIEW_VERSION_MINOR;
+    header.lcd_aspect_ratio = LV_ASPECT_4_3;
+    header.vp_desc_start = sizeof(lv_data_header);
+    header.bm_desc_start = sizeof(lv_data_header) + sizeof(lv_framebuffer_desc);
+
+    vp.fb_type = LV_FB_YUV8;
+    vp.buffer_width = vp.visible_width = this->width;
+    vp.visible_height = this->height;
+    bm.fb_type = LV_FB_PAL8;
+    bm.buffer_width = bm.visible_width = bm_width;
+    bm.visible_height = this->height;
+
+    int size = sizeof(lv_data_header) + 2 * sizeof(lv_framebuffer_desc);
+    if(flags & LV_TFR_VIEWPORT) {
+        vp.data_start = size;
+        size += vp_size;
+    }
+    if(flags & LV_TFR_BITMAP) {
+        bm.data_start = size;
+        size += bm_size;
+    }
+    if(flags & LV_TFR_PALETTE) {
+        header.palette_type = 1;
+        header.palette_data_start = size;
+        size += palette_size;
+    }
+
+    uint8_t * payload = new uint8_t[size];
+    std::memcpy(payload, &header, sizeof(lv_data_header));
+    std::memcpy(payload + header.vp_desc_start, &vp, sizeof(lv_framebuffer_desc));
+    std::memcpy(payload + header.bm_desc_start, &bm, sizeof(lv_framebuffer_desc));
+
+    int x, y;
+    const int shift = this->frame_number * 4;
+    if(vp.data_start != 0) {
+        uint8_t * row = payload + vp.data_start;
+        for(y = 0; y < this->height; y++) {
+            for(x = 0; x < this->width; x += 4) {
+                const uint8_t luma = (uint8_t)(x + y + shift);
+                row[0] = 0;         // U; signed, so 0 is gray
+                row[1] = luma;
+                row[2] = 0;         // V
+                row[3] = luma;
+                row[4] = luma;
+                row[5] = luma;
+                row += 6;
+            }
+        }
+    }
+    if(bm.data_start != 0) {
+        uint8_t * pixel = payload + bm.data_start;
+        for(y = 0; y < this->height; y++) {
+            for(x = 0; x < bm_width; x++) {
+                *pixel++ = (x == 0 || y == 0 || x == bm_width - 1 || y == this->height - 1) ? 1 : 0;
+            }
+        }
+    }
+    if(header.palette_data_start != 0) {
+        std::memset(payload + header.palette_data_start, 0, palette_size);
+        payload[header.palette_data_start + 4] = 0xff;      // Entry 1 opaque, the rest clear
+        payload[header.palette_data_start + 7] = 0xff;
+    }
+    this->frame_number++;
+
+    out_data.set_payload(payload, size);
+    delete[] payload;
+}
+
+} /* namespace PTP */
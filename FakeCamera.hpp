@@ -0,0 +1,62 @@
+#ifndef LIBPTP_PP_FAKECAMERA_H_
+#define LIBPTP_PP_FAKECAMERA_H_
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "CHDKCamera.hpp"
+#include "PTPContainer.hpp"
+
+namespace PTP {
+
+    class FakeCamera : public CHDKCamera {
+        public:
+            FakeCamera(const int width=720, const int height=240);
+            void set_latency(const int transaction_us);
+            void set_script_duration(const int duration_ms);
+            void put_file(const std::string remote_filename, const std::string contents);
+            bool get_file(const std::string remote_filename, std::string * contents);
+            uint64_t get_transaction_count() const;
+
+        protected:
+            int _bulk_write(unsigned char * bytestr, const int length, const int timeout=0);
+            int _bulk_read(unsigned char * data_out, const int size, int * transferred, const int timeout=0);
+
+        private:
+            struct Message {
+                uint32_t type;              // A PTP_CHDK_S_MSGTYPE
+                uint32_t script_id;
+                uint32_t subtype;           // A PTP_CHDK_TYPE, or PTP_CHDK_S_ERRTYPE for errors
+                std::string data;
+            };
+
+            std::mutex mutex;               // Guards everything below
+            int width, height;
+            int latency_us;
+            int script_duration_ms;
+            uint32_t script_id;             // Of the last script started
+            uint64_t script_end_us;         // When the running script finishes; 0 if none is
+            Message script_return;          // Queued when the running script finishes
+            std::deque<Message> messages;   // From scripts to the host
+            std::deque<std::string> inbox;  // From the host to scripts
+            std::map<std::string, std::string> files;
+            std::string temp_data;          // Set by PTP_CHDK_TempData, such as a file to download
+            uint32_t frame_number;
+            std::atomic<uint64_t> transactions;
+
+            PTPContainer command;           // Waiting for its data phase
+            bool awaiting_data;
+            std::deque<std::vector<uint8_t> > outgoing;     // Containers for the host to read, one transfer each
+
+            void answer(const PTPContainer& cmd, const PTPContainer& data);
+            void queue(const PTPContainer& container);
+            void display_data(const uint32_t flags, PTPContainer& out_data);
+    };
+
+}
+
+#endif /* LIBPTP_PP_FAKECAMERA_H_ */
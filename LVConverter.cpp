@@ -0,0 +1,1644 @@
+/**
+ * @file LVConverter.cpp
+ *
+ * @brief Pixel conversion kernels for live view data
+ *
+ * These are the inner loops behind \c LVData::convert.  Each kernel converts
+ * one row of CHDK \c LV_FB_YUV8 data (groups of six bytes, U Y0 V Y1 Y2 Y3,
+ * holding four pixels) to one of the \c LVData::PIXEL_FORMAT s, in one pass.
+ *
+ * The color conversion is done in fixed point, with every term scaled by 512
+ * and rounded down.  For the default full range BT.601 (JFIF) matrix:
+ *
+ *  - R = Y + ((V * 718) >> 9)
+ *  - G = Y - ((U * 176) >> 9) - ((V * 366) >> 9)
+ *  - B = Y + ((U * 907) >> 9)
+ *
+ * The BT.709 and limited range variants only differ in their coefficients,
+ * which are derived from the matrix definitions at compile time, and in
+ * limited range, Y is first stretched with ((Y - 16) * 596) >> 9.
+ *
+ * Every kernel is a template on the output format, skip mode, matrix and
+ * range, so each combination compiles into its own loop with no decisions left
+ * in it.  The scalar kernels are the reference, and look every term up in
+ * tables built at compile time.  The SSE2 and AVX2 kernels compute exactly the
+ * same values, using \c pmulhw on samples pre-scaled by 128, so the output
+ * doesn't depend on which kernel ran.  The kernel is picked at startup from
+ * what the CPU supports.
+ *
+ * Gray and planar outputs involve no color math at all; they only move Y, U
+ * and V samples around.
+ *
+ * @see http://chdk.wikia.com/wiki/Frame_buffers#Viewport
+ */
+
+#include <cmath>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LIBPTP_PP_X86 1
+#include <immintrin.h>
+#endif
+
+#include "LVConverter.hpp"
+
+namespace PTP {
+
+/**
+ * @brief Round a positive coefficient to fixed point, scaled by 512
+ */
+static constexpr int q9(const double c) {
+    return (int)(c * 512 + 0.5);
+}
+
+/**
+ * @brief The fixed point coefficients of one color matrix and range
+ *
+ * Derived from the luma weights of the red and blue primaries the same way
+ * the standards do.  Full range BT.601 comes out as 718, 176, 366 and 907.
+ */
+template<int MATRIX, int RANGE>
+struct ColorMatrix {
+    static constexpr double KR = (MATRIX == LVData::MATRIX_BT709) ? 0.2126 : 0.299;
+    static constexpr double KB = (MATRIX == LVData::MATRIX_BT709) ? 0.0722 : 0.114;
+    static constexpr double KG = 1.0 - KR - KB;
+    static constexpr bool LIMITED = (RANGE == LVData::RANGE_LIMITED);
+    // Limited range puts Y in 16-235 and U and V in -112..112; stretch them back out
+    static constexpr double Y_SCALE = LIMITED ? 255.0 / 219.0 : 1.0;
+    static constexpr double C_SCALE = LIMITED ? 255.0 / 224.0 : 1.0;
+
+    static constexpr int Y_OFFSET = LIMITED ? 16 : 0;
+    static constexpr int Y_MUL = q9(Y_SCALE);
+    static constexpr int RV = q9(2 * (1 - KR) * C_SCALE);
+    static constexpr int GU = q9(2 * KB * (1 - KB) / KG * C_SCALE);
+    static constexpr int GV = q9(2 * KR * (1 - KR) / KG * C_SCALE);
+    static constexpr int BU = q9(2 * (1 - KB) * C_SCALE);
+};
+
+/**
+ * @brief Every term of the color conversion, for each possible sample value
+ *
+ * Indexed by the raw byte from the camera; U and V bytes are signed.
+ */
+template<int MATRIX, int RANGE>
+struct ColorTables {
+    int16_t y[256];     // Y, stretched in limited range
+    int16_t rv[256];    // Added to Y for R
+    int16_t gu[256];    // Subtracted from Y for G, along with gv
+    int16_t gv[256];
+    int16_t bu[256];    // Added to Y for B
+
+    constexpr ColorTables() : y(), rv(), gu(), gv(), bu() {
+        typedef ColorMatrix<MATRIX, RANGE> M;
+        for(int i = 0; i < 256; i++) {
+            int c = (i < 128) ? i : i - 256;
+            this->y[i] = ((i - M::Y_OFFSET) * M::Y_MUL) >> 9;
+            this->rv[i] = (c * M::RV) >> 9;
+            this->gu[i] = (c * M::GU) >> 9;
+            this->gv[i] = (c * M::GV) >> 9;
+            this->bu[i] = (c * M::BU) >> 9;
+        }
+    }
+};
+
+template<int MATRIX, int RANGE>
+static constexpr ColorTables<MATRIX, RANGE> color_tables = ColorTables<MATRIX, RANGE>();
+
+LVConverter::ISA LVConverter::active_isa = LVConverter::detect_isa();
+
+/**
+ * @brief Clamp an int to 0..255 without branching
+ *
+ * @param[in] v The integer to clip
+ * @return A 8-bit unsigned integer between 0 and 255
+ */
+static inline uint8_t clamp255(int v) {
+    v &= ~(v >> 31);            // Negative -> 0
+    v |= (255 - v) >> 31;       // Over 255 -> all ones, which truncates to 255
+    return (uint8_t)v;
+}
+
+/**
+ * @brief Write one pixel in \a FORMAT
+ *
+ * @param[out] dst Where to write the pixel
+ * @param[in]  r,g,b Unclamped channel values
+ * @return The address just past the pixel
+ */
+template<int FORMAT>
+static inline uint8_t * store_pixel(uint8_t * dst, const int r, const int g, const int b) {
+    switch(FORMAT) {
+        case LVData::FORMAT_RGBA32:
+            dst[0] = clamp255(r); dst[1] = clamp255(g); dst[2] = clamp255(b); dst[3] = 255;
+            return dst + 4;
+        case LVData::FORMAT_BGRA32:
+            dst[0] = clamp255(b); dst[1] = clamp255(g); dst[2] = clamp255(r); dst[3] = 255;
+            return dst + 4;
+        case LVData::FORMAT_RGB565: {
+            uint16_t px = ((clamp255(r) & 0xF8) << 8) | ((clamp255(g) & 0xFC) << 3) | (clamp255(b) >> 3);
+            dst[0] = px & 0xFF; dst[1] = px >> 8;   // Little endian, like every framebuffer that uses it
+            return dst + 2;
+        }
+        default:
+            dst[0] = clamp255(r); dst[1] = clamp255(g); dst[2] = clamp255(b);
+            return dst + 3;
+    }
+}
+
+/**
+ * @brief The reference color kernel, in plain C++
+ *
+ * Every other kernel must produce exactly the same bytes as this one.  The
+ * inner loop has a fixed trip count and only does table lookups, additions
+ * and branch-free clamping.  A trailing partial pixel group (\a width not a
+ * multiple of four) is converted as far as it goes.
+ *
+ * @see LVConverter::yuv8_to_rgb
+ */
+template<int FORMAT, bool SKIP, int MATRIX, int RANGE>
+static void yuv8_to_rgb_scalar(const uint8_t * src, uint8_t * dst, const int width) {
+    const ColorTables<MATRIX, RANGE>& t = color_tables<MATRIX, RANGE>;
+    const int px_per_group = SKIP ? 2 : 4;
+    const int groups = width / 4;
+    const uint8_t * p = src;
+    int g, i;
+
+    for(g = 0; g < groups; g++, p += 6) {
+        int rv = t.rv[p[2]];
+        int guv = t.gu[p[0]] + t.gv[p[2]];
+        int bu = t.bu[p[0]];
+        // Y samples of this group, in pixel order
+        const uint8_t y[4] = { p[1], p[3], p[4], p[5] };
+
+        for(i = 0; i < px_per_group; i++) {
+            int l = t.y[y[i]];
+            dst = store_pixel<FORMAT>(dst, l + rv, l - guv, l + bu);
+        }
+    }
+
+    int n = width - groups * 4;
+    if(n > px_per_group) n = px_per_group;
+    if(n > 0) {
+        int rv = t.rv[p[2]];
+        int guv = t.gu[p[0]] + t.gv[p[2]];
+        int bu = t.bu[p[0]];
+        const uint8_t y[3] = { p[1], p[3], p[4] };
+
+        for(i = 0; i < n; i++) {
+            int l = t.y[y[i]];
+            dst = store_pixel<FORMAT>(dst, l + rv, l - guv, l + bu);
+        }
+    }
+}
+
+/**
+ * @brief Retrieve the size of one pixel of \a format
+ *
+ * @param[in] format A packed color format
+ * @return The number of bytes per pixel
+ */
+static inline int color_bytes_per_pixel(const int format) {
+    switch(format) {
+        case LVData::FORMAT_RGBA32:
+        case LVData::FORMAT_BGRA32: return 4;
+        case LVData::FORMAT_RGB565: return 2;
+        default:                    return 3;
+    }
+}
+
+#ifdef LIBPTP_PP_X86
+
+/**
+ * @brief Compute R, G and B for eight pixels
+ *
+ * @param[in]  y Eight Y values, as 16-bit integers
+ * @param[in]  u Eight U values, as 16-bit integers multiplied by 128
+ * @param[in]  v Eight V values, as 16-bit integers multiplied by 128
+ * @param[out] r,g,b Eight unclamped 16-bit results each
+ */
+template<int MATRIX, int RANGE>
+__attribute__((target("sse2")))
+static inline void yuv_to_rgb_epi16(__m128i y, __m128i u, __m128i v, __m128i * r, __m128i * g, __m128i * b) {
+    typedef ColorMatrix<MATRIX, RANGE> M;
+    if constexpr(M::LIMITED) {
+        y = _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(y, _mm_set1_epi16(M::Y_OFFSET)), 7), _mm_set1_epi16(M::Y_MUL));
+    }
+    // (x * 128 * c) >> 16 == (x * c) >> 9, exactly what the scalar kernel computes
+    *r = _mm_add_epi16(y, _mm_mulhi_epi16(v, _mm_set1_epi16(M::RV)));
+    *g = _mm_sub_epi16(_mm_sub_epi16(y, _mm_mulhi_epi16(u, _mm_set1_epi16(M::GU))),
+                       _mm_mulhi_epi16(v, _mm_set1_epi16(M::GV)));
+    *b = _mm_add_epi16(y, _mm_mulhi_epi16(u, _mm_set1_epi16(M::BU)));
+}
+
+/**
+ * @brief Store four pixels given as 32-bit RGBx values as 12 bytes of RGB24
+ *
+ * Drops the fourth byte of each pixel with shifts and masks, since SSE2 has no
+ * byte shuffle.
+ *
+ * @param[in]  px  Four pixels, R in the lowest byte of each 32 bits
+ * @param[out] dst Where to write 12 bytes
+ */
+__attribute__((target("sse2")))
+static inline void store_rgbx_as_rgb24(__m128i px, uint8_t * dst) {
+    // Within each 64 bits, move the odd pixel down against the even one: 6 useful bytes per half
+    __m128i even = _mm_and_si128(px, _mm_set1_epi64x(0x0000000000FFFFFFLL));
+    __m128i odd = _mm_and_si128(px, _mm_set1_epi64x(0x00FFFFFF00000000LL));
+    __m128i t = _mm_or_si128(even, _mm_srli_epi64(odd, 8));
+    // Then close the two byte gap between the halves
+    __m128i packed = _mm_or_si128(_mm_and_si128(t, _mm_set_epi32(0, 0, 0x0000FFFF, 0xFFFFFFFF)),
+                                  _mm_and_si128(_mm_srli_si128(t, 2), _mm_set_epi32(0, 0xFFFFFFFF, 0xFFFF0000, 0)));
+
+    _mm_storel_epi64((__m128i *)dst, packed);
+    int tail = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+    __builtin_memcpy(dst + 8, &tail, 4);
+}
+
+/**
+ * @brief Store 16 pixels in \a FORMAT
+ *
+ * @param[in]  r0,g0,b0 Unclamped 16-bit channels of pixels 0-7
+ * @param[in]  r1,g1,b1 Unclamped 16-bit channels of pixels 8-15
+ * @param[out] dst Where to write 16 pixels
+ */
+template<int FORMAT>
+__attribute__((target("sse2")))
+static inline void store_x16_sse2(__m128i r0, __m128i g0, __m128i b0, __m128i r1, __m128i g1, __m128i b1, uint8_t * dst) {
+    if(FORMAT == LVData::FORMAT_RGB565) {
+        // Clamp while still 16 bits wide, then pack the bits
+        __m128i zero = _mm_setzero_si128(), max = _mm_set1_epi16(255);
+        __m128i c[2][3] = { { r0, g0, b0 }, { r1, g1, b1 } };
+        int half;
+        for(half = 0; half < 2; half++) {
+            __m128i r = _mm_min_epi16(_mm_max_epi16(c[half][0], zero), max);
+            __m128i g = _mm_min_epi16(_mm_max_epi16(c[half][1], zero), max);
+            __m128i b = _mm_min_epi16(_mm_max_epi16(c[half][2], zero), max);
+            __m128i px = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(_mm_and_si128(r, _mm_set1_epi16(0xF8)), 8),
+                                                   _mm_slli_epi16(_mm_and_si128(g, _mm_set1_epi16(0xFC)), 3)),
+                                      _mm_srli_epi16(b, 3));
+            _mm_storeu_si128((__m128i *)(dst + 16 * half), px);
+        }
+        return;
+    }
+
+    __m128i r = _mm_packus_epi16(r0, r1);
+    __m128i g = _mm_packus_epi16(g0, g1);
+    __m128i b = _mm_packus_epi16(b0, b1);
+
+    if(FORMAT == LVData::FORMAT_RGB24) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i rg_lo = _mm_unpacklo_epi8(r, g);
+        __m128i rg_hi = _mm_unpackhi_epi8(r, g);
+        __m128i b0_lo = _mm_unpacklo_epi8(b, zero);
+        __m128i b0_hi = _mm_unpackhi_epi8(b, zero);
+
+        store_rgbx_as_rgb24(_mm_unpacklo_epi16(rg_lo, b0_lo), dst);
+        store_rgbx_as_rgb24(_mm_unpackhi_epi16(rg_lo, b0_lo), dst + 12);
+        store_rgbx_as_rgb24(_mm_unpacklo_epi16(rg_hi, b0_hi), dst + 24);
+        store_rgbx_as_rgb24(_mm_unpackhi_epi16(rg_hi, b0_hi), dst + 36);
+    } else {
+        // Four byte pixels: RGBA, or BGRA with R and B exchanged
+        __m128i alpha = _mm_set1_epi8((char)0xFF);
+        __m128i first = (FORMAT == LVData::FORMAT_BGRA32) ? b : r;
+        __m128i third = (FORMAT == LVData::FORMAT_BGRA32) ? r : b;
+        __m128i xg_lo = _mm_unpacklo_epi8(first, g);
+        __m128i xg_hi = _mm_unpackhi_epi8(first, g);
+        __m128i xa_lo = _mm_unpacklo_epi8(third, alpha);
+        __m128i xa_hi = _mm_unpackhi_epi8(third, alpha);
+
+        _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(xg_lo, xa_lo));
+        _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(xg_lo, xa_lo));
+        _mm_storeu_si128((__m128i *)(dst + 32), _mm_unpacklo_epi16(xg_hi, xa_hi));
+        _mm_storeu_si128((__m128i *)(dst + 48), _mm_unpackhi_epi16(xg_hi, xa_hi));
+    }
+}
+
+/**
+ * @brief Widen signed bytes to 16 bits, multiplied by 128
+ *
+ * Places each byte in the high half of a 16-bit lane and shifts arithmetically
+ * right by one, which sign extends and scales in one step.
+ */
+__attribute__((target("sse2")))
+static inline __m128i widen_chroma_lo(__m128i c) {
+    return _mm_srai_epi16(_mm_unpacklo_epi8(_mm_setzero_si128(), c), 1);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i widen_chroma_hi(__m128i c) {
+    return _mm_srai_epi16(_mm_unpackhi_epi8(_mm_setzero_si128(), c), 1);
+}
+
+/**
+ * @brief The SSE2 color kernel
+ *
+ * SSE2 has no byte shuffle, so each block of eight pixel groups is first split
+ * into Y, U and V with plain loads and stores; the color math and the packing
+ * are then done sixteen pixels at a time.  The remainder goes through the
+ * scalar kernel.
+ *
+ * @see LVConverter::yuv8_to_rgb
+ */
+template<int FORMAT, bool SKIP, int MATRIX, int RANGE>
+__attribute__((target("sse2")))
+static void yuv8_to_rgb_sse2(const uint8_t * src, uint8_t * dst, const int width) {
+    const int groups = width / 4;
+    const int px_per_group = SKIP ? 2 : 4;
+    const int bpp = color_bytes_per_pixel(FORMAT);
+    __m128i zero = _mm_setzero_si128();
+    int g = 0;
+
+    alignas(16) uint8_t ys[32];
+    alignas(16) uint8_t us[16];
+    alignas(16) uint8_t vs[16];
+
+    for(; g + 8 <= groups; g += 8) {
+        const uint8_t * p = src + g * 6;
+        int k;
+
+        for(k = 0; k < 8; k++, p += 6) {
+            us[k] = p[0];
+            vs[k] = p[2];
+            if constexpr(SKIP) {
+                ys[2*k] = p[1];
+                ys[2*k + 1] = p[3];
+            } else {
+                ys[4*k] = p[1];
+                ys[4*k + 1] = p[3];
+                ys[4*k + 2] = p[4];
+                ys[4*k + 3] = p[5];
+            }
+        }
+
+        __m128i u8 = _mm_loadl_epi64((const __m128i *)us);
+        __m128i v8 = _mm_loadl_epi64((const __m128i *)vs);
+        // Repeat each chroma sample once per pixel of its group
+        __m128i u2 = _mm_unpacklo_epi8(u8, u8);
+        __m128i v2 = _mm_unpacklo_epi8(v8, v8);
+        __m128i r0, g0, b0, r1, g1, b1;
+
+        if constexpr(SKIP) {
+            __m128i y = _mm_load_si128((const __m128i *)ys);
+            yuv_to_rgb_epi16<MATRIX, RANGE>(_mm_unpacklo_epi8(y, zero), widen_chroma_lo(u2), widen_chroma_lo(v2), &r0, &g0, &b0);
+            yuv_to_rgb_epi16<MATRIX, RANGE>(_mm_unpackhi_epi8(y, zero), widen_chroma_hi(u2), widen_chroma_hi(v2), &r1, &g1, &b1);
+            store_x16_sse2<FORMAT>(r0, g0, b0, r1, g1, b1, dst);
+        } else {
+            __m128i u4[2] = { _mm_unpacklo_epi16(u2, u2), _mm_unpackhi_epi16(u2, u2) };
+            __m128i v4[2] = { _mm_unpacklo_epi16(v2, v2), _mm_unpackhi_epi16(v2, v2) };
+            int half;
+            for(half = 0; half < 2; half++) {
+                __m128i y = _mm_load_si128((const __m128i *)(ys + 16 * half));
+                yuv_to_rgb_epi16<MATRIX, RANGE>(_mm_unpacklo_epi8(y, zero), widen_chroma_lo(u4[half]), widen_chroma_lo(v4[half]), &r0, &g0, &b0);
+                yuv_to_rgb_epi16<MATRIX, RANGE>(_mm_unpackhi_epi8(y, zero), widen_chroma_hi(u4[half]), widen_chroma_hi(v4[half]), &r1, &g1, &b1);
+                store_x16_sse2<FORMAT>(r0, g0, b0, r1, g1, b1, dst + 16 * bpp * half);
+            }
+        }
+
+        dst += 8 * px_per_group * bpp;
+    }
+
+    yuv8_to_rgb_scalar<FORMAT, SKIP, MATRIX, RANGE>(src + g * 6, dst, width - g * 4);
+}
+
+/**
+ * @brief Store the pixels of one 128-bit lane of the AVX2 kernel
+ *
+ * @param[in]  rg   R0-R7 in bytes 0-7, G0-G7 in bytes 8-15, clamped
+ * @param[in]  b0   B0-B7 in bytes 0-7, clamped
+ * @param[in]  c    The unclamped 16-bit R, G and B, for RGB565
+ * @param[in]  n    The number of pixels in the lane: 8, or 4 when skipping
+ * @param[out] dst  Where to write \a n pixels
+ */
+template<int FORMAT>
+__attribute__((target("avx2")))
+static inline void store_lane_avx2(__m128i rg, __m128i b0, const __m128i * c, const int n, uint8_t * dst) {
+    if(FORMAT == LVData::FORMAT_RGB565) {
+        __m128i zero = _mm_setzero_si128(), max = _mm_set1_epi16(255);
+        __m128i r = _mm_min_epi16(_mm_max_epi16(c[0], zero), max);
+        __m128i g = _mm_min_epi16(_mm_max_epi16(c[1], zero), max);
+        __m128i b = _mm_min_epi16(_mm_max_epi16(c[2], zero), max);
+        __m128i px = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(_mm_and_si128(r, _mm_set1_epi16(0xF8)), 8),
+                                               _mm_slli_epi16(_mm_and_si128(g, _mm_set1_epi16(0xFC)), 3)),
+                                  _mm_srli_epi16(b, 3));
+        if(n == 8) _mm_storeu_si128((__m128i *)dst, px);
+        else       _mm_storel_epi64((__m128i *)dst, px);
+    } else if(FORMAT == LVData::FORMAT_RGB24) {
+        const __m128i rg_to_out0 = _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5);
+        const __m128i b_to_out0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+        const __m128i rg_to_out1 = _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m128i b_to_out1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+        __m128i out0 = _mm_or_si128(_mm_shuffle_epi8(rg, rg_to_out0), _mm_shuffle_epi8(b0, b_to_out0));
+
+        if(n == 8) {
+            __m128i out1 = _mm_or_si128(_mm_shuffle_epi8(rg, rg_to_out1), _mm_shuffle_epi8(b0, b_to_out1));
+            _mm_storeu_si128((__m128i *)dst, out0);
+            _mm_storel_epi64((__m128i *)(dst + 16), out1);
+        } else {
+            // Four pixels: 12 bytes, all in out0
+            _mm_storel_epi64((__m128i *)dst, out0);
+            int tail = _mm_cvtsi128_si32(_mm_srli_si128(out0, 8));
+            __builtin_memcpy(dst + 8, &tail, 4);
+        }
+    } else {
+        // Four byte pixels: R (or B) from rg/b0, G from rg, B (or R), then opaque alpha
+        const bool bgra = (FORMAT == LVData::FORMAT_BGRA32);
+        const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+        __m128i lo = bgra ?
+            _mm_or_si128(_mm_shuffle_epi8(b0, _mm_setr_epi8(0, -1, -1, -1, 1, -1, -1, -1, 2, -1, -1, -1, 3, -1, -1, -1)),
+                         _mm_shuffle_epi8(rg, _mm_setr_epi8(-1, 8, 0, -1, -1, 9, 1, -1, -1, 10, 2, -1, -1, 11, 3, -1))) :
+            _mm_or_si128(_mm_shuffle_epi8(rg, _mm_setr_epi8(0, 8, -1, -1, 1, 9, -1, -1, 2, 10, -1, -1, 3, 11, -1, -1)),
+                         _mm_shuffle_epi8(b0, _mm_setr_epi8(-1, -1, 0, -1, -1, -1, 1, -1, -1, -1, 2, -1, -1, -1, 3, -1)));
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(lo, alpha));
+
+        if(n == 8) {
+            __m128i hi = bgra ?
+                _mm_or_si128(_mm_shuffle_epi8(b0, _mm_setr_epi8(4, -1, -1, -1, 5, -1, -1, -1, 6, -1, -1, -1, 7, -1, -1, -1)),
+                             _mm_shuffle_epi8(rg, _mm_setr_epi8(-1, 12, 4, -1, -1, 13, 5, -1, -1, 14, 6, -1, -1, 15, 7, -1))) :
+                _mm_or_si128(_mm_shuffle_epi8(rg, _mm_setr_epi8(4, 12, -1, -1, 5, 13, -1, -1, 6, 14, -1, -1, 7, 15, -1, -1)),
+                             _mm_shuffle_epi8(b0, _mm_setr_epi8(-1, -1, 4, -1, -1, -1, 5, -1, -1, -1, 6, -1, -1, -1, 7, -1)));
+            _mm_storeu_si128((__m128i *)(dst + 16), _mm_or_si128(hi, alpha));
+        }
+    }
+}
+
+/**
+ * @brief The AVX2 color kernel
+ *
+ * Each 128-bit lane takes two pixel groups (12 bytes), which \c vpshufb splits
+ * straight into 16-bit Y and pre-scaled U and V.  After the color math, the
+ * channels are shuffled back together in the output format.  The loop stops
+ * while there is still a full group left after the block, because each lane
+ * load reads four bytes past its two groups; the remainder goes through the
+ * scalar kernel.
+ *
+ * @see LVConverter::yuv8_to_rgb
+ */
+template<int FORMAT, bool SKIP, int MATRIX, int RANGE>
+__attribute__((target("avx2")))
+static void yuv8_to_rgb_avx2(const uint8_t * src, uint8_t * dst, const int width) {
+    typedef ColorMatrix<MATRIX, RANGE> M;
+    const int groups = width / 4;
+    const int bpp = color_bytes_per_pixel(FORMAT);
+    int g = 0;
+
+    // Per lane: group 0 is bytes 0-5, group 1 is bytes 6-11. -1 (0x80) writes zero
+    const __m256i y_full = _mm256_broadcastsi128_si256(_mm_setr_epi8(1, -1, 3, -1, 4, -1, 5, -1, 7, -1, 9, -1, 10, -1, 11, -1));
+    const __m256i u_full = _mm256_broadcastsi128_si256(_mm_setr_epi8(-1, 0, -1, 0, -1, 0, -1, 0, -1, 6, -1, 6, -1, 6, -1, 6));
+    const __m256i v_full = _mm256_broadcastsi128_si256(_mm_setr_epi8(-1, 2, -1, 2, -1, 2, -1, 2, -1, 8, -1, 8, -1, 8, -1, 8));
+    const __m256i y_skip = _mm256_broadcastsi128_si256(_mm_setr_epi8(1, -1, 3, -1, 7, -1, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+    const __m256i u_skip = _mm256_broadcastsi128_si256(_mm_setr_epi8(-1, 0, -1, 0, -1, 6, -1, 6, -1, -1, -1, -1, -1, -1, -1, -1));
+    const __m256i v_skip = _mm256_broadcastsi128_si256(_mm_setr_epi8(-1, 2, -1, 2, -1, 8, -1, 8, -1, -1, -1, -1, -1, -1, -1, -1));
+
+    const __m256i c_rv = _mm256_set1_epi16(M::RV);
+    const __m256i c_gu = _mm256_set1_epi16(M::GU);
+    const __m256i c_gv = _mm256_set1_epi16(M::GV);
+    const __m256i c_bu = _mm256_set1_epi16(M::BU);
+
+    const __m256i y_mask = SKIP ? y_skip : y_full;
+    const __m256i u_mask = SKIP ? u_skip : u_full;
+    const __m256i v_mask = SKIP ? v_skip : v_full;
+    const int lane_px = SKIP ? 4 : 8;
+
+    for(; g + 4 < groups; g += 4) {
+        const uint8_t * p = src + g * 6;
+        __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                             _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+
+        __m256i y = _mm256_shuffle_epi8(in, y_mask);
+        if constexpr(M::LIMITED) {
+            y = _mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_sub_epi16(y, _mm256_set1_epi16(M::Y_OFFSET)), 7),
+                                   _mm256_set1_epi16(M::Y_MUL));
+        }
+        __m256i u = _mm256_srai_epi16(_mm256_shuffle_epi8(in, u_mask), 1);
+        __m256i v = _mm256_srai_epi16(_mm256_shuffle_epi8(in, v_mask), 1);
+
+        __m256i r = _mm256_add_epi16(y, _mm256_mulhi_epi16(v, c_rv));
+        __m256i gr = _mm256_sub_epi16(_mm256_sub_epi16(y, _mm256_mulhi_epi16(u, c_gu)), _mm256_mulhi_epi16(v, c_gv));
+        __m256i b = _mm256_add_epi16(y, _mm256_mulhi_epi16(u, c_bu));
+
+        __m256i rg = _mm256_packus_epi16(r, gr);
+        __m256i b0 = _mm256_packus_epi16(b, _mm256_setzero_si256());
+
+        __m128i c_lo[3] = { _mm256_castsi256_si128(r), _mm256_castsi256_si128(gr), _mm256_castsi256_si128(b) };
+        __m128i c_hi[3] = { _mm256_extracti128_si256(r, 1), _mm256_extracti128_si256(gr, 1), _mm256_extracti128_si256(b, 1) };
+
+        store_lane_avx2<FORMAT>(_mm256_castsi256_si128(rg), _mm256_castsi256_si128(b0), c_lo, lane_px, dst);
+        store_lane_avx2<FORMAT>(_mm256_extracti128_si256(rg, 1), _mm256_extracti128_si256(b0, 1), c_hi, lane_px, dst + lane_px * bpp);
+
+        dst += 2 * lane_px * bpp;
+    }
+
+    yuv8_to_rgb_scalar<FORMAT, SKIP, MATRIX, RANGE>(src + g * 6, dst, width - g * 4);
+}
+
+#endif /* LIBPTP_PP_X86 */
+
+/**
+ * @brief Run the kernel for \a isa, for one combination of template parameters
+ */
+template<int FORMAT, bool SKIP, int MATRIX, int RANGE>
+static void yuv8_to_rgb_dispatch(const uint8_t * src, uint8_t * dst, const int width, const LVConverter::ISA isa) {
+    switch(isa) {
+#ifdef LIBPTP_PP_X86
+        case LVConverter::ISA_AVX2:
+            yuv8_to_rgb_avx2<FORMAT, SKIP, MATRIX, RANGE>(src, dst, width);
+            break;
+        case LVConverter::ISA_SSE2:
+            yuv8_to_rgb_sse2<FORMAT, SKIP, MATRIX, RANGE>(src, dst, width);
+            break;
+#endif
+        default:
+            yuv8_to_rgb_scalar<FORMAT, SKIP, MATRIX, RANGE>(src, dst, width);
+            break;
+    }
+}
+
+/**
+ * @brief Pick the kernel matching \a options, for one output format
+ *
+ * This is the only place the options are looked at; the kernels themselves
+ * have them compiled in.
+ */
+template<int FORMAT>
+static void yuv8_to_rgb_select(const uint8_t * src, uint8_t * dst, const int width, const LVData::ConvertOptions& options, const LVConverter::ISA isa) {
+    const int BT601 = LVData::MATRIX_BT601, BT709 = LVData::MATRIX_BT709;
+    const int FULL = LVData::RANGE_FULL, LIMITED = LVData::RANGE_LIMITED;
+    int variant = (options.skip ? 4 : 0) | ((options.matrix == LVData::MATRIX_BT709) ? 2 : 0) |
+                  ((options.range == LVData::RANGE_LIMITED) ? 1 : 0);
+
+    switch(variant) {
+        case 0: yuv8_to_rgb_dispatch<FORMAT, false, BT601, FULL>(src, dst, width, isa); break;
+        case 1: yuv8_to_rgb_dispatch<FORMAT, false, BT601, LIMITED>(src, dst, width, isa); break;
+        case 2: yuv8_to_rgb_dispatch<FORMAT, false, BT709, FULL>(src, dst, width, isa); break;
+        case 3: yuv8_to_rgb_dispatch<FORMAT, false, BT709, LIMITED>(src, dst, width, isa); break;
+        case 4: yuv8_to_rgb_dispatch<FORMAT, true, BT601, FULL>(src, dst, width, isa); break;
+        case 5: yuv8_to_rgb_dispatch<FORMAT, true, BT601, LIMITED>(src, dst, width, isa); break;
+        case 6: yuv8_to_rgb_dispatch<FORMAT, true, BT709, FULL>(src, dst, width, isa); break;
+        default: yuv8_to_rgb_dispatch<FORMAT, true, BT709, LIMITED>(src, dst, width, isa); break;
+    }
+}
+
+/**
+ * @brief Determine the best kernel this CPU can run
+ *
+ * @return The most capable instruction set supported by both this build and this CPU
+ */
+LVConverter::ISA LVConverter::detect_isa() {
+#ifdef LIBPTP_PP_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return ISA_AVX2;
+    if(__builtin_cpu_supports("sse2")) return ISA_SSE2;
+#endif
+    return ISA_SCALAR;
+}
+
+/**
+ * @brief Retrieve the instruction set used by conversions
+ *
+ * @return The instruction set \c LVConverter::yuv8_to_rgb currently dispatches to
+ */
+LVConverter::ISA LVConverter::get_isa() {
+    return LVConverter::active_isa;
+}
+
+/**
+ * @brief Choose the instruction set used by conversions
+ *
+ * Mostly useful for benchmarking, and for checking kernels against each
+ * other.  Asking for an instruction set the CPU doesn't support selects the
+ * best one it does.
+ *
+ * @warning Not thread safe; don't call this while conversions are running.
+ *
+ * @param[in] isa The instruction set to use
+ * @return The instruction set actually selected
+ */
+LVConverter::ISA LVConverter::set_isa(const ISA isa) {
+    ISA best = LVConverter::detect_isa();
+    LVConverter::active_isa = (isa > best) ? best : isa;
+
+    return LVConverter::active_isa;
+}
+
+/**
+ * @brief Retrieve a printable name for \a isa
+ *
+ * @param[in] isa An instruction set
+ * @return The name of \a isa
+ */
+const char * LVConverter::get_isa_name(const ISA isa) {
+    switch(isa) {
+        case ISA_AVX2: return "avx2";
+        case ISA_SSE2: return "sse2";
+        default:       return "scalar";
+    }
+}
+
+/**
+ * @brief Convert a row of \c LV_FB_YUV8 data to a packed color format, with the best available kernel
+ *
+ * @param[in]  src     The address of the first byte of YUV data.  Must start on a pixel group.
+ * @param[out] dst     Where to write the output pixels
+ * @param[in]  width   The number of pixels (Y samples) in \a src
+ * @param[in]  format  \c FORMAT_RGB24, \c FORMAT_RGBA32, \c FORMAT_BGRA32 or \c FORMAT_RGB565
+ * @param[in]  options Skip mode, color matrix and range
+ * @see LVConverter::set_isa
+ */
+void LVConverter::yuv8_to_rgb(const uint8_t * src, uint8_t * dst, const int width, const LVData::PIXEL_FORMAT format, const LVData::ConvertOptions& options) {
+    LVConverter::yuv8_to_rgb(src, dst, width, format, options, LVConverter::active_isa);
+}
+
+/**
+ * @brief Convert a row of \c LV_FB_YUV8 data to a packed color format, with the kernel for \a isa
+ *
+ * @warning \a isa must be supported by this CPU.
+ *
+ * @param[in]  src     The address of the first byte of YUV data.  Must start on a pixel group.
+ * @param[out] dst     Where to write the output pixels
+ * @param[in]  width   The number of pixels (Y samples) in \a src
+ * @param[in]  format  \c FORMAT_RGB24, \c FORMAT_RGBA32, \c FORMAT_BGRA32 or \c FORMAT_RGB565
+ * @param[in]  options Skip mode, color matrix and range
+ * @param[in]  isa     The kernel to run
+ */
+void LVConverter::yuv8_to_rgb(const uint8_t * src, uint8_t * dst, const int width, const LVData::PIXEL_FORMAT format, const LVData::ConvertOptions& options, const ISA isa) {
+    switch(format) {
+        case LVData::FORMAT_RGBA32:
+            yuv8_to_rgb_select<LVData::FORMAT_RGBA32>(src, dst, width, options, isa);
+            break;
+        case LVData::FORMAT_BGRA32:
+            yuv8_to_rgb_select<LVData::FORMAT_BGRA32>(src, dst, width, options, isa);
+            break;
+        case LVData::FORMAT_RGB565:
+            yuv8_to_rgb_select<LVData::FORMAT_RGB565>(src, dst, width, options, isa);
+            break;
+        default:
+            yuv8_to_rgb_select<LVData::FORMAT_RGB24>(src, dst, width, options, isa);
+            break;
+    }
+}
+
+/**
+ * @brief Add one row of \c LV_FB_YUV8 bytes to \a sums, in plain C++
+ *
+ * @see LVConverter::yuv8_accumulate
+ */
+static void yuv8_accumulate_scalar(const uint8_t * src, uint16_t * sums, const int bytes) {
+    int i;
+    for(i = 0; i + 6 <= bytes; i += 6) {
+        sums[i] += src[i] ^ 0x80;
+        sums[i + 1] += src[i + 1];
+        sums[i + 2] += src[i + 2] ^ 0x80;
+        sums[i + 3] += src[i + 3];
+        sums[i + 4] += src[i + 4];
+        sums[i + 5] += src[i + 5];
+    }
+}
+
+#ifdef LIBPTP_PP_X86
+
+/**
+ * @brief Add one row of \c LV_FB_YUV8 bytes to \a sums, 48 bytes (eight groups) at a time
+ *
+ * The bytes are summed where they are, so there's nothing to shuffle; only
+ * the U and V bytes have to be told apart, and in 48 bytes, they fall in the
+ * same places every time.
+ *
+ * @see LVConverter::yuv8_accumulate
+ */
+__attribute__((target("sse2")))
+static void yuv8_accumulate_sse2(const uint8_t * src, uint16_t * sums, const int bytes) {
+    const __m128i flip[3] = {
+        _mm_setr_epi8(-128, 0, -128, 0, 0, 0, -128, 0, -128, 0, 0, 0, -128, 0, -128, 0),
+        _mm_setr_epi8(0, 0, -128, 0, -128, 0, 0, 0, -128, 0, -128, 0, 0, 0, -128, 0),
+        _mm_setr_epi8(-128, 0, 0, 0, -128, 0, -128, 0, 0, 0, -128, 0, -128, 0, 0, 0)
+    };
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0, k;
+
+    for(; i + 48 <= bytes; i += 48) {
+        for(k = 0; k < 3; k++) {
+            __m128i in = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i + 16 * k)), flip[k]);
+            __m128i * lo = (__m128i *)(sums + i + 16 * k);
+            __m128i * hi = (__m128i *)(sums + i + 16 * k + 8);
+            _mm_storeu_si128(lo, _mm_add_epi16(_mm_loadu_si128(lo), _mm_unpacklo_epi8(in, zero)));
+            _mm_storeu_si128(hi, _mm_add_epi16(_mm_loadu_si128(hi), _mm_unpackhi_epi8(in, zero)));
+        }
+    }
+
+    yuv8_accumulate_scalar(src + i, sums + i, bytes - i);
+}
+
+#endif /* LIBPTP_PP_X86 */
+
+/**
+ * @brief Add a row of \c LV_FB_YUV8 data to a row of sums, byte by byte
+ *
+ * The first step of scaled conversions: summing the camera rows each output
+ * row covers.  U and V bytes are flipped to unsigned first, so every byte
+ * sums the same way.  Up to 257 rows can be summed before a sum overflows.
+ *
+ * @param[in]     src    The address of the first byte of YUV data.  Must start on a pixel group.
+ * @param[in,out] sums   One sum for each byte
+ * @param[in]     groups The number of pixel groups (six bytes each) to add
+ */
+void LVConverter::yuv8_accumulate(const uint8_t * src, uint16_t * sums, const int groups) {
+#ifdef LIBPTP_PP_X86
+    if(LVConverter::active_isa >= ISA_SSE2) {   // AVX2 is no faster: this is bound by memory, not arithmetic
+        yuv8_accumulate_sse2(src, sums, groups * 6);
+        return;
+    }
+#endif
+    yuv8_accumulate_scalar(src, sums, groups * 6);
+}
+
+#ifdef LIBPTP_PP_X86
+
+/**
+ * @brief Copy the Y samples of a row of \c LV_FB_YUV8 data, two pixel groups at a time
+ *
+ * Each 16-byte load covers two whole groups, whose Y samples one byte
+ * shuffle picks out.  The loads overlap by four bytes, and stop short of the
+ * end of the row, where \c yuv8_to_gray_scalar takes over.
+ *
+ * @return The number of pixels (Y samples in \a src) done
+ */
+template<bool SKIP>
+__attribute__((target("ssse3")))
+static int yuv8_to_gray_ssse3(const uint8_t * src, uint8_t * dst, const int width) {
+    const __m128i pick = SKIP ? _mm_setr_epi8(1, 3, 7, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)
+                              : _mm_setr_epi8(1, 3, 4, 5, 7, 9, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1);
+    const int bytes = (width / 4) * 6;
+    int i;
+
+    for(i = 0; i + 16 <= bytes; i += 12) {
+        __m128i y = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + i)), pick);
+        if(SKIP) {
+            int four = _mm_cvtsi128_si32(y);
+            __builtin_memcpy(dst, &four, 4);
+            dst += 4;
+        } else {
+            _mm_storel_epi64((__m128i *)dst, y);
+            dst += 8;
+        }
+    }
+
+    return (i / 6) * 4;
+}
+
+#endif /* LIBPTP_PP_X86 */
+
+/**
+ * @brief Copy the Y samples of a row of \c LV_FB_YUV8 data
+ *
+ * This is the luma plane of every planar format, and the whole of
+ * \c FORMAT_GRAY8, and what \c LVData::get_luma_stats measures.  No
+ * arithmetic is done on the samples.  Uses SSSE3 when the CPU has it.
+ *
+ * @param[in]  src   The address of the first byte of YUV data.  Must start on a pixel group.
+ * @param[out] dst   Where to write one byte per output pixel
+ * @param[in]  width The number of pixels (Y samples) in \a src
+ * @param[in]  skip  If true, only the first two pixels of every four are copied
+ */
+void LVConverter::yuv8_to_gray(const uint8_t * src, uint8_t * dst, const int width, const bool skip) {
+    int x = 0;
+    const uint8_t * p = src;
+
+#ifdef LIBPTP_PP_X86
+    static const bool ssse3 = __builtin_cpu_supports("ssse3");
+    if(ssse3 && LVConverter::active_isa >= ISA_SSE2) {
+        x = skip ? yuv8_to_gray_ssse3<true>(src, dst, width) : yuv8_to_gray_ssse3<false>(src, dst, width);
+        p += (x / 4) * 6;
+        dst += skip ? x / 2 : x;
+    }
+#endif
+
+    if(skip) {
+        for(; x + 4 <= width; x += 4, p += 6) {
+            dst[0] = p[1];
+            dst[1] = p[3];
+            dst += 2;
+        }
+    } else {
+        for(; x + 4 <= width; x += 4, p += 6) {
+            dst[0] = p[1];
+            dst[1] = p[3];
+            dst[2] = p[4];
+            dst[3] = p[5];
+            dst += 4;
+        }
+    }
+
+    // Trailing partial group
+    const uint8_t y_offset[4] = { 1, 3, 4, 5 };
+    int i, n = width - x;
+    if(skip && n > 2) n = 2;
+    for(i = 0; i < n; i++) {
+        dst[i] = p[y_offset[i]];
+    }
+}
+
+/**
+ * @brief Resample the chroma of a row of \c LV_FB_YUV8 data to one U and V per two output pixels
+ *
+ * This provides the chroma rows of \c FORMAT_I420 (separate U and V planes,
+ * \a step of 1) and \c FORMAT_NV12 (interleaved, \a step of 2).  CHDK stores one
+ * signed U and V per four pixels; each is repeated for two output pixel pairs
+ * (or one, when skipping), and flipped to the unsigned, 128-centered form those
+ * formats use.  No other arithmetic is done.
+ *
+ * @param[in]  src   The address of the first byte of YUV data.  Must start on a pixel group.
+ * @param[out] u     Where to write U samples
+ * @param[out] v     Where to write V samples
+ * @param[in]  step  The distance, in bytes, between consecutive samples written to \a u and \a v
+ * @param[in]  width The number of pixels (Y samples) in \a src
+ * @param[in]  skip  If true, only the first two pixels of every four are output
+ */
+void LVConverter::yuv8_to_chroma(const uint8_t * src, uint8_t * u, uint8_t * v, const int step, const int width, const bool skip) {
+    int out_width = width;
+    if(skip) {
+        int partial = width % 4;
+        out_width = (width / 4) * 2 + ((partial > 2) ? 2 : partial);
+    }
+
+    int j, n = (out_width + 1) / 2;      // One sample per pair of output pixels
+    for(j = 0; j < n; j++) {
+        const uint8_t * p = src + (skip ? j : j / 2) * 6;
+        u[j * step] = p[0] ^ 0x80;
+        v[j * step] = p[2] ^ 0x80;
+    }
+}
+
+/**
+ * @brief Retrieve how many bytes of palette data the camera sends for palette \a type
+ *
+ * @param[in] type The \c palette_type from the live view header
+ * @return The size of the palette, or 0 for types this library doesn't know
+ */
+int LVConverter::get_palette_size(const int type) {
+    switch(type) {
+        case 1:
+        case 2:
+        case 4: return 16 * 4;      // 16 VUYA entries
+        case 3: return 256 * 4;     // 256 AYUV entries
+        default: return 0;
+    }
+}
+
+/**
+ * @brief Convert one palette color to RGBA
+ *
+ * @param[out] dst Where to write four bytes
+ * @param[in]  y   The Y byte
+ * @param[in]  u,v U and V, as signed values
+ * @param[in]  a   The alpha to store
+ */
+static inline void palette_entry_to_rgba(uint8_t * dst, const int y, const int u, const int v, const uint8_t a) {
+    const ColorTables<LVData::MATRIX_BT601, LVData::RANGE_FULL>& t = color_tables<LVData::MATRIX_BT601, LVData::RANGE_FULL>;
+    dst[0] = clamp255(t.y[y] + t.rv[v & 0xFF]);
+    dst[1] = clamp255(t.y[y] - t.gu[u & 0xFF] - t.gv[v & 0xFF]);
+    dst[2] = clamp255(t.y[y] + t.bu[u & 0xFF]);
+    dst[3] = a;
+}
+
+/**
+ * @brief Expand a camera palette into an RGBA color for every possible bitmap byte
+ *
+ * The palette types are those of CHDK's live view protocol:
+ *  - 1: 16 VUYA entries.  Each bitmap byte holds two 4-bit indices, whose
+ *       colors are averaged.  Alpha is 0 to 3; 3 is opaque, anything else
+ *       but 0 is half transparent.
+ *  - 2: Like type 1, but alpha is two bits, of which 0 is the most transparent
+ *       visible level.  Index 0 is fully transparent.
+ *  - 3: 256 AYUV entries with two bit alpha.  Index 0 is fully transparent.
+ *  - 4: (protocol 2.1) 16 VUYA entries with two bit alpha, indexed by the low
+ *       four bits of the bitmap byte.  Index 0 is fully transparent.
+ *
+ * Two bit alpha levels 0 to 3 become 128, 171, 214 and 255.  Colors are
+ * converted as full range BT.601, like the viewport, and alpha is not
+ * premultiplied.
+ *
+ * @param[in]  type    The \c palette_type from the live view header
+ * @param[in]  palette The palette data, \c LVConverter::get_palette_size bytes of it
+ * @param[out] lut     Where to write 256 RGBA entries (1024 bytes)
+ * @return False if \a type is unknown, in which case \a lut is left alone
+ * @see http://chdk.wikia.com/wiki/Frame_buffers#Bitmap_palettes
+ */
+bool LVConverter::expand_palette(const int type, const uint8_t * palette, uint8_t * lut) {
+    static const uint8_t alpha2[4] = { 128, 171, 214, 255 };
+    int i;
+
+    switch(type) {
+        case 1:
+        case 2:
+            for(i = 0; i < 256; i++) {
+                const uint8_t * p1 = palette + 4 * (i & 0x0F);
+                const uint8_t * p2 = palette + 4 * (i >> 4);
+                // VUYA: signed V, signed U, Y, alpha
+                int v = ((int8_t)p1[0] + (int8_t)p2[0]) >> 1;
+                int u = ((int8_t)p1[1] + (int8_t)p2[1]) >> 1;
+                int y = (p1[2] + p2[2]) >> 1;
+                int a = (p1[3] + p2[3]) >> 1;
+                if(type == 1) {
+                    palette_entry_to_rgba(lut + 4 * i, y, u, v, (a == 3) ? 255 : ((a > 0) ? 128 : 0));
+                } else {
+                    palette_entry_to_rgba(lut + 4 * i, y, u, v, (i == 0) ? 0 : alpha2[a & 3]);
+                }
+            }
+            break;
+        case 3:
+            for(i = 0; i < 256; i++) {
+                // AYUV: alpha, Y, signed U, signed V
+                const uint8_t * p = palette + 4 * i;
+                palette_entry_to_rgba(lut + 4 * i, p[1], (int8_t)p[2], (int8_t)p[3], (i == 0) ? 0 : alpha2[p[0] & 3]);
+            }
+            break;
+        case 4:
+            for(i = 0; i < 256; i++) {
+                const uint8_t * p = palette + 4 * (i & 0x0F);
+                palette_entry_to_rgba(lut + 4 * i, p[2], (int8_t)p[1], (int8_t)p[0], ((i & 0x0F) == 0) ? 0 : alpha2[p[3] & 3]);
+            }
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Blend one overlay channel over one image channel
+ *
+ * Rounds to nearest; the division by 255 is exact.
+ */
+static inline uint8_t blend_channel(const int over, const int under, const int alpha) {
+    return (uint8_t)(((uint32_t)(over * alpha + under * (255 - alpha) + 128) * 257) >> 16);
+}
+
+/**
+ * @brief Blend a row of RGBA overlay pixels over a row of \a format pixels, in plain C++
+ *
+ * @see LVConverter::blend_overlay
+ */
+static void blend_overlay_scalar(const uint8_t * overlay, uint8_t * dst, const int width, const LVData::PIXEL_FORMAT format) {
+    int x;
+    for(x = 0; x < width; x++, overlay += 4) {
+        int r = overlay[0], g = overlay[1], b = overlay[2], a = overlay[3];
+        if(a == 0) continue;    // Most of an OSD is see-through
+
+        switch(format) {
+            case LVData::FORMAT_RGBA32: {
+                uint8_t * p = dst + 4 * x;
+                p[0] = blend_channel(r, p[0], a);
+                p[1] = blend_channel(g, p[1], a);
+                p[2] = blend_channel(b, p[2], a);
+                break;
+            }
+            case LVData::FORMAT_BGRA32: {
+                uint8_t * p = dst + 4 * x;
+                p[0] = blend_channel(b, p[0], a);
+                p[1] = blend_channel(g, p[1], a);
+                p[2] = blend_channel(r, p[2], a);
+                break;
+            }
+            case LVData::FORMAT_RGB565: {
+                uint8_t * p = dst + 2 * x;
+                int px = p[0] | (p[1] << 8);
+                int r0 = (px >> 11) & 0x1F, g0 = (px >> 5) & 0x3F, b0 = px & 0x1F;
+                // Widen to 8 bits the usual way, by repeating the top bits
+                r = blend_channel(r, (r0 << 3) | (r0 >> 2), a);
+                g = blend_channel(g, (g0 << 2) | (g0 >> 4), a);
+                b = blend_channel(b, (b0 << 3) | (b0 >> 2), a);
+                px = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
+                p[0] = px & 0xFF;
+                p[1] = px >> 8;
+                break;
+            }
+            case LVData::FORMAT_GRAY8:
+            case LVData::FORMAT_I420:
+            case LVData::FORMAT_NV12:
+                // BT.601 luma of the overlay color, in the same range as the camera's Y
+                dst[x] = blend_channel((77 * r + 150 * g + 29 * b + 128) >> 8, dst[x], a);
+                break;
+            default: {
+                uint8_t * p = dst + 3 * x;
+                p[0] = blend_channel(r, p[0], a);
+                p[1] = blend_channel(g, p[1], a);
+                p[2] = blend_channel(b, p[2], a);
+                break;
+            }
+        }
+    }
+}
+
+#ifdef LIBPTP_PP_X86
+
+/**
+ * @brief Blend two overlay pixels over two image pixels, as 16-bit channels
+ *
+ * The alpha of each pixel is spread over its color channels, and zero for
+ * its alpha channel, so the image's alpha comes through untouched.
+ *
+ * @param[in] over  Two overlay pixels, as 16-bit channels in the image's order
+ * @param[in] under Two image pixels, as 16-bit channels
+ * @return The blended pixels
+ */
+__attribute__((target("sse2")))
+static inline __m128i blend_rgba_epi16(__m128i over, __m128i under) {
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(over, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm_and_si128(a, _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0));
+    __m128i x = _mm_add_epi16(_mm_mullo_epi16(over, a), _mm_mullo_epi16(under, _mm_sub_epi16(_mm_set1_epi16(255), a)));
+    // The same exact division by 255 as blend_channel: (x + 128) * 257 >> 16
+    return _mm_mulhi_epu16(_mm_add_epi16(x, _mm_set1_epi16(128)), _mm_set1_epi16(257));
+}
+
+/**
+ * @brief Blend a row of RGBA overlay pixels over a row of 32-bit pixels, four at a time
+ *
+ * Sets of four pixels the overlay doesn't cover at all are skipped without
+ * touching the image.  For \c FORMAT_BGRA32, the overlay's R and B are swapped
+ * after widening, which costs two word shuffles.
+ *
+ * @see LVConverter::blend_overlay
+ */
+template<int FORMAT>
+__attribute__((target("sse2")))
+static void blend_overlay_sse2(const uint8_t * overlay, uint8_t * dst, const int width) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_bytes = _mm_set1_epi32(0xFF000000);
+    int x;
+
+    for(x = 0; x + 4 <= width; x += 4) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(overlay + 4 * x));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(o, alpha_bytes), zero)) == 0xFFFF) continue;
+
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + 4 * x));
+        __m128i o_lo = _mm_unpacklo_epi8(o, zero);
+        __m128i o_hi = _mm_unpackhi_epi8(o, zero);
+        if constexpr(FORMAT == LVData::FORMAT_BGRA32) {
+            o_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(o_lo, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+            o_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(o_hi, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+        }
+        __m128i lo = blend_rgba_epi16(o_lo, _mm_unpacklo_epi8(d, zero));
+        __m128i hi = blend_rgba_epi16(o_hi, _mm_unpackhi_epi8(d, zero));
+        _mm_storeu_si128((__m128i *)(dst + 4 * x), _mm_packus_epi16(lo, hi));
+    }
+
+    blend_overlay_scalar(overlay + 4 * x, dst + 4 * x, width - x, (LVData::PIXEL_FORMAT)FORMAT);
+}
+
+#endif /* LIBPTP_PP_X86 */
+
+/**
+ * @brief Alpha blend a row of RGBA overlay pixels over a row of \a format pixels
+ *
+ * Used to draw the camera's OSD over the viewport.  32-bit formats are
+ * blended with SSE2 when available, and keep their own alpha; the others are
+ * blended one pixel at a time.  For gray and planar formats, only the Y
+ * samples are blended.  Every path produces exactly the same bytes.
+ *
+ * @param[in]     overlay Straight (not premultiplied) RGBA pixels
+ * @param[in,out] dst     The row of the image to blend onto
+ * @param[in]     width   The number of pixels
+ * @param[in]     format  The format of \a dst
+ */
+void LVConverter::blend_overlay(const uint8_t * overlay, uint8_t * dst, const int width, const LVData::PIXEL_FORMAT format) {
+#ifdef LIBPTP_PP_X86
+    if(LVConverter::active_isa >= ISA_SSE2) {
+        if(format == LVData::FORMAT_RGBA32) {
+            blend_overlay_sse2<LVData::FORMAT_RGBA32>(overlay, dst, width);
+            return;
+        } else if(format == LVData::FORMAT_BGRA32) {
+            blend_overlay_sse2<LVData::FORMAT_BGRA32>(overlay, dst, width);
+            return;
+        }
+    }
+#endif
+    blend_overlay_scalar(overlay, dst, width, format);
+}
+
+/**
+ * @brief The CRC-32C (Castagnoli) lookup table, one entry per byte value
+ *
+ * CRC-32C is the polynomial the SSE4.2 \c crc32 instruction implements, so
+ * the table and the instruction give the same results.
+ */
+struct Crc32cTable {
+    uint32_t t[256];
+
+    constexpr Crc32cTable() : t() {
+        for(int i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for(int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+            }
+            this->t[i] = c;
+        }
+    }
+};
+
+static constexpr Crc32cTable crc32c_table = Crc32cTable();
+
+/**
+ * @brief Add eight bytes, little endian, to a CRC-32C
+ */
+static inline uint32_t crc32c_u64(uint32_t crc, uint64_t v) {
+    int i;
+    for(i = 0; i < 8; i++, v >>= 8) {
+        crc = crc32c_table.t[(crc ^ v) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+/**
+ * @brief Add one byte to a CRC-32C
+ */
+static inline uint32_t crc32c_u8(const uint32_t crc, const uint8_t v) {
+    return crc32c_table.t[(crc ^ v) & 0xFF] ^ (crc >> 8);
+}
+
+/**
+ * @brief Mix the three running CRCs and the image size into one signature
+ */
+static uint64_t signature_finish(const uint32_t a, const uint32_t b, const uint32_t c, const int row_bytes, const int rows) {
+    uint64_t s = ((uint64_t)a << 32) | b;
+    s ^= ((uint64_t)c << 16) * 0x9E3779B97F4A7C15ULL;
+    s ^= ((uint64_t)(uint32_t)row_bytes << 32) | (uint32_t)rows;
+    return s;
+}
+
+/**
+ * @brief Compute a frame signature in plain C++
+ *
+ * @see LVConverter::signature
+ */
+static uint64_t signature_scalar(const uint8_t * src, const int stride, const int row_bytes, const int rows) {
+    uint32_t a = 0xFFFFFFFF, b = 0x01234567, c = 0x89ABCDEF;
+    int row, i;
+
+    for(row = 0; row < rows; row++) {
+        const uint8_t * p = src + (size_t)row * stride;
+        for(i = 0; i + 24 <= row_bytes; i += 24) {
+            uint64_t w[3];
+            __builtin_memcpy(w, p + i, 24);
+            a = crc32c_u64(a, w[0]);
+            b = crc32c_u64(b, w[1]);
+            c = crc32c_u64(c, w[2]);
+        }
+        for(; i < row_bytes; i++) {
+            a = crc32c_u8(a, p[i]);
+        }
+    }
+
+    return signature_finish(a, b, c, row_bytes, rows);
+}
+
+#ifdef __x86_64__
+
+/**
+ * @brief Compute a frame signature with the SSE4.2 \c crc32 instruction
+ *
+ * The instruction takes three cycles, but a new one can start every cycle,
+ * so three independent CRCs over interleaved words keep it busy.  That's
+ * about eight bytes per cycle, a small fraction of the time a conversion takes.
+ *
+ * @see LVConverter::signature
+ */
+__attribute__((target("sse4.2")))
+static uint64_t signature_sse42(const uint8_t * src, const int stride, const int row_bytes, const int rows) {
+    uint64_t a = 0xFFFFFFFF, b = 0x01234567, c = 0x89ABCDEF;
+    int row, i;
+
+    for(row = 0; row < rows; row++) {
+        const uint8_t * p = src + (size_t)row * stride;
+        for(i = 0; i + 24 <= row_bytes; i += 24) {
+            uint64_t w[3];
+            __builtin_memcpy(w, p + i, 24);
+            a = _mm_crc32_u64(a, w[0]);
+            b = _mm_crc32_u64(b, w[1]);
+            c = _mm_crc32_u64(c, w[2]);
+        }
+        for(; i < row_bytes; i++) {
+            a = _mm_crc32_u8((uint32_t)a, p[i]);
+        }
+    }
+
+    return signature_finish((uint32_t)a, (uint32_t)b, (uint32_t)c, row_bytes, rows);
+}
+
+#endif /* __x86_64__ */
+
+/**
+ * @brief Compute a 64-bit signature of a block of rows
+ *
+ * Used to spot frames that are exactly the same as the last one.  Every byte
+ * counts, so any change to the image changes the signature, except for a
+ * chance collision.  Padding between rows is not read.  The SSE4.2 and
+ * plain C++ versions give the same signature.
+ *
+ * @param[in] src       The address of the first byte of the first row
+ * @param[in] stride    The distance, in bytes, from one row to the next
+ * @param[in] row_bytes The number of bytes of each row to include
+ * @param[in] rows      The number of rows
+ * @return The signature
+ */
+uint64_t LVConverter::signature(const uint8_t * src, const int stride, const int row_bytes, const int rows) {
+#ifdef __x86_64__
+    static const bool crc32 = __builtin_cpu_supports("sse4.2");
+    if(crc32 && LVConverter::active_isa >= ISA_SSE2) {
+        return signature_sse42(src, stride, row_bytes, rows);
+    }
+#endif
+    return signature_scalar(src, stride, row_bytes, rows);
+}
+
+/**
+ * @brief Count each value in a row of 8-bit samples
+ *
+ * Counting into one table stalls whenever neighbouring samples are equal,
+ * which in an image they usually are, as each increment waits for the one
+ * before.  Four tables keep four increments in flight; the caller adds them
+ * up once it has counted every row.
+ *
+ * @param[in]     src    The samples
+ * @param[in]     n      The number of samples
+ * @param[in,out] tables Four tables of 256 counts, added to
+ */
+void LVConverter::histogram(const uint8_t * src, const int n, uint32_t tables[4][256]) {
+    int i;
+    for(i = 0; i + 4 <= n; i += 4) {
+        tables[0][src[i]]++;
+        tables[1][src[i + 1]]++;
+        tables[2][src[i + 2]]++;
+        tables[3][src[i + 3]]++;
+    }
+    for(; i < n; i++) {
+        tables[0][src[i]]++;
+    }
+}
+
+/**
+ * @brief Compute the Sobel gradient energy of the middle of three rows, in plain C++
+ *
+ * @see LVConverter::sobel_energy
+ */
+static uint64_t sobel_energy_scalar(const uint8_t * r0, const uint8_t * r1, const uint8_t * r2, const int first, const int last) {
+    uint64_t sum = 0;
+    int x;
+    for(x = first; x < last; x++) {
+        int gx = (r0[x + 1] - r0[x - 1]) + 2 * (r1[x + 1] - r1[x - 1]) + (r2[x + 1] - r2[x - 1]);
+        int gy = (r2[x - 1] + 2 * r2[x] + r2[x + 1]) - (r0[x - 1] + 2 * r0[x] + r0[x + 1]);
+        sum += (uint32_t)(gx * gx + gy * gy);
+    }
+    return sum;
+}
+
+#ifdef LIBPTP_PP_X86
+
+/**
+ * @brief Load eight bytes, widened to 16 bits
+ */
+__attribute__((target("sse2")))
+static inline __m128i load_epu8_epi16(const uint8_t * p) {
+    return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p), _mm_setzero_si128());
+}
+
+/**
+ * @brief Compute the Sobel gradient energy of the middle of three rows, eight pixels at a time
+ *
+ * Gradients fit in 16 bits, and \c pmaddwd squares them and adds pairs
+ * together into 32 bits.  The 32-bit sums are moved to 64 bits every 2048
+ * pixels, before they can overflow.
+ *
+ * @see LVConverter::sobel_energy
+ */
+__attribute__((target("sse2")))
+static uint64_t sobel_energy_sse2(const uint8_t * r0, const uint8_t * r1, const uint8_t * r2, const int first, const int last) {
+    uint64_t sum = 0;
+    int x = first;
+
+    while(x + 8 <= last) {
+        __m128i acc = _mm_setzero_si128();
+        int end = (last - x > 2048) ? x + 2048 : last;
+
+        for(; x + 8 <= end; x += 8) {
+            __m128i a0 = load_epu8_epi16(r0 + x - 1), a1 = load_epu8_epi16(r0 + x), a2 = load_epu8_epi16(r0 + x + 1);
+            __m128i b0 = load_epu8_epi16(r1 + x - 1), b2 = load_epu8_epi16(r1 + x + 1);
+            __m128i c0 = load_epu8_epi16(r2 + x - 1), c1 = load_epu8_epi16(r2 + x), c2 = load_epu8_epi16(r2 + x + 1);
+
+            __m128i gx = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(a2, a0), _mm_sub_epi16(c2, c0)),
+                                       _mm_slli_epi16(_mm_sub_epi16(b2, b0), 1));
+            __m128i gy = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(c0, c2), _mm_slli_epi16(c1, 1)),
+                                       _mm_add_epi16(_mm_add_epi16(a0, a2), _mm_slli_epi16(a1, 1)));
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(gx, gx), _mm_madd_epi16(gy, gy)));
+        }
+
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    return sum + sobel_energy_scalar(r0, r1, r2, x, last);
+}
+
+#endif /* LIBPTP_PP_X86 */
+
+/**
+ * @brief Sum the squared Sobel gradient of the middle of three rows
+ *
+ * This is the Tenengrad focus measure: sharp edges give large gradients, and
+ * defocus spreads them out into small ones.  Pixels \a first to \a last - 1 of
+ * \a r1 are measured, so \a first must be at least 1, and \a last at most the
+ * row width - 1.  The SSE2 and plain C++ versions give the same sum.
+ *
+ * @param[in] r0    The row above
+ * @param[in] r1    The row to measure
+ * @param[in] r2    The row below
+ * @param[in] first The first pixel to measure
+ * @param[in] last  The pixel after the last one to measure
+ * @return The sum of Gx^2 + Gy^2 over the pixels
+ */
+uint64_t LVConverter::sobel_energy(const uint8_t * r0, const uint8_t * r1, const uint8_t * r2, const int first, const int last) {
+#ifdef LIBPTP_PP_X86
+    if(LVConverter::active_isa >= ISA_SSE2) {
+        return sobel_energy_sse2(r0, r1, r2, first, last);
+    }
+#endif
+    return sobel_energy_scalar(r0, r1, r2, first, last);
+}
+
+/**
+ * @brief Count the samples that differ by more than \a threshold, in plain C++
+ *
+ * @see LVConverter::count_changed
+ */
+static int count_changed_scalar(const uint8_t * a, const uint8_t * b, const uint8_t * mask, const int n, const uint8_t threshold) {
+    int count = 0, i;
+    for(i = 0; i < n; i++) {
+        int d = a[i] - b[i];
+        if(d < 0) d = -d;
+        if(d > threshold && (mask == NULL || mask[i] != 0)) count++;
+    }
+    return count;
+}
+
+#ifdef LIBPTP_PP_X86
+
+/**
+ * @brief Count the samples that differ by more than \a threshold, 16 at a time
+ *
+ * The absolute difference is two saturating subtractions ORed together, and
+ * is over the threshold wherever subtracting the threshold from it leaves
+ * something.  Each lane counts up to 255 changes before they're added up.
+ *
+ * @see LVConverter::count_changed
+ */
+__attribute__((target("sse2")))
+static int count_changed_sse2(const uint8_t * a, const uint8_t * b, const uint8_t * mask, const int n, const uint8_t threshold) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i t = _mm_set1_epi8((char)threshold);
+    int count = 0, i = 0;
+
+    while(i + 16 <= n) {
+        __m128i counts = _mm_setzero_si128();
+        int end = (n - i > 255 * 16) ? i + 255 * 16 : n;
+
+        for(; i + 16 <= end; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+            __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+            __m128i diff = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+            __m128i changed = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(diff, t), zero), _mm_set1_epi8(-1));
+            if(mask != NULL) {
+                __m128i m = _mm_loadu_si128((const __m128i *)(mask + i));
+                changed = _mm_andnot_si128(_mm_cmpeq_epi8(m, zero), changed);
+            }
+            counts = _mm_sub_epi8(counts, changed);     // Changed lanes are -1
+        }
+
+        __m128i sums = _mm_sad_epu8(counts, zero);
+        count += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+    }
+
+    return count + count_changed_scalar(a + i, b + i, (mask == NULL) ? NULL : mask + i, n - i, threshold);
+}
+
+#endif /* LIBPTP_PP_X86 */
+
+/**
+ * @brief Count the places where two rows of samples differ by more than \a threshold
+ *
+ * The core of motion detection (see \c MotionTrigger).
+ *
+ * @param[in] a,b       The samples to compare
+ * @param[in] mask      Only places where this is non-zero are counted; NULL to count everywhere
+ * @param[in] n         The number of samples
+ * @param[in] threshold The largest difference that isn't counted
+ * @return The number of places that changed
+ */
+int LVConverter::count_changed(const uint8_t * a, const uint8_t * b, const uint8_t * mask, const int n, const uint8_t threshold) {
+#ifdef LIBPTP_PP_X86
+    if(LVConverter::active_isa >= ISA_SSE2) {
+        return count_changed_sse2(a, b, mask, n, threshold);
+    }
+#endif
+    return count_changed_scalar(a, b, mask, n, threshold);
+}
+
+/**
+ * @brief The DCT's cosines, scaled by 8192, for each frequency and each of the first four samples
+ *
+ * c(u) / 2 * cos((2k + 1) u pi / 16), with c(0) = 1 / sqrt(2).  The last four
+ * samples use the same values mirrored, which is why the DCT works on the
+ * sums (even frequencies) and differences (odd ones) of mirrored pairs.
+ */
+static const int dct_cosines[8][4] = {
+    { 2896,  2896,  2896,  2896 },
+    { 4017,  3406,  2276,   799 },
+    { 3784,  1567, -1567, -3784 },
+    { 3406,  -799, -4017, -2276 },
+    { 2896, -2896, -2896,  2896 },
+    { 2276, -4017,   799,  3406 },
+    { 1567, -3784,  3784, -1567 },
+    {  799, -2276,  3406, -4017 }
+};
+
+static const int DCT_CONST_BITS = 13;
+static const int DCT_PASS1_BITS = 2;     // Extra precision kept between the passes
+
+/**
+ * @brief One 8 point DCT, from the sums and differences of mirrored samples
+ *
+ * @param[in]  s,d   s[k] = f(k) + f(7 - k), and d[k] = f(k) - f(7 - k)
+ * @param[out] out   The 8 outputs, scaled by 8192 then shifted down by \a shift
+ * @param[in]  step  The distance between outputs in \a out
+ */
+static inline void dct_1d(const int s[4], const int d[4], int16_t * out, const int step, const int shift) {
+    int u;
+    for(u = 0; u < 8; u++) {
+        const int * x = (u & 1) ? d : s;
+        const int * c = dct_cosines[u];
+        int sum = x[0] * c[0] + x[1] * c[1] + x[2] * c[2] + x[3] * c[3];
+        out[u * step] = (sum + (1 << (shift - 1))) >> shift;
+    }
+}
+
+/**
+ * @brief Transform and quantize one 8x8 block, in plain C++
+ *
+ * @see LVConverter::fdct_quantize
+ */
+static void fdct_quantize_scalar(const uint8_t * src, const int stride, const float * reciprocals, int16_t * out) {
+    int16_t rows[64];   // Row transforms, still scaled by 1 << DCT_PASS1_BITS
+    int16_t coefs[64];
+    int s[4], d[4];
+    int x, y, k;
+
+    for(y = 0; y < 8; y++) {
+        const uint8_t * p = src + y * stride;
+        for(k = 0; k < 4; k++) {
+            s[k] = (p[k] - 128) + (p[7 - k] - 128);
+            d[k] = p[k] - p[7 - k];
+        }
+        dct_1d(s, d, rows + y * 8, 1, DCT_CONST_BITS - DCT_PASS1_BITS);
+    }
+
+    for(x = 0; x < 8; x++) {
+        for(k = 0; k < 4; k++) {
+            s[k] = rows[k * 8 + x] + rows[(7 - k) * 8 + x];
+            d[k] = rows[k * 8 + x] - rows[(7 - k) * 8 + x];
+        }
+        dct_1d(s, d, coefs + x, 8, DCT_CONST_BITS + DCT_PASS1_BITS);
+    }
+
+    for(k = 0; k < 64; k++) {
+        out[k] = (int16_t)lrintf((float)coefs[k] * reciprocals[k]);
+    }
+}
+
+#ifdef LIBPTP_PP_X86
+
+/**
+ * @brief Transpose an 8x8 block of 16-bit values held one row per register
+ */
+__attribute__((target("sse2")))
+static inline void transpose_8x8_epi16(__m128i r[8]) {
+    __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+
+    r[0] = _mm_unpacklo_epi64(b0, b4);
+    r[1] = _mm_unpackhi_epi64(b0, b4);
+    r[2] = _mm_unpacklo_epi64(b1, b5);
+    r[3] = _mm_unpackhi_epi64(b1, b5);
+    r[4] = _mm_unpacklo_epi64(b2, b6);
+    r[5] = _mm_unpackhi_epi64(b2, b6);
+    r[6] = _mm_unpacklo_epi64(b3, b7);
+    r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+/**
+ * @brief Eight 8 point DCTs at once, one per lane
+ *
+ * Sample k of every lane's input is in \a in[k].  Interleaving two inputs lets
+ * \c pmaddwd multiply and add a pair of them in 32 bits, which is exactly what
+ * \c dct_1d does, rounding included.
+ *
+ * @param[in]  in    Eight registers of eight samples
+ * @param[out] out   Output u of every lane in \a out[u]
+ * @param[in]  shift How far to shift the 8192 scaled sums down
+ */
+__attribute__((target("sse2")))
+static inline void dct_1d_sse2(const __m128i in[8], __m128i out[8], const int shift) {
+    __m128i lo[2][2], hi[2][2];     // [sums, differences][pairs 0-1, 2-3]
+    int k, u;
+    for(k = 0; k < 4; k += 2) {
+        __m128i s0 = _mm_add_epi16(in[k], in[7 - k]), s1 = _mm_add_epi16(in[k + 1], in[6 - k]);
+        __m128i d0 = _mm_sub_epi16(in[k], in[7 - k]), d1 = _mm_sub_epi16(in[k + 1], in[6 - k]);
+        lo[0][k / 2] = _mm_unpacklo_epi16(s0, s1);
+        hi[0][k / 2] = _mm_unpackhi_epi16(s0, s1);
+        lo[1][k / 2] = _mm_unpacklo_epi16(d0, d1);
+        hi[1][k / 2] = _mm_unpackhi_epi16(d0, d1);
+    }
+
+    const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+    for(u = 0; u < 8; u++) {
+        const int * c = dct_cosines[u];
+        const __m128i c01 = _mm_setr_epi16(c[0], c[1], c[0], c[1], c[0], c[1], c[0], c[1]);
+        const __m128i c23 = _mm_setr_epi16(c[2], c[3], c[2], c[3], c[2], c[3], c[2], c[3]);
+        const int odd = u & 1;
+        __m128i l = _mm_add_epi32(_mm_madd_epi16(lo[odd][0], c01), _mm_madd_epi16(lo[odd][1], c23));
+        __m128i h = _mm_add_epi32(_mm_madd_epi16(hi[odd][0], c01), _mm_madd_epi16(hi[odd][1], c23));
+        l = _mm_srai_epi32(_mm_add_epi32(l, round), shift);
+        h = _mm_srai_epi32(_mm_add_epi32(h, round), shift);
+        out[u] = _mm_packs_epi32(l, h);     // Never saturates; the outputs fit in 12 bits
+    }
+}
+
+/**
+ * @brief Transform and quantize one 8x8 block, a row or column of it per register
+ *
+ * Transposing before each pass puts the samples of one transform in the same
+ * lane of eight registers.  Quantizing multiplies in single precision and
+ * rounds to nearest even, like \c lrintf, so this matches
+ * \c fdct_quantize_scalar exactly.
+ *
+ * @see LVConverter::fdct_quantize
+ */
+__attribute__((target("sse2")))
+static void fdct_quantize_sse2(const uint8_t * src, const int stride, const float * reciprocals, int16_t * out) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i center = _mm_set1_epi16(128);
+    __m128i r[8], t[8];
+    int i;
+
+    for(i = 0; i < 8; i++) {
+        __m128i p = _mm_loadl_epi64((const __m128i *)(src + i * stride));
+        r[i] = _mm_sub_epi16(_mm_unpacklo_epi8(p, zero), center);
+    }
+
+    transpose_8x8_epi16(r);
+    dct_1d_sse2(r, t, DCT_CONST_BITS - DCT_PASS1_BITS);
+    transpose_8x8_epi16(t);
+    dct_1d_sse2(t, r, DCT_CONST_BITS + DCT_PASS1_BITS);
+
+    for(i = 0; i < 8; i++) {
+        __m128i l = _mm_srai_epi32(_mm_unpacklo_epi16(r[i], r[i]), 16);
+        __m128i h = _mm_srai_epi32(_mm_unpackhi_epi16(r[i], r[i]), 16);
+        l = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(l), _mm_loadu_ps(reciprocals + i * 8)));
+        h = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(h), _mm_loadu_ps(reciprocals + i * 8 + 4)));
+        _mm_storeu_si128((__m128i *)(out + i * 8), _mm_packs_epi32(l, h));
+    }
+}
+
+#endif /* LIBPTP_PP_X86 */
+
+/**
+ * @brief Apply the JPEG forward DCT to an 8x8 block of samples, and quantize it
+ *
+ * An integer DCT with the scaling JPEG defines, keeping 13 bits of the
+ * cosines, and 2 extra bits between the row and column passes.  The
+ * coefficients are then multiplied by the reciprocals of the quantization
+ * table and rounded to nearest.
+ *
+ * @param[in]  src         The top left sample; 0-255, centered on 128
+ * @param[in]  stride      The distance, in bytes, between rows of \a src
+ * @param[in]  reciprocals 1 / the quantization table, in natural (row by row) order
+ * @param[out] out         64 quantized coefficients, in natural order
+ * @see LVJpegEncoder
+ */
+void LVConverter::fdct_quantize(const uint8_t * src, const int stride, const float * reciprocals, int16_t * out) {
+#ifdef LIBPTP_PP_X86
+    if(LVConverter::active_isa >= ISA_SSE2) {
+        fdct_quantize_sse2(src, stride, reciprocals, out);
+        return;
+    }
+#endif
+    fdct_quantize_scalar(src, stride, reciprocals, out);
+}
+
+} /* namespace PTP */
@@ -0,0 +1,41 @@
+#ifndef LIBPTP_PP_LVCONVERTER_H_
+#define LIBPTP_PP_LVCONVERTER_H_
+
+#include <stdint.h>
+#include "LVData.hpp"
+
+namespace PTP {
+
+    class LVConverter {
+        public:
+            enum ISA {
+                ISA_SCALAR,
+                ISA_SSE2,
+                ISA_AVX2
+            };
+
+            static ISA detect_isa();
+            static ISA get_isa();
+            static ISA set_isa(const ISA isa);
+            static const char * get_isa_name(const ISA isa);
+            static void yuv8_to_rgb(const uint8_t * src, uint8_t * dst, const int width, const LVData::PIXEL_FORMAT format, const LVData::ConvertOptions& options);
+            static void yuv8_to_rgb(const uint8_t * src, uint8_t * dst, const int width, const LVData::PIXEL_FORMAT format, const LVData::ConvertOptions& options, const ISA isa);
+            static void yuv8_accumulate(const uint8_t * src, uint16_t * sums, const int groups);
+            static void yuv8_to_gray(const uint8_t * src, uint8_t * dst, const int width, const bool skip);
+            static void yuv8_to_chroma(const uint8_t * src, uint8_t * u, uint8_t * v, const int step, const int width, const bool skip);
+            static void histogram(const uint8_t * src, const int n, uint32_t tables[4][256]);
+            static uint64_t sobel_energy(const uint8_t * r0, const uint8_t * r1, const uint8_t * r2, const int first, const int last);
+            static int count_changed(const uint8_t * a, const uint8_t * b, const uint8_t * mask, const int n, const uint8_t threshold);
+            static int get_palette_size(const int type);
+            static bool expand_palette(const int type, const uint8_t * palette, uint8_t * lut);
+            static void blend_overlay(const uint8_t * overlay, uint8_t * dst, const int width, const LVData::PIXEL_FORMAT format);
+            static uint64_t signature(const uint8_t * src, const int stride, const int row_bytes, const int rows);
+            static void fdct_quantize(const uint8_t * src, const int stride, const float * reciprocals, int16_t * out);
+
+        private:
+            static ISA active_isa;
+    };
+
+}
+
+#endif /* LIBPTP_PP_LVCONVERTER_H_ */
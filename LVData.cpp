@@ -8,11 +8,17 @@
  * LVData object, which can be manipulated to retrieve data to display an image.
  */
  
+#include <algorithm>
 #include <cstring>
+#include <vector>
 #include <stdint.h>
 
 #include "LVData.hpp"
+#include "LVConverter.hpp"
+#include "LVJpegEncoder.hpp"
+#include "ThreadPool.hpp"
 #include "PTPContainer.hpp"
+#include "Tracer.hpp"
 #include "libptp++.hpp"
  
 namespace PTP {
@@ -40,18 +46,131 @@ LVData::LVData(const uint8_t * payload, const int payload_size) {
  * @brief Frees up memory malloc()ed by \c LVData
  */
 LVData::~LVData() {
-    delete this->vp_head;
-    delete this->fb_desc;
-    delete this->payload;
+    delete[] this->buffer;
 }
 
 /**
- * @brief Initializes \c LVData variables by malloc()ing space of \c LVData::vp_head and \c LVData::fb_desc
+ * @brief Initializes \c LVData variables to describe no data at all
  */
 void LVData::init() {
-	this->vp_head = new lv_data_header;
-	this->fb_desc = new lv_framebuffer_desc;
+    std::memset(&this->vp_head, 0, sizeof(lv_data_header));
+    std::memset(&this->fb_desc, 0, sizeof(lv_framebuffer_desc));
+    std::memset(&this->bm_desc, 0, sizeof(lv_framebuffer_desc));
+    this->palette_type = 0;
+    this->signatures = false;
+    this->signature = 0;
+    this->duplicate = false;
+    this->signed_frames = 0;
+    this->duplicate_frames = 0;
     this->payload = NULL;
+    this->payload_size = 0;
+    this->buffer = NULL;
+    this->buffer_capacity = 0;
+}
+
+/**
+ * @brief Parse the headers of the payload we now point at
+ *
+ * Copies the live view header and viewport and bitmap descriptions out of
+ * the payload, and makes sure the payload is actually big enough to hold
+ * everything the headers describe, so later accesses can't run off the end of
+ * it.
+ *
+ * Cameras only send a palette when asked to, and it rarely changes, so the
+ * last one sent is kept, along with its expansion to RGBA.  It's only expanded
+ * again when a frame brings a different one.
+ *
+ * With signatures turned on (see \c LVData::set_signatures), the viewport's
+ * signature is computed here too, and compared with the last frame's.
+ *
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If the payload is too small for what it describes.
+ */
+void LVData::parse() {
+    LIBPTP_PP_TRACE_SCOPE("lv_parse", "lv", 0, "bytes", this->payload_size);
+    
+    if(this->payload_size < (sizeof(lv_data_header) + sizeof(lv_framebuffer_desc))) {
+        this->payload = NULL;
+        this->payload_size = 0;
+        throw ERR_LVDATA_NOT_ENOUGH_DATA;
+    }
+    
+    std::memcpy(&this->vp_head, this->payload, sizeof(lv_data_header));
+    
+    if(this->vp_head.vp_desc_start < 0 ||
+        this->vp_head.vp_desc_start + sizeof(lv_framebuffer_desc) > this->payload_size) {
+        this->payload = NULL;
+        this->payload_size = 0;
+        throw ERR_LVDATA_NOT_ENOUGH_DATA;
+    }
+    
+    std::memcpy(&this->fb_desc, this->payload + this->vp_head.vp_desc_start, sizeof(lv_framebuffer_desc));
+    
+    // A data_start of zero means the viewport wasn't sent. If it was, it had better all be there
+    if(this->fb_desc.data_start != 0) {
+        int64_t vp_end = (int64_t)this->fb_desc.data_start +
+                         ((int64_t)this->fb_desc.buffer_width * this->fb_desc.visible_height * 12) / 8;
+        if(this->fb_desc.data_start < 0 || this->fb_desc.buffer_width < 0 ||
+            this->fb_desc.visible_height < 0 || vp_end > this->payload_size) {
+            this->payload = NULL;
+            this->payload_size = 0;
+            throw ERR_LVDATA_NOT_ENOUGH_DATA;
+        }
+    }
+    
+    // The bitmap overlay is optional the same way, and has one byte per pixel
+    std::memset(&this->bm_desc, 0, sizeof(lv_framebuffer_desc));
+    if(this->vp_head.bm_desc_start != 0) {
+        if(this->vp_head.bm_desc_start < 0 ||
+            this->vp_head.bm_desc_start + sizeof(lv_framebuffer_desc) > this->payload_size) {
+            this->payload = NULL;
+            this->payload_size = 0;
+            throw ERR_LVDATA_NOT_ENOUGH_DATA;
+        }
+        
+        std::memcpy(&this->bm_desc, this->payload + this->vp_head.bm_desc_start, sizeof(lv_framebuffer_desc));
+        
+        if(this->bm_desc.data_start != 0) {
+            int64_t bm_end = (int64_t)this->bm_desc.data_start +
+                             (int64_t)this->bm_desc.buffer_width * this->bm_desc.visible_height;
+            if(this->bm_desc.data_start < 0 || this->bm_desc.buffer_width < 0 ||
+                this->bm_desc.visible_height < 0 || bm_end > this->payload_size) {
+                this->payload = NULL;
+                this->payload_size = 0;
+                throw ERR_LVDATA_NOT_ENOUGH_DATA;
+            }
+        }
+    }
+    
+    int palette_size = LVConverter::get_palette_size(this->vp_head.palette_type);
+    if(this->vp_head.palette_data_start != 0 && palette_size > 0) {
+        if(this->vp_head.palette_data_start < 0 ||
+            (int64_t)this->vp_head.palette_data_start + palette_size > this->payload_size) {
+            this->payload = NULL;
+            this->payload_size = 0;
+            throw ERR_LVDATA_NOT_ENOUGH_DATA;
+        }
+        
+        const uint8_t * palette = this->payload + this->vp_head.palette_data_start;
+        if(this->vp_head.palette_type != this->palette_type ||
+            std::memcmp(palette, this->palette, palette_size) != 0) {
+            std::memcpy(this->palette, palette, palette_size);
+            this->palette_type = this->vp_head.palette_type;
+            LVConverter::expand_palette(this->palette_type, this->palette, this->overlay_lut);
+        }
+    }
+    
+    if(this->signatures && this->fb_desc.data_start != 0) {
+        int vp_width = std::min(this->fb_desc.visible_width, this->fb_desc.buffer_width);
+        uint64_t previous = this->signature;
+        this->signature = LVConverter::signature(this->payload + this->fb_desc.data_start, (this->fb_desc.buffer_width * 12) / 8,
+                                                 (vp_width * 12) / 8, this->fb_desc.visible_height);
+        this->duplicate = (previous != 0 && this->signature == previous);
+        this->signed_frames++;
+        if(this->duplicate) this->duplicate_frames++;
+    } else {
+        this->signature = 0;
+        this->duplicate = false;
+    }
 }
 
 /**
@@ -60,53 +179,144 @@ void LVData::init() {
  * Parases \a payload for the necessary parts of the payload and places them
  * in our internal structures.  Also stores a copy of the complete payload
  * for later use in retrieving data.  This way, we only spend CPU time on the
- * data retrieval we NEED to make.
+ * data retrieval we NEED to make.  The copy goes into the memory used by the
+ * previous frame whenever it is big enough.
  *
  * @param[in] payload The address of the first byte of a PTP payload
  * @param[in] payload_size The number of bytes in the payload
  * @exception LVDATA_NOT_ENOUGH_DATA If payload_size given cannot possibly be large
  *              enough to actually contain live view data.
- * @todo The casting here is pretty bad. How can I clean this up?
+ * @see LVData::view, LVData::adopt
  */
 void LVData::read(const uint8_t * payload, const int payload_size) {
-    if(payload_size < (sizeof(lv_data_header) + sizeof(lv_framebuffer_desc))) {
+    LIBPTP_PP_TRACE_SCOPE("lv_read", "lv", 0, "bytes", payload_size);
+    
+    if(payload_size < (int)(sizeof(lv_data_header) + sizeof(lv_framebuffer_desc))) {
         throw ERR_LVDATA_NOT_ENOUGH_DATA;
     }
     
-    if(this->payload != NULL) {
-        delete[] this->payload; // Free up the payload if we're overwriting this object
-        this->payload = NULL;
+    if((uint32_t)payload_size > this->buffer_capacity) {
+        delete[] this->buffer; // Too small for this frame; throw it out
+        this->buffer = new uint8_t[payload_size];
+        this->buffer_capacity = payload_size;
     }
     
-	this->payload = new uint8_t[payload_size];
+    std::memcpy(this->buffer, payload, payload_size);	// Copy the payload we're reading in into OUR payload
     
-    std::memcpy(this->payload, payload, payload_size);	// Copy the payload we're reading in into OUR payload
-    
-    // Parse the payload data into vp_head and fb_desc
-    std::memcpy(this->vp_head, this->payload, sizeof(lv_data_header));
-    std::memcpy(this->fb_desc, this->payload + this->vp_head->vp_desc_start, sizeof(lv_framebuffer_desc));
+    this->payload = this->buffer;
+    this->payload_size = payload_size;
+    this->parse();
 }
 
 /**
  * @brief Read live view data directly from a \c PTPContainer
  *
  * This function exists so that we can hide the actual payload data from
- * calling functions, and just pass \c PTPContainer s around.  In a
- * perfect data-hiding world, \c PTPContainer and \c LVData might be friend
- * classes, so that methods to access the payload could be kept protected.
+ * calling functions, and just pass \c PTPContainer s around.  \c PTPContainer
+ * and \c LVData are friend classes, so the payload is copied straight out of
+ * the container, without an intermediate copy.
  *
  * @param[in] container The \c PTPContainer to read live view data from
- * @see LVData::read(uint8_t * payload, int payload_size)
+ * @see LVData::read(uint8_t * payload, int payload_size), LVData::adopt
  */
 void LVData::read(const PTPContainer& container) {
-    int payload_size;
-    unsigned char * payload;
+    if(container.is_empty()) {
+        throw ERR_LVDATA_NOT_ENOUGH_DATA;
+    }
+    
+    this->read(container.payload, container.get_length() - 12);
+}
+
+/**
+ * @brief Describe live view data in memory owned by someone else, without copying it
+ *
+ * Useful when the payload already lives somewhere stable, such as a memory
+ * mapped file.  Nothing is copied, so \a payload must stay valid, and unchanged,
+ * for as long as this \c LVData describes it.  Any memory this \c LVData already
+ * owns is kept for reuse by a later \c LVData::read.
+ *
+ * @param[in] payload The address of the first byte of a PTP payload
+ * @param[in] payload_size The number of bytes in the payload
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If the payload is too small for what it describes.
+ */
+void LVData::view(const uint8_t * payload, const int payload_size) {
+    if(payload_size < 0) {
+        throw ERR_LVDATA_NOT_ENOUGH_DATA;
+    }
     
-    payload = container.get_payload(&payload_size);
+    this->payload = payload;
+    this->payload_size = payload_size;
+    this->parse();
+}
+
+/**
+ * @brief Take the payload of \a container, without copying it
+ *
+ * The payload memory of \a container becomes ours, and the memory we were
+ * using for the previous frame is given to \a container in exchange, so that
+ * it can be received into again.  \a container is left empty.
+ *
+ * @param[in,out] container The \c PTPContainer to take live view data from
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If the payload is too small for what it describes.
+ * @see LVData::recycle
+ */
+void LVData::adopt(PTPContainer& container) {
+    uint32_t size = container.get_length() - 12;
     
-    this->read(payload, payload_size);
+    std::swap(this->buffer, container.payload);
+    std::swap(this->buffer_capacity, container.payload_capacity);
+    container.length = 12;
     
-    delete[] payload;
+    this->payload = this->buffer;
+    this->payload_size = size;
+    this->parse();
+}
+
+/**
+ * @brief Give the memory of this frame to \a container, so the next frame can be received into it
+ *
+ * After this call, this \c LVData describes no data.  Together with
+ * \c LVData::adopt, this lets one buffer go back and forth between the USB
+ * receive path and an \c LVData for every frame, without allocating or copying.
+ *
+ * @param[in,out] container An empty \c PTPContainer which will receive the next frame
+ * @see LVData::adopt, CHDKCamera::get_live_view_data
+ */
+void LVData::recycle(PTPContainer& container) {
+    if(this->buffer != NULL && this->buffer_capacity > container.payload_capacity) {
+        std::swap(this->buffer, container.payload);
+        std::swap(this->buffer_capacity, container.payload_capacity);
+        container.length = 12;
+    }
+    
+    this->payload = NULL;
+    this->payload_size = 0;
+}
+
+/**
+ * @brief Take back the memory \c LVData::recycle gave \a container, when no frame came in it
+ *
+ * For when the transfer into \a container failed, so that the next frame
+ * doesn't have to allocate again.  This \c LVData still describes no data.
+ *
+ * @param[in,out] container The \c PTPContainer that was passed to \c LVData::recycle
+ * @see LVData::recycle
+ */
+void LVData::reclaim(PTPContainer& container) {
+    if(container.payload_capacity > this->buffer_capacity) {
+        std::swap(this->buffer, container.payload);
+        std::swap(this->buffer_capacity, container.payload_capacity);
+        container.length = 12;
+    }
+}
+
+/**
+ * @brief Determine whether this \c LVData describes any live view data
+ *
+ * @return True if nothing has been read, or the last read failed
+ */
+bool LVData::is_empty() const {
+    return (this->payload == NULL);
 }
 
 /**
@@ -117,87 +327,1023 @@ void LVData::read(const PTPContainer& container) {
  * from the payload and converts it to RGB so that it can actually be used.  The
  * \a skip parameter will depend on which camera is used.  Size, width, and height
  * are calculated from properties of the live view data, to hide the underlying structure.
+ * The conversion itself is done by the fastest \c LVConverter kernel the CPU supports.
  *
  * @warning This function malloc()s space for the resulting data. Be sure to free() it!
+ *          To convert frame after frame without allocating, use
+ *          \c LVData::get_rgb(uint8_t * out, int stride, bool skip) instead.
  *
  * @param[out] out_size The size of the resulting RGB data
  * @param[out] out_width The width of the resulting RGB image
  * @param[out] out_height The height of the resulting RGB image
  * @param[in]  skip If true, skips two pixels of every four (required on some cameras)
  * @return The address of the first byte of the resulting RGB image
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If there is no viewport data to convert.
  * @see http://chdk.wikia.com/wiki/Frame_buffers#Viewport, http://trac.assembla.com/chdk/browser/trunk/tools/yuvconvert.c
  */
 uint8_t * LVData::get_rgb(int * out_size, int * out_width, int * out_height, const bool skip) const {
-    uint8_t * vp_data;
-    int vp_size;
-    vp_size = (this->fb_desc->buffer_width * this->fb_desc->visible_height * 12) / 8; // 12 bpp
-	vp_data = new uint8_t[vp_size];    // Allocate memory for YUV data 
-    std::memcpy(vp_data, this->payload + this->fb_desc->data_start, vp_size);   // Copy YUV data into vp_data
+    this->get_rgb_size(out_width, out_height, skip);
+    *out_size = *out_width * *out_height * 3;                           // RGB output size
     
-    int par = skip?2:1; // If skip, par = 2 ; else, par = 1
+	uint8_t * out = new uint8_t[*out_size];  // Allocate space for RGB output
     
-    *out_width = this->fb_desc->visible_width / par;           // Vertical width of output
-    unsigned int dispsize = *out_width * (this->fb_desc->visible_height);   // Size of output
-    *out_size = dispsize*3;                                             // RGB output size
+    this->get_rgb(out, *out_width * 3, skip);
     
-	uint8_t * out = new uint8_t[*out_size];  // Allocate space for RGB output
+    return out;     // It's up to the caller to free() this when done
+}
+
+/**
+ * @brief Convert live view data to RGB, into memory provided by the caller
+ *
+ * Writes \a out_height rows of \a out_width packed RGB24 pixels (see
+ * \c LVData::get_rgb_size), starting a new row every \a stride bytes.  Nothing
+ * is allocated.
+ *
+ * @param[out] out    The address of the first byte of the first output row
+ * @param[in]  stride The distance, in bytes, from the start of one output row
+ *                    to the start of the next.  At least \a out_width * 3.
+ * @param[in]  skip   If true, skips two pixels of every four (required on some cameras)
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If there is no viewport data to convert.
+ * @exception ERR_LVDATA_INVALID_STRIDE If \a stride is too small to hold a row.
+ * @see LVData::convert, LVData::get_rgb_size
+ */
+void LVData::get_rgb(uint8_t * out, const int stride, const bool skip) const {
+    this->convert(FORMAT_RGB24, out, stride, skip);
+}
+
+/**
+ * @brief Convert live view data to \a format, into memory provided by the caller
+ *
+ * Every format is produced from the camera's YUV data in a single pass; there
+ * is no intermediate RGB image.  \c FORMAT_GRAY8, \c FORMAT_I420 and
+ * \c FORMAT_NV12 only rearrange the camera's samples, without any color math.
+ *
+ * Packed formats are written as \a out_height rows of \a out_width pixels (see
+ * \c LVData::get_rgb_size), starting a new row every \a stride bytes.  Bytes
+ * between the end of one row and the start of the next are left alone, so
+ * frames can be written straight into texture upload or shared memory buffers
+ * with their own row alignment.  Nothing is allocated.
+ *
+ * Planar formats start with the Y plane, laid out the same way with one byte
+ * per pixel.  The chroma planes follow immediately after \a out_height rows,
+ * with one sample per 2x2 block of pixels:
+ *  - \c FORMAT_I420: the U plane, then the V plane, each with a stride of \a stride / 2
+ *  - \c FORMAT_NV12: one plane of interleaved U and V, with a stride of \a stride
+ *
+ * Only the visible part of each viewport row is converted: when the camera's
+ * buffer is wider than the visible image, the padding at the end of each row is
+ * skipped.
+ *
+ * @param[in]  format The format to write
+ * @param[out] out    The address of the first byte of output, at least
+ *                    \c LVData::get_buffer_size bytes long
+ * @param[in]  stride The distance, in bytes, from the start of one output row
+ *                    to the start of the next
+ * @param[in]  skip   If true, skips two pixels of every four (required on some cameras)
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If there is no viewport data to convert.
+ * @exception ERR_LVDATA_INVALID_STRIDE If \a stride is too small to hold a row.
+ * @see LVData::get_rgb_size, LVData::get_buffer_size
+ */
+void LVData::convert(const PIXEL_FORMAT format, uint8_t * out, const int stride, const bool skip) const {
+    this->convert(format, out, stride, ConvertOptions(skip));
+}
+
+/**
+ * @brief Convert live view data to \a format, with a choice of color matrix and range
+ *
+ * CHDK cameras produce full range BT.601, the default.  The other
+ * combinations are for viewports that don't, such as HDMI output.  Gray and
+ * planar formats pass the samples through as they are, whatever the options.
+ *
+ * If \c ConvertOptions::pool is set and the image has at least
+ * \c ConvertOptions::parallel_threshold pixels, the frame is split into bands
+ * of rows that are converted on the pool's threads at the same time.  Each
+ * band writes its own rows (and, for planar formats, its own chroma rows), so
+ * the output is identical to converting on one thread.
+ *
+ * \c ConvertOptions::scale and \c ConvertOptions::aspect make a smaller (or
+ * aspect corrected) image in the same pass; see \c LVData::get_output_size.
+ * Each output pixel is the average of the camera's samples it covers, and the
+ * color math is only done once per output pixel.
+ *
+ * @param[in]  format  The format to write
+ * @param[out] out     The address of the first byte of output, at least
+ *                     \c LVData::get_buffer_size bytes long
+ * @param[in]  stride  The distance, in bytes, from the start of one output row
+ *                     to the start of the next
+ * @param[in]  options Skip mode, color matrix, range, scaling and threading
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If there is no viewport data to convert.
+ * @exception ERR_LVDATA_INVALID_STRIDE If \a stride is too small to hold a row.
+ * @exception ERR_LVDATA_INVALID_SCALE If \c ConvertOptions::scale isn't 1, 2, 4 or 8.
+ * @see LVData::convert(const PIXEL_FORMAT, uint8_t *, const int, const bool) const
+ */
+void LVData::convert(const PIXEL_FORMAT format, uint8_t * out, const int stride, const ConvertOptions& options) const {
+    LIBPTP_PP_TRACE_SCOPE("lv_convert", "lv", 0, "format", format);
     
-    uint8_t * prgb_data = out; // Pointer we can manipulate to transverse RGB output memory
-    uint8_t * p_yuv = vp_data; // Pointer we can manipulate to transverse YUV input memory
+    int width, height;
+    this->get_output_size(&width, &height, options);
     
-    int i;
-    // Transverse input and output. For each four RGB pixels, we increment 6 YUV bytes
-    //  See: http://chdk.wikia.com/wiki/Frame_buffers#Viewport
-    // This magical code borrowed from http://trac.assembla.com/chdk/browser/trunk/tools/yuvconvert.c
-    for(i = 0; i < (this->fb_desc->buffer_width * this->fb_desc->visible_height); i += 4, p_yuv += 6) {
-        this->yuv_to_rgb(&prgb_data, p_yuv[1], p_yuv[0], p_yuv[2]);
-        this->yuv_to_rgb(&prgb_data, p_yuv[3], p_yuv[0], p_yuv[2]);
+    // Chroma rows of odd width images end on a whole sample (I420) or UV pair (NV12)
+    if(stride < width * LVData::get_bytes_per_pixel(format) ||
+        (format == FORMAT_I420 && stride / 2 < (width + 1) / 2) ||
+        (format == FORMAT_NV12 && stride < 2 * ((width + 1) / 2))) {
+        throw ERR_LVDATA_INVALID_STRIDE;
+    }
+    
+    int bands = 1;
+    if(options.pool != NULL && width * height >= options.parallel_threshold) {
+        bands = (options.threads > 0) ? options.threads : options.pool->get_thread_count();
+        if(bands > height / 2) bands = height / 2;      // Bands are whole pairs of rows
+    }
+    
+    if(bands <= 1) {
+        this->convert_rows(format, out, stride, options, 0, height);
+        return;
+    }
+    
+    options.pool->run(bands, [&](int band) {
+        // Start every band on an even row, so row pairs sharing chroma stay together
+        int first = (height * band / bands) & ~1;
+        int last = (band == bands - 1) ? height : (height * (band + 1) / bands) & ~1;
+        LIBPTP_PP_TRACE_SCOPE("lv_convert_band", "lv", 0, "rows", last - first);
+        this->convert_rows(format, out, stride, options, first, last);
+    });
+}
+
+/**
+ * @brief Convert rows \a first to \a last - 1 of the image \c LVData::convert produces
+ *
+ * For planar formats, this includes the chroma rows for those rows.  Bands
+ * converted with separate calls touch separate memory, as long as each starts
+ * on an even row.
+ *
+ * @param[in]  format  The format to write
+ * @param[out] out     The address of the first byte of the whole output image
+ * @param[in]  stride  The output stride
+ * @param[in]  options Skip mode, color matrix and range
+ * @param[in]  first   The first row to convert; even, unless it's the only row
+ * @param[in]  last    The row after the last one to convert
+ */
+void LVData::convert_rows(const PIXEL_FORMAT format, uint8_t * out, const int stride, const ConvertOptions& options, const int first, const int last) const {
+    if(options.scale > 1 || options.aspect) {
+        this->convert_rows_scaled(format, out, stride, options, first, last);
+        return;
+    }
+    
+    const bool skip = options.skip;
+    const int height = this->fb_desc.visible_height;
+    
+    // Convert straight out of the payload; there's no need for a copy of the YUV data
+    const uint8_t * vp_data = this->payload + this->fb_desc.data_start;
+    const int vp_stride = (this->fb_desc.buffer_width * 12) / 8;     // 12 bpp
+    const int vp_width = std::min(this->fb_desc.visible_width, this->fb_desc.buffer_width);
+    
+    int row;
+    switch(format) {
+        case FORMAT_GRAY8:
+        case FORMAT_I420:
+        case FORMAT_NV12:
+            for(row = first; row < last; row++) {
+                LVConverter::yuv8_to_gray(vp_data + row * vp_stride, out + row * stride, vp_width, skip);
+            }
+            break;
+        default:
+            for(row = first; row < last; row++) {
+                // For each four pixels, we increment 6 YUV bytes
+                //  See: http://chdk.wikia.com/wiki/Frame_buffers#Viewport
+                LVConverter::yuv8_to_rgb(vp_data + row * vp_stride, out + row * stride, vp_width, format, options);
+            }
+            break;
+    }
+    
+    if(format == FORMAT_I420 || format == FORMAT_NV12) {
+        // Chroma for each pair of rows comes from the first row of the pair
+        uint8_t * chroma = out + stride * height;
+        int chroma_height = (height + 1) / 2;
+        
+        for(row = first / 2; row < (last + 1) / 2; row++) {
+            const uint8_t * src = vp_data + 2 * row * vp_stride;
+            if(format == FORMAT_I420) {
+                int chroma_stride = stride / 2;
+                uint8_t * u = chroma + row * chroma_stride;
+                uint8_t * v = chroma + chroma_height * chroma_stride + row * chroma_stride;
+                LVConverter::yuv8_to_chroma(src, u, v, 1, vp_width, skip);
+            } else {
+                uint8_t * uv = chroma + row * stride;
+                LVConverter::yuv8_to_chroma(src, uv, uv + 1, 2, vp_width, skip);
+            }
+        }
+    }
+}
+
+/**
+ * @brief What scaled conversion works out per output column, and its scratch rows
+ *
+ * The tables only depend on the input and output widths and the skip mode,
+ * which rarely change from frame to frame, so each thread keeps its own and
+ * only works them out again when those do.  Bands converted at the same time
+ * run on different threads, so they never share one.
+ */
+struct ScaleTables {
+    int src_width, width;           // What the tables are for; 0 until they're first worked out
+    bool skip;
+    int reciprocal_rows;            // The camera rows per output row the reciprocals are for
+    std::vector<int> y_index;       // Where each camera column's Y is in a row
+    std::vector<int> col_first;     // The camera columns each output column covers
+    std::vector<int> col_last;
+    std::vector<int> group_first;   // The camera pixel groups each output pixel group touches
+    std::vector<int> group_last;
+    std::vector<uint64_t> y_reciprocal;
+    std::vector<uint32_t> y_half;
+    std::vector<uint64_t> c_reciprocal;
+    std::vector<uint16_t> row_sum;  // Camera rows summed byte by byte
+    std::vector<uint32_t> y_prefix;
+    std::vector<uint8_t> line;      // One output row, in the camera's format
+
+    ScaleTables() : src_width(0), width(0), skip(false), reciprocal_rows(0) { }
+};
+
+static thread_local ScaleTables scale_tables;
+
+/**
+ * @brief Convert output rows \a first to \a last - 1 of a scaled or aspect corrected image
+ *
+ * Each output pixel averages the Y samples of the box of camera pixels it
+ * covers.  Like the camera's own data, each group of four output pixels
+ * shares one U and V, the average over every pixel group their boxes touch.
+ *
+ * For each output row, the camera rows it covers are first summed byte by
+ * byte (see \c LVConverter::yuv8_accumulate), which is the only work done per
+ * camera pixel.  The averages are then written out as one row of
+ * \c LV_FB_YUV8 data at the output size, and converted with the same kernels
+ * as unscaled rows.
+ *
+ * Nothing is allocated once the calling thread has converted a frame of the
+ * same size; see \c ScaleTables.
+ *
+ * @param[in]  format  The format to write
+ * @param[out] out     The address of the first byte of the whole output image
+ * @param[in]  stride  The output stride
+ * @param[in]  options Skip mode, color matrix, range and scaling
+ * @param[in]  first   The first output row to convert; even, unless it's the only row
+ * @param[in]  last    The output row after the last one to convert
+ * @see LVData::get_output_size
+ */
+void LVData::convert_rows_scaled(const PIXEL_FORMAT format, uint8_t * out, const int stride, const ConvertOptions& options, const int first, const int last) const {
+    static const int y_offset[4] = { 1, 3, 4, 5 };    // Where each pixel's Y is in a group
+    int width, height, src_width, src_height;
+    this->get_output_size(&width, &height, options);
+    this->get_rgb_size(&src_width, &src_height, options.skip);
+    
+    const uint8_t * vp_data = this->payload + this->fb_desc.data_start;
+    const int vp_stride = (this->fb_desc.buffer_width * 12) / 8;     // 12 bpp
+    const int px_per_group = options.skip ? 2 : 4;
+    const int group_shift = options.skip ? 1 : 2;
+    const int src_groups = (src_width + px_per_group - 1) / px_per_group;
+    const int groups = (width + 3) / 4;
+    
+    ScaleTables& tables = scale_tables;
+    int x, k, col, g, row, src_row;
+    if(tables.src_width != src_width || tables.width != width || tables.skip != options.skip) {
+        tables.y_index.resize(src_width);
+        tables.col_first.resize(width);
+        tables.col_last.resize(width);
+        tables.group_first.resize(groups);
+        tables.group_last.resize(groups);
+        tables.y_reciprocal.resize(width);
+        tables.y_half.resize(width);
+        tables.c_reciprocal.resize(groups);
+        tables.row_sum.resize(src_groups * 6);
+        tables.y_prefix.resize(src_width + 1);
+        tables.line.assign(groups * 6, 0);
+    
+        for(col = 0; col < src_width; col++) {
+            tables.y_index[col] = (col >> group_shift) * 6 + y_offset[col & (px_per_group - 1)];
+        }
+        for(x = 0; x < width; x++) {
+            // Every output column covers at least one camera column, even when stretching
+            int c_first = (int)((int64_t)x * src_width / width);
+            int c_last = (int)((int64_t)(x + 1) * src_width / width);
+            if(c_first >= src_width) c_first = src_width - 1;
+            if(c_last <= c_first) c_last = c_first + 1;
+            tables.col_first[x] = c_first;
+            tables.col_last[x] = c_last;
+        }
+        for(k = 0; k < groups; k++) {
+            int x_last = (4 * k + 3 < width) ? 4 * k + 3 : width - 1;
+            tables.group_first[k] = tables.col_first[4 * k] >> group_shift;
+            tables.group_last[k] = ((tables.col_last[x_last] - 1) >> group_shift) + 1;
+        }
+    
+        tables.src_width = src_width;
+        tables.width = width;
+        tables.skip = options.skip;
+        tables.reciprocal_rows = 0;
+    }
+    
+    uint16_t * row_sum = tables.row_sum.data();
+    const int * y_index = tables.y_index.data();
+    uint32_t * y_prefix = tables.y_prefix.data();
+    const int * col_first = tables.col_first.data();
+    const int * col_last = tables.col_last.data();
+    const int * group_first = tables.group_first.data();
+    const int * group_last = tables.group_last.data();
+    uint64_t * y_reciprocal = tables.y_reciprocal.data();
+    uint32_t * y_half = tables.y_half.data();
+    uint64_t * c_reciprocal = tables.c_reciprocal.data();
+    uint8_t * line = tables.line.data();
+    
+    ConvertOptions line_options = options;
+    line_options.skip = false;              // Already applied, as the rows were summed
+    
+    uint8_t * chroma = out + stride * height;
+    int chroma_height = (height + 1) / 2;
+    int& reciprocal_rows = tables.reciprocal_rows;
+    
+    for(row = first; row < last; row++) {
+        int src_first = row * options.scale;
+        int src_last = src_first + options.scale;
+        if(src_last > src_height) src_last = src_height;
+        int rows = src_last - src_first;
+        
+        if(rows != reciprocal_rows) {
+            // Dividing by n is multiplying by 2^32 / n, rounded up; exact for sums this small
+            reciprocal_rows = rows;
+            for(x = 0; x < width; x++) {
+                y_reciprocal[x] = ((uint64_t)1 << 32) / ((col_last[x] - col_first[x]) * rows) + 1;
+                y_half[x] = (col_last[x] - col_first[x]) * rows / 2;    // Round to nearest
+            }
+            for(k = 0; k < groups; k++) {
+                c_reciprocal[k] = ((uint64_t)1 << 32) / ((group_last[k] - group_first[k]) * rows) + 1;
+            }
+        }
+        
+        std::memset(row_sum, 0, src_groups * 6 * sizeof(uint16_t));
+        for(src_row = src_first; src_row < src_last; src_row++) {
+            LVConverter::yuv8_accumulate(vp_data + src_row * vp_stride, row_sum, src_groups);
+        }
+        
+        // Running totals of Y along the row make every box sum a subtraction
+        uint32_t total = 0;
+        const uint16_t * rs = row_sum;
+        col = 0;
+        if(options.skip) {
+            for(; col + 2 <= src_width; col += 2, rs += 6) {
+                y_prefix[col] = total;
+                total += rs[1];
+                y_prefix[col + 1] = total;
+                total += rs[3];
+            }
+        } else {
+            for(; col + 4 <= src_width; col += 4, rs += 6) {
+                y_prefix[col] = total;
+                total += rs[1];
+                y_prefix[col + 1] = total;
+                total += rs[3];
+                y_prefix[col + 2] = total;
+                total += rs[4];
+                y_prefix[col + 3] = total;
+                total += rs[5];
+            }
+        }
+        for(; col < src_width; col++) {
+            y_prefix[col] = total;
+            total += row_sum[y_index[col]];
+        }
+        y_prefix[src_width] = total;
+        
+        uint8_t * y = line;
+        for(x = 0; x + 4 <= width; x += 4, y += 6) {
+            y[1] = ((y_prefix[col_last[x]] - y_prefix[col_first[x]] + y_half[x]) * y_reciprocal[x]) >> 32;
+            y[3] = ((y_prefix[col_last[x + 1]] - y_prefix[col_first[x + 1]] + y_half[x + 1]) * y_reciprocal[x + 1]) >> 32;
+            y[4] = ((y_prefix[col_last[x + 2]] - y_prefix[col_first[x + 2]] + y_half[x + 2]) * y_reciprocal[x + 2]) >> 32;
+            y[5] = ((y_prefix[col_last[x + 3]] - y_prefix[col_first[x + 3]] + y_half[x + 3]) * y_reciprocal[x + 3]) >> 32;
+        }
+        for(; x < width; x++) {
+            line[(x >> 2) * 6 + y_offset[x & 3]] = ((y_prefix[col_last[x]] - y_prefix[col_first[x]] + y_half[x]) * y_reciprocal[x]) >> 32;
+        }
+        
+        for(k = 0; k < groups; k++) {
+            uint32_t u = (group_last[k] - group_first[k]) * rows / 2;
+            uint32_t v = u;
+            for(g = group_first[k]; g < group_last[k]; g++) {
+                u += row_sum[6 * g];
+                v += row_sum[6 * g + 2];
+            }
+            // Back to signed
+            line[6 * k] = ((u * c_reciprocal[k]) >> 32) ^ 0x80;
+            line[6 * k + 2] = ((v * c_reciprocal[k]) >> 32) ^ 0x80;
+        }
+        
+        switch(format) {
+            case FORMAT_GRAY8:
+            case FORMAT_I420:
+            case FORMAT_NV12:
+                LVConverter::yuv8_to_gray(line, out + row * stride, width, false);
+                break;
+            default:
+                LVConverter::yuv8_to_rgb(line, out + row * stride, width, format, line_options);
+                break;
+        }
+        
+        if(row % 2 == 0) {
+            // Chroma for each pair of rows comes from the first row of the pair
+            if(format == FORMAT_I420) {
+                int chroma_stride = stride / 2;
+                uint8_t * u = chroma + (row / 2) * chroma_stride;
+                uint8_t * v = chroma + chroma_height * chroma_stride + (row / 2) * chroma_stride;
+                LVConverter::yuv8_to_chroma(line, u, v, 1, width, false);
+            } else if(format == FORMAT_NV12) {
+                uint8_t * uv = chroma + (row / 2) * stride;
+                LVConverter::yuv8_to_chroma(line, uv, uv + 1, 2, width, false);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Determine how much memory \c LVData::convert needs for \a format
+ *
+ * @param[in] format The format to be written
+ * @param[in] stride The stride that will be passed to \c LVData::convert
+ * @param[in] skip   If true, skips two pixels of every four (required on some cameras)
+ * @return The number of bytes \c LVData::convert will write to, from the first byte of output
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If there is no viewport data to convert.
+ */
+int LVData::get_buffer_size(const PIXEL_FORMAT format, const int stride, const bool skip) const {
+    return this->get_buffer_size(format, stride, ConvertOptions(skip));
+}
+
+/**
+ * @brief Determine how much memory \c LVData::convert needs for \a format, with \a options
+ *
+ * @param[in] format  The format to be written
+ * @param[in] stride  The stride that will be passed to \c LVData::convert
+ * @param[in] options The options that will be passed to \c LVData::convert
+ * @return The number of bytes \c LVData::convert will write to, from the first byte of output
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If there is no viewport data to convert.
+ * @exception ERR_LVDATA_INVALID_SCALE If \c ConvertOptions::scale isn't 1, 2, 4 or 8.
+ */
+int LVData::get_buffer_size(const PIXEL_FORMAT format, const int stride, const ConvertOptions& options) const {
+    int width, height;
+    this->get_output_size(&width, &height, options);
+    
+    switch(format) {
+        case FORMAT_I420:
+            return stride * height + 2 * (stride / 2) * ((height + 1) / 2);
+        case FORMAT_NV12:
+            return stride * height + stride * ((height + 1) / 2);
+        default:
+            return stride * height;
+    }
+}
+
+/**
+ * @brief Retrieve the number of bytes each pixel of \a format takes
+ *
+ * @param[in] format A pixel format
+ * @return Bytes per pixel.  For planar formats, this is for the Y plane.
+ */
+int LVData::get_bytes_per_pixel(const PIXEL_FORMAT format) {
+    switch(format) {
+        case FORMAT_RGB24:  return 3;
+        case FORMAT_RGBA32:
+        case FORMAT_BGRA32: return 4;
+        case FORMAT_RGB565: return 2;
+        default:            return 1;
+    }
+}
+
+/**
+ * @brief Retrieve the dimensions of the image \c LVData::get_rgb produces
+ *
+ * These are the dimensions of every format \c LVData::convert produces,
+ * unless it's scaling.
+ *
+ * @param[out] out_width  The width of the RGB image, in pixels
+ * @param[out] out_height The height of the RGB image, in pixels
+ * @param[in]  skip       If true, skips two pixels of every four (required on some cameras)
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If there is no viewport data to convert.
+ */
+void LVData::get_rgb_size(int * out_width, int * out_height, const bool skip) const {
+    if(this->payload == NULL || this->fb_desc.data_start == 0) {
+        throw ERR_LVDATA_NOT_ENOUGH_DATA;  // No viewport to convert
+    }
+    
+    int width = this->fb_desc.visible_width;
+    if(width > this->fb_desc.buffer_width) width = this->fb_desc.buffer_width;
+    
+    if(skip) {
+        // Two of every group of four, plus up to two from a trailing partial group
+        int partial = width % 4;
+        width = (width / 4) * 2 + ((partial > 2) ? 2 : partial);
+    }
+    
+    *out_width = width;
+    *out_height = this->fb_desc.visible_height;
+}
+
+/**
+ * @brief Retrieve the dimensions of the image \c LVData::convert produces with \a options
+ *
+ * Without scaling or aspect correction, this is the same as
+ * \c LVData::get_rgb_size.  \c ConvertOptions::scale divides both dimensions
+ * (rounding down, to at least one pixel).
+ *
+ * Live view pixels usually aren't square.  With \c ConvertOptions::aspect,
+ * the width is changed so they are: the viewport plus its margins is taken to
+ * fill the camera's screen, whose shape is given by the header's
+ * \c lcd_aspect_ratio.  For example, a 720x240 viewport on a 4:3 screen comes
+ * out 320x240.
+ *
+ * @param[out] out_width  The width of the output image, in pixels
+ * @param[out] out_height The height of the output image, in pixels
+ * @param[in]  options    The options that will be passed to \c LVData::convert
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If there is no viewport data to convert.
+ * @exception ERR_LVDATA_INVALID_SCALE If \c ConvertOptions::scale isn't 1, 2, 4 or 8.
+ */
+void LVData::get_output_size(int * out_width, int * out_height, const ConvertOptions& options) const {
+    int width, height;
+    this->get_rgb_size(&width, &height, options.skip);
+    
+    const int scale = options.scale;
+    if(scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+        throw ERR_LVDATA_INVALID_SCALE;
+    }
+    
+    if(options.aspect) {
+        const lv_framebuffer_desc& d = this->fb_desc;
+        int visible_width = (d.visible_width > d.buffer_width) ? d.buffer_width : d.visible_width;
+        int screen_width = std::max(d.margin_left, 0) + visible_width + std::max(d.margin_right, 0);
+        int screen_height = std::max(d.margin_top, 0) + d.visible_height + std::max(d.margin_bot, 0);
+        int64_t aspect_w = 4, aspect_h = 3;
+        if(this->vp_head.lcd_aspect_ratio == LV_ASPECT_16_9) {
+            aspect_w = 16;
+            aspect_h = 9;
+        }
         
-        if(skip) continue;  // If we skip two, go to the next iteration
+        // Width of the screen in output pixels, times the part of it the viewport covers
+        int64_t num = aspect_w * screen_height * visible_width;
+        int64_t den = aspect_h * screen_width * scale;
+        width = (den > 0) ? (int)((num + den / 2) / den) : width / scale;
+    } else {
+        width /= scale;
+    }
+    
+    height /= scale;
+    
+    *out_width = (width < 1) ? 1 : width;
+    *out_height = (height < 1) ? 1 : height;
+}
+
+/**
+ * @brief Determine whether there is a bitmap overlay to draw
+ *
+ * The overlay is the camera's OSD: menus, icons and the like.  Drawing it
+ * needs the bitmap from this frame, and a palette from this frame or an
+ * earlier one (see \c CHDKCamera::get_live_view_data).
+ *
+ * @return True if \c LVData::get_overlay and \c LVData::composite_overlay can be used
+ */
+bool LVData::has_overlay() const {
+    return (this->payload != NULL && this->bm_desc.data_start != 0 && this->palette_type != 0);
+}
+
+/**
+ * @brief Retrieve the dimensions of the image \c LVData::get_overlay produces
+ *
+ * @param[out] out_width  The width of the bitmap, in pixels
+ * @param[out] out_height The height of the bitmap, in pixels
+ * @exception ERR_LVDATA_NO_OVERLAY If there is no bitmap, or no palette for it.
+ */
+void LVData::get_overlay_size(int * out_width, int * out_height) const {
+    if(!this->has_overlay()) {
+        throw ERR_LVDATA_NO_OVERLAY;
+    }
+    
+    int width = this->bm_desc.visible_width;
+    if(width > this->bm_desc.buffer_width) width = this->bm_desc.buffer_width;
+    
+    *out_width = width;
+    *out_height = this->bm_desc.visible_height;
+}
+
+/**
+ * @brief Decode the bitmap overlay to \c FORMAT_RGBA32, at its own size
+ *
+ * Alpha is not premultiplied.  The bitmap usually has a different size from
+ * the viewport; to draw it over the viewport, use \c LVData::composite_overlay.
+ *
+ * @param[out] out    The address of the first byte of the first output row
+ * @param[in]  stride The distance, in bytes, from the start of one output row
+ *                    to the start of the next.  At least \a out_width * 4.
+ * @exception ERR_LVDATA_NO_OVERLAY If there is no bitmap, or no palette for it.
+ * @exception ERR_LVDATA_INVALID_STRIDE If \a stride is too small to hold a row.
+ * @see LVData::get_overlay_size, LVConverter::expand_palette
+ */
+void LVData::get_overlay(uint8_t * out, const int stride) const {
+    int width, height;
+    this->get_overlay_size(&width, &height);
+    
+    if(stride < width * 4) {
+        throw ERR_LVDATA_INVALID_STRIDE;
+    }
+    
+    const uint8_t * bm_data = this->payload + this->bm_desc.data_start;
+    int x, row;
+    for(row = 0; row < height; row++) {
+        const uint8_t * src = bm_data + row * this->bm_desc.buffer_width;
+        uint8_t * dst = out + row * stride;
+        for(x = 0; x < width; x++) {
+            std::memcpy(dst + 4 * x, this->overlay_lut + 4 * src[x], 4);
+        }
+    }
+}
+
+/**
+ * @brief Find the bitmap pixel under the middle of output pixel \a i
+ *
+ * Works along one direction at a time.  The viewport and the bitmap each
+ * cover the camera's whole screen once their margins are added, so a position
+ * on the screen links the two, whatever their sizes.
+ *
+ * @param[in] i      The output pixel
+ * @param[in] n      The number of output pixels the viewport became
+ * @param[in] vp     The viewport's visible size, and its margins before and after
+ * @param[in] bm     The bitmap's visible size, and its margins before and after
+ * @return The bitmap pixel, or -1 if the bitmap doesn't reach that far
+ */
+static int overlay_position(const int i, const int n, const int vp[3], const int bm[3]) {
+    int64_t vp_screen = std::max(vp[1], 0) + vp[0] + std::max(vp[2], 0);
+    int64_t bm_screen = std::max(bm[1], 0) + bm[0] + std::max(bm[2], 0);
+    if(vp_screen <= 0 || n <= 0) return -1;
+    
+    // ((i + 1/2) * vp / n + vp margin) / vp screen * bm screen - bm margin, in integers
+    int64_t num = ((int64_t)(2 * i + 1) * vp[0] + 2 * (int64_t)n * std::max(vp[1], 0)) * bm_screen;
+    int64_t pos = num / (2 * (int64_t)n * vp_screen) - std::max(bm[1], 0);
+    
+    return (pos >= 0 && pos < bm[0]) ? (int)pos : -1;
+}
+
+/**
+ * @brief Draw the bitmap overlay over an image made by \c LVData::convert
+ *
+ * This mirrors what the camera's screen shows.  The bitmap is placed over the
+ * image using both framebuffers' margins, and scaled to it by picking the
+ * nearest bitmap pixel, so it lines up at any \c ConvertOptions::scale and
+ * with or without \c ConvertOptions::aspect.  Each output pixel is blended
+ * with the palette color of its bitmap pixel (see \c LVConverter::blend_overlay).
+ * Rows of the overlay that are fully transparent are skipped.
+ *
+ * For \c FORMAT_GRAY8, \c FORMAT_I420 and \c FORMAT_NV12, the overlay is drawn
+ * in gray on the Y plane, and the chroma planes are left alone.
+ *
+ * Runs on the calling thread; \c ConvertOptions::pool is not used.
+ *
+ * @param[in]     format  The format of \a out
+ * @param[in,out] out     An image written by \c LVData::convert
+ * @param[in]     stride  The stride \a out was written with
+ * @param[in]     options The options \a out was written with
+ * @exception ERR_LVDATA_NO_OVERLAY If there is no bitmap, or no palette for it.
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If there is no viewport data.
+ * @exception ERR_LVDATA_INVALID_STRIDE If \a stride is too small to hold a row.
+ * @exception ERR_LVDATA_INVALID_SCALE If \c ConvertOptions::scale isn't 1, 2, 4 or 8.
+ */
+void LVData::composite_overlay(const PIXEL_FORMAT format, uint8_t * out, const int stride, const ConvertOptions& options) const {
+    this->composite_overlay(format, out, stride, options, *this);
+}
+
+/**
+ * @brief Draw the bitmap overlay of another frame over an image made from this one
+ *
+ * The OSD changes far less often than the viewport, so it can be fetched
+ * now and then, and drawn over the frames in between (see \c LVGovernor).
+ * \a overlay only needs its bitmap and palette; the viewport's size and
+ * position come from this frame.
+ *
+ * @param[in]     format  The format of \a out
+ * @param[in,out] out     An image written by \c LVData::convert on this frame
+ * @param[in]     stride  The stride \a out was written with
+ * @param[in]     options The options \a out was written with
+ * @param[in]     overlay The frame to take the bitmap and palette from; may be this one
+ * @exception ERR_LVDATA_NO_OVERLAY If \a overlay has no bitmap, or no palette for it.
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If this frame has no viewport data.
+ * @exception ERR_LVDATA_INVALID_STRIDE If \a stride is too small to hold a row.
+ * @exception ERR_LVDATA_INVALID_SCALE If \c ConvertOptions::scale isn't 1, 2, 4 or 8.
+ * @see LVData::composite_overlay(const PIXEL_FORMAT, uint8_t *, const int, const ConvertOptions&) const
+ */
+void LVData::composite_overlay(const PIXEL_FORMAT format, uint8_t * out, const int stride, const ConvertOptions& options, const LVData& overlay) const {
+    int width, height, bm_width, bm_height;
+    overlay.get_overlay_size(&bm_width, &bm_height);
+    this->get_output_size(&width, &height, options);
+    
+    if(stride < width * LVData::get_bytes_per_pixel(format)) {
+        throw ERR_LVDATA_INVALID_STRIDE;
+    }
+    
+    const lv_framebuffer_desc& vp = this->fb_desc;
+    const lv_framebuffer_desc& bm = overlay.bm_desc;
+    const int vp_x[3] = { std::min(vp.visible_width, vp.buffer_width), vp.margin_left, vp.margin_right };
+    const int vp_y[3] = { vp.visible_height, vp.margin_top, vp.margin_bot };
+    const int bm_x[3] = { bm_width, bm.margin_left, bm.margin_right };
+    const int bm_y[3] = { bm_height, bm.margin_top, bm.margin_bot };
+    
+    const uint8_t * bm_data = overlay.payload + bm.data_start;
+    const uint8_t * lut = overlay.overlay_lut;
+    int * bm_col = new int[width];
+    uint8_t * line = new uint8_t[width * 4];    // One row of overlay, in RGBA
+    
+    int x, row;
+    for(x = 0; x < width; x++) {
+        bm_col[x] = overlay_position(x, width, vp_x, bm_x);
+    }
+    
+    for(row = 0; row < height; row++) {
+        int bm_row = overlay_position(row, height, vp_y, bm_y);
+        if(bm_row < 0) continue;
+        
+        const uint8_t * src = bm_data + bm_row * bm.buffer_width;
+        uint8_t alpha = 0;
+        for(x = 0; x < width; x++) {
+            const uint8_t * color = (bm_col[x] < 0) ? lut : lut + 4 * src[bm_col[x]];
+            std::memcpy(line + 4 * x, color, 4);
+            if(bm_col[x] < 0) line[4 * x + 3] = 0;
+            alpha |= line[4 * x + 3];
+        }
         
-        this->yuv_to_rgb(&prgb_data, p_yuv[4], p_yuv[0], p_yuv[2]);
-        this->yuv_to_rgb(&prgb_data, p_yuv[5], p_yuv[0], p_yuv[2]);
+        if(alpha != 0) {
+            LVConverter::blend_overlay(line, out + row * stride, width, format);
+        }
     }
     
-    *out_height = this->fb_desc->visible_height;
+    delete[] bm_col;
+    delete[] line;
+}
+
+/**
+ * @brief Determine whether \a other would draw exactly the same overlay as this frame
+ *
+ * Compares the bitmaps' descriptions and contents, and the expanded palettes.
+ *
+ * @param[in] other Another frame
+ * @return True if both frames have an overlay, and they're the same
+ */
+bool LVData::same_overlay(const LVData& other) const {
+    if(!this->has_overlay() || !other.has_overlay()) return false;
     
-	delete[] vp_data;;  // We don't need this anymore
+    const lv_framebuffer_desc& a = this->bm_desc;
+    const lv_framebuffer_desc& b = other.bm_desc;
+    if(a.buffer_width != b.buffer_width || a.visible_width != b.visible_width || a.visible_height != b.visible_height ||
+        a.margin_left != b.margin_left || a.margin_top != b.margin_top ||
+        a.margin_right != b.margin_right || a.margin_bot != b.margin_bot) {
+        return false;
+    }
     
-    return out;     // It's up to the caller to free() this when done
+    if(std::memcmp(this->overlay_lut, other.overlay_lut, sizeof(this->overlay_lut)) != 0) return false;
+    
+    return std::memcmp(this->payload + a.data_start, other.payload + b.data_start,
+                       (size_t)a.buffer_width * a.visible_height) == 0;
 }
 
 /**
- * @brief A helper function to clip an int to a uint8_t
+ * @brief Keep a copy of just the overlay of \a frame: its bitmap and palette
  *
- * @param[in] v The integer to clip
- * @return A 8-bit unsigned integer between 0 and 255
+ * For drawing an overlay over later frames that come without one (see
+ * \c LVData::composite_overlay).  The viewport isn't copied, so this
+ * \c LVData describes a frame without one, and costs a fraction of the memory
+ * and time of \c LVData::read.  The palette is copied even if it came with
+ * an earlier frame than \a frame.
+ *
+ * @param[in] frame A frame with an overlay
+ * @exception ERR_LVDATA_NO_OVERLAY If \a frame has no bitmap, or no palette for it.
  */
-uint8_t LVData::clip(const int v) {
-    if (v<0) return 0;
-    if (v>255) return 255;
-    return v;
+void LVData::read_overlay(const LVData& frame) {
+    if(!frame.has_overlay()) {
+        throw ERR_LVDATA_NO_OVERLAY;
+    }
+    
+    // A payload of our own: the header, the viewport description without its
+    // data, then the bitmap description and the bitmap
+    lv_data_header head = frame.vp_head;
+    head.palette_data_start = 0;
+    head.vp_desc_start = sizeof(lv_data_header);
+    head.bm_desc_start = sizeof(lv_data_header) + sizeof(lv_framebuffer_desc);
+    
+    lv_framebuffer_desc vp = frame.fb_desc;
+    vp.data_start = 0;
+    
+    lv_framebuffer_desc bm = frame.bm_desc;
+    bm.data_start = head.bm_desc_start + sizeof(lv_framebuffer_desc);
+    
+    const uint32_t bitmap_size = (uint32_t)bm.buffer_width * bm.visible_height;
+    const uint32_t size = bm.data_start + bitmap_size;
+    if(size > this->buffer_capacity) {
+        delete[] this->buffer;
+        this->buffer = new uint8_t[size];
+        this->buffer_capacity = size;
+    }
+    
+    std::memcpy(this->buffer, &head, sizeof(lv_data_header));
+    std::memcpy(this->buffer + head.vp_desc_start, &vp, sizeof(lv_framebuffer_desc));
+    std::memcpy(this->buffer + head.bm_desc_start, &bm, sizeof(lv_framebuffer_desc));
+    std::memcpy(this->buffer + bm.data_start, frame.payload + frame.bm_desc.data_start, bitmap_size);
+    
+    // parse() only takes a palette from the payload, and there isn't one in ours
+    this->palette_type = frame.palette_type;
+    std::memcpy(this->palette, frame.palette, sizeof(this->palette));
+    std::memcpy(this->overlay_lut, frame.overlay_lut, sizeof(this->overlay_lut));
+    
+    this->payload = this->buffer;
+    this->payload_size = size;
+    this->parse();
 }
 
 /**
- * @brief Convert a YUV triplet to RGB values.
+ * @brief Measure the brightness and sharpness of the viewport, or part of it
  *
- * @note This modifies the \a dest pointer passed in.
- * @param[in] dest A pointer to the address of the first byte of the resulting data
- * @param[in] y The Y value to convert
- * @param[in] u The U value to convert
- * @param[in] v The V value to convert
- * @see http://www.fourcc.org/fccyvrgb.php
+ * Works straight on the camera's Y samples, the same ones \c FORMAT_GRAY8
+ * has, without any color conversion.  The histogram, mean and clipped counts
+ * show exposure.  The sharpness is the Tenengrad focus measure: the mean of
+ * Gx^2 + Gy^2 of a 3x3 Sobel filter, over the region less its one pixel border.
+ * Its scale depends on the scene, so compare it between frames of the same
+ * scene, such as while stepping focus.
+ *
+ * To measure several regions, call this once for each.
+ *
+ * @param[out] out     The measurements
+ * @param[in]  options Skip mode, the region to measure, clipping levels and whether to measure sharpness
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If there is no viewport data.
+ * @exception ERR_LVDATA_INVALID_REGION If the region isn't inside the image.
+ * @see LVConverter::histogram, LVConverter::sobel_energy
  */
-void LVData::yuv_to_rgb(uint8_t **dest, const uint8_t y, const int8_t u, const int8_t v) {
-    /*
-    *((*dest)++) = LVData::clip(((y<<12) +          v*5743 + 2048)>>12);
-    *((*dest)++) = LVData::clip(((y<<12) - u*1411 - v*2925 + 2048)>>12);
-    *((*dest)++) = LVData::clip(((y<<12) + u*7258          + 2048)>>12);
-    */
-    // Testing alternative formula:
-    *((*dest)++) = LVData::clip(y                     + 1.402   * v);
-    *((*dest)++) = LVData::clip(y - 0.34414 * u - 0.71414 * v);
-    *((*dest)++) = LVData::clip(y + 1.772   * u);
+void LVData::get_luma_stats(LumaStats * out, const LumaOptions& options) const {
+    int width, height;
+    this->get_rgb_size(&width, &height, options.skip);
+    
+    const int x0 = options.x, y0 = options.y;
+    const int w = (options.width > 0) ? options.width : width - x0;
+    const int h = (options.height > 0) ? options.height : height - y0;
+    if(x0 < 0 || y0 < 0 || w <= 0 || h <= 0 || x0 + w > width || y0 + h > height) {
+        throw ERR_LVDATA_INVALID_REGION;
+    }
+    
+    std::memset(out, 0, sizeof(LumaStats));
+    
+    const uint8_t * vp_data = this->payload + this->fb_desc.data_start;
+    const int vp_stride = (this->fb_desc.buffer_width * 12) / 8;     // 12 bpp
+    const int vp_width = std::min(this->fb_desc.visible_width, this->fb_desc.buffer_width);
+    
+    uint8_t * rows = new uint8_t[3 * width];    // The last three rows of Y, taken in turn
+    uint32_t (* tables)[256] = new uint32_t[4][256]();
+    uint64_t energy = 0;
+    int row;
+    
+    for(row = y0; row < y0 + h; row++) {
+        uint8_t * current = rows + ((row - y0) % 3) * width;
+        LVConverter::yuv8_to_gray(vp_data + row * vp_stride, current, vp_width, options.skip);
+        LVConverter::histogram(current + x0, w, tables);
+        
+        if(options.sharpness && row >= y0 + 2 && w >= 3) {
+            const uint8_t * above = rows + ((row - y0 - 2) % 3) * width;
+            const uint8_t * middle = rows + ((row - y0 - 1) % 3) * width;
+            energy += LVConverter::sobel_energy(above + x0, middle + x0, current + x0, 1, w - 1);
+        }
+    }
+    
+    uint64_t sum = 0;
+    int i;
+    for(i = 0; i < 256; i++) {
+        out->histogram[i] = tables[0][i] + tables[1][i] + tables[2][i] + tables[3][i];
+        sum += (uint64_t)i * out->histogram[i];
+        if(i <= options.clip_low) out->clipped_low += out->histogram[i];
+        if(i >= options.clip_high) out->clipped_high += out->histogram[i];
+    }
+    
+    delete[] rows;
+    delete[] tables;
+    
+    out->pixels = w * h;
+    out->mean = (double)sum / out->pixels;
+    if(w >= 3 && h >= 3) {
+        out->sharpness = (double)energy / ((w - 2) * (h - 2));
+    }
+}
+
+/**
+ * @brief Encode the viewport as a baseline JPEG
+ *
+ * The camera's Y, U and V samples go to the encoder as they are, without
+ * converting to RGB and back.  The JPEG keeps the camera's chroma
+ * subsampling, one U and V per four pixels across (per two, when skipping),
+ * and records the shape of the pixels as JFIF's aspect ratio, so viewers
+ * that honor it show the image at the screen's proportions.
+ *
+ * @param[in,out] encoder  The encoder to use, which sets the quality and keeps its buffers between frames
+ * @param[out]    out_size The size of the JPEG, in bytes
+ * @param[in]     skip     If true, skips two pixels of every four (required on some cameras)
+ * @return The JPEG, in \a encoder 's buffer; valid until it encodes another image
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If there is no viewport data to encode.
+ * @see LVJpegEncoder
+ */
+const uint8_t * LVData::encode_jpeg(LVJpegEncoder& encoder, int * out_size, const bool skip) const {
+    LIBPTP_PP_TRACE_SCOPE("lv_encode_jpeg", "lv");
+    
+    int width, height, vp_width;
+    this->get_rgb_size(&width, &height, skip);
+    this->get_rgb_size(&vp_width, &height, false);
+    
+    ConvertOptions options(skip);
+    options.aspect = true;
+    int display_width, display_height;
+    this->get_output_size(&display_width, &display_height, options);
+    
+    // Wider pixels mean fewer of them to the inch across
+    encoder.begin(width, height, skip ? 2 : 4, width, display_width);
+    
+    const uint8_t * vp_data = this->payload + this->fb_desc.data_start;
+    const int vp_stride = (this->fb_desc.buffer_width * 12) / 8;     // 12 bpp
+    
+    int row, i;
+    for(row = 0; row < height; row += 8) {
+        int y_stride, c_stride;
+        uint8_t * y = encoder.get_strip(0, &y_stride);
+        uint8_t * u = encoder.get_strip(1, &c_stride);
+        uint8_t * v = encoder.get_strip(2, &c_stride);
+        const int rows = std::min(8, height - row);
+        
+        for(i = 0; i < rows; i++) {
+            const uint8_t * src = vp_data + (row + i) * vp_stride;
+            LVConverter::yuv8_to_gray(src, y + i * y_stride, vp_width, skip);
+            // Skip mode's chroma is one sample per pixel group, which is what JPEG wants either way
+            LVConverter::yuv8_to_chroma(src, u + i * c_stride, v + i * c_stride, 1, vp_width, true);
+        }
+        
+        encoder.encode_strip(rows);
+    }
+    
+    return encoder.finish(out_size);
+}
+
+/**
+ * @brief Choose whether to compute a signature of each frame as it's read
+ *
+ * When the scene is still, or the camera hasn't updated its viewport since
+ * the last request, the same image arrives again.  The signature spots that,
+ * so converting, encoding and sending it on can be skipped.  It covers every
+ * visible byte of the viewport (see \c LVConverter::signature), and takes a
+ * fraction of the time a conversion does.  Off by default.
+ *
+ * @param[in] enabled True to compute signatures, starting with the next frame
+ * @see LVData::is_duplicate, LVData::get_signature
+ */
+void LVData::set_signatures(const bool enabled) {
+    this->signatures = enabled;
+}
+
+/**
+ * @brief Retrieve the signature of this frame's viewport
+ *
+ * Frames with the same signature have the same viewport image.
+ *
+ * @return The signature, or 0 if signatures are off or there's no viewport
+ * @see LVData::set_signatures
+ */
+uint64_t LVData::get_signature() const {
+    return this->signature;
+}
+
+/**
+ * @brief Determine whether this frame's viewport is the same as the previous frame's
+ *
+ * The previous frame is the last one read into this same \c LVData.  When
+ * frames rotate through several \c LVData s, as in an \c LVStream, compare
+ * signatures instead, or use \c LVStream::is_duplicate.
+ *
+ * @return True if both frames had signatures, and they matched
+ * @see LVData::set_signatures
+ */
+bool LVData::is_duplicate() const {
+    return this->duplicate;
+}
+
+/**
+ * @brief Retrieve the number of duplicate frames read into this \c LVData
+ *
+ * @return The number of frames \c LVData::is_duplicate was true for
+ */
+uint64_t LVData::get_duplicate_count() const {
+    return this->duplicate_frames;
+}
+
+/**
+ * @brief Retrieve the share of frames that were duplicates
+ *
+ * @return Duplicates divided by frames with signatures, from 0 to 1
+ */
+double LVData::get_duplicate_rate() const {
+    if(this->signed_frames == 0) return 0;
+    
+    return (double)this->duplicate_frames / this->signed_frames;
 }
 
 /**
@@ -208,9 +1354,9 @@ void LVData::yuv_to_rgb(uint8_t **dest, const uint8_t y, const int8_t u, const i
  * @return The version of this live view data
  */
 float LVData::get_lv_version() const {
-    if(this->vp_head == NULL) return -1;
+    if(this->payload == NULL) return -1;
     
-    return this->vp_head->version_major + this->vp_head->version_minor / 10.0;
+    return this->vp_head.version_major + this->vp_head.version_minor / 10.0;
 }
 
 } /* namespace PTP */
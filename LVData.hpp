@@ -3,28 +3,135 @@
 
 namespace PTP {
 #include "chdk/live_view.h"
-    
+
     class PTPContainer; // Forward delcaration for this is enough
-    
+    class ThreadPool;
+    class LVRecorder;
+    class LVPublisher;
+    class LVJpegEncoder;
+
     class LVData {
+        public:
+            enum PIXEL_FORMAT {
+                FORMAT_RGB24,       // Packed R, G, B
+                FORMAT_RGBA32,      // Packed R, G, B, A (opaque)
+                FORMAT_BGRA32,      // Packed B, G, R, A (opaque)
+                FORMAT_RGB565,      // 16-bit little endian, R in the top 5 bits
+                FORMAT_GRAY8,       // Luma only
+                FORMAT_I420,        // Planar Y, then U, then V; chroma halved in both directions
+                FORMAT_NV12         // Planar Y, then interleaved UV; chroma halved in both directions
+            };
+
+            enum COLOR_MATRIX {
+                MATRIX_BT601,       // Standard definition; what CHDK cameras produce
+                MATRIX_BT709        // High definition
+            };
+
+            enum COLOR_RANGE {
+                RANGE_FULL,         // Y, U and V use all 256 values (JFIF)
+                RANGE_LIMITED       // Y in 16-235, U and V in 16-240 (video)
+            };
+
+            static const int DEFAULT_PARALLEL_THRESHOLD = 256 * 1024;  // Pixels; above the largest CHDK viewports
+
+            struct ConvertOptions {
+                bool skip;              // Skip two pixels of every four (required on some cameras)
+                COLOR_MATRIX matrix;
+                COLOR_RANGE range;
+                ThreadPool * pool;      // Threads to convert bands of rows on, or NULL for the calling thread only
+                int threads;            // Bands to split the frame into; 0 for one per thread in the pool
+                int parallel_threshold; // Images with fewer pixels than this are converted on the calling thread
+                int scale;              // Shrink by 1, 2, 4 or 8 in each direction, averaging boxes of pixels
+                bool aspect;            // Make pixels square, using the screen's aspect ratio and the margins
+
+                ConvertOptions(const bool skip=false, const COLOR_MATRIX matrix=MATRIX_BT601, const COLOR_RANGE range=RANGE_FULL)
+                    : skip(skip), matrix(matrix), range(range), pool(NULL), threads(0), parallel_threshold(DEFAULT_PARALLEL_THRESHOLD),
+                      scale(1), aspect(false) { }
+            };
+
+            struct LumaOptions {
+                bool skip;              // Skip two pixels of every four (required on some cameras)
+                int x, y;               // Top left of the region to measure, in pixels of the image get_rgb produces
+                int width, height;      // Size of the region; 0 for the rest of the image
+                int clip_low;           // Samples at or below this are counted as clipped to black
+                int clip_high;          // Samples at or above this are counted as clipped to white
+                bool sharpness;         // Compute LumaStats::sharpness, which costs more than the rest together
+
+                LumaOptions(const bool skip=false)
+                    : skip(skip), x(0), y(0), width(0), height(0), clip_low(0), clip_high(255), sharpness(true) { }
+            };
+
+            struct LumaStats {
+                uint32_t histogram[256];    // Number of samples with each value
+                uint32_t pixels;            // Number of samples measured
+                double mean;
+                uint32_t clipped_low;       // Samples at or below LumaOptions::clip_low
+                uint32_t clipped_high;      // Samples at or above LumaOptions::clip_high
+                double sharpness;           // Mean squared Sobel gradient (Tenengrad); higher is sharper
+            };
+
         private:
-            PTP::lv_data_header * vp_head;
-            PTP::lv_framebuffer_desc * fb_desc;
-            uint8_t * payload;
+            friend class LVRecorder;    // Writes the payload out as it is
+            friend class LVPublisher;   // Shares it as it is
+            PTP::lv_data_header vp_head;
+            PTP::lv_framebuffer_desc fb_desc;
+            PTP::lv_framebuffer_desc bm_desc;
+            int palette_type;           // Type of the last palette the camera sent, or 0 for none yet
+            uint8_t palette[256 * 4];   // That palette, as sent
+            uint8_t overlay_lut[256 * 4];   // That palette expanded to RGBA, for every bitmap byte
+            bool signatures;            // Whether parse() computes a signature of each frame
+            uint64_t signature;         // Of this frame's viewport, or 0
+            bool duplicate;             // Whether this frame's viewport is the same as the last one's
+            uint64_t signed_frames;     // Frames a signature was computed for
+            uint64_t duplicate_frames;  // Of those, the ones that were the same as the frame before
+            const uint8_t * payload;    // The frame we describe: either our buffer, or memory we're viewing
+            uint32_t payload_size;
+            uint8_t * buffer;           // Memory we own, reused from frame to frame
+            uint32_t buffer_capacity;
             void init();
-            static uint8_t clip(const int v);
-            static void yuv_to_rgb(uint8_t **dest, const uint8_t y, const int8_t u, const int8_t v);
-            
+            void parse();
+            void convert_rows(const PIXEL_FORMAT format, uint8_t * out, const int stride, const ConvertOptions& options, const int first, const int last) const;
+            void convert_rows_scaled(const PIXEL_FORMAT format, uint8_t * out, const int stride, const ConvertOptions& options, const int first, const int last) const;
+            LVData(const LVData&);              // Owns its buffer, so it can't be copied
+            LVData& operator=(const LVData&);
+
         public:
             LVData();
             LVData(const uint8_t * payload, const int payload_size);
             ~LVData();
             void read(const uint8_t * payload, const int payload_size);
             void read(const PTPContainer& container);    // Could this make life easier?
+            void view(const uint8_t * payload, const int payload_size);
+            void adopt(PTPContainer& container);
+            void recycle(PTPContainer& container);
+            void reclaim(PTPContainer& container);
+            bool is_empty() const;
             uint8_t * get_rgb(int * out_size, int * out_width, int * out_height, const bool skip=false) const;    // Some cameras don't require skip
+            void get_rgb(uint8_t * out, const int stride, const bool skip=false) const;
+            void get_rgb_size(int * out_width, int * out_height, const bool skip=false) const;
+            void convert(const PIXEL_FORMAT format, uint8_t * out, const int stride, const bool skip=false) const;
+            void convert(const PIXEL_FORMAT format, uint8_t * out, const int stride, const ConvertOptions& options) const;
+            int get_buffer_size(const PIXEL_FORMAT format, const int stride, const bool skip=false) const;
+            int get_buffer_size(const PIXEL_FORMAT format, const int stride, const ConvertOptions& options) const;
+            void get_output_size(int * out_width, int * out_height, const ConvertOptions& options) const;
+            static int get_bytes_per_pixel(const PIXEL_FORMAT format);
+            bool has_overlay() const;
+            void get_overlay_size(int * out_width, int * out_height) const;
+            void get_overlay(uint8_t * out, const int stride) const;
+            void composite_overlay(const PIXEL_FORMAT format, uint8_t * out, const int stride, const ConvertOptions& options=ConvertOptions()) const;
+            void composite_overlay(const PIXEL_FORMAT format, uint8_t * out, const int stride, const ConvertOptions& options, const LVData& overlay) const;
+            bool same_overlay(const LVData& other) const;
+            void read_overlay(const LVData& frame);
+            void get_luma_stats(LumaStats * out, const LumaOptions& options=LumaOptions()) const;
+            const uint8_t * encode_jpeg(LVJpegEncoder& encoder, int * out_size, const bool skip=false) const;
+            void set_signatures(const bool enabled);
+            uint64_t get_signature() const;
+            bool is_duplicate() const;
+            uint64_t get_duplicate_count() const;
+            double get_duplicate_rate() const;
             float get_lv_version() const;
     };
-    
+
 }
 
 #endif /* LIBPTP_PP_LVDATA_H_ */
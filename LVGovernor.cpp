@@ -0,0 +1,307 @@
+/**
+ * @file LVGovernor.cpp
+ *
+ * @brief Paces live view fetching to what the consumer actually uses
+ *
+ * Fetching frames faster than they're displayed wastes USB bandwidth and
+ * camera CPU, and the bitmap overlay, which is as big as a quarter of the
+ * viewport, rarely changes at all.  An \c LVGovernor decides when to fetch
+ * the next frame, from how often the consumer takes frames (see
+ * \c LVGovernor::demand), and asks for the bitmap and palette along with it
+ * only now and then, keeping the last overlay to draw over the frames in
+ * between.
+ *
+ * The time between overlay transfers adapts: each transfer that brings the
+ * same overlay as last time doubles it, up to a limit, and a transfer that
+ * brings a different one starts it over from the minimum.  Anything the
+ * caller knows will change the OSD, such as a key press, can ask for a new
+ * overlay straight away with \c LVGovernor::invalidate_overlay.
+ */
+
+#include <chrono>
+#include <stdint.h>
+
+#include "libptp++.hpp"
+#include "LVGovernor.hpp"
+#include "CHDKCamera.hpp"
+#include "LVData.hpp"
+#include "Util.hpp"
+
+namespace PTP {
+
+/**
+ * @brief Create a governor for live view from \a camera
+ *
+ * By default, frames are fetched at least once a second and with no upper
+ * limit, and the overlay isn't fetched.
+ *
+ * @warning Only the thread calling \c LVGovernor::fetch may talk to \a camera.
+ *
+ * @param[in] camera The camera to fetch live view data from
+ */
+LVGovernor::LVGovernor(CHDKCamera& camera) : camera(camera) {
+    this->min_fps = 1;
+    this->max_fps = 0;
+    this->demand_interval_ms = 0;
+    this->last_demand_us = 0;
+    this->last_fetch_us = 0;
+    this->woken_up = false;
+
+    this->overlay_enabled = false;
+    this->overlay_min_ms = 250;
+    this->overlay_max_ms = 4000;
+    this->overlay_interval_ms = this->overlay_min_ms;
+    this->overlay_due_us = 0;
+    this->current_overlay = -1;
+
+    this->frames = 0;
+    this->overlay_fetches = 0;
+    this->overlay_changes = 0;
+    this->overlay_reuses = 0;
+}
+
+/**
+ * @brief Limit how slowly and how quickly frames are fetched
+ *
+ * Whatever the demand, frames are fetched at between \a min_fps and \a max_fps
+ * frames per second.  The minimum keeps a consumer that has stopped asking
+ * from seeing a stale frame when it starts again.
+ *
+ * @param[in] min_fps The slowest rate, used while there's no demand; 0 for once a second
+ * @param[in] max_fps The fastest rate; 0 for as fast as the camera can go
+ */
+void LVGovernor::set_rate_limits(const double min_fps, const double max_fps) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->min_fps = (min_fps > 0) ? min_fps : 1;
+        this->max_fps = (max_fps > 0) ? max_fps : 0;
+    }
+    this->woken.notify_all();
+}
+
+/**
+ * @brief Choose whether, and how often, to fetch the bitmap overlay
+ *
+ * The bitmap and palette are fetched together, in the same transfer as a
+ * viewport frame, at most every \a min_interval_ms and at least every
+ * \a max_interval_ms.
+ *
+ * @param[in] enabled         True to fetch the overlay
+ * @param[in] min_interval_ms The shortest time between overlay transfers, used while the OSD is changing
+ * @param[in] max_interval_ms The longest time between overlay transfers, reached while it isn't
+ */
+void LVGovernor::set_overlay(const bool enabled, const int min_interval_ms, const int max_interval_ms) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->overlay_enabled = enabled;
+    this->overlay_min_ms = (min_interval_ms > 0) ? min_interval_ms : 1;
+    this->overlay_max_ms = (max_interval_ms > this->overlay_min_ms) ? max_interval_ms : this->overlay_min_ms;
+    this->overlay_interval_ms = this->overlay_min_ms;
+    this->overlay_due_us = 0;
+}
+
+/**
+ * @brief Fetch the overlay with the next frame, whenever it was due
+ *
+ * Call this after anything that changes what's on the camera's screen, like
+ * pressing a key or switching modes, so the change shows up right away.
+ */
+void LVGovernor::invalidate_overlay() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->overlay_interval_ms = this->overlay_min_ms;
+    this->overlay_due_us = 0;
+}
+
+/**
+ * @brief Tell the governor that the consumer has taken a frame
+ *
+ * The time between calls is smoothed into the demand rate.  Frames are then
+ * fetched a little faster than that, so a fresh one is always waiting, and so
+ * the rate creeps back up when the consumer could take more.  Without any
+ * calls at all, frames are fetched as fast as the rate limits allow; after
+ * \c IDLE_TIMEOUT_MS without one, at the minimum rate.
+ *
+ * @see LVStream::set_governor, which calls this for every frame it hands out
+ */
+void LVGovernor::demand() {
+    const double alpha = 0.2;   // Weight of the newest interval
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        uint64_t now = monotonic_us();
+        if(this->last_demand_us != 0) {
+            double interval = (now - this->last_demand_us) / 1000.0;
+            if(interval < IDLE_TIMEOUT_MS) {    // Coming back from idle says nothing about the rate
+                if(this->demand_interval_ms == 0) {
+                    this->demand_interval_ms = interval;
+                } else {
+                    this->demand_interval_ms += alpha * (interval - this->demand_interval_ms);
+                }
+            }
+        }
+        this->last_demand_us = now;
+    }
+    this->woken.notify_all();   // The next frame may be due sooner now
+}
+
+/**
+ * @brief Make a thread waiting in \c LVGovernor::fetch return without fetching
+ *
+ * Used to stop a fetching thread without waiting out a long interval.
+ */
+void LVGovernor::wake() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->woken_up = true;
+    }
+    this->woken.notify_all();
+}
+
+/**
+ * @brief Wait until the next frame is due, and fetch it
+ *
+ * Fetches the viewport into \a data_out.  When the overlay is enabled and due,
+ * the bitmap and palette come in the same transfer, and the governor keeps a
+ * copy of them whenever they've changed; draw that with
+ * \c LVGovernor::composite_overlay.
+ *
+ * @param[out] data_out Where to fetch the viewport to
+ * @return True if a frame was fetched, false if \c LVGovernor::wake was called first
+ * @see CHDKCamera::get_live_view_data
+ */
+bool LVGovernor::fetch(LVData& data_out) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    // Demand and new limits move the deadline, so work it out again after every wakeup
+    while(!this->woken_up && this->last_fetch_us != 0) {
+        uint64_t now = monotonic_us();
+        uint64_t due = this->last_fetch_us + (uint64_t)(this->get_target_interval_ms(now) * 1000);
+        if(now >= due) break;
+        this->woken.wait_for(lock, std::chrono::microseconds(due - now));
+    }
+
+    if(this->woken_up) {
+        this->woken_up = false;
+        return false;
+    }
+
+    uint64_t now = monotonic_us();
+    this->last_fetch_us = now;
+    bool overlay_due = this->overlay_enabled && now >= this->overlay_due_us;
+    lock.unlock();
+
+    this->camera.get_live_view_data(data_out, true, overlay_due, overlay_due);
+    if(overlay_due) {
+        this->keep_overlay(data_out, now);
+    }
+
+    lock.lock();
+    this->frames++;
+    if(this->overlay_enabled && !overlay_due) {
+        this->overlay_reuses++;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Draw the latest overlay over an image converted from \a frame
+ *
+ * @param[in]     frame   The frame \a out was converted from
+ * @param[in]     format  The format of \a out
+ * @param[in,out] out     An image written by \c LVData::convert
+ * @param[in]     stride  The stride \a out was written with
+ * @param[in]     options The options \a out was written with
+ * @return False if there's no overlay yet, in which case \a out is left alone
+ * @see LVData::composite_overlay
+ */
+bool LVGovernor::composite_overlay(const LVData& frame, const LVData::PIXEL_FORMAT format, uint8_t * out, const int stride,
+                                   const LVData::ConvertOptions& options) {
+    std::lock_guard<std::mutex> lock(this->mutex);     // Keeps the next transfer out of this overlay
+    if(this->current_overlay < 0 || !this->overlays[this->current_overlay].has_overlay()) {
+        return false;
+    }
+
+    frame.composite_overlay(format, out, stride, options, this->overlays[this->current_overlay]);
+    return true;
+}
+
+/**
+ * @brief Retrieve the governor's counters and current rates
+ *
+ * @return A snapshot of the counters
+ */
+LVGovernor::Stats LVGovernor::get_stats() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    double target = this->get_target_interval_ms(monotonic_us());
+
+    Stats out;
+    out.frames = this->frames;
+    out.overlay_fetches = this->overlay_fetches;
+    out.overlay_changes = this->overlay_changes;
+    out.overlay_reuses = this->overlay_reuses;
+    out.demand_fps = (this->demand_interval_ms > 0) ? 1000.0 / this->demand_interval_ms : 0;
+    out.target_fps = (target > 0) ? 1000.0 / target : 0;
+    out.overlay_interval_ms = this->overlay_interval_ms;
+
+    return out;
+}
+
+/**
+ * @brief Work out how long to leave between frames
+ *
+ * @param[in] now The current time, from \c monotonic_us
+ * @return Milliseconds from one fetch to the next; 0 for no wait
+ */
+double LVGovernor::get_target_interval_ms(const uint64_t now) const {
+    double fastest = (this->max_fps > 0) ? 1000.0 / this->max_fps : 0;
+    double slowest = 1000.0 / this->min_fps;
+    double interval = fastest;
+
+    if(this->last_demand_us != 0) {
+        if(now - this->last_demand_us >= (uint64_t)IDLE_TIMEOUT_MS * 1000) {
+            interval = slowest;
+        } else if(this->demand_interval_ms > 0) {
+            interval = this->demand_interval_ms * 0.9;  // About 10% ahead of the consumer
+        }
+    }
+
+    if(interval < fastest) interval = fastest;
+    if(interval > slowest) interval = slowest;
+
+    return interval;
+}
+
+/**
+ * @brief Keep the bitmap and palette that came with \a frame, if they're new
+ *
+ * A new overlay is copied into whichever of the two overlay frames isn't
+ * current, so \c LVGovernor::composite_overlay can keep drawing the current
+ * one meanwhile.  If it's the same as the current overlay, nothing is copied
+ * and the interval doubles.
+ *
+ * @param[in] frame A frame fetched with the bitmap and palette
+ * @param[in] now   When \a frame was fetched
+ */
+void LVGovernor::keep_overlay(const LVData& frame, const uint64_t now) {
+    // Only this thread ever writes the overlays, so reading them needs no lock
+    bool changed = frame.has_overlay() &&
+                   (this->current_overlay < 0 || !frame.same_overlay(this->overlays[this->current_overlay]));
+
+    int spare = (this->current_overlay < 0) ? 0 : 1 - this->current_overlay;
+    if(changed) {
+        this->overlays[spare].read_overlay(frame);
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->overlay_fetches++;
+    if(changed) {
+        this->current_overlay = spare;
+        this->overlay_changes++;
+        this->overlay_interval_ms = this->overlay_min_ms;
+    } else {
+        this->overlay_interval_ms *= 2;
+        if(this->overlay_interval_ms > this->overlay_max_ms) this->overlay_interval_ms = this->overlay_max_ms;
+    }
+    this->overlay_due_us = now + (uint64_t)this->overlay_interval_ms * 1000;
+}
+
+} /* namespace PTP */
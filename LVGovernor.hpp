@@ -0,0 +1,65 @@
+#ifndef LIBPTP_PP_LVGOVERNOR_H_
+#define LIBPTP_PP_LVGOVERNOR_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include "LVData.hpp"
+
+namespace PTP {
+
+    class CHDKCamera;
+
+    class LVGovernor {
+        public:
+            static const int IDLE_TIMEOUT_MS = 2000;    // No demand for this long drops to the minimum rate
+
+            struct Stats {
+                uint64_t frames;            // Viewport frames fetched
+                uint64_t overlay_fetches;   // Frames fetched with the bitmap and palette
+                uint64_t overlay_changes;   // Transfers that brought a different overlay
+                uint64_t overlay_reuses;    // Frames that reused the cached overlay instead of fetching it
+                double demand_fps;          // Smoothed rate the consumer takes frames at
+                double target_fps;          // Rate frames are being fetched at
+                int overlay_interval_ms;    // Current time between overlay transfers
+            };
+
+            LVGovernor(CHDKCamera& camera);
+            void set_rate_limits(const double min_fps, const double max_fps);
+            void set_overlay(const bool enabled, const int min_interval_ms=250, const int max_interval_ms=4000);
+            void invalidate_overlay();
+            void demand();
+            void wake();
+            bool fetch(LVData& data_out);
+            bool composite_overlay(const LVData& frame, const LVData::PIXEL_FORMAT format, uint8_t * out, const int stride,
+                                   const LVData::ConvertOptions& options=LVData::ConvertOptions());
+            Stats get_stats() const;
+
+        private:
+            CHDKCamera& camera;
+            mutable std::mutex mutex;       // Guards everything below, and the current overlay while it's drawn
+            std::condition_variable woken;
+            double min_fps, max_fps;
+            double demand_interval_ms;      // Smoothed time between demand() calls; 0 until there are two
+            uint64_t last_demand_us;
+            uint64_t last_fetch_us;
+            bool woken_up;                  // Set by wake(), to end the current wait
+
+            bool overlay_enabled;
+            int overlay_min_ms, overlay_max_ms, overlay_interval_ms;
+            uint64_t overlay_due_us;
+            LVData overlays[2];             // The current overlay, and the one the next change is copied into
+            int current_overlay;            // Index into overlays; -1 until the first transfer
+
+            uint64_t frames, overlay_fetches, overlay_changes, overlay_reuses;
+
+            LVGovernor(const LVGovernor&);  // Owns frames, so it can't be copied
+            LVGovernor& operator=(const LVGovernor&);
+
+            double get_target_interval_ms(const uint64_t now) const;
+            void keep_overlay(const LVData& frame, const uint64_t now);
+    };
+
+}
+
+#endif /* LIBPTP_PP_LVGOVERNOR_H_ */
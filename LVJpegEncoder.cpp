@@ -0,0 +1,525 @@
+/**
+ * @file LVJpegEncoder.cpp
+ *
+ * @brief A baseline JPEG encoder that takes YCbCr straight from the camera
+ *
+ * JPEG stores luma and chroma, which is what the camera sends: converting live
+ * view to RGB for a general purpose encoder, only for it to convert back,
+ * costs two color conversions per frame and blurs the chroma twice.  This
+ * encoder takes planar Y, Cb and Cr in strips of 8 rows (see
+ * \c LVData::encode_jpeg, which fills them from the viewport with no color
+ * math), and writes a baseline JFIF file with the chroma subsampled just as
+ * the camera subsampled it: one Cb and Cr for every four pixels across (two,
+ * in skip mode), and every row.
+ *
+ * The DCT and quantization are \c LVConverter::fdct_quantize, which has
+ * vectorized versions; the Huffman coding uses the standard tables from the
+ * JPEG specification (Annex K), so there are no statistics to gather and the
+ * frame is written in a single pass.  Tables, strips and the output buffer
+ * all belong to the encoder and are kept from one frame to the next, so
+ * encoding a stream of frames allocates nothing after the first.
+ */
+
+#include <cstring>
+#include <stdint.h>
+
+#include "libptp++.hpp"
+#include "LVJpegEncoder.hpp"
+#include "LVConverter.hpp"
+
+namespace PTP {
+
+/**
+ * @brief The natural order index of each coefficient, in the order they're written
+ */
+static const uint8_t zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// Annex K.1: the example quantization tables, in natural order, for quality 50
+static const uint8_t luma_quantization[64] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+
+static const uint8_t chroma_quantization[64] = {
+    17,  18,  24,  47,  99,  99,  99,  99,
+    18,  21,  26,  66,  99,  99,  99,  99,
+    24,  26,  56,  99,  99,  99,  99,  99,
+    47,  66,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99
+};
+
+// Annex K.3: the typical Huffman tables, as the number of codes of each length then the symbols
+static const uint8_t dc_luma_counts[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uint8_t dc_chroma_counts[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const uint8_t dc_symbols[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const uint8_t ac_luma_counts[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uint8_t ac_luma_symbols[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+static const uint8_t ac_chroma_counts[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const uint8_t ac_chroma_symbols[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+static const int BLOCK_WORST_CASE = 512;    // Bytes one block can take, with every byte stuffed
+
+/**
+ * @brief Create an encoder
+ *
+ * @param[in] quality 1 (smallest) to 100 (best), on the same scale as libjpeg
+ */
+LVJpegEncoder::LVJpegEncoder(const int quality) {
+    this->width = 0;
+    this->height = 0;
+    this->h_samp = 0;
+    this->mcus = 0;
+    this->out = NULL;
+    this->out_size = 0;
+    this->out_capacity = 0;
+    this->bits = 0;
+    this->bit_count = 0;
+
+    int c;
+    for(c = 0; c < 3; c++) {
+        this->widths[c] = 0;
+        this->strides[c] = 0;
+        this->strips[c] = NULL;
+        this->strip_capacity[c] = 0;
+        this->last_dc[c] = 0;
+    }
+
+    LVJpegEncoder::build_huffman_table(&this->dc[0], dc_luma_counts, dc_symbols);
+    LVJpegEncoder::build_huffman_table(&this->dc[1], dc_chroma_counts, dc_symbols);
+    LVJpegEncoder::build_huffman_table(&this->ac[0], ac_luma_counts, ac_luma_symbols);
+    LVJpegEncoder::build_huffman_table(&this->ac[1], ac_chroma_counts, ac_chroma_symbols);
+
+    this->set_quality(quality);
+}
+
+/**
+ * @brief Frees the strips and the output buffer
+ */
+LVJpegEncoder::~LVJpegEncoder() {
+    int c;
+    for(c = 0; c < 3; c++) {
+        delete[] this->strips[c];
+    }
+    delete[] this->out;
+}
+
+/**
+ * @brief Choose the quality of the images from now on
+ *
+ * The example tables from the JPEG specification are scaled the way libjpeg
+ * does, so a given quality gives about the same size and look as it would
+ * there.
+ *
+ * @param[in] quality 1 (smallest) to 100 (best); values outside that are clamped
+ */
+void LVJpegEncoder::set_quality(const int quality) {
+    this->quality = (quality < 1) ? 1 : ((quality > 100) ? 100 : quality);
+    int scale = (this->quality < 50) ? 5000 / this->quality : 200 - this->quality * 2;
+
+    int i, t;
+    for(t = 0; t < 2; t++) {
+        const uint8_t * base = (t == 0) ? luma_quantization : chroma_quantization;
+        for(i = 0; i < 64; i++) {
+            int q = (base[zigzag[i]] * scale + 50) / 100;
+            q = (q < 1) ? 1 : ((q > 255) ? 255 : q);
+            this->qtables[t][i] = q;
+            this->reciprocals[t][zigzag[i]] = 1.0f / q;
+        }
+    }
+}
+
+/**
+ * @brief Retrieve the quality images are encoded at
+ *
+ * @return 1 to 100
+ */
+int LVJpegEncoder::get_quality() const {
+    return this->quality;
+}
+
+/**
+ * @brief Start a new image
+ *
+ * Writes the headers, and sizes the strips.  Fill the strips (see
+ * \c LVJpegEncoder::get_strip) and call \c LVJpegEncoder::encode_strip for
+ * every 8 rows, top to bottom, then \c LVJpegEncoder::finish.
+ *
+ * The density is only stored, as the shape of the pixels: JFIF takes
+ * densities with no units as an aspect ratio.
+ *
+ * @param[in] width     The width of the image, in pixels
+ * @param[in] height    The height of the image, in pixels
+ * @param[in] h_samp    Luma samples across for every chroma sample: 1, 2 or 4
+ * @param[in] x_density Relative horizontal pixel density; smaller for wider pixels
+ * @param[in] y_density Relative vertical pixel density
+ * @exception ERR_LVJPEG_INVALID_PARAM If the size or \a h_samp can't be encoded.
+ */
+void LVJpegEncoder::begin(const int width, const int height, const int h_samp, const int x_density, const int y_density) {
+    if(width < 1 || height < 1 || width > 65535 || height > 65535 || (h_samp != 1 && h_samp != 2 && h_samp != 4)) {
+        throw ERR_LVJPEG_INVALID_PARAM;
+    }
+
+    this->width = width;
+    this->height = height;
+    this->h_samp = h_samp;
+    this->mcus = (width + 8 * h_samp - 1) / (8 * h_samp);
+    this->widths[0] = width;
+    this->widths[1] = this->widths[2] = (width + h_samp - 1) / h_samp;
+    this->strides[0] = this->mcus * 8 * h_samp;
+    this->strides[1] = this->strides[2] = this->mcus * 8;
+
+    int c;
+    for(c = 0; c < 3; c++) {
+        if(this->strides[c] * 8 > this->strip_capacity[c]) {
+            delete[] this->strips[c];
+            this->strips[c] = new uint8_t[this->strides[c] * 8];
+            this->strip_capacity[c] = this->strides[c] * 8;
+        }
+        this->last_dc[c] = 0;
+    }
+
+    this->out_size = 0;
+    this->bits = 0;
+    this->bit_count = 0;
+    this->write_headers(x_density, y_density);
+}
+
+/**
+ * @brief Retrieve where to put the next 8 rows of one component
+ *
+ * Only the image's own samples need to be filled in: the encoder pads rows
+ * and columns out to whole blocks itself.
+ *
+ * @param[in]  component 0 for Y, 1 for Cb, 2 for Cr; all unsigned, centered on 128
+ * @param[out] stride    The distance, in bytes, between rows of the strip
+ * @return The address of the first sample of the strip's first row
+ */
+uint8_t * LVJpegEncoder::get_strip(const int component, int * stride) {
+    *stride = this->strides[component];
+    return this->strips[component];
+}
+
+/**
+ * @brief Encode the strips, as the next 8 rows of the image
+ *
+ * @param[in] rows The number of rows of the strips that are filled in; only
+ *                 less than 8 for the last strip of the image
+ */
+void LVJpegEncoder::encode_strip(const int rows) {
+    int c, r, m, b;
+
+    // Repeat the last column and row out to the edge of the blocks, which keeps them from ringing
+    for(c = 0; c < 3; c++) {
+        const int stride = this->strides[c];
+        const int valid = this->widths[c];
+        uint8_t * strip = this->strips[c];
+        for(r = 0; r < rows; r++) {
+            std::memset(strip + r * stride + valid, strip[r * stride + valid - 1], stride - valid);
+        }
+        for(r = rows; r < 8; r++) {
+            std::memcpy(strip + r * stride, strip + (rows - 1) * stride, stride);
+        }
+    }
+
+    this->reserve(this->out_size + (size_t)this->mcus * (this->h_samp + 2) * BLOCK_WORST_CASE);
+
+    for(m = 0; m < this->mcus; m++) {
+        for(b = 0; b < this->h_samp; b++) {
+            this->encode_block(this->strips[0] + (m * this->h_samp + b) * 8, this->strides[0], 0);
+        }
+        this->encode_block(this->strips[1] + m * 8, this->strides[1], 1);
+        this->encode_block(this->strips[2] + m * 8, this->strides[2], 2);
+    }
+}
+
+/**
+ * @brief Finish the image
+ *
+ * @param[out] out_size The size of the JPEG, in bytes
+ * @return The JPEG; valid until the next call to \c LVJpegEncoder::begin
+ */
+const uint8_t * LVJpegEncoder::finish(int * out_size) {
+    this->reserve(this->out_size + 4);
+    if(this->bit_count > 0) {
+        this->put_bits((1 << (8 - this->bit_count)) - 1, 8 - this->bit_count);     // Pad with ones
+    }
+    this->put_word(0xFFD9);     // EOI
+
+    *out_size = this->out_size;
+    return this->out;
+}
+
+/**
+ * @brief Make sure the output buffer holds at least \a bytes
+ */
+void LVJpegEncoder::reserve(const size_t bytes) {
+    if(bytes <= this->out_capacity) return;
+
+    size_t capacity = (this->out_capacity > 0) ? this->out_capacity : 64 * 1024;
+    while(capacity < bytes) capacity *= 2;
+
+    uint8_t * grown = new uint8_t[capacity];
+    if(this->out_size > 0) {
+        std::memcpy(grown, this->out, this->out_size);
+    }
+    delete[] this->out;
+    this->out = grown;
+    this->out_capacity = capacity;
+}
+
+void LVJpegEncoder::put_byte(const uint8_t byte) {
+    this->out[this->out_size++] = byte;
+}
+
+void LVJpegEncoder::put_word(const uint16_t word) {
+    this->out[this->out_size++] = word >> 8;
+    this->out[this->out_size++] = word & 0xFF;
+}
+
+/**
+ * @brief Append the low \a size bits of \a code to the entropy coded data
+ *
+ * Whole bytes are written out as soon as there are any, with a zero after
+ * every 0xFF, so it isn't mistaken for a marker.
+ */
+inline void LVJpegEncoder::put_bits(const uint32_t code, const int size) {
+    this->bits = (this->bits << size) | code;
+    this->bit_count += size;
+    while(this->bit_count >= 8) {
+        this->bit_count -= 8;
+        uint8_t byte = this->bits >> this->bit_count;
+        this->out[this->out_size++] = byte;
+        if(byte == 0xFF) {
+            this->out[this->out_size++] = 0;
+        }
+    }
+}
+
+/**
+ * @brief Write everything from the start of the file to the start of the scan
+ */
+void LVJpegEncoder::write_headers(const int x_density, const int y_density) {
+    this->reserve(1024);
+
+    this->put_word(0xFFD8);     // SOI
+
+    // Densities are 16 bits; keep their ratio
+    int x = (x_density > 0) ? x_density : 1, y = (y_density > 0) ? y_density : 1;
+    int a = x, b = y;
+    while(b != 0) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    x /= a;
+    y /= a;
+    while(x > 65535 || y > 65535) {
+        x = (x + 1) / 2;
+        y = (y + 1) / 2;
+    }
+
+    this->put_word(0xFFE0);     // APP0, JFIF 1.01
+    this->put_word(16);
+    this->put_byte('J');
+    this->put_byte('F');
+    this->put_byte('I');
+    this->put_byte('F');
+    this->put_byte(0);
+    this->put_word(0x0101);
+    this->put_byte(0);          // Densities are an aspect ratio
+    this->put_word(x);
+    this->put_word(y);
+    this->put_word(0);          // No thumbnail
+
+    int t, i;
+    this->put_word(0xFFDB);     // DQT
+    this->put_word(2 + 2 * 65);
+    for(t = 0; t < 2; t++) {
+        this->put_byte(t);      // 8-bit entries, table t
+        for(i = 0; i < 64; i++) {
+            this->put_byte(this->qtables[t][i]);
+        }
+    }
+
+    this->put_word(0xFFC0);     // SOF0, baseline
+    this->put_word(8 + 3 * 3);
+    this->put_byte(8);
+    this->put_word(this->height);
+    this->put_word(this->width);
+    this->put_byte(3);
+    this->put_byte(1);                          // Y: h_samp x 1, table 0
+    this->put_byte((this->h_samp << 4) | 1);
+    this->put_byte(0);
+    this->put_byte(2);                          // Cb: 1 x 1, table 1
+    this->put_byte(0x11);
+    this->put_byte(1);
+    this->put_byte(3);                          // Cr: 1 x 1, table 1
+    this->put_byte(0x11);
+    this->put_byte(1);
+
+    this->put_word(0xFFC4);     // DHT
+    this->put_word(2 + 4 * 17 + 2 * 12 + 2 * 162);
+    this->write_huffman_table(0x00, dc_luma_counts, dc_symbols);
+    this->write_huffman_table(0x10, ac_luma_counts, ac_luma_symbols);
+    this->write_huffman_table(0x01, dc_chroma_counts, dc_symbols);
+    this->write_huffman_table(0x11, ac_chroma_counts, ac_chroma_symbols);
+
+    this->put_word(0xFFDA);     // SOS
+    this->put_word(6 + 2 * 3);
+    this->put_byte(3);
+    this->put_byte(1);
+    this->put_byte(0x00);       // Y: DC and AC table 0
+    this->put_byte(2);
+    this->put_byte(0x11);       // Cb, Cr: DC and AC table 1
+    this->put_byte(3);
+    this->put_byte(0x11);
+    this->put_byte(0);          // The whole spectrum, in one go
+    this->put_byte(63);
+    this->put_byte(0);
+}
+
+/**
+ * @brief Write one table of a DHT segment
+ *
+ * @param[in] id      The class (0 for DC, 1 for AC) in the high nibble, and the table number in the low
+ * @param[in] counts  The number of codes of each length, 1 to 16 bits
+ * @param[in] symbols The symbols, shortest codes first
+ */
+void LVJpegEncoder::write_huffman_table(const int id, const uint8_t * counts, const uint8_t * symbols) {
+    int i, n = 0;
+    this->put_byte(id);
+    for(i = 0; i < 16; i++) {
+        this->put_byte(counts[i]);
+        n += counts[i];
+    }
+    for(i = 0; i < n; i++) {
+        this->put_byte(symbols[i]);
+    }
+}
+
+/**
+ * @brief Transform, quantize and entropy code one 8x8 block
+ *
+ * Coefficients are coded in zigzag order as runs of zeros followed by a
+ * value.  The positions of the non-zero coefficients are collected into a
+ * bitmask first, so runs of zeros are skipped in one step instead of one
+ * coefficient at a time.
+ *
+ * @param[in] src       The block's top left sample
+ * @param[in] stride    The distance between its rows
+ * @param[in] component 0 for Y, 1 for Cb, 2 for Cr
+ */
+void LVJpegEncoder::encode_block(const uint8_t * src, const int stride, const int component) {
+    const int table = (component > 0) ? 1 : 0;
+    const HuffmanTable& dc = this->dc[table];
+    const HuffmanTable& ac = this->ac[table];
+
+    int16_t coefs[64], ordered[64];
+    LVConverter::fdct_quantize(src, stride, this->reciprocals[table], coefs);
+
+    // DC is coded as the change from the last block of this component
+    int value = coefs[0] - this->last_dc[component];
+    this->last_dc[component] = coefs[0];
+    int magnitude = (value < 0) ? -value : value;
+    int n = (magnitude == 0) ? 0 : 32 - __builtin_clz(magnitude);
+    if(value < 0) value += (1 << n) - 1;   // Negative values are sent as their ones' complement
+    this->put_bits(((uint32_t)dc.code[n] << n) | (value & ((1 << n) - 1)), dc.size[n] + n);
+
+    uint64_t nonzero = 0;
+    int i;
+    for(i = 1; i < 64; i++) {
+        ordered[i] = coefs[zigzag[i]];
+        if(ordered[i] != 0) nonzero |= (uint64_t)1 << i;
+    }
+
+    int next = 1;
+    while(nonzero != 0) {
+        i = __builtin_ctzll(nonzero);
+        nonzero &= nonzero - 1;
+
+        int run = i - next;
+        while(run >= 16) {
+            this->put_bits(ac.code[0xF0], ac.size[0xF0]);   // 16 zeros
+            run -= 16;
+        }
+
+        value = ordered[i];
+        magnitude = (value < 0) ? -value : value;
+        n = 32 - __builtin_clz(magnitude);
+        if(value < 0) value += (1 << n) - 1;
+        const int symbol = (run << 4) | n;
+        this->put_bits(((uint32_t)ac.code[symbol] << n) | (value & ((1 << n) - 1)), ac.size[symbol] + n);
+        next = i + 1;
+    }
+
+    if(next < 64) {
+        this->put_bits(ac.code[0x00], ac.size[0x00]);   // End of block
+    }
+}
+
+/**
+ * @brief Work out the code of every symbol in a Huffman table
+ *
+ * Codes of each length are consecutive, starting from the last code of the
+ * length before plus one, doubled (Annex C).
+ *
+ * @param[out] table   The codes and sizes, by symbol
+ * @param[in]  counts  The number of codes of each length, 1 to 16 bits
+ * @param[in]  symbols The symbols, shortest codes first
+ */
+void LVJpegEncoder::build_huffman_table(HuffmanTable * table, const uint8_t * counts, const uint8_t * symbols) {
+    std::memset(table, 0, sizeof(HuffmanTable));
+
+    int length, i, k = 0;
+    uint16_t code = 0;
+    for(length = 1; length <= 16; length++) {
+        for(i = 0; i < counts[length - 1]; i++) {
+            table->code[symbols[k]] = code++;
+            table->size[symbols[k]] = length;
+            k++;
+        }
+        code <<= 1;
+    }
+}
+
+} /* namespace PTP */
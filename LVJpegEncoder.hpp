@@ -0,0 +1,59 @@
+#ifndef LIBPTP_PP_LVJPEGENCODER_H_
+#define LIBPTP_PP_LVJPEGENCODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace PTP {
+
+    class LVJpegEncoder {
+        public:
+            LVJpegEncoder(const int quality=75);
+            ~LVJpegEncoder();
+            void set_quality(const int quality);
+            int get_quality() const;
+            void begin(const int width, const int height, const int h_samp, const int x_density=1, const int y_density=1);
+            uint8_t * get_strip(const int component, int * stride);
+            void encode_strip(const int rows);
+            const uint8_t * finish(int * out_size);
+
+        private:
+            struct HuffmanTable {
+                uint16_t code[256];     // By symbol
+                uint8_t size[256];      // In bits; 0 for symbols the table doesn't have
+            };
+
+            int quality;
+            uint8_t qtables[2][64];         // Luma, chroma; zigzag order, as written to the file
+            float reciprocals[2][64];       // 1 / qtables, in natural order
+            HuffmanTable dc[2], ac[2];      // The standard tables, luma then chroma
+
+            int width, height, h_samp;
+            int mcus;                       // Per strip of 8 rows
+            int widths[3];                  // Samples per row of each component, before padding
+            int strides[3];                 // Row length of each strip; whole MCUs
+            uint8_t * strips[3];            // 8 rows of Y, Cb and Cr
+            int strip_capacity[3];
+            int last_dc[3];
+
+            uint8_t * out;                  // The JPEG so far, reused from frame to frame
+            size_t out_size, out_capacity;
+            uint64_t bits;                  // Bits not yet written to out
+            int bit_count;
+
+            LVJpegEncoder(const LVJpegEncoder&);    // Owns buffers, so it can't be copied
+            LVJpegEncoder& operator=(const LVJpegEncoder&);
+
+            void reserve(const size_t bytes);
+            void put_byte(const uint8_t byte);
+            void put_word(const uint16_t word);
+            void put_bits(const uint32_t code, const int size);
+            void write_headers(const int x_density, const int y_density);
+            void write_huffman_table(const int id, const uint8_t * counts, const uint8_t * symbols);
+            void encode_block(const uint8_t * src, const int stride, const int component);
+            static void build_huffman_table(HuffmanTable * table, const uint8_t * counts, const uint8_t * symbols);
+    };
+
+}
+
+#endif /* LIBPTP_PP_LVJPEGENCODER_H_ */
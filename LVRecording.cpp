@@ -0,0 +1,472 @@
+/**
+ * @file LVRecording.cpp
+ *
+ * @brief Records live view to disk as the camera sent it, and plays it back
+ *
+ * Converting frames to RGB before storing them roughly doubles their size,
+ * and costs a conversion per frame whether or not it's ever looked at again.
+ * An \c LVRecorder instead appends each \c GetDisplayData payload, headers,
+ * descriptors and all, to a series of segment files, and writes an index of
+ * when each frame arrived and where it was put.  An \c LVPlayer maps the
+ * segments into memory and hands frames out as \c LVData views of the mapping,
+ * so nothing is copied or read from disk until it's actually used, and any
+ * frame is as quick to get to as the next one.
+ *
+ * A recording called \c path is made of \c path.idx, the index, and the
+ * segments \c path.000, \c path.001 and so on.  Each segment record starts
+ * with its own header, so a recording can be played back even if the index is
+ * lost or falls behind, as it may if the recorder is killed.
+ */
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <stdint.h>
+
+#include "libptp++.hpp"
+#include "LVRecording.hpp"
+#include "LVData.hpp"
+
+namespace PTP {
+
+using namespace LVRecordingFormat;
+
+/**
+ * @brief Build the file name of segment number \a segment of the recording at \a path
+ */
+static std::string segment_path(const std::string path, const uint32_t segment) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%03u", segment);
+
+    return path + suffix;
+}
+
+/**
+ * @brief Round \a size up to the next multiple of 8, so every record starts aligned
+ */
+static uint64_t padded(const uint64_t size) {
+    return (size + 7) & ~(uint64_t)7;
+}
+
+/**
+ * @brief Start a new recording at \a path
+ *
+ * Any recording already at \a path is overwritten, segment by segment, as the
+ * new one reaches it.
+ *
+ * @param[in] path          The name of the recording; the files are named after it
+ * @param[in] segment_bytes The size beyond which a new segment is started
+ * @exception ERR_LVRECORDING_CANNOT_OPEN If the first segment or the index can't be created.
+ */
+LVRecorder::LVRecorder(const std::string path, const uint64_t segment_bytes) {
+    this->path = path;
+    this->segment_bytes = segment_bytes;
+    this->segment_file = NULL;
+    this->index_file = NULL;
+    this->segment = 0;
+    this->segment_offset = 0;
+    this->frames = 0;
+    this->bytes_written = 0;
+
+    this->index_file = fopen((path + ".idx").c_str(), "wb");
+    if(this->index_file == NULL) {
+        throw ERR_LVRECORDING_CANNOT_OPEN;
+    }
+
+    FileHeader header = { INDEX_MAGIC, VERSION, 0, 0 };
+    if(fwrite(&header, sizeof(header), 1, this->index_file) != 1) {
+        this->close();
+        throw ERR_LVRECORDING_CANNOT_OPEN;
+    }
+
+    try {
+        this->open_segment(0);
+    } catch(LIBPTP_PP_ERRORS e) {
+        this->close();
+        throw;
+    }
+}
+
+/**
+ * @brief Flushes and closes the recording
+ */
+LVRecorder::~LVRecorder() {
+    this->close();
+}
+
+/**
+ * @brief Add \a frame to the end of the recording
+ *
+ * Frames should be added in the order of their timestamps, for
+ * \c LVPlayer::seek to find them.
+ *
+ * @param[in] frame        A frame, as fetched from the camera
+ * @param[in] timestamp_us When \a frame was captured, in microseconds; 0 for now, since the Unix epoch
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If \a frame is empty.
+ * @exception ERR_LVRECORDING_CANNOT_WRITE If the recording is closed, or the disk is full.
+ */
+void LVRecorder::append(const LVData& frame, const uint64_t timestamp_us) {
+    if(frame.payload == NULL || frame.payload_size == 0) {
+        throw ERR_LVDATA_NOT_ENOUGH_DATA;
+    }
+
+    if(this->segment_file == NULL) {
+        throw ERR_LVRECORDING_CANNOT_WRITE;
+    }
+
+    uint64_t timestamp = timestamp_us;
+    if(timestamp == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        timestamp = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    const uint64_t record_size = sizeof(RecordHeader) + padded(frame.payload_size);
+    if(this->segment_offset > sizeof(FileHeader) && this->segment_offset + record_size > this->segment_bytes) {
+        this->open_segment(this->segment + 1);
+    }
+
+    RecordHeader record = { RECORD_MAGIC, frame.payload_size, timestamp };
+    IndexEntry entry = { timestamp, this->segment_offset + sizeof(RecordHeader), this->segment, frame.payload_size };
+    static const uint8_t padding[8] = { 0 };
+    const size_t padding_size = padded(frame.payload_size) - frame.payload_size;
+
+    if(fwrite(&record, sizeof(record), 1, this->segment_file) != 1 ||
+       fwrite(frame.payload, 1, frame.payload_size, this->segment_file) != frame.payload_size ||
+       fwrite(padding, 1, padding_size, this->segment_file) != padding_size ||
+       fwrite(&entry, sizeof(entry), 1, this->index_file) != 1) {
+        throw ERR_LVRECORDING_CANNOT_WRITE;
+    }
+
+    this->segment_offset += record_size;
+    this->bytes_written += record_size;
+    this->frames++;
+}
+
+/**
+ * @brief Write out anything buffered, so a player opened now sees every frame so far
+ *
+ * @exception ERR_LVRECORDING_CANNOT_WRITE If the disk is full.
+ */
+void LVRecorder::flush() {
+    if(this->segment_file == NULL) return;
+
+    // Frames before the index, so the index never points past what's there
+    if(fflush(this->segment_file) != 0 || fflush(this->index_file) != 0) {
+        throw ERR_LVRECORDING_CANNOT_WRITE;
+    }
+}
+
+/**
+ * @brief Finish the recording
+ *
+ * Further calls to \c LVRecorder::append throw.  Does nothing if already closed.
+ */
+void LVRecorder::close() {
+    if(this->segment_file != NULL) {
+        fclose(this->segment_file);
+        this->segment_file = NULL;
+    }
+
+    if(this->index_file != NULL) {
+        fclose(this->index_file);
+        this->index_file = NULL;
+    }
+}
+
+/**
+ * @brief Retrieve the number of frames recorded
+ *
+ * @return The number of calls to \c LVRecorder::append that succeeded
+ */
+int LVRecorder::get_frame_count() const {
+    return this->frames;
+}
+
+/**
+ * @brief Retrieve the size of the recorded frames
+ *
+ * @return The bytes written to segments, not counting their headers or the index
+ */
+uint64_t LVRecorder::get_bytes_written() const {
+    return this->bytes_written;
+}
+
+/**
+ * @brief Close the current segment, if any, and start segment number \a segment
+ *
+ * @exception ERR_LVRECORDING_CANNOT_OPEN If the segment can't be created.
+ */
+void LVRecorder::open_segment(const uint32_t segment) {
+    if(this->segment_file != NULL) {
+        fclose(this->segment_file);
+        this->segment_file = NULL;
+    }
+
+    FILE * file = fopen(segment_path(this->path, segment).c_str(), "wb");
+    if(file == NULL) {
+        throw ERR_LVRECORDING_CANNOT_OPEN;
+    }
+
+    FileHeader header = { SEGMENT_MAGIC, VERSION, segment, 0 };
+    if(fwrite(&header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        throw ERR_LVRECORDING_CANNOT_OPEN;
+    }
+
+    // A longer recording that was here before would otherwise carry on after this one
+    unlink(segment_path(this->path, segment + 1).c_str());
+
+    this->segment_file = file;
+    this->segment = segment;
+    this->segment_offset = sizeof(header);
+}
+
+/**
+ * @brief Open the recording at \a path for playback
+ *
+ * Every segment is mapped into memory, and the index is read.  Frames the
+ * index is missing, because the recorder didn't get to write them, are found
+ * by reading through the end of the last segment instead.  A frame that was
+ * only partly written is left out.
+ *
+ * @param[in] path The name the recording was made with
+ * @exception ERR_LVRECORDING_CANNOT_OPEN If there's no recording at \a path.
+ * @exception ERR_LVRECORDING_CORRUPT If a segment isn't from a recording.
+ */
+LVPlayer::LVPlayer(const std::string path) {
+    uint32_t number;
+    for(number = 0; ; number++) {
+        int fd = open(segment_path(path, number).c_str(), O_RDONLY);
+        if(fd < 0) break;
+
+        struct stat info;
+        Segment segment = { NULL, 0 };
+        if(fstat(fd, &info) == 0 && info.st_size > 0) {
+            void * data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(data != MAP_FAILED) {
+                segment.data = (const uint8_t *)data;
+                segment.size = info.st_size;
+            }
+        }
+        ::close(fd);    // The mapping stays
+
+        FileHeader header;
+        if(segment.size < sizeof(header)) {
+            this->unmap();
+            throw ERR_LVRECORDING_CORRUPT;
+        }
+        this->segments.push_back(segment);
+
+        std::memcpy(&header, segment.data, sizeof(header));
+        if(header.magic != SEGMENT_MAGIC || header.version != VERSION || header.segment != number) {
+            this->unmap();
+            throw ERR_LVRECORDING_CORRUPT;
+        }
+    }
+
+    if(this->segments.empty()) {
+        throw ERR_LVRECORDING_CANNOT_OPEN;
+    }
+
+    this->load_index(path + ".idx");
+    this->scan_segments();
+}
+
+/**
+ * @brief Unmaps the recording
+ *
+ * @warning Frames from \c LVPlayer::get_frame can't be used after this.
+ */
+LVPlayer::~LVPlayer() {
+    this->unmap();
+}
+
+/**
+ * @brief Retrieve the number of frames in the recording
+ */
+int LVPlayer::get_frame_count() const {
+    return this->index.size();
+}
+
+/**
+ * @brief Retrieve when frame number \a index was captured
+ *
+ * @param[in] index The frame number, from 0
+ * @return The timestamp the frame was recorded with, in microseconds
+ * @exception ERR_LVRECORDING_OUT_OF_RANGE If there's no such frame.
+ */
+uint64_t LVPlayer::get_timestamp(const int index) const {
+    if(index < 0 || index >= (int)this->index.size()) {
+        throw ERR_LVRECORDING_OUT_OF_RANGE;
+    }
+
+    return this->index[index].timestamp_us;
+}
+
+/**
+ * @brief Retrieve the time from the first frame to the last
+ *
+ * @return The difference in their timestamps, in microseconds
+ */
+uint64_t LVPlayer::get_duration_us() const {
+    if(this->index.empty()) return 0;
+
+    return this->index.back().timestamp_us - this->index.front().timestamp_us;
+}
+
+/**
+ * @brief Find the frame that was showing at \a timestamp_us
+ *
+ * A binary search of the index, so scrubbing costs the same anywhere in the
+ * recording.
+ *
+ * @param[in] timestamp_us A time, in microseconds, as the frames were recorded with
+ * @return The number of the last frame captured at or before \a timestamp_us; 0 if it's before them all, or -1 if there are none
+ */
+int LVPlayer::seek(const uint64_t timestamp_us) const {
+    if(this->index.empty()) return -1;
+
+    int after = 0, count = this->index.size();
+    while(count > 0) {  // First frame later than timestamp_us
+        int half = count / 2;
+        if(this->index[after + half].timestamp_us <= timestamp_us) {
+            after += half + 1;
+            count -= half + 1;
+        } else {
+            count = half;
+        }
+    }
+
+    return (after > 0) ? after - 1 : 0;
+}
+
+/**
+ * @brief Point \a out at frame number \a index, without copying it
+ *
+ * Memory \a out already owns is kept for later.
+ *
+ * @param[in]  index The frame number, from 0
+ * @param[out] out   The frame, viewing the mapped recording; valid until this \c LVPlayer is destroyed
+ * @exception ERR_LVRECORDING_OUT_OF_RANGE If there's no such frame.
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If the frame describes more data than it has.
+ * @see LVData::view
+ */
+void LVPlayer::get_frame(const int index, LVData& out) const {
+    if(index < 0 || index >= (int)this->index.size()) {
+        throw ERR_LVRECORDING_OUT_OF_RANGE;
+    }
+
+    const IndexEntry& entry = this->index[index];
+    out.view(this->segments[entry.segment].data + entry.offset, entry.size);
+}
+
+/**
+ * @brief Ask the kernel to start reading \a count frames from \a first in from disk
+ *
+ * Call this ahead of playing or scrubbing through a stretch of the
+ * recording, so frames are in memory by the time they're needed.  Frames out
+ * of range are ignored.
+ *
+ * @param[in] first The number of the first frame
+ * @param[in] count The number of frames
+ */
+void LVPlayer::prefetch(const int first, const int count) const {
+    const int begin = std::max(first, 0);
+    const int end = std::min(first + count, (int)this->index.size());
+    const uint64_t page = sysconf(_SC_PAGESIZE);
+
+    int i = begin;
+    while(i < end) {
+        // One call for each segment the frames span
+        const uint32_t segment = this->index[i].segment;
+        uint64_t start = this->index[i].offset;
+        uint64_t stop = start;
+        for(; i < end && this->index[i].segment == segment; i++) {
+            stop = this->index[i].offset + this->index[i].size;
+        }
+
+        start -= start % page;
+        madvise((void *)(this->segments[segment].data + start), stop - start, MADV_WILLNEED);
+    }
+}
+
+/**
+ * @brief Unmap all the segments
+ */
+void LVPlayer::unmap() {
+    size_t i;
+    for(i = 0; i < this->segments.size(); i++) {
+        if(this->segments[i].data != NULL) {
+            munmap((void *)this->segments[i].data, this->segments[i].size);
+        }
+    }
+    this->segments.clear();
+}
+
+/**
+ * @brief Read the index at \a index_path, up to the first entry that doesn't match the segments
+ *
+ * A missing or unreadable index leaves the index empty, for
+ * \c LVPlayer::scan_segments to rebuild.
+ */
+void LVPlayer::load_index(const std::string index_path) {
+    FILE * file = fopen(index_path.c_str(), "rb");
+    if(file == NULL) return;
+
+    FileHeader header;
+    if(fread(&header, sizeof(header), 1, file) != 1 || header.magic != INDEX_MAGIC || header.version != VERSION) {
+        fclose(file);
+        return;
+    }
+
+    IndexEntry entry;
+    while(fread(&entry, sizeof(entry), 1, file) == 1) {
+        // The index is flushed after the segments, but a crash can still leave it ahead of them
+        if(entry.segment >= this->segments.size()) break;
+        const Segment& segment = this->segments[entry.segment];
+        if(entry.offset < sizeof(FileHeader) + sizeof(RecordHeader) || entry.offset + entry.size > segment.size) break;
+
+        RecordHeader record;
+        std::memcpy(&record, segment.data + entry.offset - sizeof(RecordHeader), sizeof(record));
+        if(record.magic != RECORD_MAGIC || record.size != entry.size) break;
+
+        this->index.push_back(entry);
+    }
+
+    fclose(file);
+}
+
+/**
+ * @brief Add the frames after the last one in the index, by reading through the segments
+ *
+ * Stops at the end of the last segment, or at a record that was only partly
+ * written.
+ */
+void LVPlayer::scan_segments() {
+    uint32_t segment = 0;
+    uint64_t offset = sizeof(FileHeader);
+    if(!this->index.empty()) {
+        segment = this->index.back().segment;
+        offset = this->index.back().offset + padded(this->index.back().size);
+    }
+
+    for(; segment < this->segments.size(); segment++, offset = sizeof(FileHeader)) {
+        const Segment& current = this->segments[segment];
+        while(offset + sizeof(RecordHeader) <= current.size) {
+            RecordHeader record;
+            std::memcpy(&record, current.data + offset, sizeof(record));
+            if(record.magic != RECORD_MAGIC || offset + sizeof(record) + record.size > current.size) return;
+
+            IndexEntry entry = { record.timestamp_us, offset + sizeof(record), segment, record.size };
+            this->index.push_back(entry);
+            offset += sizeof(record) + padded(record.size);
+        }
+    }
+}
+
+} /* namespace PTP */
@@ -0,0 +1,101 @@
+#ifndef LIBPTP_PP_LVRECORDING_H_
+#define LIBPTP_PP_LVRECORDING_H_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace PTP {
+
+    class LVData;
+
+    // On-disk layout, in host byte order.  Every segment and the index start
+    // with a FileHeader; segments then hold records, each a RecordHeader and
+    // the payload, padded to 8 bytes.  The index is an IndexEntry per record.
+    namespace LVRecordingFormat {
+        static const uint32_t SEGMENT_MAGIC = 0x5356494c;   // "LIVS"
+        static const uint32_t INDEX_MAGIC = 0x5856494c;     // "LIVX"
+        static const uint32_t RECORD_MAGIC = 0x4656494c;    // "LIVF"
+        static const uint32_t VERSION = 1;
+
+        struct FileHeader {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t segment;       // This segment's number; 0 in the index
+            uint32_t reserved;
+        };
+
+        struct RecordHeader {
+            uint32_t magic;
+            uint32_t size;          // Of the payload, without padding
+            uint64_t timestamp_us;
+        };
+
+        struct IndexEntry {
+            uint64_t timestamp_us;
+            uint64_t offset;        // Of the payload, from the start of the segment
+            uint32_t segment;
+            uint32_t size;
+        };
+    }
+
+    class LVRecorder {
+        public:
+            static const uint64_t DEFAULT_SEGMENT_BYTES = 256 * 1024 * 1024;
+
+            LVRecorder(const std::string path, const uint64_t segment_bytes=DEFAULT_SEGMENT_BYTES);
+            ~LVRecorder();
+            void append(const LVData& frame, const uint64_t timestamp_us=0);
+            void flush();
+            void close();
+            int get_frame_count() const;
+            uint64_t get_bytes_written() const;
+
+        private:
+            std::string path;
+            uint64_t segment_bytes;
+            FILE * segment_file;
+            FILE * index_file;
+            uint32_t segment;           // Number of the segment being written
+            uint64_t segment_offset;    // Bytes in it so far
+            int frames;
+            uint64_t bytes_written;
+
+            LVRecorder(const LVRecorder&);  // Owns open files, so it can't be copied
+            LVRecorder& operator=(const LVRecorder&);
+
+            void open_segment(const uint32_t segment);
+    };
+
+    class LVPlayer {
+        public:
+            LVPlayer(const std::string path);
+            ~LVPlayer();
+            int get_frame_count() const;
+            uint64_t get_timestamp(const int index) const;
+            uint64_t get_duration_us() const;
+            int seek(const uint64_t timestamp_us) const;
+            void get_frame(const int index, LVData& out) const;
+            void prefetch(const int first, const int count) const;
+
+        private:
+            struct Segment {
+                const uint8_t * data;   // Mapped read only, or NULL if empty
+                uint64_t size;
+            };
+
+            std::vector<Segment> segments;
+            std::vector<LVRecordingFormat::IndexEntry> index;
+
+            LVPlayer(const LVPlayer&);      // Owns mappings, so it can't be copied
+            LVPlayer& operator=(const LVPlayer&);
+
+            void unmap();
+            void load_index(const std::string index_path);
+            void scan_segments();
+    };
+
+}
+
+#endif /* LIBPTP_PP_LVRECORDING_H_ */
@@ -0,0 +1,523 @@
+/**
+ * @file LVSharedRing.cpp
+ *
+ * @brief Shares live view frames with other processes through shared memory
+ *
+ * One process talks to the camera; recorders, viewers and analysis in other
+ * processes want its frames.  Sending every frame to each of them over a
+ * socket costs a copy per consumer, and a consumer that falls behind backs
+ * the sender up.  An \c LVPublisher instead writes each frame, raw or
+ * converted, into a ring of slots in a memfd, and \c LVSubscriber s map the
+ * same memory and read frames where they lie.
+ *
+ * Each slot has a sequence number that is odd while the publisher is writing
+ * it, like a seqlock.  The publisher never waits for anyone: it just writes
+ * the next slot.  A subscriber notes the sequence when it picks up a frame,
+ * and checks it hasn't changed once it's done (\c LVSubscriber::validate); if
+ * it has, the publisher lapped it, and what it read may be torn.  With N
+ * slots, a subscriber has N - 1 frame times to finish with a frame.
+ *
+ * The memfd has no name in the filesystem, so subscribers get its file
+ * descriptor from the publisher over a Unix socket (\c LVPublisher::listen),
+ * or from \c LVPublisher::get_fd by any other means, such as inheriting it.
+ * It's sealed with F_SEAL_FUTURE_WRITE (Linux 5.1 and later), so they can only
+ * map it to read.
+ */
+
+#include <cstring>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "libptp++.hpp"
+#include "LVSharedRing.hpp"
+#include "LVData.hpp"
+
+namespace PTP {
+
+using namespace LVSharedRingFormat;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "Shared memory atomics must not need a lock");
+
+/**
+ * @brief Round \a size up to a whole number of cache lines
+ */
+static size_t cache_align(const size_t size) {
+    return (size + 63) & ~(size_t)63;
+}
+
+/**
+ * @brief Find the data of \a slot, which starts on the cache line after its header
+ */
+static uint8_t * slot_data(SlotHeader * slot) {
+    return (uint8_t *)slot + cache_align(sizeof(SlotHeader));
+}
+
+/**
+ * @brief Create a ring of \a slots slots, each with room for \a slot_bytes of frame data
+ *
+ * @param[in] slots      The number of slots; at least 2
+ * @param[in] slot_bytes The size of the largest frame that can be published
+ * @exception ERR_LVSHARED_CANNOT_CREATE If the shared memory can't be created, or \a slots is less than 2.
+ */
+LVPublisher::LVPublisher(const int slots, const uint32_t slot_bytes) {
+    this->fd = -1;
+    this->memory = NULL;
+    this->memory_size = 0;
+    this->header = NULL;
+    this->frames = 0;
+
+    if(slots < 2 || slot_bytes == 0) {
+        throw ERR_LVSHARED_CANNOT_CREATE;
+    }
+
+    const size_t slot_stride = cache_align(sizeof(SlotHeader)) + cache_align(slot_bytes);
+    this->memory_size = cache_align(sizeof(RingHeader)) + slots * slot_stride;
+
+    this->fd = memfd_create("libptp++ live view", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(this->fd < 0) {
+        throw ERR_LVSHARED_CANNOT_CREATE;
+    }
+
+    void * memory = MAP_FAILED;
+    if(ftruncate(this->fd, this->memory_size) == 0) {
+        memory = mmap(NULL, this->memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+    }
+    if(memory == MAP_FAILED) {
+        close(this->fd);
+        throw ERR_LVSHARED_CANNOT_CREATE;
+    }
+    this->memory = (uint8_t *)memory;
+
+    // Subscribers map the whole ring; it mustn't shrink under them.  Only our
+    // mapping, made before the seal, may write: subscribers get the same fd,
+    // and a stray write from one of them would corrupt the ring for the rest.
+    if(fcntl(this->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) != 0) {
+        munmap(this->memory, this->memory_size);
+        close(this->fd);
+        throw ERR_LVSHARED_CANNOT_CREATE;
+    }
+
+    this->header = new(this->memory) RingHeader();
+    this->header->magic = MAGIC;
+    this->header->version = VERSION;
+    this->header->slots = slots;
+    this->header->slot_bytes = slot_bytes;
+    this->header->slot_stride = slot_stride;
+    this->header->latest.store(0);
+
+    int i;
+    for(i = 0; i < slots; i++) {
+        SlotHeader * slot = new(this->memory + cache_align(sizeof(RingHeader)) + i * slot_stride) SlotHeader();
+        slot->sequence.store(0);
+        slot->frame = 0;
+    }
+}
+
+/**
+ * @brief Stops listening, and unmaps the ring
+ *
+ * Subscribers keep their own mappings, which stay valid; they just get no
+ * more frames.
+ */
+LVPublisher::~LVPublisher() {
+    this->stop_listening();
+    munmap(this->memory, this->memory_size);
+    close(this->fd);
+}
+
+/**
+ * @brief Publish \a frame as the camera sent it
+ *
+ * The payload is copied into the ring once, and subscribers read it from
+ * there with \c LVData::view.
+ *
+ * @param[in] frame The frame to publish
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If \a frame is empty.
+ * @exception ERR_LVSHARED_TOO_BIG If \a frame doesn't fit in a slot.
+ */
+void LVPublisher::publish(const LVData& frame) {
+    if(frame.payload == NULL || frame.payload_size == 0) {
+        throw ERR_LVDATA_NOT_ENOUGH_DATA;
+    }
+
+    if(frame.payload_size > this->header->slot_bytes) {
+        throw ERR_LVSHARED_TOO_BIG;
+    }
+
+    SlotHeader * slot = this->begin_slot();
+    std::memcpy(slot_data(slot), frame.payload, frame.payload_size);
+    slot->format = RAW_PAYLOAD;
+    slot->size = frame.payload_size;
+    slot->width = 0;
+    slot->height = 0;
+    slot->stride = 0;
+    this->end_slot(slot);
+}
+
+/**
+ * @brief Publish \a frame converted to \a format
+ *
+ * The conversion writes straight into the ring, so there's no copy at all.
+ * Rows start every multiple of 4 bytes.
+ *
+ * @param[in] frame   The frame to publish
+ * @param[in] format  The format to convert it to
+ * @param[in] options Options for \c LVData::convert
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If \a frame has no viewport.
+ * @exception ERR_LVSHARED_TOO_BIG If the image doesn't fit in a slot.
+ */
+void LVPublisher::publish(const LVData& frame, const LVData::PIXEL_FORMAT format, const LVData::ConvertOptions& options) {
+    int width, height;
+    frame.get_output_size(&width, &height, options);
+    const int stride = (width * LVData::get_bytes_per_pixel(format) + 3) & ~3;
+    const int size = frame.get_buffer_size(format, stride, options);
+
+    if((uint32_t)size > this->header->slot_bytes) {
+        throw ERR_LVSHARED_TOO_BIG;
+    }
+
+    SlotHeader * slot = this->begin_slot();
+    try {
+        frame.convert(format, slot_data(slot), stride, options);
+    } catch(LIBPTP_PP_ERRORS e) {
+        slot->frame = 0;    // Leave the slot even, so it isn't stuck, but match no frame
+        slot->sequence.fetch_add(1, std::memory_order_release);
+        throw;
+    }
+    slot->format = format;
+    slot->size = size;
+    slot->width = width;
+    slot->height = height;
+    slot->stride = stride;
+    this->end_slot(slot);
+}
+
+/**
+ * @brief Hand the ring to anyone who connects to the Unix socket at \a path
+ *
+ * A background thread accepts connections, sends each the ring's file
+ * descriptor, and hangs up; see \c LVSubscriber::LVSubscriber(const std::string).
+ * Anything already at \a path is replaced.
+ *
+ * @param[in] path Where to create the socket
+ * @exception ERR_LVSHARED_CANNOT_CONNECT If the socket can't be created.
+ */
+void LVPublisher::listen(const std::string path) {
+    if(!this->server.listen(path, 8, [this](int connection) { this->serve(connection); })) {
+        throw ERR_LVSHARED_CANNOT_CONNECT;
+    }
+}
+
+/**
+ * @brief Stop handing out the ring, and remove the socket
+ *
+ * Subscribers that already have it are unaffected.  Does nothing if not listening.
+ */
+void LVPublisher::stop_listening() {
+    this->server.stop();
+}
+
+/**
+ * @brief Retrieve the ring's file descriptor, to share it some other way
+ *
+ * @return A memfd; \c LVSubscriber::LVSubscriber(const int) maps it
+ */
+int LVPublisher::get_fd() const {
+    return this->fd;
+}
+
+/**
+ * @brief Retrieve the number of frames published
+ */
+uint64_t LVPublisher::get_frame_count() const {
+    return this->frames;
+}
+
+/**
+ * @brief Mark the slot for the next frame as being written
+ *
+ * @return The slot, with its sequence made odd
+ */
+SlotHeader * LVPublisher::begin_slot() {
+    const uint64_t number = this->frames + 1;
+    SlotHeader * slot = (SlotHeader *)(this->memory + cache_align(sizeof(RingHeader)) +
+                                       (number % this->header->slots) * this->header->slot_stride);
+
+    slot->sequence.store(slot->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);     // Odd before any of the new data
+
+    return slot;
+}
+
+/**
+ * @brief Mark \a slot as holding the next frame, and announce it
+ */
+void LVPublisher::end_slot(SlotHeader * slot) {
+    const uint64_t number = this->frames + 1;
+
+    slot->frame = number;
+    slot->timestamp_us = monotonic_us();
+
+    slot->sequence.store(slot->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    this->header->latest.store(number, std::memory_order_release);
+    this->frames = number;
+}
+
+/**
+ * @brief Send the ring's descriptor to \a connection, and hang up
+ */
+void LVPublisher::serve(const int connection) {
+    char byte = 0;
+    struct iovec data = { &byte, 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    std::memset(control, 0, sizeof(control));
+
+    struct msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    struct cmsghdr * c = CMSG_FIRSTHDR(&message);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(c), &this->fd, sizeof(int));
+
+    sendmsg(connection, &message, MSG_NOSIGNAL);
+    close(connection);
+}
+
+/**
+ * @brief Map the ring published on the Unix socket at \a path
+ *
+ * @param[in] path The socket an \c LVPublisher is listening on
+ * @exception ERR_LVSHARED_CANNOT_CONNECT If there's no publisher there.
+ * @exception ERR_LVSHARED_INVALID If what it sent isn't a ring.
+ * @see LVPublisher::listen
+ */
+LVSubscriber::LVSubscriber(const std::string path) {
+    this->memory = NULL;
+    this->memory_size = 0;
+    this->header = NULL;
+    this->last_frame = 0;
+    this->dropped = 0;
+
+    struct sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path)) {
+        throw ERR_LVSHARED_CANNOT_CONNECT;
+    }
+    std::strcpy(address.sun_path, path.c_str());
+
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0) {
+        throw ERR_LVSHARED_CANNOT_CONNECT;
+    }
+    if(connect(s, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(s);
+        throw ERR_LVSHARED_CANNOT_CONNECT;
+    }
+
+    char byte;
+    struct iovec data = { &byte, 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    int fd = -1;
+    if(recvmsg(s, &message, MSG_CMSG_CLOEXEC) > 0) {
+        struct cmsghdr * c = CMSG_FIRSTHDR(&message);
+        if(c != NULL && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            std::memcpy(&fd, CMSG_DATA(c), sizeof(int));
+        }
+    }
+    close(s);
+
+    if(fd < 0) {
+        throw ERR_LVSHARED_CANNOT_CONNECT;
+    }
+
+    try {
+        this->map(fd);
+    } catch(LIBPTP_PP_ERRORS e) {
+        close(fd);
+        throw;
+    }
+    close(fd);      // The mapping stays
+}
+
+/**
+ * @brief Map the ring whose file descriptor is \a fd
+ *
+ * @param[in] fd From \c LVPublisher::get_fd, by whatever means; it's left open
+ * @exception ERR_LVSHARED_INVALID If \a fd isn't a ring.
+ */
+LVSubscriber::LVSubscriber(const int fd) {
+    this->memory = NULL;
+    this->memory_size = 0;
+    this->header = NULL;
+    this->last_frame = 0;
+    this->dropped = 0;
+
+    this->map(fd);
+}
+
+/**
+ * @brief Unmaps the ring
+ *
+ * @warning Frames acquired from it can't be used after this.
+ */
+LVSubscriber::~LVSubscriber() {
+    if(this->memory != NULL) {
+        munmap((void *)this->memory, this->memory_size);
+    }
+}
+
+/**
+ * @brief Pick up the newest frame
+ *
+ * For viewers, which only ever want the latest.  Frames are read in place:
+ * call \c LVSubscriber::validate when done with the data, and throw away
+ * whatever came of it if that fails.
+ *
+ * @param[out] out The frame
+ * @return False if nothing has been published yet
+ */
+bool LVSubscriber::acquire_latest(Frame * out) {
+    int tries;
+    for(tries = 0; tries < 3; tries++) {
+        uint64_t latest = this->header->latest.load(std::memory_order_acquire);
+        if(latest == 0) return false;
+
+        if(this->read_slot(latest, out)) {  // Only fails if the publisher lapped us meanwhile
+            if(latest > this->last_frame) this->last_frame = latest;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Pick up the frame after the last one acquired
+ *
+ * For consumers that want every frame, such as recorders.  Frames that were
+ * overwritten before they could be picked up are skipped, and counted (see
+ * \c LVSubscriber::get_dropped).  The first call returns the newest frame.
+ *
+ * @param[out] out The frame; call \c LVSubscriber::validate when done with it
+ * @return False if there's no frame newer than the last one acquired
+ */
+bool LVSubscriber::acquire_next(Frame * out) {
+    if(this->last_frame == 0) {
+        return this->acquire_latest(out);
+    }
+
+    for(;;) {
+        uint64_t latest = this->header->latest.load(std::memory_order_acquire);
+        if(latest <= this->last_frame) return false;
+
+        uint64_t next = this->last_frame + 1;
+        uint64_t oldest = (latest >= this->header->slots) ? latest - this->header->slots + 1 : 1;
+        if(next < oldest) {
+            this->dropped += oldest - next;
+            next = oldest;
+        }
+
+        this->last_frame = next;
+        if(this->read_slot(next, out)) return true;
+        this->dropped++;    // Overwritten while we looked
+    }
+}
+
+/**
+ * @brief Determine whether \a frame is still intact
+ *
+ * @param[in] frame A frame from \c LVSubscriber::acquire_latest or \c LVSubscriber::acquire_next
+ * @return True if the publisher hasn't started overwriting it; whatever was read from it before this call is good
+ */
+bool LVSubscriber::validate(const Frame& frame) const {
+    std::atomic_thread_fence(std::memory_order_acquire);     // Everything read from the frame, before the check
+    return frame.slot->sequence.load(std::memory_order_relaxed) == frame.sequence;
+}
+
+/**
+ * @brief Retrieve the number of frames \c LVSubscriber::acquire_next missed
+ */
+uint64_t LVSubscriber::get_dropped() const {
+    return this->dropped;
+}
+
+/**
+ * @brief Map the ring behind \a fd, and check it is one
+ */
+void LVSubscriber::map(const int fd) {
+    struct stat info;
+    if(fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(RingHeader)) {
+        throw ERR_LVSHARED_INVALID;
+    }
+
+    void * memory = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(memory == MAP_FAILED) {
+        throw ERR_LVSHARED_INVALID;
+    }
+    this->memory = (const uint8_t *)memory;
+    this->memory_size = info.st_size;
+    this->header = (const RingHeader *)memory;
+
+    const RingHeader * h = this->header;
+    if(h->magic != MAGIC || h->version != VERSION || h->slots < 2 ||
+        h->slot_stride < cache_align(sizeof(SlotHeader)) + h->slot_bytes ||
+        cache_align(sizeof(RingHeader)) + h->slots * h->slot_stride > this->memory_size) {
+        munmap(memory, this->memory_size);
+        this->memory = NULL;
+        throw ERR_LVSHARED_INVALID;
+    }
+}
+
+/**
+ * @brief Describe frame number \a number, if its slot still holds it
+ *
+ * @return False if the slot is being written, or already holds another frame
+ */
+bool LVSubscriber::read_slot(const uint64_t number, Frame * out) const {
+    const SlotHeader * slot = (const SlotHeader *)(this->memory + cache_align(sizeof(RingHeader)) +
+                                                   (number % this->header->slots) * this->header->slot_stride);
+
+    uint32_t sequence = slot->sequence.load(std::memory_order_acquire);
+    if(sequence & 1) return false;
+
+    out->data = (const uint8_t *)slot + cache_align(sizeof(SlotHeader));
+    out->size = slot->size;
+    out->format = slot->format;
+    out->width = slot->width;
+    out->height = slot->height;
+    out->stride = slot->stride;
+    out->number = slot->frame;
+    out->timestamp_us = slot->timestamp_us;
+    out->slot = slot;
+    out->sequence = sequence;
+
+    // The header fields are only good if the slot wasn't rewritten while we read them
+    if(!this->validate(*out) || out->number != number || out->size > this->header->slot_bytes) {
+        return false;
+    }
+
+    return true;
+}
+
+} /* namespace PTP */
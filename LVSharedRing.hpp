@@ -0,0 +1,106 @@
+#ifndef LIBPTP_PP_LVSHAREDRING_H_
+#define LIBPTP_PP_LVSHAREDRING_H_
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+#include "LVData.hpp"
+#include "Util.hpp"
+
+namespace PTP {
+
+    // Layout of the shared memory: a RingHeader, then the slots, each a
+    // SlotHeader followed by slot_bytes of frame data.  Slots start on cache
+    // lines, so the producer's writes to one don't disturb readers of another.
+    namespace LVSharedRingFormat {
+        static const uint32_t MAGIC = 0x5256494c;   // "LIVR"
+        static const uint32_t VERSION = 1;
+        static const int32_t RAW_PAYLOAD = -1;      // SlotHeader::format of unconverted GetDisplayData payloads
+
+        struct RingHeader {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t slots;
+            uint32_t slot_bytes;            // Room for data in each slot
+            uint64_t slot_stride;           // From the start of one slot header to the next
+            std::atomic<uint64_t> latest;   // Number of the newest complete frame; 0 before the first
+        };
+
+        struct SlotHeader {
+            std::atomic<uint32_t> sequence; // Odd while the slot is being written
+            int32_t format;                 // An LVData::PIXEL_FORMAT, or RAW_PAYLOAD
+            uint32_t size;                  // Bytes of data
+            uint32_t width, height, stride; // Of converted images; 0 for payloads
+            uint64_t frame;                 // Frame number, from 1
+            uint64_t timestamp_us;          // CLOCK_MONOTONIC, so comparable between processes
+        };
+    }
+
+    class LVPublisher {
+        public:
+            static const uint32_t DEFAULT_SLOT_BYTES = 1024 * 1024;
+
+            LVPublisher(const int slots=4, const uint32_t slot_bytes=DEFAULT_SLOT_BYTES);
+            ~LVPublisher();
+            void publish(const LVData& frame);
+            void publish(const LVData& frame, const LVData::PIXEL_FORMAT format, const LVData::ConvertOptions& options=LVData::ConvertOptions());
+            void listen(const std::string path);
+            void stop_listening();
+            int get_fd() const;
+            uint64_t get_frame_count() const;
+
+        private:
+            int fd;
+            uint8_t * memory;
+            size_t memory_size;
+            LVSharedRingFormat::RingHeader * header;
+            uint64_t frames;
+
+            UnixServer server;
+
+            LVPublisher(const LVPublisher&);    // Owns the ring, so it can't be copied
+            LVPublisher& operator=(const LVPublisher&);
+
+            LVSharedRingFormat::SlotHeader * begin_slot();
+            void end_slot(LVSharedRingFormat::SlotHeader * slot);
+            void serve(const int connection);
+    };
+
+    class LVSubscriber {
+        public:
+            struct Frame {
+                const uint8_t * data;       // In the shared memory; check LVSubscriber::validate after using it
+                uint32_t size;
+                int32_t format;             // An LVData::PIXEL_FORMAT, or LVSharedRingFormat::RAW_PAYLOAD
+                uint32_t width, height, stride;
+                uint64_t number;
+                uint64_t timestamp_us;
+                const LVSharedRingFormat::SlotHeader * slot;
+                uint32_t sequence;          // The slot's sequence when the frame was acquired
+            };
+
+            LVSubscriber(const std::string path);
+            LVSubscriber(const int fd);
+            ~LVSubscriber();
+            bool acquire_latest(Frame * out);
+            bool acquire_next(Frame * out);
+            bool validate(const Frame& frame) const;
+            uint64_t get_dropped() const;
+
+        private:
+            const uint8_t * memory;
+            size_t memory_size;
+            const LVSharedRingFormat::RingHeader * header;
+            uint64_t last_frame;            // Number of the last frame acquired
+            uint64_t dropped;               // Frames acquire_next skipped because they were overwritten
+
+            LVSubscriber(const LVSubscriber&);  // Owns a mapping, so it can't be copied
+            LVSubscriber& operator=(const LVSubscriber&);
+
+            void map(const int fd);
+            bool read_slot(const uint64_t number, Frame * out) const;
+    };
+
+}
+
+#endif /* LIBPTP_PP_LVSHAREDRING_H_ */
@@ -0,0 +1,484 @@
+/**
+ * @file LVStream.cpp
+ *
+ * @brief Continuous live view fetching on a background thread
+ *
+ * An \c LVStream repeatedly calls \c CHDKCamera::get_live_view_data on its own
+ * thread, placing each frame into one of a fixed number of preallocated
+ * \c LVData slots.  The caller picks frames up with \c LVStream::acquire_next
+ * or \c LVStream::acquire_latest, and hands them back with \c LVStream::release.
+ * While the caller converts or displays one frame, the USB transfer of the next
+ * one is already under way.
+ *
+ * Slots move between states with atomic compare-and-swap operations only, so
+ * neither side ever blocks on a lock held by the other.
+ */
+
+#include <unistd.h>
+#include <stdint.h>
+
+#include "libptp++.hpp"
+#include "LVStream.hpp"
+#include "CHDKCamera.hpp"
+#include "LVData.hpp"
+#include "LVGovernor.hpp"
+#include "Tracer.hpp"
+#include "Util.hpp"
+
+namespace PTP {
+
+/**
+ * @brief Create a stream of live view data from \a camera
+ *
+ * The stream is idle until \c LVStream::start is called.
+ *
+ * @warning While the stream is running, the background thread is the only
+ *          thing that may talk to \a camera.
+ *
+ * @param[in] camera The camera to fetch live view data from
+ * @param[in] slots  The number of frames the ring can hold (at least 2)
+ * @param[in] policy What to do with new frames when every slot is unread or in use
+ */
+LVStream::LVStream(CHDKCamera& camera, const int slots, const DROP_POLICY policy) : camera(camera) {
+    this->n_slots = (slots < 2) ? 2 : slots;
+    this->slots = new Slot[this->n_slots];
+    this->policy = policy;
+    this->governor = NULL;
+    this->liveview = true;
+    this->overlay = false;
+    this->palette = false;
+    this->running = false;
+    this->next_sequence = 1;
+    this->detect_duplicates = false;
+    this->last_signature = 0;
+
+    int i;
+    for(i = 0; i < this->n_slots; i++) {
+        this->slots[i].state = SLOT_FREE;
+        this->slots[i].sequence = 0;
+        this->slots[i].duplicate = false;
+        this->slots[i].acquired_ns = 0;
+    }
+
+    this->frames = 0;
+    this->dropped = 0;
+    this->skipped = 0;
+    this->errors = 0;
+    this->duplicates = 0;
+    this->fps = 0;
+    this->jitter_ms = 0;
+}
+
+/**
+ * @brief Stops the background thread, if running, and frees the ring
+ */
+LVStream::~LVStream() {
+    this->stop();
+    delete[] this->slots;
+}
+
+/**
+ * @brief Let \a governor decide when frames are fetched
+ *
+ * Instead of fetching back to back, the background thread waits for
+ * \a governor between frames, and every frame handed out by
+ * \c LVStream::acquire_next or \c LVStream::acquire_latest counts as demand.
+ * The governor also takes over fetching the overlay.  Must be called before
+ * \c LVStream::start.
+ *
+ * @param[in] governor A governor for the same camera, or NULL to fetch as fast as possible
+ * @see LVGovernor
+ */
+void LVStream::set_governor(LVGovernor * governor) {
+    if(this->running) return;
+
+    this->governor = governor;
+}
+
+/**
+ * @brief Choose whether to mark frames whose viewport is the same as the frame before
+ *
+ * Signatures are computed on the background thread as frames arrive (see
+ * \c LVData::set_signatures), so a consumer can check \c LVStream::is_duplicate
+ * and skip work on a frame it has effectively already seen.  Duplicates are
+ * counted in \c Stats::duplicates.  Must be called before \c LVStream::start.
+ *
+ * @param[in] enabled True to detect duplicate frames
+ */
+void LVStream::set_duplicate_detection(const bool enabled) {
+    if(this->running) return;
+
+    this->detect_duplicates = enabled;
+    this->last_signature = 0;
+    this->scratch.set_signatures(enabled);
+
+    int i;
+    for(i = 0; i < this->n_slots; i++) {
+        this->slots[i].data.set_signatures(enabled);
+    }
+}
+
+/**
+ * @brief Start fetching frames on the background thread
+ *
+ * The flags have the same meaning as in \c CHDKCamera::get_live_view_data,
+ * except with a governor, which fetches the viewport and decides about the
+ * overlay itself.  Does nothing if the stream is already running.
+ *
+ * @param[in] liveview True to fetch the live view frame buffer
+ * @param[in] overlay  True to fetch the overlay frame buffer
+ * @param[in] palette  True to fetch the palette for the overlay
+ * @see CHDKCamera::get_live_view_data
+ */
+void LVStream::start(const bool liveview, const bool overlay, const bool palette) {
+    if(this->running) return;
+
+    this->liveview = liveview;
+    this->overlay = overlay;
+    this->palette = palette;
+
+    this->running = true;
+    this->thread = std::thread(&LVStream::run, this);
+}
+
+/**
+ * @brief Stop fetching frames, and wait for the background thread to exit
+ *
+ * Frames already in the ring stay available to \c LVStream::acquire_next
+ * and \c LVStream::acquire_latest.
+ */
+void LVStream::stop() {
+    this->running = false;
+    if(this->governor != NULL) {
+        this->governor->wake();     // Don't wait out the time until the next frame
+    }
+    if(this->thread.joinable()) {
+        this->thread.join();
+    }
+}
+
+/**
+ * @brief Determine whether the background thread is fetching frames
+ *
+ * @return True if \c LVStream::start has been called, and \c LVStream::stop hasn't
+ */
+bool LVStream::is_running() const {
+    return this->running;
+}
+
+/**
+ * @brief Take the oldest unread frame out of the ring
+ *
+ * Frames are returned in the order they were fetched.  The frame belongs to
+ * the caller until it is passed to \c LVStream::release.
+ *
+ * @return The oldest unread frame, or NULL if there are none
+ * @see LVStream::acquire_latest
+ */
+LVData * LVStream::acquire_next() {
+    while(1) {
+        Slot * oldest = NULL;
+        uint64_t oldest_seq = 0;
+        int i;
+
+        for(i = 0; i < this->n_slots; i++) {
+            if(this->slots[i].state.load(std::memory_order_acquire) != SLOT_READY) continue;
+            uint64_t seq = this->slots[i].sequence.load(std::memory_order_relaxed);
+            if(oldest == NULL || seq < oldest_seq) {
+                oldest = &this->slots[i];
+                oldest_seq = seq;
+            }
+        }
+
+        if(oldest == NULL) return NULL;
+
+        int expected = SLOT_READY;
+        if(oldest->state.compare_exchange_strong(expected, SLOT_READING, std::memory_order_acq_rel)) {
+            // The producer may have reclaimed it under DROP_OLDEST and refilled it between our scan and our
+            //  swap, or finished an older frame in a slot we'd already passed. Either way, it isn't the
+            //  oldest; put it back and look again.
+            bool oldest_still = (oldest->sequence.load(std::memory_order_relaxed) == oldest_seq);
+            for(i = 0; i < this->n_slots && oldest_still; i++) {
+                if(this->slots[i].state.load(std::memory_order_acquire) == SLOT_READY &&
+                    this->slots[i].sequence.load(std::memory_order_relaxed) < oldest_seq) {
+                    oldest_still = false;
+                }
+            }
+            if(!oldest_still) {
+                oldest->state.store(SLOT_READY, std::memory_order_release);
+                continue;
+            }
+#ifdef LIBPTP_PP_TRACE
+            oldest->acquired_ns = Tracer::is_enabled() ? Tracer::now_ns() : 0;
+#endif
+            if(this->governor != NULL) this->governor->demand();
+            return &oldest->data;
+        }
+        // The producer reclaimed it under DROP_OLDEST between our scan and our swap. Look again.
+    }
+}
+
+/**
+ * @brief Take the newest frame out of the ring, discarding older unread frames
+ *
+ * This is the accessor for displays, which only ever care about the most
+ * recent frame.  Unread frames older than the one returned are given back to
+ * the producer and counted in \c Stats::skipped.  The frame belongs to the
+ * caller until it is passed to \c LVStream::release.
+ *
+ * @return The newest unread frame, or NULL if there are none
+ * @see LVStream::acquire_next
+ */
+LVData * LVStream::acquire_latest() {
+    Slot * newest = NULL;
+
+    while(newest == NULL) {
+        uint64_t newest_seq = 0;
+        int i;
+
+        for(i = 0; i < this->n_slots; i++) {
+            if(this->slots[i].state.load(std::memory_order_acquire) != SLOT_READY) continue;
+            uint64_t seq = this->slots[i].sequence.load(std::memory_order_relaxed);
+            if(newest == NULL || seq > newest_seq) {
+                newest = &this->slots[i];
+                newest_seq = seq;
+            }
+        }
+
+        if(newest == NULL) return NULL;
+
+        int expected = SLOT_READY;
+        if(!newest->state.compare_exchange_strong(expected, SLOT_READING, std::memory_order_acq_rel)) {
+            newest = NULL;  // Lost it to the producer; look again
+        } else if(newest->sequence.load(std::memory_order_relaxed) != newest_seq) {
+            // Lost it to the producer and got it back refilled, so there may be newer; put it back and look again
+            newest->state.store(SLOT_READY, std::memory_order_release);
+            newest = NULL;
+        }
+    }
+
+#ifdef LIBPTP_PP_TRACE
+    newest->acquired_ns = Tracer::is_enabled() ? Tracer::now_ns() : 0;
+#endif
+    
+    // Anything still waiting is older than what we just took
+    uint64_t newest_seq = newest->sequence.load(std::memory_order_relaxed);
+    int i;
+    for(i = 0; i < this->n_slots; i++) {
+        if(this->slots[i].sequence.load(std::memory_order_relaxed) >= newest_seq) continue;
+        // Hold it while checking it's still the old frame, so a newer one the producer just put there isn't thrown away
+        int expected = SLOT_READY;
+        if(this->slots[i].state.compare_exchange_strong(expected, SLOT_READING, std::memory_order_acq_rel)) {
+            if(this->slots[i].sequence.load(std::memory_order_relaxed) < newest_seq) {
+                this->slots[i].state.store(SLOT_FREE, std::memory_order_release);
+                this->skipped++;
+            } else {
+                this->slots[i].state.store(SLOT_READY, std::memory_order_release);
+            }
+        }
+    }
+
+    if(this->governor != NULL) this->governor->demand();
+    return &newest->data;
+}
+
+/**
+ * @brief Give a frame from \c LVStream::acquire_next or \c LVStream::acquire_latest back to the ring
+ *
+ * @param[in] frame The frame to give back.  Must not be used after this call.
+ */
+void LVStream::release(LVData * frame) {
+    Slot * slot = this->find_slot(frame);
+    if(slot == NULL) return;
+
+#ifdef LIBPTP_PP_TRACE
+    if(slot->acquired_ns != 0) {
+        Tracer::record("lv_hold", "lv", slot->acquired_ns, Tracer::now_ns());
+    }
+#endif
+    slot->state.store(SLOT_FREE, std::memory_order_release);
+}
+
+/**
+ * @brief Retrieve the sequence number of an acquired frame
+ *
+ * Sequence numbers start at 1 and count every frame fetched, including
+ * dropped frames, so gaps show where frames were lost.
+ *
+ * @param[in] frame A frame returned by \c LVStream::acquire_next or \c LVStream::acquire_latest
+ * @return The sequence number of \a frame, or 0 if \a frame isn't from this stream
+ */
+uint64_t LVStream::get_sequence(const LVData * frame) const {
+    Slot * slot = this->find_slot(frame);
+    if(slot == NULL) return 0;
+
+    return slot->sequence.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Determine whether an acquired frame has the same viewport as the frame fetched before it
+ *
+ * The frame before is the one fetched just before, even if it was dropped or
+ * skipped.  Always false unless \c LVStream::set_duplicate_detection is on.
+ *
+ * @param[in] frame A frame returned by \c LVStream::acquire_next or \c LVStream::acquire_latest
+ * @return True if \a frame is a duplicate
+ */
+bool LVStream::is_duplicate(const LVData * frame) const {
+    Slot * slot = this->find_slot(frame);
+    if(slot == NULL) return false;
+
+    return slot->duplicate;
+}
+
+/**
+ * @brief Retrieve the stream's frame counters and timing
+ *
+ * @return A snapshot of the counters.  Each counter is read individually, so
+ *         the values may be off from each other by a frame.
+ */
+LVStream::Stats LVStream::get_stats() const {
+    Stats out;
+    out.frames = this->frames;
+    out.dropped = this->dropped;
+    out.skipped = this->skipped;
+    out.errors = this->errors;
+    out.duplicates = this->duplicates;
+    out.fps = this->fps;
+    out.jitter_ms = this->jitter_ms;
+
+    return out;
+}
+
+/**
+ * @brief The background thread: fetch frames until stopped
+ *
+ * The frame interval is smoothed with an exponential moving average, from
+ * which \c Stats::fps is derived.  \c Stats::jitter_ms is the same kind of
+ * average of how far each interval strays from the smoothed interval.
+ */
+void LVStream::run() {
+    const double alpha = 0.1;   // Weight of the newest sample in the moving averages
+    double mean_interval = 0;
+    double jitter = 0;
+    uint64_t last_us = 0;
+
+#ifdef LIBPTP_PP_TRACE
+    Tracer::set_thread_name("lv_stream");
+#endif
+
+    while(this->running) {
+        Slot * slot = this->claim_slot_for_writing();
+        LVData& target = (slot == NULL) ? this->scratch : slot->data;
+
+        try {
+            LIBPTP_PP_TRACE_SCOPE("lv_fetch", "lv");
+            if(this->governor == NULL) {
+                this->camera.get_live_view_data(target, this->liveview, this->overlay, this->palette);
+            } else if(!this->governor->fetch(target)) {
+                if(slot != NULL) slot->state.store(SLOT_FREE, std::memory_order_release);
+                continue;   // Woken up to stop
+            }
+        } catch(LIBPTP_PP_ERRORS e) {
+            this->errors++;
+            if(slot != NULL) slot->state.store(SLOT_FREE, std::memory_order_release);
+            usleep(10 * 1000);  // Don't spin on a camera that's gone away
+            continue;
+        }
+
+        bool duplicate = false;
+        if(this->detect_duplicates) {
+            uint64_t signature = target.get_signature();
+            duplicate = (signature != 0 && signature == this->last_signature);
+            this->last_signature = signature;
+            if(duplicate) this->duplicates++;
+        }
+
+        uint64_t seq = this->next_sequence++;
+        if(slot != NULL) {
+            slot->duplicate = duplicate;
+            slot->sequence.store(seq, std::memory_order_relaxed);
+            slot->state.store(SLOT_READY, std::memory_order_release);
+        } else {
+            this->dropped++;    // DROP_NEWEST with a full ring: the frame we just read goes nowhere
+        }
+
+        this->frames++;
+
+        uint64_t t = monotonic_us();
+        if(last_us != 0) {
+            double interval = (t - last_us) / 1000.0;
+            if(mean_interval == 0) {
+                mean_interval = interval;
+            } else {
+                double deviation = interval - mean_interval;
+                if(deviation < 0) deviation = -deviation;
+                jitter += alpha * (deviation - jitter);
+                mean_interval += alpha * (interval - mean_interval);
+            }
+            this->fps = (mean_interval > 0) ? 1000.0 / mean_interval : 0;
+            this->jitter_ms = jitter;
+        }
+        last_us = t;
+    }
+}
+
+/**
+ * @brief Find a slot for the producer to write the next frame into
+ *
+ * Prefers a free slot.  If there are none, \c DROP_OLDEST reclaims the oldest
+ * unread frame, while \c DROP_NEWEST gives up so the next frame is dropped.
+ *
+ * @return A slot in the \c SLOT_WRITING state, or NULL if the next frame should be dropped
+ */
+LVStream::Slot * LVStream::claim_slot_for_writing() {
+    int i;
+
+    for(i = 0; i < this->n_slots; i++) {
+        int expected = SLOT_FREE;
+        if(this->slots[i].state.compare_exchange_strong(expected, SLOT_WRITING, std::memory_order_acq_rel)) {
+            return &this->slots[i];
+        }
+    }
+
+    if(this->policy == DROP_NEWEST) return NULL;
+
+    while(1) {
+        Slot * oldest = NULL;
+        uint64_t oldest_seq = 0;
+
+        for(i = 0; i < this->n_slots; i++) {
+            if(this->slots[i].state.load(std::memory_order_acquire) != SLOT_READY) continue;
+            uint64_t seq = this->slots[i].sequence.load(std::memory_order_relaxed);
+            if(oldest == NULL || seq < oldest_seq) {
+                oldest = &this->slots[i];
+                oldest_seq = seq;
+            }
+        }
+
+        if(oldest == NULL) return NULL;     // Every slot is held by the consumer
+
+        int expected = SLOT_READY;
+        if(oldest->state.compare_exchange_strong(expected, SLOT_WRITING, std::memory_order_acq_rel)) {
+            this->dropped++;
+            return oldest;
+        }
+    }
+}
+
+/**
+ * @brief Find the slot holding \a frame
+ *
+ * @param[in] frame A frame handed out by this stream
+ * @return The slot containing \a frame, or NULL if it isn't one of ours
+ */
+LVStream::Slot * LVStream::find_slot(const LVData * frame) const {
+    int i;
+    for(i = 0; i < this->n_slots; i++) {
+        if(&this->slots[i].data == frame) return &this->slots[i];
+    }
+
+    return NULL;
+}
+
+} /* namespace PTP */
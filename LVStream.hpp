@@ -0,0 +1,84 @@
+#ifndef LIBPTP_PP_LVSTREAM_H_
+#define LIBPTP_PP_LVSTREAM_H_
+
+#include <atomic>
+#include <thread>
+#include <stdint.h>
+#include "LVData.hpp"
+
+namespace PTP {
+
+    class CHDKCamera;
+    class LVGovernor;
+
+    class LVStream {
+        public:
+            enum DROP_POLICY {
+                DROP_OLDEST,    // When the ring is full, overwrite the oldest unread frame
+                DROP_NEWEST     // When the ring is full, discard the frame just fetched
+            };
+
+            struct Stats {
+                uint64_t frames;        // Frames fetched successfully
+                uint64_t dropped;       // Frames lost because the ring was full
+                uint64_t skipped;       // Unread frames discarded by acquire_latest
+                uint64_t errors;        // Failed fetches
+                uint64_t duplicates;    // Frames with the same viewport as the frame before
+                double fps;             // Smoothed fetch rate
+                double jitter_ms;       // Smoothed deviation of the frame interval from its mean
+            };
+
+            LVStream(CHDKCamera& camera, const int slots=4, const DROP_POLICY policy=DROP_OLDEST);
+            ~LVStream();
+            void set_governor(LVGovernor * governor);
+            void set_duplicate_detection(const bool enabled);
+            void start(const bool liveview=true, const bool overlay=false, const bool palette=false);
+            void stop();
+            bool is_running() const;
+            LVData * acquire_next();
+            LVData * acquire_latest();
+            void release(LVData * frame);
+            uint64_t get_sequence(const LVData * frame) const;
+            bool is_duplicate(const LVData * frame) const;
+            Stats get_stats() const;
+
+        private:
+            enum SLOT_STATE {
+                SLOT_FREE,
+                SLOT_WRITING,
+                SLOT_READY,
+                SLOT_READING
+            };
+
+            struct Slot {
+                LVData data;
+                std::atomic<int> state;
+                std::atomic<uint64_t> sequence;
+                bool duplicate;         // Written before the slot becomes ready, so no atomic needed
+                uint64_t acquired_ns;   // When the caller took it, if tracing; see Tracer
+            };
+
+            CHDKCamera& camera;
+            LVGovernor * governor;      // Decides when to fetch, and what; NULL to fetch flat out
+            Slot * slots;
+            LVData scratch;             // Fetch target for frames dropped under DROP_NEWEST
+            int n_slots;
+            DROP_POLICY policy;
+            bool liveview, overlay, palette;
+            std::thread thread;
+            std::atomic<bool> running;
+            uint64_t next_sequence;
+            bool detect_duplicates;
+            uint64_t last_signature;    // Of the last frame fetched, whichever slot it went to
+
+            std::atomic<uint64_t> frames, dropped, skipped, errors, duplicates;
+            std::atomic<double> fps, jitter_ms;
+
+            void run();
+            Slot * claim_slot_for_writing();
+            Slot * find_slot(const LVData * frame) const;
+    };
+
+}
+
+#endif /* LIBPTP_PP_LVSTREAM_H_ */
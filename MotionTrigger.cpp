@@ -0,0 +1,454 @@
+/**
+ * @file MotionTrigger.cpp
+ *
+ * @brief Shoots when something moves in front of the camera
+ *
+ * A \c MotionTrigger shrinks each live view frame to a small gray image (see
+ * \c ConvertOptions::scale), compares it with the one before, and if enough of
+ * the watched area has changed, runs a Lua command, such as \c shoot(), on
+ * the camera.  The command lives in a script that is started once, by
+ * \c MotionTrigger::arm, and waits for messages; a trigger is just a short
+ * message to it, so nothing has to be compiled on the camera while the
+ * moment passes.  Everything between a frame arriving and the message going
+ * out happens on one thread, with no RGB image, to keep the time from motion
+ * to shutter short.  How short is measured, and reported in
+ * \c MotionTrigger::Stats.
+ *
+ * Shrinking averages away most sensor noise, so a pixel only counts as
+ * changed when its brightness moves by more than the level, and the frame
+ * only counts as motion when the changed pixels cover enough of the area.
+ * A mask limits both to the parts of the scene that matter.
+ */
+
+#include <cstring>
+#include <sstream>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "libptp++.hpp"
+#include "MotionTrigger.hpp"
+#include "CHDKCamera.hpp"
+#include "LVConverter.hpp"
+#include "Util.hpp"
+
+namespace PTP {
+
+static const std::string trigger_message("shoot");  // Built once, so triggering doesn't build a string
+
+/**
+ * @brief Set up motion detection on \a camera
+ *
+ * Defaults to shooting with \c shoot() when 1% of the image changes by more
+ * than 24 levels, on frames shrunk by 4, with 2 seconds between shots.
+ *
+ * @param[in] camera The camera to send commands to, and fetch frames from in \c MotionTrigger::start
+ */
+MotionTrigger::MotionTrigger(CHDKCamera& camera) : camera(camera) {
+    this->command = "shoot()";
+    this->level = 24;
+    this->area = 0.01;
+    this->scale = 4;
+    this->skip = false;
+    this->cooldown_ms = 2000;
+    this->mask_width = 0;
+    this->mask_height = 0;
+    this->grid_width = 0;
+    this->grid_height = 0;
+    this->watched = 0;
+    this->have_previous = false;
+    this->last_trigger_us = 0;
+    this->armed = false;
+    this->script_id = 0;
+    this->detect_ms_total = 0;
+    this->trigger_ms_total = 0;
+    this->running = false;
+
+    std::memset(&this->stats, 0, sizeof(Stats));
+}
+
+/**
+ * @brief Stops the background thread, if running, and the script, if armed
+ */
+MotionTrigger::~MotionTrigger() {
+    this->stop();
+    this->disarm();
+}
+
+/**
+ * @brief Set the Lua the camera runs when motion is detected
+ *
+ * If the script is already armed with a different command, it's started again
+ * with this one at the next trigger; call \c MotionTrigger::arm to do that
+ * beforehand.
+ *
+ * @param[in] command A Lua script, \c shoot() by default
+ */
+void MotionTrigger::set_command(const std::string command) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->command = command;
+}
+
+/**
+ * @brief Set how much change counts as motion
+ *
+ * @param[in] level The largest change in brightness (0-255) that doesn't count
+ * @param[in] area  The share of the watched pixels, from 0 to 1, that must change
+ */
+void MotionTrigger::set_threshold(const int level, const double area) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->level = (level < 0) ? 0 : ((level > 255) ? 255 : level);
+    this->area = area;
+}
+
+/**
+ * @brief Set how much frames are shrunk before they're compared
+ *
+ * Smaller frames are quicker to compare and less noisy, but miss smaller
+ * movements.
+ *
+ * @param[in] scale 1, 2, 4 or 8, as \c ConvertOptions::scale
+ * @param[in] skip  If true, skips two pixels of every four (required on some cameras)
+ * @exception ERR_LVDATA_INVALID_SCALE If \a scale isn't 1, 2, 4 or 8.
+ */
+void MotionTrigger::set_scale(const int scale, const bool skip) {
+    if(scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+        throw ERR_LVDATA_INVALID_SCALE;
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->scale = scale;
+    this->skip = skip;
+}
+
+/**
+ * @brief Only watch part of the scene
+ *
+ * The mask is stretched over the whole frame, so it can be any size; a
+ * mask the size of the shrunk frames is used as it is.
+ *
+ * @param[in] mask   \a width x \a height bytes, non-zero where motion counts; NULL to watch everything
+ * @param[in] width  The width of \a mask
+ * @param[in] height The height of \a mask
+ */
+void MotionTrigger::set_mask(const uint8_t * mask, const int width, const int height) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if(mask == NULL || width <= 0 || height <= 0) {
+        this->mask.clear();
+        this->mask_width = 0;
+        this->mask_height = 0;
+    } else {
+        this->mask.assign(mask, mask + width * height);
+        this->mask_width = width;
+        this->mask_height = height;
+    }
+
+    this->grid_width = 0;   // Stretch it again on the next frame
+    this->grid_height = 0;
+}
+
+/**
+ * @brief Set the time after each command during which no more are sent
+ *
+ * Shooting takes a while, and the screen changes when it does, which looks
+ * like motion.
+ *
+ * @param[in] cooldown_ms The time, in milliseconds
+ */
+void MotionTrigger::set_cooldown(const int cooldown_ms) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->cooldown_ms = cooldown_ms;
+}
+
+/**
+ * @brief Start the script that runs the command on the camera
+ *
+ * The script waits for messages and runs the command for each trigger, so
+ * the camera has nothing to compile when motion is seen.  \c MotionTrigger::process
+ * arms it if it isn't already, but that costs the first trigger the time it
+ * takes to start a script.  Any script this trigger already had running is
+ * stopped first.
+ *
+ * @warning While armed, the camera won't run any other script.
+ *
+ * @return True if the script is running
+ */
+bool MotionTrigger::arm() {
+    if(this->is_armed()) {
+        this->disarm();
+
+        // CHDK won't start a script until the last one has finished
+        int waited;
+        for(waited = 0; waited < QUIT_TIMEOUT_MS; waited += 10) {
+            Result<uint32_t> status = this->camera.try_check_script_status();
+            if(!status || !(status.value() & PTP_CHDK_SCRIPT_STATUS_RUN)) break;
+            usleep(10 * 1000);
+        }
+    }
+
+    std::string command, script;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        command = this->command;
+        script = this->build_script();
+    }
+
+    uint32_t script_error = PTP_CHDK_S_ERRTYPE_NONE;
+    Result<uint32_t> started = this->camera.try_execute_lua(script, &script_error);
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->armed = started && script_error == PTP_CHDK_S_ERRTYPE_NONE;
+    if(this->armed) {
+        this->script_id = started.value();
+        this->armed_command = command;
+    }
+
+    return this->armed;
+}
+
+/**
+ * @brief Stop the script started by \c MotionTrigger::arm, if it's running
+ */
+void MotionTrigger::disarm() {
+    uint32_t script_id;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if(!this->armed) return;
+        this->armed = false;
+        script_id = this->script_id;
+    }
+
+    this->camera.try_write_script_message("quit", script_id);   // Nothing more to do if it's already gone
+}
+
+/**
+ * @brief Determine whether the script is running, as far as we know
+ *
+ * @return True if \c MotionTrigger::arm started it, and it hasn't been found stopped since
+ */
+bool MotionTrigger::is_armed() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->armed;
+}
+
+/**
+ * @brief Compare \a frame with the last one, and trigger the script if there was motion
+ *
+ * For use with frames fetched elsewhere, for example by an \c LVStream.  The
+ * trigger goes to the camera from the calling thread, so that thread must be
+ * the only one talking to the camera at the time.  If the script isn't armed,
+ * or was armed with an older command, it's armed first.
+ *
+ * @warning Don't call this from more than one thread at a time.
+ *
+ * @param[in] frame      The latest frame
+ * @param[in] arrived_us When \a frame arrived, from \c MotionTrigger::now_us; 0 for now
+ * @return True if there was motion, whether or not the script was triggered
+ * @exception ERR_LVDATA_NOT_ENOUGH_DATA If \a frame has no viewport data.
+ */
+bool MotionTrigger::process(const LVData& frame, const uint64_t arrived_us) {
+    const uint64_t start = (arrived_us != 0) ? arrived_us : MotionTrigger::now_us();
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    LVData::ConvertOptions options(this->skip);
+    options.scale = this->scale;
+    int width, height;
+    frame.get_output_size(&width, &height, options);
+    if(width != this->grid_width || height != this->grid_height) {
+        this->resize_grid(width, height);
+    }
+
+    frame.convert(LVData::FORMAT_GRAY8, &this->current[0], width, options);
+    this->stats.frames++;
+
+    bool motion = false;
+    if(this->have_previous && this->watched > 0) {
+        const uint8_t * mask = this->grid_mask.empty() ? NULL : &this->grid_mask[0];
+        int changed = LVConverter::count_changed(&this->current[0], &this->previous[0], mask, width * height, this->level);
+        this->stats.changed = (double)changed / this->watched;
+        motion = (changed > 0 && this->stats.changed >= this->area);
+    }
+    this->current.swap(this->previous);
+    this->have_previous = true;
+
+    const uint64_t decided = MotionTrigger::now_us();
+    this->stats.detect_ms_last = (decided - start) / 1000.0;
+    this->detect_ms_total += this->stats.detect_ms_last;
+    this->stats.detect_ms_mean = this->detect_ms_total / this->stats.frames;
+    if(this->stats.detect_ms_last > this->stats.detect_ms_max) this->stats.detect_ms_max = this->stats.detect_ms_last;
+
+    if(!motion) return false;
+
+    this->stats.motion_frames++;
+    if(this->last_trigger_us != 0 && decided - this->last_trigger_us < (uint64_t)this->cooldown_ms * 1000) {
+        return true;
+    }
+    this->last_trigger_us = decided;
+    this->have_previous = false;    // What's on screen after the shot isn't motion
+    bool ready = this->armed && this->armed_command == this->command;
+    lock.unlock();
+
+    if(!ready) {
+        this->arm();
+    }
+
+    lock.lock();
+    const uint32_t script_id = this->script_id;
+    ready = this->armed;
+    lock.unlock();
+
+    uint32_t status = PTP_CHDK_S_MSGSTATUS_NOTRUN;
+    if(ready) {
+        Result<uint32_t> sent = this->camera.try_write_script_message(trigger_message, script_id);
+        if(sent) status = sent.value();
+    }
+    const uint64_t triggered = MotionTrigger::now_us();
+
+    lock.lock();
+    if(status != PTP_CHDK_S_MSGSTATUS_OK) {
+        if(status == PTP_CHDK_S_MSGSTATUS_NOTRUN || status == PTP_CHDK_S_MSGSTATUS_BADID) {
+            this->armed = false;    // It stopped, perhaps on an error in the command; start it again next time
+        }
+        this->stats.failed_triggers++;
+    } else {
+        this->stats.triggers++;
+        this->stats.trigger_ms_last = (triggered - start) / 1000.0;
+        this->trigger_ms_total += this->stats.trigger_ms_last;
+        this->stats.trigger_ms_mean = this->trigger_ms_total / this->stats.triggers;
+        if(this->stats.trigger_ms_last > this->stats.trigger_ms_max) this->stats.trigger_ms_max = this->stats.trigger_ms_last;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Start fetching frames and watching them on a background thread
+ *
+ * The thread arms the script, then fetches the viewport only, as fast as the
+ * camera sends it, and passes each frame to \c MotionTrigger::process the
+ * moment it arrives.  Does nothing if already running.
+ *
+ * @warning While running, the background thread is the only thing that may
+ *          talk to the camera.
+ */
+void MotionTrigger::start() {
+    if(this->running) return;
+
+    this->running = true;
+    this->thread = std::thread(&MotionTrigger::run, this);
+}
+
+/**
+ * @brief Stop the background thread, and wait for it to exit
+ */
+void MotionTrigger::stop() {
+    this->running = false;
+    if(this->thread.joinable()) {
+        this->thread.join();
+    }
+}
+
+/**
+ * @brief Determine whether the background thread is running
+ *
+ * @return True if \c MotionTrigger::start has been called, and \c MotionTrigger::stop hasn't
+ */
+bool MotionTrigger::is_running() const {
+    return this->running;
+}
+
+/**
+ * @brief Retrieve the counters and latencies
+ *
+ * @return A snapshot of the stats
+ */
+MotionTrigger::Stats MotionTrigger::get_stats() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->stats;
+}
+
+/**
+ * @brief Read the clock latencies are measured with
+ *
+ * @return The current time, in microseconds, from an arbitrary starting point
+ */
+uint64_t MotionTrigger::now_us() {
+    return monotonic_us();
+}
+
+/**
+ * @brief Build the script that waits for triggers and runs the command for each
+ *
+ * @return The Lua script
+ */
+std::string MotionTrigger::build_script() const {
+    std::ostringstream script;
+    script << "while true do\n"
+              "    local msg = read_usb_msg(100)\n"
+              "    if msg == \"" << trigger_message << "\" then\n"
+              "        " << this->command << "\n"
+              "    elseif msg == \"quit\" then\n"
+              "        break\n"
+              "    end\n"
+              "end\n";
+
+    return script.str();
+}
+
+/**
+ * @brief Set up the buffers and the mask for frames that shrink to \a width x \a height
+ *
+ * The next frame becomes the first one, with nothing to compare it to.
+ */
+void MotionTrigger::resize_grid(const int width, const int height) {
+    this->grid_width = width;
+    this->grid_height = height;
+    this->current.assign(width * height, 0);
+    this->previous.assign(width * height, 0);
+    this->have_previous = false;
+
+    this->grid_mask.clear();
+    this->watched = width * height;
+    if(this->mask.empty()) return;
+
+    // Nearest neighbour is plenty for a mask
+    this->grid_mask.resize(width * height);
+    this->watched = 0;
+    int x, y;
+    for(y = 0; y < height; y++) {
+        const uint8_t * row = &this->mask[(y * this->mask_height / height) * this->mask_width];
+        for(x = 0; x < width; x++) {
+            uint8_t m = row[x * this->mask_width / width];
+            this->grid_mask[y * width + x] = m;
+            if(m != 0) this->watched++;
+        }
+    }
+}
+
+/**
+ * @brief The background thread: fetch and process frames until stopped
+ */
+void MotionTrigger::run() {
+    if(!this->is_armed()) {
+        this->arm();    // If it can't be, process will try again when it's needed
+    }
+
+    while(this->running) {
+        try {
+            this->camera.get_live_view_data(this->frame);
+        } catch(LIBPTP_PP_ERRORS e) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stats.errors++;
+            usleep(10 * 1000);  // Don't spin on a camera that's gone away
+            continue;
+        }
+
+        try {
+            this->process(this->frame, MotionTrigger::now_us());
+        } catch(LIBPTP_PP_ERRORS e) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stats.errors++;
+        }
+    }
+}
+
+} /* namespace PTP */
@@ -0,0 +1,92 @@
+#ifndef LIBPTP_PP_MOTIONTRIGGER_H_
+#define LIBPTP_PP_MOTIONTRIGGER_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include "LVData.hpp"
+
+namespace PTP {
+
+    class CHDKCamera;
+
+    class MotionTrigger {
+        public:
+            static const int QUIT_TIMEOUT_MS = 1000;    // How long arm() waits for a script it told to quit to stop
+
+            struct Stats {
+                uint64_t frames;            // Frames compared
+                uint64_t motion_frames;     // Frames with motion in them
+                uint64_t triggers;          // Triggers the script took
+                uint64_t failed_triggers;   // Triggers it didn't, such as when it couldn't be started
+                uint64_t errors;            // Failed fetches or conversions on the background thread
+                double changed;             // Share of the watched area that changed in the last frame
+                double detect_ms_last;      // From a frame arriving to deciding about it
+                double detect_ms_mean;
+                double detect_ms_max;
+                double trigger_ms_last;     // From a frame arriving to the script taking the trigger it caused
+                double trigger_ms_mean;
+                double trigger_ms_max;
+            };
+
+            MotionTrigger(CHDKCamera& camera);
+            ~MotionTrigger();
+            void set_command(const std::string command);
+            void set_threshold(const int level, const double area);
+            void set_scale(const int scale, const bool skip=false);
+            void set_mask(const uint8_t * mask, const int width, const int height);
+            void set_cooldown(const int cooldown_ms);
+            bool arm();
+            void disarm();
+            bool is_armed() const;
+            bool process(const LVData& frame, const uint64_t arrived_us=0);
+            void start();
+            void stop();
+            bool is_running() const;
+            Stats get_stats() const;
+            static uint64_t now_us();
+
+        private:
+            CHDKCamera& camera;
+            mutable std::mutex mutex;       // Guards everything below
+            std::string command;
+            int level;
+            double area;
+            int scale;
+            bool skip;
+            int cooldown_ms;
+
+            std::vector<uint8_t> mask;      // As given, mask_width x mask_height; empty to watch everything
+            int mask_width, mask_height;
+            std::vector<uint8_t> grid_mask; // The mask stretched to the grid
+            int grid_width, grid_height;    // Size of the downsampled frames
+            int watched;                    // Grid pixels the mask lets through
+            std::vector<uint8_t> current, previous;
+            bool have_previous;
+            uint64_t last_trigger_us;
+
+            bool armed;                     // Our script is running on the camera, with armed_command in it
+            uint32_t script_id;
+            std::string armed_command;
+
+            Stats stats;
+            double detect_ms_total, trigger_ms_total;
+
+            LVData frame;                   // Fetch target for the background thread
+            std::thread thread;
+            std::atomic<bool> running;
+
+            MotionTrigger(const MotionTrigger&);    // Owns a thread, so it can't be copied
+            MotionTrigger& operator=(const MotionTrigger&);
+
+            std::string build_script() const;
+            void resize_grid(const int width, const int height);
+            void run();
+    };
+
+}
+
+#endif /* LIBPTP_PP_MOTIONTRIGGER_H_ */
@@ -8,6 +8,7 @@
  * functions for extacting this data in a few different ways.
  */
  
+#include <algorithm>
 #include <cstring>
 #include <stdint.h>
  
@@ -46,6 +47,7 @@ PTPContainer::PTPContainer(uint16_t type, uint16_t op_code) {
  */
 PTPContainer::PTPContainer(const unsigned char * data) {
     // This is essentially lv_framebuffer_desc .unpack() function, in the form of a constructor
+    this->init();
     this->unpack(data);
 }
 
@@ -65,6 +67,32 @@ PTPContainer::~PTPContainer() {
 void PTPContainer::init() {
     this->length = this->default_length; // Length is at least the sum of the header parts
     this->payload = NULL;
+    this->payload_capacity = 0;
+    this->type = 0;
+    this->code = 0;
+    this->transaction_id = 0;
+}
+
+/**
+ * @brief Make room for a payload of \a payload_length bytes
+ *
+ * The existing payload buffer is reused if it is big enough, so containers
+ * which are used over and over again stop allocating.  The contents of the
+ * payload are NOT preserved.
+ *
+ * @param[in] payload_length The number of bytes of payload needed
+ * @return The address of the (uninitialized) payload, which the caller fills in
+ */
+unsigned char * PTPContainer::reserve_payload(const uint32_t payload_length) {
+    if(payload_length > this->payload_capacity) {
+        delete[] this->payload;
+        this->payload = new unsigned char[payload_length];
+        this->payload_capacity = payload_length;
+    }
+    
+    this->length = this->default_length + payload_length;
+    
+    return this->payload;
 }
 
 /**
@@ -78,21 +106,28 @@ void PTPContainer::init() {
  * @param[in] param The parameter to be added
  */
 void PTPContainer::add_param(const uint32_t param) {
-    // Allocate new memory for the payload
     uint32_t old_length = (this->length)-(this->default_length);
-    uint32_t new_length = this->length + sizeof(uint32_t);
-    unsigned char * new_payload = new unsigned char[new_length];
-    
-    // Copy old payload into new payload
-    std::memcpy(new_payload, this->payload, old_length);
-    // Copy new data into new payload
-    std::memcpy(new_payload + old_length, &param, sizeof(uint32_t));
-    // Free up old payload memory
-	delete[] this->payload;
-    // Change payload pointer to new payload
-    this->payload = new_payload;
+    uint32_t new_length = old_length + sizeof(uint32_t);
+    
+    if(new_length > this->payload_capacity) {
+        // Allocate new memory for the payload. Leave room for all five PTP parameters,
+        //  so adding the rest doesn't reallocate again
+        uint32_t new_capacity = (new_length < 5 * sizeof(uint32_t)) ? 5 * sizeof(uint32_t) : new_length;
+        unsigned char * new_payload = new unsigned char[new_capacity];
+        
+        // Copy old payload into new payload
+        std::memcpy(new_payload, this->payload, old_length);
+        // Free up old payload memory
+        delete[] this->payload;
+        // Change payload pointer to new payload
+        this->payload = new_payload;
+        this->payload_capacity = new_capacity;
+    }
+    
+    // Copy new data into the payload
+    std::memcpy(this->payload + old_length, &param, sizeof(uint32_t));
     // Update length
-    this->length = new_length;
+    this->length = this->default_length + new_length;
 }
 
 /**
@@ -107,19 +142,9 @@ void PTPContainer::add_param(const uint32_t param) {
  * @param[in] payload_length The amount of data to read from \a payload
  */
 void PTPContainer::set_payload(const void * payload, int payload_length) {
-    // Allocate new memory to copy the payload into
-    // This way, we can ensure that we always want to free() the memory
-    uint32_t new_length = this->default_length + payload_length;
-	unsigned char * new_payload = new unsigned char[payload_length];
-    
-    // Copy the payload over
-    std::memcpy(new_payload, payload, payload_length);
-    // Free up the old payload
-	delete[] this->payload;
-    // Change payload pointer to new payload
-    this->payload = new_payload;
-    // Update length
-    this->length = new_length;
+    // Copy the payload into memory we own, so we can ensure that we always want to
+    //  free() it. Our old buffer is reused if it's big enough.
+    std::memcpy(this->reserve_payload(payload_length), payload, payload_length);
 }
 
 /**
@@ -138,6 +163,21 @@ void PTPContainer::set_payload(const void * payload, int payload_length) {
 unsigned char * PTPContainer::pack() const {
 	unsigned char * packed = new unsigned char[this->length];
     
+    this->pack(packed);
+    
+    return packed;
+}
+
+/**
+ * @brief Pack \c PTPContainer data into memory provided by the caller
+ *
+ * The same as \c PTPContainer::pack, without the allocation, so small
+ * containers can be packed onto the stack.
+ *
+ * @param[out] packed Where to write the packed container; at least \c PTPContainer::get_length bytes
+ * @see PTPContainer::pack
+ */
+void PTPContainer::pack(unsigned char * packed) const {
     uint32_t header_size = (sizeof this->length)+(sizeof this->type)+(sizeof this->code)+(sizeof this->transaction_id);
     
     std::memcpy(packed, &(this->length), sizeof this->length);      // Copy length
@@ -145,8 +185,6 @@ unsigned char * PTPContainer::pack() const {
     std::memcpy(packed + 6, &(this->code), sizeof this->code);      // Two bytes of code
     std::memcpy(packed + 8, &(this->transaction_id), sizeof this->transaction_id);  // Four bytes of transaction ID
     std::memcpy(packed + 12, this->payload, this->length - header_size);    // The rest of payload
-    
-    return packed;
 }
 
 /**
@@ -191,12 +229,10 @@ uint32_t PTPContainer::get_length() const {
  *                 in length.
  */
 void PTPContainer::unpack(const unsigned char * data) {
-    // Free up our current payload
-	delete[] this->payload;
-    this->payload = NULL;
+    uint32_t new_length;
     
     // First four bytes are the length
-    std::memcpy(&this->length, data, 4);
+    std::memcpy(&new_length, data, 4);
     // Next, container type
     std::memcpy(&this->type, data + 4, 2);
     // Copy over code
@@ -204,9 +240,8 @@ void PTPContainer::unpack(const unsigned char * data) {
     // And transaction ID...
     std::memcpy(&this->transaction_id, data + 8, 4);
     
-    // Finally, copy over the payload
-	this->payload = new unsigned char[this->length - 12];
-    std::memcpy(this->payload, data + 12, this->length - 12);
+    // Finally, copy over the payload, reusing our current payload memory if we can
+    std::memcpy(this->reserve_payload(new_length - 12), data + 12, new_length - 12);
     
     // Since we copied all of this data, the data passed in can be free()d
 }
@@ -220,12 +255,24 @@ void PTPContainer::unpack(const unsigned char * data) {
  * @exception PTP::ERR_PTPCONTAINER_INVALID_PARAM If this \c PTPContainer is too short to have a parameter \a n.
  */
 uint32_t PTPContainer::get_param_n(const uint32_t n) const {
+    return this->try_get_param_n(n).value();
+}
+
+/**
+ * @brief Retrieve parameter #\a n from \c PTPContainer, without throwing
+ *
+ * @param[in] n Parameter number to extract.
+ * @return Value stored in parameter \a n, or \c PTP::ERR_PTPCONTAINER_NO_PAYLOAD if this
+ *         \c PTPContainer has no payload, or \c PTP::ERR_PTPCONTAINER_INVALID_PARAM if
+ *         it is too short to have a parameter \a n.
+ * @see PTPContainer::get_param_n
+ */
+Result<uint32_t> PTPContainer::try_get_param_n(const uint32_t n) const {
     uint32_t out;
     uint32_t first_byte;
     
-    if(this->payload == NULL) {
-        throw PTP::ERR_PTPCONTAINER_NO_PAYLOAD;
-        return 0;
+    if(this->is_empty()) {
+        return Result<uint32_t>::failure(PTP::ERR_PTPCONTAINER_NO_PAYLOAD);
     }
     
     first_byte = 4*n;   // First byte of parameter n is 4*n bytes into container
@@ -234,8 +281,7 @@ uint32_t PTPContainer::get_param_n(const uint32_t n) const {
     //  Add an extra four to ensure we have a parameter n
     // Subtract 12 bytes (header) from length
     if((this->length-12) < 4+4*n) {
-        throw PTP::ERR_PTPCONTAINER_INVALID_PARAM;
-        return 0;
+        return Result<uint32_t>::failure(PTP::ERR_PTPCONTAINER_INVALID_PARAM);
     }
     
     std::memcpy(&out, payload + first_byte, 4); // Copy parameter into out
@@ -246,10 +292,27 @@ uint32_t PTPContainer::get_param_n(const uint32_t n) const {
 /**
  * @brief Determines if this PTPContainer contains data
  * 
- * @return True if payload is a null pointer
+ * @return True if there is no payload
  */
 bool PTPContainer::is_empty() const {
-    return (this->payload == NULL);
+    return (this->payload == NULL || this->length == this->default_length);
+}
+
+/**
+ * @brief Exchange the contents of this \c PTPContainer with \a other
+ *
+ * Swaps the headers and the payload buffers themselves, so no payload is
+ * copied.  This is how a received container is moved to where it's needed.
+ *
+ * @param[in,out] other The \c PTPContainer to exchange contents with
+ */
+void PTPContainer::swap(PTPContainer& other) {
+    std::swap(this->length, other.length);
+    std::swap(this->payload, other.payload);
+    std::swap(this->payload_capacity, other.payload_capacity);
+    std::swap(this->type, other.type);
+    std::swap(this->code, other.code);
+    std::swap(this->transaction_id, other.transaction_id);
 }
 
 } /* namespace PTP */
@@ -1,6 +1,8 @@
 #ifndef LIBPTP_PP_PTPCONTAINER_H_
 #define LIBPTP_PP_PTPCONTAINER_H_
 
+#include "Result.hpp"
+
 namespace PTP {
 
     class PTPContainer {
@@ -8,7 +10,15 @@ namespace PTP {
             static const uint32_t default_length = sizeof(uint32_t)+sizeof(uint32_t)+sizeof(uint16_t)+sizeof(uint16_t);
             uint32_t length;
             unsigned char * payload;    // We'll deal with this completely internally
+            uint32_t payload_capacity;  // Bytes allocated for payload; may be more than we're using
             void init();
+            unsigned char * reserve_payload(const uint32_t payload_length);
+            PTPContainer(const PTPContainer&);              // Containers own their payload, so they can't
+            PTPContainer& operator=(const PTPContainer&);   //  be copied. Use swap() to move one instead.
+            
+            // These receive and hand out payloads without copying them
+            friend class CameraBase;
+            friend class LVData;
         public:
             enum CONTAINER_TYPE {
                 CONTAINER_TYPE_COMMAND  = 1,
@@ -27,11 +37,14 @@ namespace PTP {
             void add_param(const uint32_t param);
             void set_payload(const void * payload, const int payload_length);
             unsigned char * pack() const;
+            void pack(unsigned char * out) const;
             unsigned char * get_payload(int * size_out) const;  // This might end up being useful...
             uint32_t get_length() const;  // So we can get, but not set
             void unpack(const unsigned char * data);
             uint32_t get_param_n(const uint32_t n) const;
+            Result<uint32_t> try_get_param_n(const uint32_t n) const;
             bool is_empty() const;
+            void swap(PTPContainer& other);
     };
     
 }
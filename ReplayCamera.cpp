@@ -0,0 +1,301 @@
+/**
+ * @file ReplayCamera.cpp
+ *
+ * @brief A camera that plays back a capture made by \c USBRecorder
+ *
+ * Like \c FakeCamera, \c ReplayCamera stands in for a camera by overriding
+ * \c CameraBase::_bulk_write and \c CameraBase::_bulk_read.  Instead of making
+ * its answers up, it reads them from a capture: each container the host reads
+ * is the next one the camera sent in the recorded session, byte for byte, and
+ * each transfer fails if it failed then.  So the same code that ran in the
+ * field, driven the same way, gets the same responses, of the same sizes,
+ * in the same order.
+ *
+ * Untimed, every transfer completes at once, which is what a profile of the
+ * host side wants.  Timed, each transfer takes as long as it took in the
+ * session, which is what a benchmark of the whole pipeline wants; the time
+ * the host spends between transfers is whatever it is on the machine doing
+ * the replay.
+ *
+ * Containers the host sends are checked against the recorded ones, by type,
+ * operation and first parameter, and differences counted in
+ * \c ReplayCamera::get_mismatch_count.  A host that has wandered from the
+ * script is kept in step where possible: a write skips any responses it
+ * didn't read, and a read skips any writes it didn't make.
+ */
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "libptp++.hpp"
+#include "ReplayCamera.hpp"
+#include "USBCapture.hpp"
+
+namespace PTP {
+
+using namespace USBCaptureFormat;
+
+/**
+ * @brief Open the capture at \a path for replay
+ *
+ * The capture is mapped, not read, so long captures start at once.
+ *
+ * @param[in] path  A capture written by \c USBRecorder
+ * @param[in] timed True to make each transfer take as long as it did when it was recorded
+ * @exception ERR_USBCAPTURE_CANNOT_OPEN If the capture can't be opened.
+ * @exception ERR_USBCAPTURE_CORRUPT If it isn't a capture, or is cut short in the middle of a record.
+ */
+ReplayCamera::ReplayCamera(const std::string path, const bool timed) {
+    this->mapping = NULL;
+    this->mapping_size = 0;
+    this->position = 0;
+    this->offset = 0;
+    this->timed = timed;
+    this->mismatches = 0;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        throw ERR_USBCAPTURE_CANNOT_OPEN;
+    }
+    struct stat info;
+    if(fstat(fd, &info) == 0 && info.st_size > 0) {
+        void * data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED) {
+            this->mapping = (const uint8_t *)data;
+            this->mapping_size = info.st_size;
+            madvise(data, info.st_size, MADV_SEQUENTIAL);
+        }
+    }
+    ::close(fd);    // The mapping stays
+
+    FileHeader header;
+    if(this->mapping_size < sizeof(header)) {
+        this->unmap();
+        throw ERR_USBCAPTURE_CORRUPT;
+    }
+    std::memcpy(&header, this->mapping, sizeof(header));
+    if(header.magic != MAGIC || header.version != VERSION) {
+        this->unmap();
+        throw ERR_USBCAPTURE_CORRUPT;
+    }
+
+    uint64_t at = sizeof(header);
+    while(at < this->mapping_size) {
+        RecordHeader record_header;
+        if(this->mapping_size - at < sizeof(record_header)) {
+            break;      // The recorder was killed partway through; replay what's whole
+        }
+        std::memcpy(&record_header, this->mapping + at, sizeof(record_header));
+        at += sizeof(record_header);
+        if(this->mapping_size - at < record_header.stored) {
+            break;
+        }
+        if((record_header.direction != DIRECTION_OUT && record_header.direction != DIRECTION_IN) ||
+            record_header.stored > record_header.length) {
+            this->unmap();
+            throw ERR_USBCAPTURE_CORRUPT;
+        }
+
+        Record record;
+        record.data = this->mapping + at;
+        record.stored = record_header.stored;
+        record.length = record_header.length;
+        record.duration_us = record_header.duration_us;
+        record.result = record_header.result;
+        record.direction = record_header.direction;
+        this->records.push_back(record);
+        at += record_header.stored;
+    }
+}
+
+/**
+ * @brief Unmaps the capture
+ */
+ReplayCamera::~ReplayCamera() {
+    this->unmap();
+}
+
+/**
+ * @brief Unmaps the capture, if it's mapped
+ */
+void ReplayCamera::unmap() {
+    if(this->mapping != NULL) {
+        munmap((void *)this->mapping, this->mapping_size);
+        this->mapping = NULL;
+        this->mapping_size = 0;
+    }
+    this->records.clear();
+}
+
+/**
+ * @brief Choose whether transfers take as long as they did when recorded
+ *
+ * @param[in] timed True to sleep for each transfer's recorded duration, false to complete them at once
+ */
+void ReplayCamera::set_timed(const bool timed) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->timed = timed;
+}
+
+/**
+ * @brief Go back to the start of the capture, to replay it again
+ *
+ * The mismatch count starts again from 0.  The transaction ID carries on
+ * from where it was, which the camera side of a replay doesn't care about.
+ */
+void ReplayCamera::rewind() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->position = 0;
+    this->offset = 0;
+    this->mismatches = 0;
+}
+
+/**
+ * @brief Determine whether every record has been replayed
+ *
+ * After this, every transfer fails with \c LIBUSB_ERROR_NO_DEVICE, as if the
+ * camera had been unplugged.
+ */
+bool ReplayCamera::is_finished() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->position >= (int)this->records.size();
+}
+
+/**
+ * @brief Retrieve the number of containers in the capture
+ */
+int ReplayCamera::get_record_count() const {
+    return this->records.size();
+}
+
+/**
+ * @brief Retrieve the number of the next record to be replayed, from 0
+ */
+int ReplayCamera::get_position() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->position;
+}
+
+/**
+ * @brief Get the number of times the host strayed from the capture
+ *
+ * Counts containers sent that don't match the recorded ones, by type,
+ * operation and first parameter, and recorded containers skipped to keep up
+ * with the host.  A faithful replay has none.
+ */
+uint64_t ReplayCamera::get_mismatch_count() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->mismatches;
+}
+
+/**
+ * @brief Move to the next record going in \a direction, counting any skipped
+ *
+ * A record partly read already is finished with, and not counted.
+ *
+ * @return False if there are no more records going that way
+ */
+bool ReplayCamera::skip_to(const int direction) {
+    if(this->offset > 0) {
+        this->position++;
+        this->offset = 0;
+    }
+
+    while(this->position < (int)this->records.size() && this->records[this->position].direction != direction) {
+        this->mismatches++;
+        this->position++;
+    }
+
+    return this->position < (int)this->records.size();
+}
+
+/**
+ * @brief Take a container from the host, as the next recorded container sent was taken
+ *
+ * @return The recorded result of the transfer, or \c LIBUSB_ERROR_NO_DEVICE past the end of the capture
+ */
+int ReplayCamera::_bulk_write(unsigned char * bytestr, const int length, const int timeout) {
+    (void)timeout;
+    uint32_t duration_us = 0;
+    int result;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if(!this->skip_to(DIRECTION_OUT)) {
+            return LIBUSB_ERROR_NO_DEVICE;
+        }
+
+        // Compare the type, the operation and, for CHDK's sake, the first parameter, but not the transaction ID
+        const Record& record = this->records[this->position];
+        if(length < 8 || record.stored < 8 || std::memcmp(bytestr + 4, record.data + 4, 4) != 0) {
+            this->mismatches++;
+        } else if(length >= 16 && record.stored >= 16 && std::memcmp(bytestr + 12, record.data + 12, 4) != 0) {
+            this->mismatches++;
+        }
+        result = record.result;
+        if(this->timed) duration_us = record.duration_us;
+        this->position++;
+    }
+
+    if(duration_us > 0) {
+        usleep(duration_us);
+    }
+
+    return result;
+}
+
+/**
+ * @brief Hand the host the next recorded container it received, or as much of it as fits
+ *
+ * A container read in pieces is timed on the first piece, and its recorded
+ * result is given with the last.
+ *
+ * @return The recorded result of the transfer, or \c LIBUSB_ERROR_NO_DEVICE past the end of the capture
+ */
+int ReplayCamera::_bulk_read(unsigned char * data_out, const int size, int * transferred, const int timeout) {
+    (void)timeout;
+    uint32_t duration_us = 0;
+    int result = 0;
+    *transferred = 0;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if(this->offset == 0 && !this->skip_to(DIRECTION_IN)) {
+            return LIBUSB_ERROR_NO_DEVICE;
+        }
+        if(this->position >= (int)this->records.size()) {
+            return LIBUSB_ERROR_NO_DEVICE;
+        }
+
+        const Record& record = this->records[this->position];
+        if(this->offset == 0 && this->timed) duration_us = record.duration_us;
+
+        uint32_t n = record.length - this->offset;
+        if(n > (uint32_t)size) n = size;
+        uint32_t from_data = 0;
+        if(this->offset < record.stored) {
+            from_data = record.stored - this->offset;
+            if(from_data > n) from_data = n;
+            std::memcpy(data_out, record.data + this->offset, from_data);
+        }
+        std::memset(data_out + from_data, 0, n - from_data);    // Cut from the capture to save space
+        *transferred = n;
+
+        this->offset += n;
+        if(this->offset >= record.length) {
+            result = record.result;
+            this->position++;
+            this->offset = 0;
+        }
+    }
+
+    if(duration_us > 0) {
+        usleep(duration_us);
+    }
+
+    return result;
+}
+
+} /* namespace PTP */
@@ -0,0 +1,55 @@
+#ifndef LIBPTP_PP_REPLAYCAMERA_H_
+#define LIBPTP_PP_REPLAYCAMERA_H_
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "CHDKCamera.hpp"
+
+namespace PTP {
+
+    class ReplayCamera : public CHDKCamera {
+        public:
+            ReplayCamera(const std::string path, const bool timed=false);
+            ~ReplayCamera();
+            void set_timed(const bool timed);
+            void rewind();
+            bool is_finished() const;
+            int get_record_count() const;
+            int get_position() const;
+            uint64_t get_mismatch_count() const;
+
+        protected:
+            int _bulk_write(unsigned char * bytestr, const int length, const int timeout=0);
+            int _bulk_read(unsigned char * data_out, const int size, int * transferred, const int timeout=0);
+
+        private:
+            struct Record {
+                const uint8_t * data;   // The stored bytes, in the mapping
+                uint32_t stored;
+                uint32_t length;        // On the wire; the bytes after the stored ones are replayed as zeros
+                uint32_t duration_us;
+                int result;
+                int direction;          // A USBCaptureFormat::DIRECTION
+            };
+
+            mutable std::mutex mutex;   // Guards everything below
+            const uint8_t * mapping;
+            uint64_t mapping_size;
+            std::vector<Record> records;
+            int position;               // The next record to replay
+            uint32_t offset;            // Bytes of it already read, for containers read in pieces
+            bool timed;
+            uint64_t mismatches;
+
+            ReplayCamera(const ReplayCamera&);  // Owns a mapping, so it can't be copied
+            ReplayCamera& operator=(const ReplayCamera&);
+
+            void unmap();
+            bool skip_to(const int direction);
+    };
+
+}
+
+#endif /* LIBPTP_PP_REPLAYCAMERA_H_ */
@@ -0,0 +1,76 @@
+#ifndef LIBPTP_PP_RESULT_H_
+#define LIBPTP_PP_RESULT_H_
+
+namespace PTP {
+
+    enum LIBPTP_PP_ERRORS : int;    // Defined in libptp++.hpp
+
+    /*
+     * A value, or the error that kept us from getting one: what the try_ functions
+     * return instead of throwing.  Like std::expected, it's tested with has_value()
+     * or as a bool; unlike it, a failure also carries the libusb error, if there was
+     * one.  Nothing is allocated, and nothing is thrown unless value() is called on
+     * a failure.
+     */
+    template <typename T>
+    class Result {
+        public:
+            Result(const T& value) : stored(value), error(static_cast<LIBPTP_PP_ERRORS>(0)), usb_error(0) { }
+
+            static Result failure(const LIBPTP_PP_ERRORS error, const int usb_error=0) {
+                return Result(T(), error, usb_error);
+            }
+
+            bool has_value() const { return this->error == 0; }
+            explicit operator bool() const { return this->error == 0; }
+
+            // Throws the error, as the throwing API would have, if there's no value
+            const T& value() const {
+                if(this->error != 0) throw this->error;
+                return this->stored;
+            }
+            T value_or(const T& fallback) const { return (this->error == 0) ? this->stored : fallback; }
+
+            LIBPTP_PP_ERRORS get_error() const { return this->error; }      // ERR_NONE if there's a value
+            int get_usb_error() const { return this->usb_error; }           // A libusb_error, or 0
+
+        private:
+            T stored;
+            LIBPTP_PP_ERRORS error;
+            int usb_error;
+
+            Result(const T& value, const LIBPTP_PP_ERRORS error, const int usb_error) : stored(value), error(error), usb_error(usb_error) { }
+    };
+
+    // For the calls that succeed or fail, with nothing to return
+    template <>
+    class Result<void> {
+        public:
+            Result() : error(static_cast<LIBPTP_PP_ERRORS>(0)), usb_error(0) { }
+
+            static Result failure(const LIBPTP_PP_ERRORS error, const int usb_error=0) {
+                Result out;
+                out.error = error;
+                out.usb_error = usb_error;
+                return out;
+            }
+
+            bool has_value() const { return this->error == 0; }
+            explicit operator bool() const { return this->error == 0; }
+
+            // Throws the error, as the throwing API would have, if the call failed
+            void value() const {
+                if(this->error != 0) throw this->error;
+            }
+
+            LIBPTP_PP_ERRORS get_error() const { return this->error; }
+            int get_usb_error() const { return this->usb_error; }
+
+        private:
+            LIBPTP_PP_ERRORS error;
+            int usb_error;
+    };
+
+}
+
+#endif /* LIBPTP_PP_RESULT_H_ */
@@ -0,0 +1,147 @@
+/**
+ * @file ThreadPool.cpp
+ *
+ * @brief A small, reusable pool of threads for splitting up per-frame work
+ *
+ * Starting threads for every live view frame would cost more than converting
+ * the frame, so a \c ThreadPool starts its threads once and keeps them asleep
+ * between jobs.  A job is a number of independent tasks; the calling thread
+ * works on them too, and \c ThreadPool::run returns when all are done.
+ */
+
+#include <stdint.h>
+
+#include "ThreadPool.hpp"
+
+namespace PTP {
+
+/**
+ * @brief Start a pool of threads
+ *
+ * @param[in] threads The number of threads that work on each job, counting the
+ *                    thread that calls \c ThreadPool::run.  0 uses one per CPU.
+ */
+ThreadPool::ThreadPool(const int threads) {
+    this->job = NULL;
+    this->job_tasks = 0;
+    this->next_task = 0;
+    this->done_tasks = 0;
+    this->generation = 0;
+    this->stopping = false;
+
+    int n = threads;
+    if(n <= 0) n = std::thread::hardware_concurrency();
+    if(n <= 0) n = 1;   // hardware_concurrency doesn't always know
+
+    int i;
+    for(i = 1; i < n; i++) {    // The caller of run() is the first thread
+        this->workers.push_back(std::thread(&ThreadPool::worker, this));
+    }
+}
+
+/**
+ * @brief Wait for the threads to finish what they're doing, and stop them
+ */
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->wake.notify_all();
+
+    unsigned int i;
+    for(i = 0; i < this->workers.size(); i++) {
+        this->workers[i].join();
+    }
+}
+
+/**
+ * @brief Retrieve the number of threads that work on each job
+ *
+ * @return The number of threads, including the one calling \c ThreadPool::run
+ */
+int ThreadPool::get_thread_count() const {
+    return this->workers.size() + 1;
+}
+
+/**
+ * @brief Run \a task once for each number from 0 to \a tasks - 1, spread over the pool
+ *
+ * Blocks until every task has finished.  Tasks are handed out in order, but
+ * may run in any order, and at the same time as each other.  Jobs from
+ * different threads are run one after another.
+ *
+ * @warning \a task must not throw, and must not call \c ThreadPool::run on the same pool.
+ *
+ * @param[in] tasks The number of tasks
+ * @param[in] task  The function to run, given the number of the task
+ */
+void ThreadPool::run(const int tasks, const std::function<void(int)>& task) {
+    if(tasks <= 0) return;
+
+    if(tasks == 1 || this->workers.empty()) {
+        int i;
+        for(i = 0; i < tasks; i++) task(i);
+        return;
+    }
+
+    std::lock_guard<std::mutex> serial(this->run_mutex);
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    this->job = &task;
+    this->job_tasks = tasks;
+    this->next_task = 0;
+    this->done_tasks = 0;
+    this->generation++;
+    this->wake.notify_all();
+
+    this->work(lock);
+    while(this->done_tasks < this->job_tasks) {
+        this->finished.wait(lock);
+    }
+
+    this->job = NULL;
+}
+
+/**
+ * @brief The worker threads: sleep until there's a job, and help with it
+ */
+void ThreadPool::worker() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    uint64_t seen = this->generation;
+
+    while(1) {
+        while(!this->stopping && this->generation == seen) {
+            this->wake.wait(lock);
+        }
+        if(this->stopping) return;
+
+        seen = this->generation;
+        this->work(lock);
+    }
+}
+
+/**
+ * @brief Run tasks from the current job until there are none left to start
+ *
+ * A worker that wakes up late finds every task taken, and goes back to sleep
+ * without touching the job.
+ *
+ * @param[in] lock A lock on \c ThreadPool::mutex, released while each task runs
+ */
+void ThreadPool::work(std::unique_lock<std::mutex>& lock) {
+    while(this->next_task < this->job_tasks) {
+        int t = this->next_task++;
+        const std::function<void(int)> * task = this->job;
+
+        lock.unlock();
+        (*task)(t);
+        lock.lock();
+
+        if(++this->done_tasks == this->job_tasks) {
+            this->finished.notify_all();
+        }
+    }
+}
+
+} /* namespace PTP */
@@ -0,0 +1,42 @@
+#ifndef LIBPTP_PP_THREADPOOL_H_
+#define LIBPTP_PP_THREADPOOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+namespace PTP {
+
+    class ThreadPool {
+        public:
+            ThreadPool(const int threads=0);
+            ~ThreadPool();
+            int get_thread_count() const;
+            void run(const int tasks, const std::function<void(int)>& task);
+
+        private:
+            std::vector<std::thread> workers;
+            std::mutex run_mutex;               // One job at a time
+            std::mutex mutex;                   // Guards everything below
+            std::condition_variable wake;
+            std::condition_variable finished;
+            const std::function<void(int)> * job;
+            int job_tasks;
+            int next_task;
+            int done_tasks;
+            uint64_t generation;                // Bumped for every job, so sleeping workers notice it
+            bool stopping;
+
+            ThreadPool(const ThreadPool&);      // Owns threads, so it can't be copied
+            ThreadPool& operator=(const ThreadPool&);
+
+            void worker();
+            void work(std::unique_lock<std::mutex>& lock);
+    };
+
+}
+
+#endif /* LIBPTP_PP_THREADPOOL_H_ */
@@ -0,0 +1,406 @@
+/**
+ * @file Tracer.cpp
+ *
+ * @brief Records where the time goes, as spans on a timeline
+ *
+ * Metrics say that a camera's frame rate dropped; a trace says which stage
+ * stalled.  Built with \c LIBPTP_PP_TRACE defined, \c CameraBase, \c LVData
+ * and \c LVStream mark out their stages -- USB writes and reads, unpacking,
+ * parsing, conversion, and the time the caller holds a frame -- and, while
+ * \c Tracer::start is in effect, each one is recorded as a span.  Built
+ * without it, the trace points aren't there at all.
+ *
+ * Each thread records into a ring of its own, so recording never takes a
+ * lock or shares a cache line with another thread: two clock reads and a
+ * few stores.  When a ring fills up, its oldest spans are overwritten.
+ * Rings are handed on to new threads when their threads exit, so threads
+ * that come and go don't grow memory.
+ *
+ * \c Tracer::format_chrome writes the rings out as Chrome trace JSON, which
+ * chrome://tracing and Perfetto both open.  Work done for a camera is put
+ * under a process of its own, named after the camera, with a row per thread,
+ * so transfers on different cameras, and the CPU work between them, line up
+ * on one timeline.  Timestamps are CLOCK_MONOTONIC, so traces from two
+ * processes on the same machine, such as a broker and its clients, line up
+ * too.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "Tracer.hpp"
+#include "Util.hpp"
+
+namespace PTP {
+
+struct TraceEvent {
+    uint64_t begin_ns;
+    uint64_t end_ns;
+    const char * name;
+    const char * category;
+    const char * arg_name;      // NULL if the span has no argument
+    int64_t arg;
+    int track;
+    int tid;
+};
+
+// A TraceEvent as kept in a ring.  Its thread writes it while format_chrome may
+//  be reading it, so every field is atomic; relaxed, as head orders them.
+struct TraceSlot {
+    std::atomic<uint64_t> begin_ns;
+    std::atomic<uint64_t> end_ns;
+    std::atomic<const char *> name;
+    std::atomic<const char *> category;
+    std::atomic<const char *> arg_name;
+    std::atomic<int64_t> arg;
+    std::atomic<int> track;
+    std::atomic<int> tid;
+};
+
+struct TraceRing {
+    std::atomic<uint64_t> head;     // Events ever written; the next goes at head % RING_EVENTS
+    bool owned;                     // By a live thread; guarded by registry_mutex
+    int tid;
+    TraceSlot events[Tracer::RING_EVENTS];
+};
+
+std::atomic<bool> Tracer::enabled(false);
+
+static std::mutex registry_mutex;           // Guards the rings list, ownership, and names
+static std::vector<TraceRing *> * rings = new std::vector<TraceRing *>;     // Never freed, so threads still recording at exit are safe
+static std::map<int, std::string> track_names;
+static std::map<int, std::string> thread_names;     // By thread ID; kept after the thread exits, like its events
+static std::atomic<int> next_track(1);      // Track 0 is for work that isn't for any one camera
+
+/**
+ * @brief Gives the calling thread's ring back when the thread exits
+ */
+struct TraceRingHolder {
+    TraceRing * ring;
+
+    TraceRingHolder() {
+        this->ring = NULL;
+    }
+    ~TraceRingHolder() {
+        if(this->ring == NULL) return;
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        this->ring->owned = false;
+    }
+};
+
+static thread_local TraceRingHolder ring_holder;
+
+/**
+ * @brief Find the calling thread's ring, taking one the first time
+ *
+ * A ring left behind by a thread that has exited is reused before a new one
+ * is made.  Its old events are kept, until they're overwritten.
+ */
+static TraceRing * get_ring() {
+    if(ring_holder.ring != NULL) return ring_holder.ring;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    TraceRing * ring = NULL;
+    size_t i;
+    for(i = 0; i < rings->size(); i++) {
+        if(!(*rings)[i]->owned) {
+            ring = (*rings)[i];
+            break;
+        }
+    }
+    if(ring == NULL) {
+        ring = new TraceRing;
+        ring->head.store(0, std::memory_order_relaxed);
+        rings->push_back(ring);
+    }
+
+    ring->owned = true;
+    ring->tid = (int)syscall(SYS_gettid);
+    ring_holder.ring = ring;
+
+    return ring;
+}
+
+/**
+ * @brief Quote \a text for JSON
+ */
+static void write_json_string(std::ostringstream& out, const std::string& text) {
+    size_t i;
+    out << '"';
+    for(i = 0; i < text.size(); i++) {
+        unsigned char c = text[i];
+        if(c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if(c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+/**
+ * @brief Write a time in nanoseconds as the microseconds Chrome traces use
+ */
+static void write_us(std::ostringstream& out, const uint64_t ns) {
+    char text[32];
+    snprintf(text, sizeof(text), "%llu.%03u", (unsigned long long)(ns / 1000), (unsigned)(ns % 1000));
+    out << text;
+}
+
+/**
+ * @brief Start recording spans
+ *
+ * Spans already running when tracing starts aren't recorded.
+ */
+void Tracer::start() {
+    Tracer::enabled.store(true, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Stop recording spans
+ *
+ * What has been recorded is kept, for \c Tracer::format_chrome.  Spans
+ * that began before this call are still recorded when they end.
+ */
+void Tracer::stop() {
+    Tracer::enabled.store(false, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Throw away everything recorded so far
+ *
+ * Meant to be called with tracing stopped; a span recorded at the same time
+ * may survive it.
+ */
+void Tracer::clear() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    size_t i;
+    for(i = 0; i < rings->size(); i++) {
+        (*rings)[i]->head.store(0, std::memory_order_release);
+    }
+}
+
+/**
+ * @brief Record a span that has already ended on the calling thread's ring
+ *
+ * Most spans come from \c Tracer::Scope; this is for ones that don't fit in
+ * a block, such as the time between two calls.  Nothing is recorded while
+ * tracing is stopped.
+ *
+ * @param[in] name     What the span was.  Only the pointer is kept, so this must be a string literal.
+ * @param[in] category The span's category, such as "usb".  Also a string literal.
+ * @param[in] begin_ns When the span began, from \c Tracer::now_ns
+ * @param[in] end_ns   When it ended
+ * @param[in] track    The camera it was for, from \c Tracer::add_track, or 0 for none
+ * @param[in] arg_name (optional) The name of a number to show with the span, such as "bytes".  Also a string literal.
+ * @param[in] arg      The number
+ */
+void Tracer::record(const char * name, const char * category, const uint64_t begin_ns, const uint64_t end_ns,
+                    const int track, const char * arg_name, const int64_t arg) {
+    if(!Tracer::is_enabled()) return;
+
+    TraceRing * ring = get_ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);   // A reader that sees any of this also sees head
+    TraceSlot& slot = ring->events[head % RING_EVENTS];
+    slot.begin_ns.store(begin_ns, std::memory_order_relaxed);
+    slot.end_ns.store(end_ns, std::memory_order_relaxed);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.category.store(category, std::memory_order_relaxed);
+    slot.arg_name.store(arg_name, std::memory_order_relaxed);
+    slot.arg.store(arg, std::memory_order_relaxed);
+    slot.track.store(track, std::memory_order_relaxed);
+    slot.tid.store(ring->tid, std::memory_order_relaxed);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+/**
+ * @brief Make a track, which puts spans for one camera together in a trace
+ *
+ * Each \c CameraBase makes one for itself.
+ *
+ * @param[in] name What to call the track in a trace
+ * @return The track's number, for \c Tracer::record
+ */
+int Tracer::add_track(const std::string name) {
+    int track = next_track.fetch_add(1);
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    track_names[track] = name;
+
+    return track;
+}
+
+/**
+ * @brief Rename a track
+ *
+ * @param[in] track A track from \c Tracer::add_track
+ * @param[in] name  What to call it in a trace
+ */
+void Tracer::set_track_name(const int track, const std::string name) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    track_names[track] = name;
+}
+
+/**
+ * @brief Name the calling thread's row in a trace
+ *
+ * @param[in] name What to call the thread
+ */
+void Tracer::set_thread_name(const std::string name) {
+    int tid = (int)syscall(SYS_gettid);
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    thread_names[tid] = name;
+}
+
+/**
+ * @brief Format everything recorded as Chrome trace JSON
+ *
+ * Safe to call while tracing is running.  The rings are copied as they are,
+ * then any events that were being overwritten during the copy are left out,
+ * like a seqlock reader.  A thread writes the slot of event \c head before it
+ * moves head on, so the oldest event still whole is the one after
+ * \c head - \c RING_EVENTS.
+ *
+ * @return A JSON object with a \c traceEvents array, which chrome://tracing and Perfetto can open
+ */
+std::string Tracer::format_chrome() {
+    std::vector<TraceEvent> events;
+    std::map<std::pair<int, int>, std::string> threads;     // (track, tid) to thread name
+    std::map<int, std::string> tracks;
+    size_t i;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        tracks = track_names;
+        std::map<int, std::string> names = thread_names;
+
+        for(i = 0; i < rings->size(); i++) {
+            TraceRing * ring = (*rings)[i];
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t first = (head > (uint64_t)RING_EVENTS) ? head - RING_EVENTS : 0;
+            std::vector<TraceEvent> copied;
+            uint64_t n;
+            for(n = first; n < head; n++) {
+                const TraceSlot& slot = ring->events[n % RING_EVENTS];
+                TraceEvent event;
+                event.begin_ns = slot.begin_ns.load(std::memory_order_relaxed);
+                event.end_ns = slot.end_ns.load(std::memory_order_relaxed);
+                event.name = slot.name.load(std::memory_order_relaxed);
+                event.category = slot.category.load(std::memory_order_relaxed);
+                event.arg_name = slot.arg_name.load(std::memory_order_relaxed);
+                event.arg = slot.arg.load(std::memory_order_relaxed);
+                event.track = slot.track.load(std::memory_order_relaxed);
+                event.tid = slot.tid.load(std::memory_order_relaxed);
+                copied.push_back(event);
+            }
+
+            // Whatever the thread wrote while we copied may have torn the oldest entries,
+            //  including the one it's writing now, at after % RING_EVENTS
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t after = ring->head.load(std::memory_order_relaxed);
+            uint64_t valid = (after >= (uint64_t)RING_EVENTS) ? after - RING_EVENTS + 1 : 0;
+            for(n = first; n < head; n++) {
+                if(n < valid) continue;
+                const TraceEvent& event = copied[n - first];
+                events.push_back(event);
+                threads[std::make_pair(event.track, event.tid)] = names[event.tid];
+            }
+        }
+    }
+
+    std::ostringstream out;
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+
+    std::map<int, bool> processes;
+    std::map<std::pair<int, int>, std::string>::const_iterator thread;
+    for(thread = threads.begin(); thread != threads.end(); thread++) {
+        processes[thread->first.first] = true;
+    }
+
+    std::map<int, bool>::const_iterator process;
+    for(process = processes.begin(); process != processes.end(); process++) {
+        std::string name = "libptp++";
+        if(process->first != 0) {
+            std::map<int, std::string>::const_iterator found = tracks.find(process->first);
+            if(found != tracks.end() && !found->second.empty()) {
+                name = found->second;
+            } else {
+                std::ostringstream numbered;
+                numbered << "camera " << process->first;
+                name = numbered.str();
+            }
+        }
+        out << (first ? "\n" : ",\n") << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << process->first << ",\"args\":{\"name\":";
+        write_json_string(out, name);
+        out << "}}";
+        first = false;
+    }
+
+    for(thread = threads.begin(); thread != threads.end(); thread++) {
+        if(thread->second.empty()) continue;
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << thread->first.first << ",\"tid\":" << thread->first.second << ",\"args\":{\"name\":";
+        write_json_string(out, thread->second);
+        out << "}}";
+    }
+
+    for(i = 0; i < events.size(); i++) {
+        const TraceEvent& event = events[i];
+        out << (first ? "\n" : ",\n") << "{\"name\":";
+        write_json_string(out, event.name);
+        out << ",\"cat\":";
+        write_json_string(out, event.category);
+        out << ",\"ph\":\"X\",\"ts\":";
+        write_us(out, event.begin_ns);
+        out << ",\"dur\":";
+        write_us(out, (event.end_ns > event.begin_ns) ? event.end_ns - event.begin_ns : 0);
+        out << ",\"pid\":" << event.track << ",\"tid\":" << event.tid;
+        if(event.arg_name != NULL) {
+            out << ",\"args\":{";
+            write_json_string(out, event.arg_name);
+            out << ":" << event.arg << "}";
+        }
+        out << "}";
+        first = false;
+    }
+
+    out << "\n]}\n";
+    return out.str();
+}
+
+/**
+ * @brief Write \c Tracer::format_chrome to a file
+ *
+ * The file is written under a temporary name and renamed into place, so
+ * nothing ever sees half a trace.
+ *
+ * @param[in] path Where to write the trace, conventionally ending in .json
+ * @return True if the file was written
+ */
+bool Tracer::write_chrome(const std::string path) {
+    return write_file_atomically(path, Tracer::format_chrome());
+}
+
+/**
+ * @brief Read the clock spans are timed with
+ *
+ * @return CLOCK_MONOTONIC, in nanoseconds
+ */
+uint64_t Tracer::now_ns() {
+    return monotonic_ns();
+}
+
+} /* namespace PTP */
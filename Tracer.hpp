@@ -0,0 +1,77 @@
+#ifndef LIBPTP_PP_TRACER_H_
+#define LIBPTP_PP_TRACER_H_
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+/*
+ * Trace points are only compiled in when LIBPTP_PP_TRACE is defined; otherwise
+ * LIBPTP_PP_TRACE_SCOPE expands to nothing.  The arguments are those of
+ * PTP::Tracer::Scope::Scope, and the span lasts until the end of the enclosing block.
+ */
+#ifdef LIBPTP_PP_TRACE
+#define LIBPTP_PP_TRACE_CONCAT_(a, b) a##b
+#define LIBPTP_PP_TRACE_CONCAT(a, b) LIBPTP_PP_TRACE_CONCAT_(a, b)
+#define LIBPTP_PP_TRACE_SCOPE(...) PTP::Tracer::Scope LIBPTP_PP_TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+#else
+#define LIBPTP_PP_TRACE_SCOPE(...) ((void)0)
+#endif
+
+namespace PTP {
+
+    class Tracer {
+        public:
+            static const int RING_EVENTS = 8192;    // Per thread; older events are overwritten
+
+            // Times the block it lives in, if tracing was on when it was made
+            class Scope {
+                public:
+                    Scope(const char * name, const char * category, const int track=0, const char * arg_name=NULL, const int64_t arg=0) {
+                        this->begin_ns = Tracer::is_enabled() ? Tracer::now_ns() : 0;
+                        this->name = name;
+                        this->category = category;
+                        this->track = track;
+                        this->arg_name = arg_name;
+                        this->arg = arg;
+                    }
+                    ~Scope() {
+                        if(this->begin_ns != 0) {
+                            Tracer::record(this->name, this->category, this->begin_ns, Tracer::now_ns(), this->track, this->arg_name, this->arg);
+                        }
+                    }
+
+                private:
+                    uint64_t begin_ns;
+                    const char * name;
+                    const char * category;
+                    int track;
+                    const char * arg_name;
+                    int64_t arg;
+
+                    Scope(const Scope&);
+                    Scope& operator=(const Scope&);
+            };
+
+            static void start();
+            static void stop();
+            static bool is_enabled() { return Tracer::enabled.load(std::memory_order_relaxed); }
+            static void clear();
+            static void record(const char * name, const char * category, const uint64_t begin_ns, const uint64_t end_ns,
+                               const int track=0, const char * arg_name=NULL, const int64_t arg=0);
+            static int add_track(const std::string name);
+            static void set_track_name(const int track, const std::string name);
+            static void set_thread_name(const std::string name);
+            static std::string format_chrome();
+            static bool write_chrome(const std::string path);
+            static uint64_t now_ns();
+
+        private:
+            static std::atomic<bool> enabled;
+
+            Tracer();   // Everything is static
+    };
+
+}
+
+#endif /* LIBPTP_PP_TRACER_H_ */
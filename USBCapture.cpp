@@ -0,0 +1,167 @@
+/**
+ * @file USBCapture.cpp
+ *
+ * @brief Records every container a camera sends and receives, with timings
+ *
+ * A camera given a \c USBRecorder with \c CameraBase::set_capture writes
+ * each container that crosses the wire to a capture file: which way it went,
+ * when, how long the transfer took, whether it failed, and the container
+ * itself.  \c ReplayCamera plays a capture back, so a session from the field
+ * can be run again, as it happened, with no camera attached.
+ *
+ * Most of a live view session is viewport data.  To keep long captures
+ * small, containers can be cut short at \c max_stored bytes; the length they
+ * had on the wire is still recorded, and \c ReplayCamera makes the rest up
+ * with zeros.  512 bytes keeps every PTP header, and the live view headers and
+ * descriptors, so the sizes, timings and frame layouts of a two hour session
+ * fit in a hundred megabytes or so, at the cost of black frames on replay.
+ *
+ * Writes go through stdio's buffer, so recording a container is a memcpy,
+ * most of the time.  If a write fails, the recorder stops writing and says so
+ * in \c USBRecorder::is_failed, rather than throwing in the middle of a
+ * transaction.
+ */
+
+#include <cstring>
+#include <stdint.h>
+
+#include "libptp++.hpp"
+#include "USBCapture.hpp"
+#include "Util.hpp"
+
+namespace PTP {
+
+using namespace USBCaptureFormat;
+
+static const size_t WRITE_BUFFER_BYTES = 1024 * 1024;
+
+/**
+ * @brief Start a new capture at \a path
+ *
+ * Anything already at \a path is overwritten.  A recorder should only be
+ * given to one camera; containers from two would be interleaved, and
+ * couldn't be replayed.
+ *
+ * @param[in] path       Where to write the capture
+ * @param[in] max_stored The most bytes of each container to keep, or 0 to keep them whole
+ * @exception ERR_USBCAPTURE_CANNOT_OPEN If the file can't be created.
+ */
+USBRecorder::USBRecorder(const std::string path, const uint32_t max_stored) {
+    this->max_stored = max_stored;
+    this->start_ns = monotonic_ns();
+    this->records = 0;
+    this->bytes_written = 0;
+    this->failed = false;
+
+    this->file = fopen(path.c_str(), "wb");
+    if(this->file == NULL) {
+        throw ERR_USBCAPTURE_CANNOT_OPEN;
+    }
+    setvbuf(this->file, NULL, _IOFBF, WRITE_BUFFER_BYTES);
+
+    FileHeader header = { MAGIC, VERSION, max_stored, 0 };
+    if(fwrite(&header, sizeof(header), 1, this->file) != 1) {
+        fclose(this->file);
+        throw ERR_USBCAPTURE_CANNOT_OPEN;
+    }
+    this->bytes_written = sizeof(header);
+}
+
+/**
+ * @brief Finishes the capture
+ */
+USBRecorder::~USBRecorder() {
+    this->close();
+}
+
+/**
+ * @brief Write out anything still buffered, so the capture can be read as it stands
+ */
+void USBRecorder::flush() {
+    if(this->file == NULL) return;
+
+    if(fflush(this->file) != 0) {
+        this->failed = true;
+    }
+}
+
+/**
+ * @brief Finish the capture.  Containers reported after this aren't recorded.
+ */
+void USBRecorder::close() {
+    if(this->file == NULL) return;
+
+    if(fclose(this->file) != 0) {
+        this->failed = true;
+    }
+    this->file = NULL;
+}
+
+/**
+ * @brief Determine whether a write to the capture has failed
+ *
+ * Once one has, nothing more is recorded, and the capture ends with the last
+ * container written whole.
+ */
+bool USBRecorder::is_failed() const {
+    return this->failed;
+}
+
+/**
+ * @brief Retrieve the number of containers recorded
+ */
+uint64_t USBRecorder::get_record_count() const {
+    return this->records;
+}
+
+/**
+ * @brief Retrieve the size of the capture so far, in bytes, including anything still buffered
+ */
+uint64_t USBRecorder::get_bytes_written() const {
+    return this->bytes_written;
+}
+
+/**
+ * @brief Record a container
+ *
+ * The container is passed in two pieces, so \c CameraBase::recv_ptp_message
+ * can hand over its header and payload where they lie.
+ *
+ * @param[in] direction   Which way it went
+ * @param[in] result      The libusb error its transfer failed with, or 0
+ * @param[in] begin_ns    When the transfer started, from CLOCK_MONOTONIC
+ * @param[in] end_ns      When it finished
+ * @param[in] head        The first bytes of the container
+ * @param[in] head_length How many there are
+ * @param[in] tail        The rest of the container; may be NULL if \a tail_length is 0
+ * @param[in] tail_length How many bytes that is
+ */
+void USBRecorder::append(const DIRECTION direction, const int result, const uint64_t begin_ns, const uint64_t end_ns,
+                         const uint8_t * head, const uint32_t head_length, const uint8_t * tail, const uint32_t tail_length) {
+    if(this->file == NULL || this->failed) return;
+
+    RecordHeader record;
+    record.direction = direction;
+    record.reserved = 0;
+    record.result = (int16_t)result;
+    record.length = head_length + tail_length;
+    record.stored = (this->max_stored != 0 && record.length > this->max_stored) ? this->max_stored : record.length;
+    record.duration_us = (uint32_t)((end_ns - begin_ns) / 1000);
+    record.begin_us = (begin_ns > this->start_ns) ? (begin_ns - this->start_ns) / 1000 : 0;
+
+    const uint32_t from_head = (record.stored < head_length) ? record.stored : head_length;
+    const uint32_t from_tail = record.stored - from_head;
+
+    bool ok = (fwrite(&record, sizeof(record), 1, this->file) == 1);
+    if(ok && from_head > 0) ok = (fwrite(head, 1, from_head, this->file) == from_head);
+    if(ok && from_tail > 0) ok = (fwrite(tail, 1, from_tail, this->file) == from_tail);
+    if(!ok) {
+        this->failed = true;
+        return;
+    }
+
+    this->records++;
+    this->bytes_written += sizeof(record) + record.stored;
+}
+
+} /* namespace PTP */
@@ -0,0 +1,69 @@
+#ifndef LIBPTP_PP_USBCAPTURE_H_
+#define LIBPTP_PP_USBCAPTURE_H_
+
+#include <cstdio>
+#include <string>
+#include <stdint.h>
+
+namespace PTP {
+
+    // On-disk layout, in host byte order.  A FileHeader, then a RecordHeader
+    // per container, each followed by the first RecordHeader::stored bytes of
+    // the container as it went over the wire.  Nothing is padded.
+    namespace USBCaptureFormat {
+        static const uint32_t MAGIC = 0x43425355;   // "USBC"
+        static const uint32_t VERSION = 1;
+
+        enum DIRECTION {
+            DIRECTION_OUT = 1,      // Host to camera
+            DIRECTION_IN = 2        // Camera to host
+        };
+
+        struct FileHeader {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t max_stored;    // Containers longer than this were cut short; 0 if none were
+            uint32_t reserved;
+        };
+
+        struct RecordHeader {
+            uint8_t direction;      // A DIRECTION
+            uint8_t reserved;
+            int16_t result;         // The libusb_error of the transfer, or 0
+            uint32_t length;        // Bytes that went over the wire
+            uint32_t stored;        // Bytes of them that follow; less than length if cut short
+            uint32_t duration_us;   // How long the transfer took
+            uint64_t begin_us;      // When it started, from the start of the capture
+        };
+    }
+
+    class USBRecorder {
+        public:
+            USBRecorder(const std::string path, const uint32_t max_stored=0);
+            ~USBRecorder();
+            void flush();
+            void close();
+            bool is_failed() const;
+            uint64_t get_record_count() const;
+            uint64_t get_bytes_written() const;
+
+        private:
+            FILE * file;
+            uint32_t max_stored;
+            uint64_t start_ns;
+            uint64_t records;
+            uint64_t bytes_written;
+            bool failed;                // A write failed, so nothing more is written
+
+            USBRecorder(const USBRecorder&);    // Owns an open file, so it can't be copied
+            USBRecorder& operator=(const USBRecorder&);
+
+            // CameraBase::send_ptp_message and recv_ptp_message report each container here
+            friend class CameraBase;
+            void append(const USBCaptureFormat::DIRECTION direction, const int result, const uint64_t begin_ns, const uint64_t end_ns,
+                        const uint8_t * head, const uint32_t head_length, const uint8_t * tail, const uint32_t tail_length);
+    };
+
+}
+
+#endif /* LIBPTP_PP_USBCAPTURE_H_ */
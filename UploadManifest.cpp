@@ -0,0 +1,193 @@
+/**
+ * @file UploadManifest.cpp
+ *
+ * @brief A local record of what has already been uploaded to a camera
+ *
+ * An \c UploadManifest remembers, for one camera, the content hash and size of
+ * every file uploaded through \c CHDKCamera::upload_file_cached, along with the
+ * modification time the camera reported for it.  This lets us skip uploads of
+ * files that are already current on the card.
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdint.h>
+
+#include "UploadManifest.hpp"
+
+namespace PTP {
+
+/**
+ * @brief Create a new, empty \c UploadManifest which is not backed by a file
+ */
+UploadManifest::UploadManifest() {
+    ;
+}
+
+/**
+ * @brief Create an \c UploadManifest backed by \a filename
+ *
+ * If \a filename exists, the manifest is loaded from it.  Otherwise, the
+ * manifest starts empty and \a filename will be created on \c UploadManifest::save.
+ *
+ * @param[in] filename The local manifest file.  Use one file per camera.
+ * @see UploadManifest::load
+ */
+UploadManifest::UploadManifest(const std::string filename) {
+    this->load(filename);
+}
+
+/**
+ * @brief Load manifest entries from \a filename
+ *
+ * Any entries currently in the manifest are discarded.  Each line of the
+ * file holds the hex content hash, size, camera mtime, and remote filename of
+ * one entry.  Lines which can't be parsed are ignored, so a damaged manifest
+ * only ever causes extra uploads.
+ *
+ * @param[in] filename The local manifest file to read
+ * @return True if the file was read, false if it could not be opened
+ */
+bool UploadManifest::load(const std::string filename) {
+    this->filename = filename;
+    this->entries.clear();
+
+    std::ifstream stream(filename.c_str());
+    if(!stream.is_open()) {
+        return false;
+    }
+
+    std::string line;
+    while(std::getline(stream, line)) {
+        if(line.empty() || line[0] == '#') continue;
+
+        std::istringstream fields(line);
+        Entry entry;
+        std::string remote_filename;
+
+        fields >> std::hex >> entry.hash >> std::dec >> entry.size >> entry.mtime;
+        fields.get();   // Skip the single space in front of the filename
+        std::getline(fields, remote_filename);  // Filename is the rest of the line; it may contain spaces
+
+        if(fields.fail() || remote_filename.empty()) continue;
+
+        this->entries[remote_filename] = entry;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Write the manifest back to the file it was loaded from
+ *
+ * @return True on success, false if there is no backing file or it can't be written
+ * @see UploadManifest::save(const std::string filename)
+ */
+bool UploadManifest::save() const {
+    if(this->filename.empty()) return false;
+
+    return this->save(this->filename);
+}
+
+/**
+ * @brief Write the manifest to \a filename
+ *
+ * The manifest is written to a temporary file which is then renamed over
+ * \a filename, so an interrupted save never leaves a half-written manifest.
+ *
+ * @param[in] filename The local manifest file to write
+ * @return True on success
+ */
+bool UploadManifest::save(const std::string filename) const {
+    std::string tmp_filename = filename + ".tmp";
+    std::ofstream stream(tmp_filename.c_str(), std::ios::out | std::ios::trunc);
+    if(!stream.is_open()) {
+        return false;
+    }
+
+    stream << "# libptp++ upload manifest: hash size mtime remote_filename" << std::endl;
+
+    std::map<std::string, Entry>::const_iterator it;
+    for(it = this->entries.begin(); it != this->entries.end(); it++) {
+        stream << std::hex << it->second.hash << std::dec << ' '
+               << it->second.size << ' ' << it->second.mtime << ' ' << it->first << '\n';
+    }
+
+    stream.close();
+    if(stream.fail()) {
+        return false;
+    }
+
+    return (std::rename(tmp_filename.c_str(), filename.c_str()) == 0);
+}
+
+/**
+ * @brief Look up the manifest entry for \a remote_filename
+ *
+ * @param[in] remote_filename The path of the file on the camera
+ * @return The entry for the file, or NULL if it has never been uploaded
+ */
+const UploadManifest::Entry * UploadManifest::find(const std::string remote_filename) const {
+    std::map<std::string, Entry>::const_iterator it = this->entries.find(remote_filename);
+    if(it == this->entries.end()) return NULL;
+
+    return &(it->second);
+}
+
+/**
+ * @brief Record that a file has been uploaded to \a remote_filename
+ *
+ * @param[in] remote_filename The path of the file on the camera
+ * @param[in] hash The content hash of the uploaded file, from \c UploadManifest::hash
+ * @param[in] size The size of the uploaded file
+ * @param[in] mtime The modification time the camera reports for the file
+ */
+void UploadManifest::update(const std::string remote_filename, const uint64_t hash, const uint32_t size, const uint32_t mtime) {
+    Entry entry;
+    entry.hash = hash;
+    entry.size = size;
+    entry.mtime = mtime;
+
+    this->entries[remote_filename] = entry;
+}
+
+/**
+ * @brief Forget about \a remote_filename, so that it is uploaded next time
+ *
+ * @param[in] remote_filename The path of the file on the camera
+ */
+void UploadManifest::remove(const std::string remote_filename) {
+    this->entries.erase(remote_filename);
+}
+
+/**
+ * @brief Forget about every file, so that all of them are uploaded next time
+ */
+void UploadManifest::clear() {
+    this->entries.clear();
+}
+
+/**
+ * @brief Compute the content hash used to identify uploaded files
+ *
+ * This is a 64-bit FNV-1a hash.  It is meant to detect changed files, not to
+ * resist deliberate collisions.
+ *
+ * @param[in] data The address of the first byte of file contents
+ * @param[in] size The number of bytes in \a data
+ * @return The 64-bit hash of \a data
+ */
+uint64_t UploadManifest::hash(const uint8_t * data, const uint32_t size) {
+    uint64_t h = 0xcbf29ce484222325ULL;     // FNV offset basis
+    uint32_t i;
+
+    for(i = 0; i < size; i++) {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;              // FNV prime
+    }
+
+    return h;
+}
+
+} /* namespace PTP */
@@ -0,0 +1,36 @@
+#ifndef LIBPTP_PP_UPLOADMANIFEST_H_
+#define LIBPTP_PP_UPLOADMANIFEST_H_
+
+#include <map>
+#include <string>
+#include <stdint.h>
+
+namespace PTP {
+
+    class UploadManifest {
+        public:
+            struct Entry {
+                uint64_t hash;      // Content hash of the local file that was uploaded
+                uint32_t size;      // Size of the file, in bytes
+                uint32_t mtime;     // Modification time reported by the camera after upload
+            };
+
+            UploadManifest();
+            UploadManifest(const std::string filename);
+            bool load(const std::string filename);
+            bool save() const;
+            bool save(const std::string filename) const;
+            const Entry * find(const std::string remote_filename) const;
+            void update(const std::string remote_filename, const uint64_t hash, const uint32_t size, const uint32_t mtime);
+            void remove(const std::string remote_filename);
+            void clear();
+            static uint64_t hash(const uint8_t * data, const uint32_t size);
+
+        private:
+            std::string filename;
+            std::map<std::string, Entry> entries;
+    };
+
+}
+
+#endif /* LIBPTP_PP_UPLOADMANIFEST_H_ */
@@ -0,0 +1,141 @@
+/**
+ * @file Util.cpp
+ *
+ * @brief Small system helpers shared across the library
+ *
+ * Metrics, traces, brokers and live view publishers all write files that
+ * readers mustn't see half-written, and serve Unix sockets from a thread of
+ * their own.  These do it one way, in one place.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Util.hpp"
+
+namespace PTP {
+
+/**
+ * @brief Replace the file at \a path with \a text, all at once
+ *
+ * Writes a temporary file beside it and renames it into place, so a reader
+ * sees either the old contents or the new, never part of them.
+ *
+ * @param[in] path Where to write
+ * @param[in] text What to write there
+ * @return False if the file couldn't be written; it's left as it was.
+ */
+bool write_file_atomically(const std::string path, const std::string& text) {
+    const std::string temp = path + ".tmp";
+
+    FILE * f = fopen(temp.c_str(), "w");
+    if(f == NULL) {
+        return false;
+    }
+    bool ok = (fwrite(text.data(), 1, text.size(), f) == text.size());
+    ok = (fclose(f) == 0) && ok;
+    if(!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        unlink(temp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+UnixServer::UnixServer() {
+    this->listen_fd = -1;
+    this->listening = false;
+}
+
+UnixServer::~UnixServer() {
+    this->stop();
+}
+
+/**
+ * @brief Accept connections on the Unix socket at \a path, from a thread of its own
+ *
+ * Anything already at \a path is replaced.  Stops listening anywhere else first.
+ *
+ * @param[in] path          Where to create the socket
+ * @param[in] backlog       Connections that may wait to be accepted
+ * @param[in] on_connection Called on the server's thread with each new
+ *                          connection, which it must close
+ * @param[in] on_idle       If set, called on the server's thread between
+ *                          connections, and at least every 100 ms
+ * @return False if the socket couldn't be created.
+ */
+bool UnixServer::listen(const std::string path, const int backlog, const std::function<void(int)>& on_connection,
+                        const std::function<void()>& on_idle) {
+    this->stop();
+
+    struct sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    std::strcpy(address.sun_path, path.c_str());
+
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0) {
+        return false;
+    }
+
+    unlink(path.c_str());
+    if(bind(s, (struct sockaddr *)&address, sizeof(address)) != 0 || ::listen(s, backlog) != 0) {
+        close(s);
+        return false;
+    }
+
+    this->socket_path = path;
+    this->listen_fd = s;
+    this->on_connection = on_connection;
+    this->on_idle = on_idle;
+    this->listening = true;
+    this->listener = std::thread(&UnixServer::serve, this);
+
+    return true;
+}
+
+/**
+ * @brief Stop accepting connections, and remove the socket
+ *
+ * Connections already handed out are unaffected.  Does nothing if not listening.
+ */
+void UnixServer::stop() {
+    this->listening = false;
+    if(this->listener.joinable()) {
+        this->listener.join();
+    }
+
+    if(this->listen_fd >= 0) {
+        close(this->listen_fd);
+        unlink(this->socket_path.c_str());
+        this->listen_fd = -1;
+    }
+}
+
+/**
+ * @brief The listening thread: hand each connection to \c on_connection
+ */
+void UnixServer::serve() {
+    while(this->listening) {
+        if(this->on_idle) {
+            this->on_idle();
+        }
+
+        struct pollfd p = { this->listen_fd, POLLIN, 0 };
+        if(poll(&p, 1, 100) <= 0) continue;     // Wake up now and then to check for stop()
+
+        int connection = accept4(this->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(connection < 0) continue;
+
+        this->on_connection(connection);
+    }
+}
+
+} /* namespace PTP */
@@ -0,0 +1,51 @@
+#ifndef LIBPTP_PP_UTIL_H_
+#define LIBPTP_PP_UTIL_H_
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <stdint.h>
+
+namespace PTP {
+
+    // Internal helpers shared by the classes that need them; not part of the API.
+
+    inline uint64_t monotonic_ns() {                // CLOCK_MONOTONIC, so comparable between processes
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    inline uint64_t monotonic_us() {
+        return monotonic_ns() / 1000;
+    }
+
+    bool write_file_atomically(const std::string path, const std::string& text);
+
+    class UnixServer {
+        public:
+            UnixServer();
+            ~UnixServer();
+            bool listen(const std::string path, const int backlog, const std::function<void(int)>& on_connection,
+                        const std::function<void()>& on_idle=std::function<void()>());
+            void stop();
+
+        private:
+            std::string socket_path;
+            int listen_fd;
+            std::thread listener;
+            std::atomic<bool> listening;
+            std::function<void(int)> on_connection;     // Owns the connection it's given
+            std::function<void()> on_idle;              // Called at least every 100 ms
+
+            UnixServer(const UnixServer&);      // Owns a thread, so it can't be copied
+            UnixServer& operator=(const UnixServer&);
+
+            void serve();
+    };
+
+}
+
+#endif /* LIBPTP_PP_UTIL_H_ */
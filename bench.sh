@@ -0,0 +1,15 @@
+#!/bin/sh
+
+# This script builds the benchmarks in bench/. Run them from the top directory,
+#  e.g. ./bench/lvconvert_bench
+#
+# bench/lvwidth_check isn't a benchmark: it exits with 1 if converting a frame
+#  that claims more visible width than its buffer holds writes past the output.
+#
+# bench/throughput_bench writes JSON; pass it an earlier run with -b to fail on
+#  regressions, e.g. ./bench/throughput_bench -o new.json -b old.json
+
+g++ -std=c++20 -O2 bench/lvconvert_bench.cpp LVConverter.cpp -o bench/lvconvert_bench
+g++ -std=c++20 -O2 bench/lvparallel_bench.cpp LVData.cpp LVConverter.cpp LVJpegEncoder.cpp PTPContainer.cpp ThreadPool.cpp -o bench/lvparallel_bench -pthread
+g++ -std=c++20 -O2 bench/lvwidth_check.cpp LVData.cpp LVConverter.cpp LVJpegEncoder.cpp PTPContainer.cpp ThreadPool.cpp -o bench/lvwidth_check -pthread
+g++ -std=c++20 -O2 bench/throughput_bench.cpp CameraBase.cpp CameraExecutor.cpp CameraMetrics.cpp CHDKCamera.cpp FakeCamera.cpp LVData.cpp LVConverter.cpp LVJpegEncoder.cpp PTPContainer.cpp ThreadPool.cpp Tracer.cpp UploadManifest.cpp USBCapture.cpp Util.cpp -o bench/throughput_bench -lusb-1.0 -pthread
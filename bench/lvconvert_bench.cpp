@@ -0,0 +1,93 @@
+/**
+ * @file lvconvert_bench.cpp
+ *
+ * @brief Measures live view YUV to RGB conversion speed for each kernel
+ *
+ * Converts a synthetic frame at the viewport sizes of common CHDK cameras
+ * with every kernel this CPU supports, to every packed color format, with the
+ * default full range BT.601 and with limited range BT.709, and prints
+ * megapixels per second of output.  Each kernel's output is also checked
+ * against the scalar reference.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+#include <stdint.h>
+
+#include "../LVConverter.hpp"
+
+using namespace PTP;
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char ** argv) {
+    static const int sizes[][2] = { {720, 240}, {960, 270} };
+    static const LVData::PIXEL_FORMAT formats[] = { LVData::FORMAT_RGB24, LVData::FORMAT_RGBA32,
+                                                    LVData::FORMAT_BGRA32, LVData::FORMAT_RGB565 };
+    static const char * format_names[] = { "rgb24", "rgba32", "bgra32", "rgb565" };
+    static const int format_bytes_per_pixel[] = { 3, 4, 4, 2 };
+    static const LVData::COLOR_MATRIX matrices[] = { LVData::MATRIX_BT601, LVData::MATRIX_BT709 };
+    static const LVData::COLOR_RANGE ranges[] = { LVData::RANGE_FULL, LVData::RANGE_LIMITED };
+    static const char * color_names[] = { "601full", "709ltd" };
+    const double min_time = (argc > 1) ? atof(argv[1]) : 0.5;    // Seconds to run each case for
+    unsigned int i, f, c;
+    int isa, skip;
+
+    printf("%-8s %-8s %-8s %-10s %-5s %10s %10s\n", "kernel", "format", "color", "viewport", "skip", "MP/s", "exact");
+
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int width = sizes[i][0], height = sizes[i][1];
+        int pixels = width * height;
+        uint8_t * yuv = new uint8_t[pixels * 12 / 8];
+        uint8_t * ref = new uint8_t[pixels * 4];
+        uint8_t * out = new uint8_t[pixels * 4];
+        int j;
+
+        srand(1);
+        for(j = 0; j < pixels * 12 / 8; j++) yuv[j] = rand();
+
+        for(f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+            int out_bytes_per_pixel = format_bytes_per_pixel[f];
+
+            for(c = 0; c < 2; c++) {
+                for(skip = 0; skip < 2; skip++) {
+                    LVData::ConvertOptions options(skip, matrices[c], ranges[c]);
+                    int out_pixels = skip ? pixels / 2 : pixels;
+                    LVConverter::yuv8_to_rgb(yuv, ref, pixels, formats[f], options, LVConverter::ISA_SCALAR);
+
+                    for(isa = LVConverter::ISA_SCALAR; isa <= LVConverter::detect_isa(); isa++) {
+                        LVConverter::ISA k = (LVConverter::ISA)isa;
+                        std::memset(out, 0, pixels * 4);
+                        LVConverter::yuv8_to_rgb(yuv, out, pixels, formats[f], options, k);
+                        bool exact = (std::memcmp(out, ref, out_pixels * out_bytes_per_pixel) == 0);
+
+                        long frames = 0;
+                        double start = now_s(), elapsed;
+                        do {
+                            LVConverter::yuv8_to_rgb(yuv, out, pixels, formats[f], options, k);
+                            frames++;
+                            elapsed = now_s() - start;
+                        } while(elapsed < min_time);
+
+                        char viewport[32];
+                        snprintf(viewport, sizeof(viewport), "%dx%d", width, height);
+                        printf("%-8s %-8s %-8s %-10s %-5s %10.1f %10s\n", LVConverter::get_isa_name(k), format_names[f], color_names[c],
+                               viewport, skip ? "yes" : "no", frames * (double)out_pixels / elapsed / 1e6, exact ? "yes" : "NO");
+                    }
+                }
+            }
+        }
+
+        delete[] yuv;
+        delete[] ref;
+        delete[] out;
+    }
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+/**
+ * @file lvparallel_bench.cpp
+ *
+ * @brief Measures how live view conversion scales with the number of threads
+ *
+ * Builds synthetic live view frames at a CHDK viewport size and at HDMI
+ * sizes, and converts them with \c LVData::convert split into 1 to N bands on
+ * one \c ThreadPool, where N is the number of CPUs.  Prints megapixels per
+ * second and the speedup over one thread, and checks each output against the
+ * single threaded one.
+ *
+ * Usage: lvparallel_bench [seconds per case] [maximum threads]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+#include <stdint.h>
+
+#include "../libptp++.hpp"
+#include "../LVData.hpp"
+#include "../ThreadPool.hpp"
+
+using namespace PTP;
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Build a live view payload with a random \a width x \a height viewport
+ *
+ * @param[out] size Set to the size of the payload
+ * @return The payload; delete[] it when done
+ */
+static uint8_t * make_frame(const int width, const int height, int * size) {
+    lv_data_header head;
+    lv_framebuffer_desc vp, bm;
+    std::memset(&head, 0, sizeof(head));
+    std::memset(&vp, 0, sizeof(vp));
+    std::memset(&bm, 0, sizeof(bm));
+
+    head.version_major = 2;
+    head.version_minor = 1;
+    head.vp_desc_start = sizeof(head);
+    head.bm_desc_start = sizeof(head) + sizeof(vp);
+
+    vp.fb_type = LV_FB_YUV8;
+    vp.data_start = sizeof(head) + sizeof(vp) + sizeof(bm);
+    vp.buffer_width = width;
+    vp.visible_width = width;
+    vp.visible_height = height;
+    bm.fb_type = LV_FB_PAL8;
+
+    int vp_size = width * height * 12 / 8;
+    *size = vp.data_start + vp_size;
+    uint8_t * frame = new uint8_t[*size];
+    std::memcpy(frame, &head, sizeof(head));
+    std::memcpy(frame + head.vp_desc_start, &vp, sizeof(vp));
+    std::memcpy(frame + head.bm_desc_start, &bm, sizeof(bm));
+
+    int i;
+    for(i = 0; i < vp_size; i++) frame[vp.data_start + i] = rand();
+
+    return frame;
+}
+
+int main(int argc, char ** argv) {
+    static const int sizes[][2] = { {720, 240}, {1280, 720}, {1920, 1080} };
+    static const LVData::PIXEL_FORMAT formats[] = { LVData::FORMAT_RGBA32, LVData::FORMAT_RGB24, LVData::FORMAT_I420 };
+    static const char * format_names[] = { "rgba32", "rgb24", "i420" };
+    const double min_time = (argc > 1) ? atof(argv[1]) : 0.5;    // Seconds to run each case for
+    ThreadPool pool((argc > 2) ? atoi(argv[2]) : 0);
+    unsigned int i, f;
+    int threads;
+
+    printf("%-8s %-10s %-8s %10s %10s %10s\n", "format", "viewport", "threads", "MP/s", "speedup", "identical");
+
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int width = sizes[i][0], height = sizes[i][1];
+        int frame_size;
+        uint8_t * frame = make_frame(width, height, &frame_size);
+        LVData lv;
+        lv.view(frame, frame_size);
+
+        for(f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+            int stride = width * LVData::get_bytes_per_pixel(formats[f]);
+            int out_size = lv.get_buffer_size(formats[f], stride);
+            uint8_t * ref = new uint8_t[out_size];
+            uint8_t * out = new uint8_t[out_size];
+            double serial_rate = 0;
+
+            lv.convert(formats[f], ref, stride);
+
+            for(threads = 1; threads <= pool.get_thread_count(); threads++) {
+                LVData::ConvertOptions options;
+                options.pool = &pool;
+                options.threads = threads;
+                options.parallel_threshold = 0;     // Always split, to see the small sizes too
+
+                std::memset(out, 0, out_size);
+                lv.convert(formats[f], out, stride, options);
+                bool identical = (std::memcmp(out, ref, out_size) == 0);
+
+                long frames = 0;
+                double start = now_s(), elapsed;
+                do {
+                    lv.convert(formats[f], out, stride, options);
+                    frames++;
+                    elapsed = now_s() - start;
+                } while(elapsed < min_time);
+
+                double rate = frames * (double)width * height / elapsed / 1e6;
+                if(threads == 1) serial_rate = rate;
+
+                char viewport[32];
+                snprintf(viewport, sizeof(viewport), "%dx%d", width, height);
+                printf("%-8s %-10s %-8d %10.1f %9.2fx %10s\n", format_names[f], viewport, threads, rate,
+                       rate / serial_rate, identical ? "yes" : "NO");
+            }
+
+            delete[] ref;
+            delete[] out;
+        }
+
+        delete[] frame;
+    }
+
+    return 0;
+}
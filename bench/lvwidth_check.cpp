@@ -0,0 +1,103 @@
+/**
+ * @file lvwidth_check.cpp
+ *
+ * @brief Checks conversion of frames whose visible width is past the buffer width
+ *
+ * Some cameras send a viewport descriptor that claims more visible pixels
+ * than each buffer row holds.  Converting such a frame must stay inside an
+ * output buffer sized by \c LVData::get_buffer_size.  This builds one,
+ * converts it to every format, unscaled and scaled, into buffers followed by
+ * guard bytes, and looks for anything written over them.
+ *
+ * Exits with 0 if nothing was, and 1 otherwise.  Build with
+ * -fsanitize=address to catch reads past the frame, too.
+ *
+ * Usage: lvwidth_check
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include "../libptp++.hpp"
+#include "../LVData.hpp"
+
+using namespace PTP;
+
+/**
+ * @brief Build a live view payload with a random viewport \a buffer_width wide, claiming \a visible_width
+ *
+ * @param[out] size Set to the size of the payload
+ * @return The payload; delete[] it when done
+ */
+static uint8_t * make_frame(const int buffer_width, const int visible_width, const int height, int * size) {
+    lv_data_header head;
+    lv_framebuffer_desc vp, bm;
+    std::memset(&head, 0, sizeof(head));
+    std::memset(&vp, 0, sizeof(vp));
+    std::memset(&bm, 0, sizeof(bm));
+
+    head.version_major = 2;
+    head.version_minor = 1;
+    head.vp_desc_start = sizeof(head);
+    head.bm_desc_start = sizeof(head) + sizeof(vp);
+
+    vp.fb_type = LV_FB_YUV8;
+    vp.data_start = sizeof(head) + sizeof(vp) + sizeof(bm);
+    vp.buffer_width = buffer_width;
+    vp.visible_width = visible_width;
+    vp.visible_height = height;
+    bm.fb_type = LV_FB_PAL8;
+
+    int vp_size = buffer_width * height * 12 / 8;
+    *size = vp.data_start + vp_size;
+    uint8_t * frame = new uint8_t[*size];
+    std::memcpy(frame, &head, sizeof(head));
+    std::memcpy(frame + head.vp_desc_start, &vp, sizeof(vp));
+    std::memcpy(frame + head.bm_desc_start, &bm, sizeof(bm));
+
+    int i;
+    for(i = 0; i < vp_size; i++) frame[vp.data_start + i] = rand();
+
+    return frame;
+}
+
+int main() {
+    static const LVData::PIXEL_FORMAT formats[] = { LVData::FORMAT_RGBA32, LVData::FORMAT_RGB24, LVData::FORMAT_GRAY8,
+                                                    LVData::FORMAT_I420, LVData::FORMAT_NV12 };
+    static const char * format_names[] = { "rgba32", "rgb24", "gray8", "i420", "nv12" };
+    static const int scales[] = { 1, 2 };
+    static const int guard = 4096;
+    int frame_size;
+    uint8_t * frame = make_frame(640, 720, 240, &frame_size);
+    LVData lv;
+    lv.view(frame, frame_size);
+    int failures = 0;
+    unsigned int f, s;
+
+    for(f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        for(s = 0; s < sizeof(scales) / sizeof(scales[0]); s++) {
+            LVData::ConvertOptions options;
+            options.scale = scales[s];
+            int width, height;
+            lv.get_output_size(&width, &height, options);
+            int stride = width * LVData::get_bytes_per_pixel(formats[f]);
+            int out_size = lv.get_buffer_size(formats[f], stride, options);
+            uint8_t * out = new uint8_t[out_size + guard];
+            std::memset(out + out_size, 0xa5, guard);
+
+            lv.convert(formats[f], out, stride, options);
+            int i;
+            for(i = 0; i < guard && out[out_size + i] == 0xa5; i++);
+            bool ok = (i == guard);
+            printf("%-8s scale %d  %s\n", format_names[f], scales[s], ok ? "ok" : "WROTE PAST THE OUTPUT");
+            if(!ok) failures++;
+
+            delete[] out;
+        }
+    }
+
+    delete[] frame;
+    return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,407 @@
+/**
+ * @file throughput_bench.cpp
+ *
+ * @brief Measures the protocol and image paths, and writes the results as JSON
+ *
+ * Covers building, packing and unpacking \c PTPContainer s, whole
+ * \c CameraBase::ptp_transaction round trips, file upload and download, and
+ * \c LVData::read and \c LVData::get_rgb at the viewport sizes CHDK cameras
+ * send, with and without skip.  Transactions go to a \c FakeCamera, which
+ * answers at the USB endpoints with no delay, so what's measured is the
+ * library's own cost per transaction.  They're timed again with a
+ * \c CameraMetrics counting them, to see what counting costs.
+ *
+ * Every input is made from a fixed seed.  Each case is calibrated to a batch
+ * size, then timed over several batches; the median batch is reported, with
+ * the spread between batches so noisy runs can be told apart.
+ *
+ * The results go to stdout (or \c -o) as JSON, one case per line.  Given an
+ * earlier result file with \c -b, the exit status is 1 if any case got slower
+ * by more than the tolerance, so a build can be gated on it.
+ *
+ * Usage: throughput_bench [-t seconds per case] [-r batches] [-o results.json]
+ *                         [-b baseline.json] [-x tolerance percent]
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "../libptp++.hpp"
+#include "../CameraMetrics.hpp"
+#include "../FakeCamera.hpp"
+#include "../LVConverter.hpp"
+#include "../LVData.hpp"
+#include "../PTPContainer.hpp"
+
+using namespace PTP;
+
+struct CaseResult {
+    std::string name;
+    std::string unit;       // Of value: ops/s or MB/s
+    double value;           // From the median batch; higher is better
+    double median_ns;       // Per operation
+    double min_ns;
+    double spread;          // (slowest - fastest) / median, over the batches
+    long iterations;        // Per batch
+};
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t seed = 1;
+
+/**
+ * @brief A fixed sequence of pseudo-random bytes, the same on every run
+ */
+static uint8_t next_byte() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+}
+
+/**
+ * @brief Build a live view payload with a \a width x \a height viewport
+ *
+ * @param[out] size Set to the size of the payload
+ * @return The payload; delete[] it when done
+ */
+static uint8_t * make_frame(const int width, const int height, int * size) {
+    lv_data_header head;
+    lv_framebuffer_desc vp, bm;
+    std::memset(&head, 0, sizeof(head));
+    std::memset(&vp, 0, sizeof(vp));
+    std::memset(&bm, 0, sizeof(bm));
+
+    head.version_major = 2;
+    head.version_minor = 1;
+    head.vp_desc_start = sizeof(head);
+    head.bm_desc_start = sizeof(head) + sizeof(vp);
+
+    vp.fb_type = LV_FB_YUV8;
+    vp.data_start = sizeof(head) + sizeof(vp) + sizeof(bm);
+    vp.buffer_width = width;
+    vp.visible_width = width;
+    vp.visible_height = height;
+    bm.fb_type = LV_FB_PAL8;
+
+    int vp_size = width * height * 12 / 8;
+    *size = vp.data_start + vp_size;
+    uint8_t * frame = new uint8_t[*size];
+    std::memcpy(frame, &head, sizeof(head));
+    std::memcpy(frame + head.vp_desc_start, &vp, sizeof(vp));
+    std::memcpy(frame + head.bm_desc_start, &bm, sizeof(bm));
+
+    int i;
+    for(i = 0; i < vp_size; i++) frame[vp.data_start + i] = next_byte();
+
+    return frame;
+}
+
+/**
+ * @brief Time \a op, and add the result to \a results
+ *
+ * The batch size is doubled until a batch takes a tenth of the case's time,
+ * then \a batches batches are timed.
+ *
+ * @param[in] bytes Bytes each operation moves, to report MB/s; 0 to report ops/s
+ */
+static void run_case(std::vector<CaseResult>& results, const std::string name, const double bytes,
+                     const double seconds, const int batches, const std::function<void()>& op) {
+    long n = 1, i;
+    int b;
+    double elapsed;
+
+    op();   // Warm up caches and buffers that are reused
+    while(true) {
+        double start = now_s();
+        for(i = 0; i < n; i++) op();
+        elapsed = now_s() - start;
+        if(elapsed >= seconds / 10 || n >= (1L << 30)) break;
+        n *= 2;
+    }
+
+    std::vector<double> ns;
+    for(b = 0; b < batches; b++) {
+        double start = now_s();
+        for(i = 0; i < n; i++) op();
+        ns.push_back((now_s() - start) * 1e9 / n);
+    }
+    std::sort(ns.begin(), ns.end());
+
+    CaseResult r;
+    r.name = name;
+    r.median_ns = ns[ns.size() / 2];
+    r.min_ns = ns.front();
+    r.spread = (ns.back() - ns.front()) / r.median_ns;
+    r.iterations = n;
+    if(bytes > 0) {
+        r.unit = "MB/s";
+        r.value = bytes / r.median_ns * 1e9 / 1e6;
+    } else {
+        r.unit = "ops/s";
+        r.value = 1e9 / r.median_ns;
+    }
+    results.push_back(r);
+
+    fprintf(stderr, "%-34s %14.1f %-6s %12.1f ns %7.1f%%\n", name.c_str(), r.value, r.unit.c_str(), r.median_ns, r.spread * 100);
+}
+
+/**
+ * @brief Write \a results as JSON, one case per line
+ */
+static void write_json(FILE * out, const std::vector<CaseResult>& results, const double seconds, const int batches) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"suite\": \"libptp++\",\n");
+    fprintf(out, "  \"format\": 1,\n");
+#ifdef __OPTIMIZE__
+    const bool optimized = true;
+#else
+    const bool optimized = false;
+#endif
+    fprintf(out, "  \"environment\": {\"compiler\": \"%s\", \"optimized\": %s, \"isa\": \"%s\", \"cpus\": %ld, "
+                 "\"seconds_per_case\": %g, \"batches\": %d},\n",
+            __VERSION__, optimized ? "true" : "false", LVConverter::get_isa_name(LVConverter::get_isa()),
+            sysconf(_SC_NPROCESSORS_ONLN), seconds, batches);
+    fprintf(out, "  \"results\": [\n");
+
+    unsigned int i;
+    for(i = 0; i < results.size(); i++) {
+        const CaseResult& r = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.6g, \"median_ns\": %.6g, \"min_ns\": %.6g, "
+                     "\"spread\": %.4f, \"iterations\": %ld}%s\n",
+                r.name.c_str(), r.unit.c_str(), r.value, r.median_ns, r.min_ns, r.spread, r.iterations,
+                (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+/**
+ * @brief Compare \a results with the ones in the file \a path wrote by \c write_json
+ *
+ * Cases that aren't in both are ignored.
+ *
+ * @return The number of cases that got slower by more than \a tolerance percent, or -1 if \a path can't be read
+ */
+static int compare(const std::vector<CaseResult>& results, const char * path, const double tolerance) {
+    std::ifstream in(path);
+    if(!in.is_open()) {
+        return -1;
+    }
+
+    int regressions = 0;
+    std::string line;
+    while(std::getline(in, line)) {
+        std::string::size_type name_at = line.find("\"name\": \"");
+        std::string::size_type value_at = line.find("\"value\": ");
+        if(name_at == std::string::npos || value_at == std::string::npos) continue;
+
+        name_at += 9;
+        std::string name = line.substr(name_at, line.find('"', name_at) - name_at);
+        double old_value = atof(line.c_str() + value_at + 9);
+
+        unsigned int i;
+        for(i = 0; i < results.size(); i++) {
+            if(results[i].name != name || old_value <= 0) continue;
+            double change = (results[i].value / old_value - 1) * 100;
+            bool regressed = (change < -tolerance);
+            if(regressed) regressions++;
+            fprintf(stderr, "%-34s %+7.1f%%%s\n", name.c_str(), change, regressed ? "  REGRESSION" : "");
+        }
+    }
+
+    return regressions;
+}
+
+int main(int argc, char ** argv) {
+    // Viewport sizes CHDK cameras send: 4:3 and 16:9 LCDs, and the wide buffer some models use
+    static const int sizes[][2] = { {360, 240}, {720, 240}, {960, 270}, {720, 480} };
+    double seconds = 0.5;
+    int batches = 7;
+    const char * output = NULL;
+    const char * baseline = NULL;
+    double tolerance = 10;
+    int c;
+    unsigned int i;
+
+    while((c = getopt(argc, argv, "t:r:o:b:x:")) != -1) {
+        switch(c) {
+            case 't': seconds = atof(optarg); break;
+            case 'r': batches = atoi(optarg); break;
+            case 'o': output = optarg; break;
+            case 'b': baseline = optarg; break;
+            case 'x': tolerance = atof(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-t seconds per case] [-r batches] [-o results.json] "
+                                "[-b baseline.json] [-x tolerance percent]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(batches < 1) batches = 1;
+
+    std::vector<CaseResult> results;
+
+    // Containers
+    {
+        PTPContainer cmd;
+        run_case(results, "container.add_param", 0, seconds, batches, [&]() {
+            PTPContainer fresh(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+            fresh.add_param(PTP_CHDK_GetDisplayData);
+            fresh.add_param(LV_TFR_VIEWPORT);
+            cmd.swap(fresh);
+        });
+        run_case(results, "container.pack.command", 0, seconds, batches, [&]() {
+            unsigned char * packed = cmd.pack();
+            delete[] packed;
+        });
+
+        unsigned char * packed = cmd.pack();
+        PTPContainer out;
+        run_case(results, "container.unpack.command", 0, seconds, batches, [&]() {
+            out.unpack(packed);
+        });
+        delete[] packed;
+
+        const int data_size = 256 * 1024;
+        std::vector<uint8_t> bytes(data_size);
+        for(i = 0; i < bytes.size(); i++) bytes[i] = next_byte();
+        PTPContainer data(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+        data.set_payload(bytes.data(), data_size);
+        run_case(results, "container.pack.256k", data_size, seconds, batches, [&]() {
+            unsigned char * p = data.pack();
+            delete[] p;
+        });
+
+        packed = data.pack();
+        run_case(results, "container.unpack.256k", data_size, seconds, batches, [&]() {
+            out.unpack(packed);
+        });
+        delete[] packed;
+    }
+
+    // Transactions, uploads and downloads, through CameraBase to the fake camera's endpoints
+    {
+        FakeCamera camera(720, 240);
+        run_case(results, "transaction.script_status", 0, seconds, batches, [&]() {
+            camera.check_script_status();
+        });
+
+        // The same, counted in metrics, to see what counting costs
+        FakeCamera counted(720, 240);
+        CameraMetrics metrics;
+        counted.set_metrics(&metrics, "bench");
+        run_case(results, "transaction.script_status.metrics", 0, seconds, batches, [&]() {
+            counted.check_script_status();
+        });
+
+        LVData lv;
+        int frame_bytes = 720 * 240 * 3 / 2;
+        run_case(results, "transaction.live_view.720x240", frame_bytes, seconds, batches, [&]() {
+            camera.get_live_view_data(lv);
+        });
+
+        const int file_size = 4 * 1024 * 1024;
+        char local[] = "/tmp/throughput_bench.XXXXXX";
+        int fd = mkstemp(local);
+        if(fd < 0) {
+            perror("mkstemp");
+            return 2;
+        }
+        std::string contents(file_size, '\0');
+        for(i = 0; i < contents.size(); i++) contents[i] = next_byte();
+        if(write(fd, contents.data(), contents.size()) != (ssize_t)contents.size()) {
+            perror("write");
+            return 2;
+        }
+        close(fd);
+
+        run_case(results, "transfer.upload.4m", file_size, seconds, batches, [&]() {
+            camera.upload_file(local, "A/BENCH.BIN");
+        });
+        unlink(local);
+
+        PTPContainer name(PTPContainer::CONTAINER_TYPE_DATA, 0x9999);
+        const std::string remote = "A/BENCH.BIN";
+        name.set_payload(remote.data(), remote.size());
+        PTPContainer file;
+        run_case(results, "transfer.download.4m", file_size, seconds, batches, [&]() {
+            PTPContainer temp(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999), none, resp, unused;
+            temp.add_param(PTP_CHDK_TempData);
+            temp.add_param(0);
+            camera.ptp_transaction(temp, name, false, resp, unused);
+
+            PTPContainer download(PTPContainer::CONTAINER_TYPE_COMMAND, 0x9999);
+            download.add_param(PTP_CHDK_DownloadFile);
+            camera.ptp_transaction(download, none, true, resp, file);
+        });
+        if(file.get_length() != (uint32_t)file_size + 12) {
+            fprintf(stderr, "download returned %u bytes, expected %d\n", file.get_length() - 12, file_size);
+            return 2;
+        }
+    }
+
+    // Live view decoding and conversion
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        const int width = sizes[i][0], height = sizes[i][1];
+        int frame_size;
+        uint8_t * frame = make_frame(width, height, &frame_size);
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%dx%d", width, height);
+
+        LVData lv;
+        run_case(results, std::string("lvdata.read") + suffix, frame_size, seconds, batches, [&]() {
+            lv.read(frame, frame_size);
+        });
+
+        int skip;
+        for(skip = 0; skip <= 1; skip++) {
+            int out_width, out_height;
+            lv.get_rgb_size(&out_width, &out_height, skip);
+            std::vector<uint8_t> rgb(out_width * out_height * 3);
+            run_case(results, std::string(skip ? "lvdata.get_rgb_skip" : "lvdata.get_rgb") + suffix,
+                     (double)out_width * out_height * 3, seconds, batches, [&]() {
+                lv.get_rgb(rgb.data(), out_width * 3, skip);
+            });
+        }
+
+        delete[] frame;
+    }
+
+    FILE * out = stdout;
+    if(output != NULL) {
+        out = fopen(output, "w");
+        if(out == NULL) {
+            perror(output);
+            return 2;
+        }
+    }
+    write_json(out, results, seconds, batches);
+    if(out != stdout) {
+        fclose(out);
+    }
+
+    if(baseline != NULL) {
+        int regressions = compare(results, baseline, tolerance);
+        if(regressions < 0) {
+            perror(baseline);
+            return 2;
+        }
+        if(regressions > 0) {
+            fprintf(stderr, "%d case(s) slower than %s by more than %g%%\n", regressions, baseline, tolerance);
+            return 1;
+        }
+    }
+
+    return 0;
+}
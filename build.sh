@@ -1,6 +1,8 @@
 #!/bin/sh
 
 # This script is responsible for building the libptp++ shared library.
+#
+# To build with trace points (see Tracer.hpp), run CXXFLAGS=-DLIBPTP_PP_TRACE ./build.sh
 
-g++ -shared -fPIC CameraBase.cpp CHDKCamera.cpp LVData.cpp PTPCamera.cpp PTPContainer.cpp -o libptp++.so -lusb-1.0
+g++ -std=c++20 -O2 $CXXFLAGS -shared -fPIC CameraBase.cpp CameraBroker.cpp CameraExecutor.cpp CameraMetrics.cpp CameraRig.cpp CHDKCamera.cpp FakeCamera.cpp LVData.cpp PTPCamera.cpp PTPContainer.cpp UploadManifest.cpp LVStream.cpp LVGovernor.cpp LVJpegEncoder.cpp LVRecording.cpp LVSharedRing.cpp MotionTrigger.cpp LVConverter.cpp ThreadPool.cpp Tracer.cpp USBCapture.cpp ReplayCamera.cpp Util.cpp -o libptp++.so -lusb-1.0 -pthread
 
@@ -92,10 +92,29 @@ libusb_exit(NULL);
 // This serves as a global "include" file -- include this to grab all the other
 //  headers, too
 #include "CameraBase.hpp"
+#include "CameraBroker.hpp"
+#if __cpp_impl_coroutine
+#include "CameraExecutor.hpp"  // The coroutine API needs C++20; the rest doesn't
+#endif
+#include "CameraMetrics.hpp"
+#include "CameraRig.hpp"
 #include "CHDKCamera.hpp"
+#include "FakeCamera.hpp"
 #include "LVData.hpp"
+#include "LVGovernor.hpp"
+#include "LVJpegEncoder.hpp"
+#include "LVRecording.hpp"
+#include "LVSharedRing.hpp"
+#include "LVStream.hpp"
+#include "MotionTrigger.hpp"
 #include "PTPCamera.hpp"
 #include "PTPContainer.hpp"
+#include "ReplayCamera.hpp"
+#include "Result.hpp"
+#include "ThreadPool.hpp"
+#include "Tracer.hpp"
+#include "UploadManifest.hpp"
+#include "USBCapture.hpp"
 
 namespace PTP {
 
@@ -103,7 +122,7 @@ namespace PTP {
 #include "chdk/live_view.h"
 #include "chdk/ptp.h"
 
-    enum LIBPTP_PP_ERRORS {
+    enum LIBPTP_PP_ERRORS : int {     // Also declared in Result.hpp, so the type must match
         ERR_NONE = 0,
         ERR_CANNOT_CONNECT,
         ERR_NO_DEVICE,
@@ -117,7 +136,41 @@ namespace PTP {
         ERR_PTPCONTAINER_NO_PAYLOAD,
         ERR_PTPCONTAINER_INVALID_PARAM,
         
-        ERR_LVDATA_NOT_ENOUGH_DATA
+        ERR_LVDATA_NOT_ENOUGH_DATA,
+        ERR_LVDATA_INVALID_STRIDE,
+        ERR_LVDATA_INVALID_SCALE,
+        ERR_LVDATA_NO_OVERLAY,
+        ERR_LVDATA_INVALID_REGION,
+        
+        ERR_LVRECORDING_CANNOT_OPEN,
+        ERR_LVRECORDING_CANNOT_WRITE,
+        ERR_LVRECORDING_CORRUPT,
+        ERR_LVRECORDING_OUT_OF_RANGE,
+        
+        ERR_LVJPEG_INVALID_PARAM,
+        
+        ERR_LVSHARED_CANNOT_CREATE,
+        ERR_LVSHARED_CANNOT_CONNECT,
+        ERR_LVSHARED_TOO_BIG,
+        ERR_LVSHARED_INVALID,
+        
+        ERR_BROKER_CANNOT_CONNECT,
+        ERR_BROKER_DISCONNECTED,
+        ERR_BROKER_INVALID_REQUEST,
+        
+        ERR_METRICS_TOO_MANY_CAMERAS,
+        ERR_METRICS_CANNOT_LISTEN,
+        
+        ERR_USBCAPTURE_CANNOT_OPEN,
+        ERR_USBCAPTURE_CORRUPT,
+        
+        ERR_CANCELLED,
+        
+        ERR_RIG_NOT_ARMED,
+        ERR_RIG_SCRIPT_STOPPED,
+        ERR_RIG_OUT_OF_RANGE,
+        
+        ERR_CANNOT_SEND
     };
     
     // Picked out of CHDK source in a header we don't want to include